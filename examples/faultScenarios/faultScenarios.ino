@@ -0,0 +1,113 @@
+/**
+   esp32 firmware OTA
+
+   Purpose: Run the fault scenarios of tools/fault_server.py against this device
+
+   Setup:
+   Step 1 : Set your WiFi (ssid & password)
+   Step 2 : Start the server with any image built for this chip:
+              python3 tools/fault_server.py firmware.bin --host <address of the computer>
+   Step 3 : Set server_url to that address
+
+   Each scenario is downloaded and written to the next OTA partition, without
+   rebooting: the running partition stays the boot one. Failed attempts are
+   retried up to MAX_ATTEMPTS times, after the server's Retry-After if any.
+   The results are posted to the server, which prints the completion time
+   and the wasted bytes of each scenario.
+
+*/
+
+#include <esp32fota.h>
+#include <WiFi.h>
+#include <HTTPClient.h>
+#include <esp_ota_ops.h>
+
+#define MAX_ATTEMPTS 3
+
+esp32FOTA esp32FOTA("esp32-fota-http", "1.0.0", false);
+const char* server_url = "http://192.168.1.10:8000";
+
+
+void setup_wifi()
+{
+  delay(10);
+  Serial.print("Connecting to WiFi");
+
+  WiFi.begin(); // no WiFi creds in this demo :-)
+
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    delay(500);
+    Serial.print(".");
+  }
+
+  Serial.println("");
+  Serial.println(WiFi.localIP());
+}
+
+
+String http_request( const String& url, bool post )
+{
+  HTTPClient http;
+  http.begin( url );
+  int code = post ? http.POST( "" ) : http.GET();
+  String body = code == HTTP_CODE_OK ? http.getString() : "";
+  http.end();
+  return body;
+}
+
+
+void run_scenario( const String& name )
+{
+  Serial.printf("\n=== %s\n", name.c_str());
+  esp32FOTA.setManifestURL( String(server_url) + "/s/" + name + "/manifest.json" );
+
+  uint32_t started = millis();
+  bool ok = false;
+  int attempts = 0;
+  while( !ok && attempts < MAX_ATTEMPTS ) {
+    if( attempts++ > 0 ) {
+      uint32_t wait = esp32FOTA.getRetryAfter() ? esp32FOTA.getRetryAfter() * 1000 : 1000;
+      Serial.printf("Attempt #%d in %u ms\n", attempts, wait);
+      delay( wait );
+    }
+    ok = esp32FOTA.execHTTPcheck() && esp32FOTA.execOTA( U_FLASH, false );
+  }
+  uint32_t elapsed = millis() - started;
+
+  // keep running this firmware
+  esp_ota_set_boot_partition( esp_ota_get_running_partition() );
+
+  Serial.printf("%s: %s after %d attempt(s), %u ms\n", name.c_str(), ok ? "updated" : "failed", attempts, elapsed);
+  http_request( String(server_url) + "/result/" + name + "?ok=" + (ok ? 1 : 0) + "&ms=" + elapsed + "&attempts=" + attempts, true );
+}
+
+
+void setup()
+{
+  Serial.begin(115200);
+  setup_wifi();
+
+  String scenarios = http_request( String(server_url) + "/scenarios", false );
+  if( scenarios.isEmpty() ) {
+    Serial.println("Unable to get the scenarios, check server_url");
+    return;
+  }
+
+  int start = 0;
+  while( start < (int)scenarios.length() ) {
+    int end = scenarios.indexOf( '\n', start );
+    if( end < 0 ) end = scenarios.length();
+    String name = scenarios.substring( start, end );
+    name.trim();
+    if( !name.isEmpty() ) run_scenario( name );
+    start = end + 1;
+  }
+  Serial.println("\nAll scenarios done, see the server output");
+}
+
+
+void loop()
+{
+  delay(1000);
+}
@@ -0,0 +1,115 @@
+/**
+   esp32 firmware OTA
+
+   Purpose: Measure how flash writes delay the other tasks during an update,
+            with the Update library and with cfg.max_flash_block_us
+
+   Setup:
+   Step 1 : Set your WiFi (ssid & password)
+   Step 2 : Set firmware_url, any image for this chip will do
+
+   The sketch updates twice, rebooting in between: first with the Update library,
+   then with flash operations bounded to MAX_FLASH_BLOCK_US. A high priority task
+   wakes up every millisecond and records how late it is. After each update the
+   distributions are printed as:
+
+     latency,<label>,<count>,<max_us>,<below 125us>,<below 250us>,...,<above 64ms>
+
+   Capture the serial output and compare both runs on the host:
+
+     python3 tools/flash_latency.py report capture.log
+
+*/
+
+#include <esp32fota.h>
+#include <WiFi.h>
+
+#define MAX_FLASH_BLOCK_US 1000
+
+esp32FOTA esp32FOTA("esp32-fota-http", 1, false);
+const char* firmware_url = "http://server/fota/esp32-fota-http-2.bin";
+
+RTC_NOINIT_ATTR uint32_t run; // survives the restart that follows an update
+
+FOTAFlashStats task_latency; // same histogram as getFlashStats()
+
+
+void latency_task( void* )
+{
+  const uint32_t period = portTICK_PERIOD_MS * 1000;
+  uint32_t last = micros();
+  for(;;) {
+    vTaskDelay( 1 );
+    uint32_t now = micros();
+    uint32_t elapsed = now - last;
+    task_latency.add( elapsed > period ? elapsed - period : 0 );
+    last = now;
+  }
+}
+
+
+void print_latency( const char* label, const FOTAFlashStats& stats )
+{
+  Serial.printf("latency,%s,%u,%u", label, stats.ops, stats.max_us);
+  for( size_t i = 0; i < FOTA_LATENCY_BUCKETS; i++ ) {
+    Serial.printf(",%u", stats.buckets[i]);
+  }
+  Serial.println();
+}
+
+
+void setup_wifi()
+{
+  delay(10);
+  Serial.print("Connecting to WiFi");
+
+  WiFi.begin(); // no WiFi creds in this demo :-)
+
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    delay(500);
+    Serial.print(".");
+  }
+
+  Serial.println("");
+  Serial.println(WiFi.localIP());
+}
+
+
+void setup()
+{
+  Serial.begin(115200);
+  if( esp_reset_reason() != ESP_RST_SW || run > 2 ) run = 0;
+
+  if( run > 1 ) {
+    Serial.println("Done, power cycle to measure again");
+    return;
+  }
+
+  auto cfg = esp32FOTA.getConfig();
+  cfg.max_flash_block_us = run == 0 ? 0 : MAX_FLASH_BLOCK_US;
+  esp32FOTA.setConfig( cfg );
+
+  esp32FOTA.setUpdateFinishedCb( []( int partition, bool restart_after ) {
+    const char* label = run == 0 ? "update_library" : "sliced";
+    print_latency( label, task_latency );
+    if( run > 0 ) print_latency( "flash_ops", esp32FOTA.getFlashStats() );
+    run++;
+    Serial.flush();
+  });
+
+  setup_wifi();
+
+  // code running from flash is stalled on both cores while the flash is busy
+  xTaskCreate( latency_task, "latency", 2048, NULL, configMAX_PRIORITIES - 1, NULL );
+  delay(100);
+  task_latency.reset(); // only measure the update
+
+  esp32FOTA.forceUpdate( firmware_url, false );
+}
+
+
+void loop()
+{
+  delay(1000);
+}
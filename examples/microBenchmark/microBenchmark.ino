@@ -0,0 +1,132 @@
+/**
+   esp32 firmware OTA
+
+   Purpose: Measure the cost of manifest checks on the device: SemverClass
+            construction, semver_compare() and manifest matching with 1, 100
+            and 10k entries, with "url" or "host"/"port"/"bin" entries
+
+   No network is needed: manifests are generated in memory and evaluated with
+   execManifestCheck(). Results are printed as:
+
+     bench,<name>,<ns/op>,<allocations/op>
+
+   Allocations are counted by the heap hooks of ESP-IDF builds with
+   CONFIG_HEAP_USE_HOOKS (ESP-IDF 5.1+), "n/a" otherwise.
+
+   The manifest document is JSON_FW_BUFF_SIZE bytes (2048, a dozen entries):
+   a manifest that doesn't parse is reported as an error line instead of a
+   figure, build with e.g. -D JSON_FW_BUFF_SIZE=2000000 (and PSRAM) to
+   benchmark it. tools/bench/manifest_bench.cpp prints the size each manifest
+   needs. The 10k entries manifest is skipped without enough memory.
+
+   Host side figures: tools/bench/semver_bench.c, tools/bench/manifest_bench.cpp
+
+*/
+
+#include <esp32FOTA.hpp>
+
+esp32FOTA FOTA("esp32-fota-bench", "1.0.0", false);
+
+static volatile int sink; // keeps results alive
+
+#if CONFIG_HEAP_USE_HOOKS
+static volatile uint32_t allocations;
+extern "C" void esp_heap_trace_alloc_hook( void* /*ptr*/, size_t /*size*/, uint32_t /*caps*/ ) { allocations++; }
+extern "C" void esp_heap_trace_free_hook( void* /*ptr*/ ) { }
+#endif
+
+
+template<typename Fn> void bench( const char* name, uint32_t iterations, Fn fn )
+{
+  fn(); // warm up: lazy allocations, caches
+  #if CONFIG_HEAP_USE_HOOKS
+    uint32_t allocated = allocations;
+  #endif
+  int64_t started = esp_timer_get_time();
+  for( uint32_t i = 0; i < iterations; i++ ) {
+    fn();
+  }
+  int64_t elapsed = esp_timer_get_time() - started;
+  Serial.printf("bench,%s,%.1f,", name, elapsed * 1000.0 / iterations);
+  #if CONFIG_HEAP_USE_HOOKS
+    Serial.printf("%.2f\n", (double)( allocations - allocated ) / iterations);
+  #else
+    Serial.println("n/a");
+  #endif
+}
+
+
+// entries - 1 firmware types that don't match, then the matching one
+String make_manifest( uint32_t entries, bool host_port_bin )
+{
+  String json;
+  json.reserve( entries * 96 );
+  json = "[";
+  for( uint32_t i = 0; i < entries; i++ ) {
+    bool match = i == entries - 1;
+    json += "{\"type\":\"";
+    json += match ? "esp32-fota-bench" : "esp32-fota-other-";
+    if( !match ) json += i;
+    json += "\",\"version\":\"1.2.4\",";
+    if( host_port_bin ) json += "\"host\":\"server.local\",\"port\":80,\"bin\":\"/fota/firmware-1.2.4.bin\"}";
+    else json += "\"url\":\"http://server.local/fota/firmware-1.2.4.bin\"}";
+    if( !match ) json += ",";
+  }
+  json += "]";
+  return json;
+}
+
+
+// false when the manifest couldn't be benchmarked
+bool bench_manifest( uint32_t entries, bool host_port_bin, uint32_t iterations )
+{
+  size_t needed = entries * 110 + 64;
+  if( needed > ESP.getMaxAllocHeap() && needed > ESP.getMaxAllocPsram() ) {
+    Serial.printf("bench,manifest_%u_%s,skipped (%u bytes needed)\n", entries, host_port_bin ? "host" : "url", needed);
+    return true;
+  }
+  char name[48];
+  snprintf( name, sizeof(name), "manifest_%u_%s", entries, host_port_bin ? "host" : "url" );
+  String json = make_manifest( entries, host_port_bin );
+  // the last entry always matches: a failed check is a manifest that didn't parse, timing it would be meaningless
+  if( !FOTA.execManifestCheck( json.c_str(), json.length() ) ) {
+    Serial.printf("bench,%s,ERROR: %u bytes of JSON don't parse in JSON_FW_BUFF_SIZE %d, raise it with a build flag\n", name, json.length(), JSON_FW_BUFF_SIZE);
+    return false;
+  }
+  bench( name, iterations, [&json]() { sink += FOTA.execManifestCheck( json.c_str(), json.length() ); } );
+  return true;
+}
+
+
+void setup()
+{
+  Serial.begin(115200);
+  delay(1000);
+  Serial.printf("CPU %u MHz, JSON_FW_BUFF_SIZE %d\n", getCpuFrequencyMhz(), JSON_FW_BUFF_SIZE);
+
+  const char* versions[] = { "1.2.3", "1.2.3-rc.1", "1.2.3-alpha.1.beta+build.2024.10.18" };
+  for( const char* v : versions ) {
+    char name[64];
+    snprintf( name, sizeof(name), "semver_class_%s", v );
+    bench( name, 10000, [v]() { SemverClass sem( v ); sink += sem.ver()->major; } );
+  }
+
+  SemverClass a( "1.2.3" ), b( "1.2.4" );
+  bench( "semver_compare", 100000, [&a, &b]() { sink += semver_compare( *a.ver(), *b.ver() ); } );
+
+  int errors = 0;
+  for( bool host_port_bin : { false, true } ) {
+    errors += !bench_manifest( 1, host_port_bin, 1000 );
+    errors += !bench_manifest( 100, host_port_bin, 100 );
+    errors += !bench_manifest( 10000, host_port_bin, 3 );
+  }
+
+  if( errors ) Serial.printf("done, %d manifest(s) NOT benchmarked, see the ERROR lines\n", errors);
+  else Serial.println("done");
+}
+
+
+void loop()
+{
+  delay(1000);
+}
@@ -0,0 +1,108 @@
+/**
+   esp32 firmware OTA
+
+   Purpose: Update over the application's MQTT connection (FOTA_MQTT_STREAM),
+            without any HTTP request
+
+   Setup:
+   Step 1 : Set your WiFi (ssid & password), mqtt_host and device_prefix
+   Step 2 : Install the PubSubClient library
+   Step 3 : Build this sketch with a higher version in the manifest, and serve it:
+              python3 tools/mqtt_fota.py send -H <broker> --prefix fota/device-01 \
+                --firmware firmware.bin --type esp32-fota-mqtt --version 2.0.0
+
+   The sender publishes a retained manifest on <prefix>/manifest, checked with
+   execManifestCheck(). The update runs from loop(): while it's in progress,
+   the stream calls mqtt.loop() to get the image chunks from <prefix>/down.
+
+*/
+
+#include <esp32fota.h>
+#include <WiFi.h>
+#include <PubSubClient.h>
+
+esp32FOTA esp32FOTA("esp32-fota-mqtt", "1.0.0", false);
+const char* mqtt_host = "192.168.1.10";
+const char* device_prefix = "fota/device-01";
+
+WiFiClient wifi_client;
+PubSubClient mqtt( wifi_client );
+String manifest; // received on <prefix>/manifest, checked in loop()
+
+
+void setup_wifi()
+{
+  delay(10);
+  Serial.print("Connecting to WiFi");
+
+  WiFi.begin(); // no WiFi creds in this demo :-)
+
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    delay(500);
+    Serial.print(".");
+  }
+
+  Serial.println("");
+  Serial.println(WiFi.localIP());
+}
+
+
+void on_message( char* topic, byte* payload, unsigned int length )
+{
+  if( String( topic ) == String( device_prefix ) + "/manifest" ) {
+    manifest = String( (const char*)payload, length );
+  } else {
+    esp32FOTA.feedMQTT( topic, payload, length );
+  }
+}
+
+
+void mqtt_connect()
+{
+  while( !mqtt.connected() ) {
+    if( mqtt.connect( WiFi.macAddress().c_str() ) ) {
+      mqtt.subscribe( (String( device_prefix ) + "/manifest").c_str() );
+      mqtt.subscribe( esp32FOTA.getMQTTLink()->downTopic().c_str() );
+    } else {
+      delay(1000);
+    }
+  }
+}
+
+
+void setup()
+{
+  Serial.begin(115200);
+  setup_wifi();
+
+  mqtt.setServer( mqtt_host, 1883 );
+  mqtt.setBufferSize( FOTA_MQTT_CHUNK + 128 ); // a DATA message: chunk + header + topic
+  mqtt.setCallback( on_message );
+
+  esp32FOTA.setMQTT( []( const char* topic, const uint8_t* payload, size_t len ) {
+    return mqtt.publish( topic, payload, len );
+  }, device_prefix, []() {
+    if( !mqtt.connected() ) mqtt_connect(); // chunks lost meanwhile are sent again
+    mqtt.loop();
+  });
+  esp32FOTA.setStreamType( FOTA_MQTT_STREAM );
+  mqtt_connect();
+}
+
+
+void loop()
+{
+  mqtt_connect();
+  mqtt.loop();
+
+  if( !manifest.isEmpty() ) {
+    String body = manifest;
+    manifest = "";
+    if( esp32FOTA.execManifestCheck( body.c_str(), body.length() ) ) {
+      esp32FOTA.execOTA();
+    } else {
+      Serial.println("Up to date");
+    }
+  }
+}
@@ -0,0 +1,70 @@
+/**
+   esp32 firmware OTA
+
+   Purpose: Fleet update from a UDP multicast broadcast (FOTA_MULTICAST_STREAM),
+            every device of the site receives the same packets
+
+   Setup:
+   Step 1 : Set your WiFi (ssid & password) and manifest_url
+   Step 2 : Start the broadcast on a machine of the same LAN, it also writes the
+            manifest to serve at manifest_url:
+              python3 tools/multicast_fota.py send firmware.bin --group 239.255.70.1 --port 5007 \
+                --manifest fota.json --type esp32-fota-multicast --version 2.0.0
+
+   The manifest is fetched over HTTP as usual, its "udp://239.255.70.1:5007" url
+   is the group to join. Lost packets are rebuilt from the parity packets, a
+   group missing too many of them is completed on the next round of the
+   broadcast: devices never ask anything to the sender.
+
+*/
+
+#include <esp32fota.h>
+#include <WiFi.h>
+
+esp32FOTA esp32FOTA("esp32-fota-multicast", "1.0.0", false);
+const char* manifest_url = "http://server/fota/fota.json";
+
+
+void setup_wifi()
+{
+  delay(10);
+  Serial.print("Connecting to WiFi");
+
+  WiFi.begin(); // no WiFi creds in this demo :-)
+
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    delay(500);
+    Serial.print(".");
+  }
+
+  Serial.println("");
+  Serial.println(WiFi.localIP());
+}
+
+
+void setup()
+{
+  Serial.begin(115200);
+  setup_wifi();
+
+  auto cfg = esp32FOTA.getConfig();
+  cfg.turbo = true; // WiFi power save drops multicast packets
+  esp32FOTA.setConfig( cfg );
+
+  esp32FOTA.setManifestURL( manifest_url );
+  esp32FOTA.setStreamType( FOTA_MULTICAST_STREAM );
+  esp32FOTA.setStreamTimeout( 30000 ); // waiting for the broadcast to start
+}
+
+
+void loop()
+{
+  if( esp32FOTA.execHTTPcheck() ) {
+    if( !esp32FOTA.execOTA() ) { // restarts on success
+      MulticastFECStream* link = esp32FOTA.getMulticastLink();
+      Serial.printf("Update failed: %u packets heard, %u rebuilt from parity\n", link->packets(), link->recovered());
+    }
+  }
+  delay(60000);
+}
@@ -0,0 +1,90 @@
+/**
+   esp32 firmware OTA
+
+   Purpose: Gateway downloading one image for itself, two UART-attached MCUs
+            and an SD card archive (FOTATeeAgent)
+
+   Setup:
+   Step 1 : Set your WiFi (ssid & password) and manifest_url
+   Step 2 : Wire the MCUs to Serial1/Serial2 (see the pins below), they run
+            esp32FOTA with setSerialPort() and the same firmware type
+   Step 3 : Insert a FAT formatted SD card
+
+   The local partition is the primary sink: its signature check decides the
+   update. Each MCU gets a 16KB buffer and the SD card 32KB, a slower sink only
+   holds the download back once its buffer is full, and a sink that fails is
+   dropped without failing the others.
+
+*/
+
+#include <esp32fota.h>
+#include <WiFi.h>
+#include <SD.h>
+
+#define MCU1_RX 16
+#define MCU1_TX 17
+#define MCU2_RX 25
+#define MCU2_TX 26
+
+esp32FOTA esp32FOTA("esp32-fota-http", "1.0.0", false);
+const char* manifest_url = "http://server/fota/fota.json";
+
+FOTADefaultAgent local;
+FOTASerialSink mcu1, mcu2;
+FOTAFileSink archive;
+FOTATeeAgent tee( &local );
+
+
+void setup_wifi()
+{
+  delay(10);
+  Serial.print("Connecting to WiFi");
+
+  WiFi.begin(); // no WiFi creds in this demo :-)
+
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    delay(500);
+    Serial.print(".");
+  }
+
+  Serial.println("");
+  Serial.println(WiFi.localIP());
+}
+
+
+void setup()
+{
+  Serial.begin(115200);
+  Serial1.begin( 921600, SERIAL_8N1, MCU1_RX, MCU1_TX );
+  Serial2.begin( 921600, SERIAL_8N1, MCU2_RX, MCU2_TX );
+  setup_wifi();
+
+  mcu1.writer().setPort( &Serial1 );
+  mcu2.writer().setPort( &Serial2 );
+  tee.add( &mcu1 );
+  tee.add( &mcu2 );
+  if( SD.begin() ) {
+    archive.writer().setFile( SD, "/firmware.bin" );
+    tee.add( &archive, 32768 );
+  } else {
+    Serial.println("No SD card, not archiving");
+  }
+
+  esp32FOTA.setManifestURL( manifest_url );
+  esp32FOTA.setUpdateAgent( &tee );
+}
+
+
+void loop()
+{
+  if( esp32FOTA.execHTTPcheck() ) {
+    bool updated = esp32FOTA.execOTA( U_FLASH, false );
+    Serial.printf("local: %s\n", updated ? "updated" : "failed");
+    for( size_t i = 0; i < tee.sinks(); i++ ) {
+      Serial.printf("sink #%d: %s (error #%d)\n", i, tee.sinkError( i ) ? "failed" : "updated", tee.sinkError( i ));
+    }
+    if( updated ) ESP.restart();
+  }
+  delay(60000);
+}
@@ -0,0 +1,150 @@
+/*
+   esp32 firmware OTA
+   Manifest cache, see ManifestCache.hpp
+*/
+
+#include "ManifestCache.hpp"
+#include "../streams/SerialFrameStream.hpp" // fota_crc32()
+#include <Preferences.h>
+#include <time.h>
+
+#define FOTA_MANIFEST_CACHE_MAGIC 0x46434d31 // "FCM1"
+
+
+struct fota_manifest_cache_t
+{
+  uint32_t magic;
+  uint32_t url_hash;
+  int64_t  fetched;       // time(), 0 = unknown (loaded from NVS)
+  uint32_t max_age;       // seconds
+  char     etag[64];
+  char     last_modified[40];
+  uint16_t len;
+  bool     msgpack;
+  char     body[FOTA_MANIFEST_CACHE_SIZE+1];
+  uint32_t crc;           // all the above
+};
+
+static RTC_DATA_ATTR fota_manifest_cache_t rtc_cache;
+
+
+uint32_t ManifestCache::urlHash( const char* url )
+{
+    return fota_crc32( 0, (const uint8_t*)url, strlen(url) );
+}
+
+
+void ManifestCache::seal()
+{
+    rtc_cache.magic = FOTA_MANIFEST_CACHE_MAGIC;
+    rtc_cache.crc   = fota_crc32( 0, (const uint8_t*)&rtc_cache, offsetof(fota_manifest_cache_t, crc) );
+}
+
+
+bool ManifestCache::sealed()
+{
+    return rtc_cache.magic == FOTA_MANIFEST_CACHE_MAGIC
+        && rtc_cache.len <= FOTA_MANIFEST_CACHE_SIZE
+        && rtc_cache.crc == fota_crc32( 0, (const uint8_t*)&rtc_cache, offsetof(fota_manifest_cache_t, crc) );
+}
+
+
+bool ManifestCache::load( const char* url )
+{
+    uint32_t hash = urlHash( url );
+    _loaded = sealed() && rtc_cache.url_hash == hash;
+    if( _loaded ) return true;
+
+    // cold boot: validators and body from NVS, freshness unknown
+    Preferences prefs;
+    if( !prefs.begin( FOTA_MANIFEST_CACHE_NVS, true ) ) return false;
+    if( prefs.getUInt( "url", 0 ) == hash && prefs.isKey( "body" ) && prefs.getBytesLength( "body" ) <= FOTA_MANIFEST_CACHE_SIZE ) {
+        memset( &rtc_cache, 0, sizeof(rtc_cache) );
+        rtc_cache.url_hash = hash;
+        rtc_cache.len      = prefs.getBytes( "body", rtc_cache.body, FOTA_MANIFEST_CACHE_SIZE );
+        rtc_cache.msgpack  = prefs.getUChar( "fmt", 0 ) == 1;
+        prefs.getString( "etag", rtc_cache.etag, sizeof(rtc_cache.etag) );
+        prefs.getString( "lm", rtc_cache.last_modified, sizeof(rtc_cache.last_modified) );
+        seal();
+        _loaded = true;
+        log_d("Manifest cache restored from NVS (%d bytes)", rtc_cache.len);
+    }
+    prefs.end();
+    return _loaded;
+}
+
+
+uint32_t ManifestCache::secondsLeft()
+{
+    if( !_loaded || rtc_cache.fetched == 0 ) return 0;
+    int64_t age = (int64_t)time( nullptr ) - rtc_cache.fetched;
+    if( age < 0 || age >= rtc_cache.max_age ) return 0; // clock went backwards or expired
+    return rtc_cache.max_age - age;
+}
+
+
+bool ManifestCache::store( const char* url, const String& etag, const String& last_modified, const String& body, bool msgpack, uint32_t max_age )
+{
+    if( body.length() > FOTA_MANIFEST_CACHE_SIZE || etag.length() >= sizeof(rtc_cache.etag) || last_modified.length() >= sizeof(rtc_cache.last_modified) ) {
+        log_d("Manifest too large to be cached (%d bytes)", body.length());
+        clear();
+        return false;
+    }
+
+    uint32_t hash = urlHash( url );
+    bool changed = !sealed() || rtc_cache.url_hash != hash || rtc_cache.msgpack != msgpack || rtc_cache.len != body.length() || memcmp( rtc_cache.body, body.c_str(), body.length() ) != 0
+                || strcmp( rtc_cache.etag, etag.c_str() ) != 0 || strcmp( rtc_cache.last_modified, last_modified.c_str() ) != 0;
+
+    memset( &rtc_cache, 0, sizeof(rtc_cache) );
+    rtc_cache.url_hash = hash;
+    rtc_cache.fetched  = time( nullptr );
+    rtc_cache.max_age  = max_age;
+    rtc_cache.len      = body.length();
+    rtc_cache.msgpack  = msgpack;
+    memcpy( rtc_cache.body, body.c_str(), body.length() );
+    strcpy( rtc_cache.etag, etag.c_str() );
+    strcpy( rtc_cache.last_modified, last_modified.c_str() );
+    seal();
+    _loaded = true;
+
+    if( changed ) { // spare the flash, freshness alone lives in RTC memory
+        Preferences prefs;
+        if( prefs.begin( FOTA_MANIFEST_CACHE_NVS, false ) ) {
+            prefs.putUInt( "url", hash );
+            prefs.putBytes( "body", body.c_str(), body.length() );
+            prefs.putUChar( "fmt", msgpack ? 1 : 0 );
+            prefs.putString( "etag", etag );
+            prefs.putString( "lm", last_modified );
+            prefs.end();
+        }
+    }
+    return true;
+}
+
+
+void ManifestCache::touch( uint32_t max_age )
+{
+    if( !_loaded ) return;
+    rtc_cache.fetched = time( nullptr );
+    rtc_cache.max_age = max_age;
+    seal();
+}
+
+
+void ManifestCache::clear()
+{
+    memset( &rtc_cache, 0, sizeof(rtc_cache) );
+    _loaded = false;
+    Preferences prefs;
+    if( prefs.begin( FOTA_MANIFEST_CACHE_NVS, false ) ) {
+        if( prefs.isKey( "body" ) ) prefs.clear();
+        prefs.end();
+    }
+}
+
+
+const char* ManifestCache::etag()         { return _loaded ? rtc_cache.etag : ""; }
+const char* ManifestCache::lastModified() { return _loaded ? rtc_cache.last_modified : ""; }
+const char* ManifestCache::body()         { return _loaded ? rtc_cache.body : ""; }
+size_t      ManifestCache::length()       { return _loaded ? rtc_cache.len : 0; }
+bool        ManifestCache::msgpack()      { return _loaded && rtc_cache.msgpack; }
@@ -0,0 +1,57 @@
+/*
+   esp32 firmware OTA
+   Manifest cache.
+
+   Keeps the last manifest body (JSON or MessagePack) along with its HTTP validators (ETag,
+   Last-Modified) and freshness, so a device waking up from deep sleep can
+   evaluate it again without bringing up the network. Caching the body rather
+   than the decision keeps the decision right after the running version changed.
+
+   - RTC slow memory survives deep sleep: fetch time (wall clock, kept by the
+     RTC timer during deep sleep), freshness, validators and body.
+   - NVS survives power loss: validators and body only, written when the body
+     changes. After a cold boot the cache is stale and only saves the download
+     of an unchanged manifest (304 Not Modified).
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#ifndef FOTA_MANIFEST_CACHE_SIZE
+  #define FOTA_MANIFEST_CACHE_SIZE 1536 // bytes of RTC memory for the manifest body, larger manifests aren't cached
+#endif
+
+#define FOTA_MANIFEST_CACHE_NVS "fota-cache"
+
+
+class ManifestCache
+{
+public:
+  ManifestCache() { }
+
+  // select the cache entry of this url, from RTC memory or NVS, returns false if there's none
+  bool load( const char* url );
+  // fetched less than max_age seconds ago
+  bool fresh() { return secondsLeft() > 0; }
+  uint32_t secondsLeft();
+
+  // manifest received (200), writes NVS when the body changed
+  bool store( const char* url, const String& etag, const String& last_modified, const String& body, bool msgpack, uint32_t max_age );
+  // manifest not modified (304)
+  void touch( uint32_t max_age );
+  void clear();
+
+  const char* etag();
+  const char* lastModified();
+  const char* body();
+  size_t      length();
+  bool        msgpack(); // body is MessagePack rather than JSON
+
+private:
+  bool _loaded = false;
+
+  static uint32_t urlHash( const char* url );
+  static void seal();
+  static bool sealed();
+};
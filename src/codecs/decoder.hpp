@@ -0,0 +1,42 @@
+/*
+   esp32 firmware OTA
+   Streaming decoder interface for compressed firmware images.
+
+   Decoders are push-based: compressed bytes are fed with write() in chunks
+   of any size, decoded bytes are handed to the output callback as soon as
+   they are produced. This lets esp32FOTA pump a network stream through any
+   codec and into the Update agent without knowing the unpacked size.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+
+class FOTADecoder
+{
+public:
+  // return false to abort decoding (e.g. the Update agent refused the data)
+  typedef std::function<bool(const uint8_t*,size_t)> output_cb;
+
+  virtual ~FOTADecoder() { }
+  virtual const char* name() = 0;
+  // allocate the window/history buffers, false when out of memory
+  virtual bool begin( output_cb out ) = 0;
+  // feed compressed data, false on corrupt stream or output failure
+  virtual bool write( const uint8_t* data, size_t len ) = 0;
+  // flush pending output, true if the stream terminated cleanly
+  virtual bool end() = 0;
+  // total decoded bytes so far
+  virtual size_t produced() = 0;
+
+  // size of the window/history buffer begin() needs, 0 for invalid parameters
+  virtual size_t bufferSize() = 0;
+  // use this buffer (at least bufferSize() bytes) instead of allocating one
+  void setBuffer( uint8_t* buffer ) { _buffer = buffer; }
+
+protected:
+  uint8_t* _buffer = nullptr; // provided by setBuffer(), not owned
+};
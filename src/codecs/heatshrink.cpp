@@ -0,0 +1,139 @@
+/*
+   esp32 firmware OTA
+   Streaming heatshrink decoder, see heatshrink.hpp
+
+   Bitstream: a 1 tag bit is followed by an 8 bits literal, a 0 tag bit by a
+   backreference made of (window_sz2) bits index and (lookahead_sz2) bits
+   count, both stored minus one. The window starts zero-filled.
+*/
+
+#include <Arduino.h>
+#include "heatshrink.hpp"
+
+#define HEATSHRINK_FLUSH_SIZE     1024
+
+
+HeatshrinkDecoder::~HeatshrinkDecoder()
+{
+    if( _window && _window != _buffer ) free( _window );
+}
+
+
+size_t HeatshrinkDecoder::bufferSize()
+{
+    if( _window_sz2 < HEATSHRINK_MIN_WINDOW_SZ2 || _window_sz2 > HEATSHRINK_MAX_WINDOW_SZ2 ) return 0;
+    return 1UL << _window_sz2;
+}
+
+
+bool HeatshrinkDecoder::begin( output_cb out )
+{
+    if( _window_sz2 < HEATSHRINK_MIN_WINDOW_SZ2 || _window_sz2 > HEATSHRINK_MAX_WINDOW_SZ2 || _lookahead_sz2 < 3 || _lookahead_sz2 >= _window_sz2 ) {
+        log_e("Invalid heatshrink parameters (window=%d, lookahead=%d)", _window_sz2, _lookahead_sz2);
+        return false;
+    }
+    _out  = out;
+    _mask = (1UL << _window_sz2) - 1;
+    if( !_window ) {
+        _window = _buffer ? _buffer : (uint8_t*)malloc( _mask+1 );
+        if( !_window ) {
+            log_e("Unable to allocate %d bytes for heatshrink window", _mask+1);
+            return false;
+        }
+    }
+    memset( _window, 0, _mask+1 );
+    _flush_size = std::min( (size_t)HEATSHRINK_FLUSH_SIZE, _mask+1 );
+    _head = _flushed = _produced = 0;
+    _state = HS_STATE_TAG;
+    _bits  = 0;
+    _nbits = 0;
+    return true;
+}
+
+
+inline bool HeatshrinkDecoder::putByte( uint8_t c )
+{
+    _window[_head & _mask] = c;
+    _head++;
+    // window size is a multiple of the flush size: pending bytes never wrap
+    if( (_head & (_flush_size-1)) == 0 ) return flush();
+    return true;
+}
+
+
+bool HeatshrinkDecoder::flush()
+{
+    size_t n = _head - _flushed;
+    if( n == 0 ) return true;
+    const uint8_t* p = &_window[_flushed & _mask];
+    _flushed   = _head;
+    _produced += n;
+    if( !_out( p, n ) ) {
+        log_e("heatshrink output refused %u bytes", (unsigned)n);
+        _state = HS_STATE_ERROR;
+        return false;
+    }
+    return true;
+}
+
+
+bool HeatshrinkDecoder::write( const uint8_t* data, size_t len )
+{
+    if( _state == HS_STATE_ERROR ) return false;
+
+    while( len-- ) {
+        _bits = (_bits << 8) | *data++;
+        _nbits += 8;
+
+        bool more = true;
+        while( more ) {
+            switch( _state ) {
+                case HS_STATE_TAG:
+                    if( _nbits < 1 ) { more = false; break; }
+                    _nbits--;
+                    _state = ((_bits >> _nbits) & 1) ? HS_STATE_LITERAL : HS_STATE_INDEX;
+                break;
+                case HS_STATE_LITERAL:
+                    if( _nbits < 8 ) { more = false; break; }
+                    _nbits -= 8;
+                    if( !putByte( (_bits >> _nbits) & 0xff ) ) return false;
+                    _state = HS_STATE_TAG;
+                break;
+                case HS_STATE_INDEX:
+                    if( _nbits < _window_sz2 ) { more = false; break; }
+                    _nbits -= _window_sz2;
+                    _index = ((_bits >> _nbits) & _mask) + 1;
+                    _state = HS_STATE_COUNT;
+                break;
+                case HS_STATE_COUNT:
+                    if( _nbits < _lookahead_sz2 ) { more = false; break; }
+                    _nbits -= _lookahead_sz2;
+                    {
+                        uint16_t count = ((_bits >> _nbits) & ((1 << _lookahead_sz2) - 1)) + 1;
+                        while( count-- ) {
+                            if( !putByte( _window[(_head - _index) & _mask] ) ) return false;
+                        }
+                    }
+                    _state = HS_STATE_TAG;
+                break;
+                case HS_STATE_ERROR:
+                default:
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+bool HeatshrinkDecoder::end()
+{
+    if( _state == HS_STATE_ERROR ) return false;
+    if( !flush() ) return false;
+    // the encoder pads the last byte with zeroes, which reads as an incomplete backref
+    if( _nbits >= 8 || (_state != HS_STATE_TAG && _state != HS_STATE_INDEX) ) {
+        log_e("heatshrink stream ended prematurely (state=%d, bits=%d)", _state, _nbits);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,67 @@
+/*
+   esp32 firmware OTA
+   Streaming heatshrink decoder.
+
+   heatshrink is a LZSS variant designed for embedded systems: the decoder
+   only needs a (1 << window_sz2) bytes history buffer, e.g. 2KB with the
+   default parameters of the `heatshrink` command line utility.
+   The stream has no header, window and lookahead sizes must match the
+   ones used by the encoder (see "hs_window" and "hs_lookahead" manifest keys).
+
+   $ heatshrink -e -w 11 -l 4 firmware.bin firmware.bin.hs
+
+   Format reference: https://github.com/atomicobject/heatshrink
+*/
+
+#pragma once
+
+#include "decoder.hpp"
+
+#define HEATSHRINK_DEFAULT_WINDOW_SZ2    11
+#define HEATSHRINK_DEFAULT_LOOKAHEAD_SZ2 4
+#define HEATSHRINK_MIN_WINDOW_SZ2        4
+#define HEATSHRINK_MAX_WINDOW_SZ2        15
+
+
+class HeatshrinkDecoder : public FOTADecoder
+{
+public:
+  HeatshrinkDecoder( uint8_t window_sz2=HEATSHRINK_DEFAULT_WINDOW_SZ2, uint8_t lookahead_sz2=HEATSHRINK_DEFAULT_LOOKAHEAD_SZ2 )
+    : _window_sz2(window_sz2), _lookahead_sz2(lookahead_sz2) { }
+  ~HeatshrinkDecoder();
+  const char* name() { return "heatshrink"; }
+  bool begin( output_cb out );
+  bool write( const uint8_t* data, size_t len );
+  bool end();
+  size_t produced() { return _produced; }
+  size_t bufferSize();
+
+private:
+
+  enum hs_state_t
+  {
+    HS_STATE_TAG,
+    HS_STATE_LITERAL,
+    HS_STATE_INDEX,
+    HS_STATE_COUNT,
+    HS_STATE_ERROR
+  };
+
+  output_cb  _out;
+  uint8_t    _window_sz2;
+  uint8_t    _lookahead_sz2;
+  uint8_t*   _window = nullptr;
+  size_t     _mask = 0;
+  size_t     _head = 0;      // total bytes written to the window
+  size_t     _flushed = 0;   // window position of the last flush
+  size_t     _flush_size = 0;
+  size_t     _produced = 0;
+
+  hs_state_t _state = HS_STATE_TAG;
+  uint32_t   _bits = 0;      // bit accumulator, MSB first
+  uint8_t    _nbits = 0;
+  uint16_t   _index = 0;
+
+  inline bool putByte( uint8_t c );
+  bool flush();
+};
@@ -0,0 +1,491 @@
+/*
+   esp32 firmware OTA
+   Streaming LZ4 frame decoder, see lz4.hpp
+
+   Format reference: https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
+*/
+
+#include <Arduino.h>
+#include "lz4.hpp"
+
+#define LZ4_MAGIC           0x184D2204
+#define LZ4_SKIPPABLE_MASK  0xFFFFFFF0
+#define LZ4_SKIPPABLE_MAGIC 0x184D2A50
+#define LZ4_WINDOW_MASK     (LZ4_WINDOW_SIZE-1)
+#define LZ4_FLUSH_SIZE      4096  // emit decoded data by flash sector sized chunks
+#define LZ4_MIN_MATCH       4
+
+#define LZ4_FLG_BLOCK_CHECKSUM   0x10
+#define LZ4_FLG_CONTENT_SIZE     0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLG_DICT_ID          0x01
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME32_4 0x27D4EB2FU
+#define XXH_PRIME32_5 0x165667B1U
+
+
+static inline uint32_t read_le32( const uint8_t* p )
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1]<<8) | ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+
+static inline uint32_t rotl32( uint32_t x, int r )
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+
+static inline uint32_t xxh32_round( uint32_t acc, uint32_t input )
+{
+    acc += input * XXH_PRIME32_2;
+    acc  = rotl32( acc, 13 );
+    return acc * XXH_PRIME32_1;
+}
+
+
+LZ4Decoder::~LZ4Decoder()
+{
+    if( _window && _window != _buffer ) free( _window );
+}
+
+
+bool LZ4Decoder::begin( output_cb out )
+{
+    _out = out;
+    if( !_window ) {
+        _window = _buffer ? _buffer : (uint8_t*)malloc( LZ4_WINDOW_SIZE );
+        if( !_window ) {
+            log_e("Unable to allocate %d bytes for LZ4 window", LZ4_WINDOW_SIZE);
+            return false;
+        }
+    }
+    _pos = _flushed = _frame_start = 0;
+    _frames = 0;
+    expect( LZ4_STATE_MAGIC, 4 );
+    return true;
+}
+
+
+void LZ4Decoder::expect( lz4_state_t state, uint8_t bytes )
+{
+    _state    = state;
+    _hdr_len  = 0;
+    _hdr_need = bytes;
+}
+
+
+// accumulate fixed size fields that may be split across write() calls
+bool LZ4Decoder::collect( const uint8_t** data, size_t* len )
+{
+    while( *len > 0 && _hdr_len < _hdr_need ) {
+        _hdr[_hdr_len++] = **data;
+        (*data)++;
+        (*len)--;
+    }
+    return _hdr_len == _hdr_need;
+}
+
+
+bool LZ4Decoder::parseDescriptor()
+{
+    uint8_t flg = _hdr[0];
+    uint8_t bd  = _hdr[1];
+
+    if( (flg >> 6) != 1 ) {
+        log_e("Unsupported LZ4 frame version %d", flg >> 6);
+        return false;
+    }
+    if( flg & LZ4_FLG_DICT_ID ) {
+        log_e("LZ4 dictionaries are not supported");
+        return false;
+    }
+    uint8_t bsid = (bd >> 4) & 0x07;
+    if( bsid < 4 ) {
+        log_e("Invalid LZ4 block size id %d", bsid);
+        return false;
+    }
+    // header checksum is the second byte of xxh32(descriptor)
+    xxh32_reset( &_xxh );
+    xxh32_update( &_xxh, _hdr, _hdr_need-1 );
+    if( ((xxh32_digest( &_xxh ) >> 8) & 0xff) != _hdr[_hdr_need-1] ) {
+        log_e("LZ4 frame descriptor checksum mismatch");
+        return false;
+    }
+    _flags     = flg;
+    _block_max = 1UL << (8 + 2*bsid);
+    _frame_start = _pos; // the previous frame was flushed at its EndMark
+    xxh32_reset( &_xxh ); // now used for the content checksum
+    return true;
+}
+
+
+bool LZ4Decoder::write( const uint8_t* data, size_t len )
+{
+    while( len > 0 ) {
+        // compressed bytes of a block also feed its checksum, see blockDone()
+        const uint8_t* consumed = data;
+        bool in_block = _state >= LZ4_STATE_BLOCK_RAW && _state <= LZ4_STATE_MATCHLEN;
+
+        switch( _state ) {
+
+            case LZ4_STATE_MAGIC:
+                if( !collect( &data, &len ) ) break;
+                {
+                    uint32_t magic = read_le32( _hdr );
+                    if( magic == LZ4_MAGIC ) {
+                        expect( LZ4_STATE_DESCRIPTOR, 3 ); // FLG + BD + HC, extended once FLG is known
+                    } else if( (magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC ) {
+                        expect( LZ4_STATE_SKIP_SIZE, 4 );
+                    } else {
+                        log_e("Bad LZ4 magic 0x%08x", (unsigned)magic);
+                        _state = LZ4_STATE_ERROR;
+                        return false;
+                    }
+                }
+            break;
+
+            case LZ4_STATE_SKIP_SIZE:
+                if( !collect( &data, &len ) ) break;
+                _skip_left = read_le32( _hdr );
+                if( _skip_left ) _state = LZ4_STATE_SKIP_DATA;
+                else expect( LZ4_STATE_MAGIC, 4 );
+            break;
+
+            case LZ4_STATE_SKIP_DATA:
+                {
+                    size_t n = std::min( (size_t)_skip_left, len );
+                    _skip_left -= n;
+                    data += n;
+                    len  -= n;
+                    if( !_skip_left ) expect( LZ4_STATE_MAGIC, 4 );
+                }
+            break;
+
+            case LZ4_STATE_DESCRIPTOR:
+                if( _hdr_len == 0 && len > 0 ) {
+                    uint8_t flg = *data;
+                    _hdr_need = 3 + ((flg & LZ4_FLG_CONTENT_SIZE) ? 8 : 0) + ((flg & LZ4_FLG_DICT_ID) ? 4 : 0);
+                }
+                if( !collect( &data, &len ) ) break;
+                if( !parseDescriptor() ) {
+                    _state = LZ4_STATE_ERROR;
+                    return false;
+                }
+                expect( LZ4_STATE_BLOCK_SIZE, 4 );
+            break;
+
+            case LZ4_STATE_BLOCK_SIZE:
+                if( !collect( &data, &len ) ) break;
+                {
+                    uint32_t bsize = read_le32( _hdr );
+                    if( bsize == 0 ) { // EndMark
+                        // hand over the whole frame now: the content checksum covers exactly
+                        // its bytes, and the next frame may use different flags
+                        if( !flush() ) return false;
+                        if( _flags & LZ4_FLG_CONTENT_CHECKSUM ) {
+                            expect( LZ4_STATE_CONTENT_CHECKSUM, 4 );
+                        } else {
+                            _frames++;
+                            expect( LZ4_STATE_MAGIC, 4 );
+                        }
+                        break;
+                    }
+                    _block_left = bsize & 0x7FFFFFFF;
+                    if( _block_left > _block_max ) {
+                        log_e("LZ4 block too large (%u > %u)", (unsigned)_block_left, (unsigned)_block_max);
+                        _state = LZ4_STATE_ERROR;
+                        return false;
+                    }
+                    if( _flags & LZ4_FLG_BLOCK_CHECKSUM ) xxh32_reset( &_block_xxh );
+                    _state = (bsize & 0x80000000) ? LZ4_STATE_BLOCK_RAW : LZ4_STATE_TOKEN;
+                }
+            break;
+
+            case LZ4_STATE_BLOCK_RAW:
+                {
+                    size_t n = std::min( (size_t)_block_left, len );
+                    if( !copyLiterals( data, n ) ) return false;
+                    _block_left -= n;
+                    data += n;
+                    len  -= n;
+                    if( !_block_left && !blockDone() ) return false;
+                }
+            break;
+
+            case LZ4_STATE_TOKEN:
+                _token = *data++;
+                len--;
+                _block_left--;
+                _literals = _token >> 4;
+                if( _literals == 15 ) {
+                    _state = LZ4_STATE_LITLEN;
+                } else if( _literals > 0 ) {
+                    _state = LZ4_STATE_LITERALS;
+                } else if( !literalsDone() ) {
+                    return false;
+                }
+            break;
+
+            case LZ4_STATE_LITLEN:
+                if( !_block_left ) {
+                    log_e("LZ4 sequence overflows block");
+                    _state = LZ4_STATE_ERROR;
+                    return false;
+                }
+                {
+                    uint8_t b = *data++;
+                    len--;
+                    _block_left--;
+                    _literals += b;
+                    if( b != 255 ) _state = LZ4_STATE_LITERALS;
+                }
+            break;
+
+            case LZ4_STATE_LITERALS:
+                {
+                    size_t n = std::min( (size_t)_literals, len );
+                    if( n > _block_left ) {
+                        log_e("LZ4 literals overflow block");
+                        _state = LZ4_STATE_ERROR;
+                        return false;
+                    }
+                    if( !copyLiterals( data, n ) ) return false;
+                    _literals   -= n;
+                    _block_left -= n;
+                    data += n;
+                    len  -= n;
+                    if( !_literals && !literalsDone() ) return false;
+                }
+            break;
+
+            case LZ4_STATE_OFFSET:
+                if( !collect( &data, &len ) ) break;
+                _block_left -= 2;
+                _offset = _hdr[0] | (_hdr[1] << 8);
+                if( _offset == 0 || _offset > _pos - _frame_start ) {
+                    log_e("Invalid LZ4 match offset %d", _offset);
+                    _state = LZ4_STATE_ERROR;
+                    return false;
+                }
+                _match = _token & 0x0f;
+                if( _match == 15 ) {
+                    _state = LZ4_STATE_MATCHLEN;
+                } else {
+                    if( !copyMatch() ) return false;
+                }
+            break;
+
+            case LZ4_STATE_MATCHLEN:
+                if( !_block_left ) {
+                    log_e("LZ4 sequence overflows block");
+                    _state = LZ4_STATE_ERROR;
+                    return false;
+                }
+                {
+                    uint8_t b = *data++;
+                    len--;
+                    _block_left--;
+                    _match += b;
+                    if( b != 255 && !copyMatch() ) return false;
+                }
+            break;
+
+            case LZ4_STATE_BLOCK_CHECKSUM:
+                if( !collect( &data, &len ) ) break;
+                if( xxh32_digest( &_block_xxh ) != read_le32( _hdr ) ) {
+                    log_e("LZ4 block checksum mismatch");
+                    _state = LZ4_STATE_ERROR;
+                    return false;
+                }
+                expect( LZ4_STATE_BLOCK_SIZE, 4 );
+            break;
+
+            case LZ4_STATE_CONTENT_CHECKSUM:
+                if( !collect( &data, &len ) ) break;
+                if( xxh32_digest( &_xxh ) != read_le32( _hdr ) ) {
+                    log_e("LZ4 content checksum mismatch");
+                    _state = LZ4_STATE_ERROR;
+                    return false;
+                }
+                _frames++;
+                expect( LZ4_STATE_MAGIC, 4 );
+            break;
+
+            case LZ4_STATE_ERROR:
+            default:
+                return false;
+        }
+
+        if( in_block && (_flags & LZ4_FLG_BLOCK_CHECKSUM) ) {
+            xxh32_update( &_block_xxh, consumed, data - consumed );
+        }
+    }
+    return true;
+}
+
+
+bool LZ4Decoder::literalsDone()
+{
+    if( _block_left == 0 ) { // last sequence of the block has no match
+        return blockDone();
+    }
+    if( _block_left < 2 ) {
+        log_e("LZ4 block truncated before match offset");
+        _state = LZ4_STATE_ERROR;
+        return false;
+    }
+    expect( LZ4_STATE_OFFSET, 2 );
+    return true;
+}
+
+
+bool LZ4Decoder::blockDone()
+{
+    if( _flags & LZ4_FLG_BLOCK_CHECKSUM ) {
+        expect( LZ4_STATE_BLOCK_CHECKSUM, 4 );
+    } else {
+        expect( LZ4_STATE_BLOCK_SIZE, 4 );
+    }
+    return true;
+}
+
+
+bool LZ4Decoder::copyLiterals( const uint8_t* src, size_t len )
+{
+    while( len > 0 ) {
+        size_t n = std::min( len, LZ4_FLUSH_SIZE - (_pos & (LZ4_FLUSH_SIZE-1)) );
+        memcpy( &_window[_pos & LZ4_WINDOW_MASK], src, n );
+        _pos += n;
+        src  += n;
+        len  -= n;
+        if( (_pos & (LZ4_FLUSH_SIZE-1)) == 0 && !flush() ) return false;
+    }
+    return true;
+}
+
+
+bool LZ4Decoder::copyMatch()
+{
+    size_t len = _match + LZ4_MIN_MATCH;
+    while( len > 0 ) {
+        size_t n   = std::min( len, LZ4_FLUSH_SIZE - (_pos & (LZ4_FLUSH_SIZE-1)) );
+        size_t src = (_pos - _offset) & LZ4_WINDOW_MASK;
+        uint8_t* dst = &_window[_pos & LZ4_WINDOW_MASK];
+        if( _offset >= n && _offset + n <= LZ4_WINDOW_SIZE && src + n <= LZ4_WINDOW_SIZE ) { // no overlap, no wrap
+            memcpy( dst, &_window[src], n );
+        } else {
+            for( size_t i=0; i<n; i++ ) {
+                dst[i] = _window[(src + i) & LZ4_WINDOW_MASK];
+            }
+        }
+        _pos += n;
+        len  -= n;
+        if( (_pos & (LZ4_FLUSH_SIZE-1)) == 0 && !flush() ) return false;
+    }
+    if( _block_left ) _state = LZ4_STATE_TOKEN;
+    else blockDone();
+    return true;
+}
+
+
+// Hand over everything decoded since the last flush. Flushes happen on every
+// LZ4_FLUSH_SIZE boundary so the pending region never wraps around the window.
+bool LZ4Decoder::flush()
+{
+    size_t n = _pos - _flushed;
+    if( n == 0 ) return true;
+    const uint8_t* p = &_window[_flushed & LZ4_WINDOW_MASK];
+    if( _flags & LZ4_FLG_CONTENT_CHECKSUM ) xxh32_update( &_xxh, p, n );
+    _flushed = _pos;
+    if( !_out( p, n ) ) {
+        log_e("LZ4 output refused %u bytes", (unsigned)n);
+        _state = LZ4_STATE_ERROR;
+        return false;
+    }
+    return true;
+}
+
+
+bool LZ4Decoder::end()
+{
+    if( _state == LZ4_STATE_ERROR ) return false;
+    if( !flush() ) return false;
+    if( _state != LZ4_STATE_MAGIC || _hdr_len != 0 || _frames == 0 ) {
+        log_e("LZ4 stream ended prematurely (state=%d)", _state);
+        return false;
+    }
+    return true;
+}
+
+
+void LZ4Decoder::xxh32_reset( xxh32_t* st )
+{
+    st->v[0] = XXH_PRIME32_1 + XXH_PRIME32_2;
+    st->v[1] = XXH_PRIME32_2;
+    st->v[2] = 0;
+    st->v[3] = 0 - XXH_PRIME32_1;
+    st->total   = 0;
+    st->memsize = 0;
+}
+
+
+void LZ4Decoder::xxh32_update( xxh32_t* st, const uint8_t* data, size_t len )
+{
+    st->total += len;
+    if( st->memsize + len < 16 ) {
+        memcpy( st->mem + st->memsize, data, len );
+        st->memsize += len;
+        return;
+    }
+    if( st->memsize ) {
+        size_t fill = 16 - st->memsize;
+        memcpy( st->mem + st->memsize, data, fill );
+        for( int i=0; i<4; i++ ) st->v[i] = xxh32_round( st->v[i], read_le32( st->mem + 4*i ) );
+        data += fill;
+        len  -= fill;
+        st->memsize = 0;
+    }
+    while( len >= 16 ) {
+        for( int i=0; i<4; i++ ) st->v[i] = xxh32_round( st->v[i], read_le32( data + 4*i ) );
+        data += 16;
+        len  -= 16;
+    }
+    if( len ) {
+        memcpy( st->mem, data, len );
+        st->memsize = len;
+    }
+}
+
+
+uint32_t LZ4Decoder::xxh32_digest( xxh32_t* st )
+{
+    uint32_t h;
+    if( st->total >= 16 ) {
+        h = rotl32( st->v[0], 1 ) + rotl32( st->v[1], 7 ) + rotl32( st->v[2], 12 ) + rotl32( st->v[3], 18 );
+    } else {
+        h = st->v[2] /* seed */ + XXH_PRIME32_5;
+    }
+    h += st->total;
+    const uint8_t* p = st->mem;
+    size_t left = st->memsize;
+    while( left >= 4 ) {
+        h += read_le32( p ) * XXH_PRIME32_3;
+        h  = rotl32( h, 17 ) * XXH_PRIME32_4;
+        p += 4;
+        left -= 4;
+    }
+    while( left-- ) {
+        h += (*p++) * XXH_PRIME32_5;
+        h  = rotl32( h, 11 ) * XXH_PRIME32_1;
+    }
+    h ^= h >> 15;
+    h *= XXH_PRIME32_2;
+    h ^= h >> 13;
+    h *= XXH_PRIME32_3;
+    h ^= h >> 16;
+    return h;
+}
@@ -0,0 +1,96 @@
+/*
+   esp32 firmware OTA
+   Streaming LZ4 frame decoder.
+
+   Accepts the standard LZ4 frame format as produced by the `lz4` command line
+   utility (linked or independent blocks, any block size, optional block and
+   content checksums). Matches can reach back 64KB, so the decoder keeps a
+   64KB history window: use heatshrink instead when RAM is scarce.
+
+   $ lz4 -9 --content-size firmware.bin firmware.bin.lz4
+*/
+
+#pragma once
+
+#include "decoder.hpp"
+
+#define LZ4_WINDOW_SIZE 65536 // max match offset
+
+
+class LZ4Decoder : public FOTADecoder
+{
+public:
+  LZ4Decoder() { }
+  ~LZ4Decoder();
+  const char* name() { return "lz4"; }
+  bool begin( output_cb out );
+  bool write( const uint8_t* data, size_t len );
+  bool end();
+  size_t produced() { return _flushed; }
+  size_t bufferSize() { return LZ4_WINDOW_SIZE; }
+
+private:
+
+  enum lz4_state_t
+  {
+    LZ4_STATE_MAGIC,
+    LZ4_STATE_SKIP_SIZE,
+    LZ4_STATE_SKIP_DATA,
+    LZ4_STATE_DESCRIPTOR,
+    LZ4_STATE_BLOCK_SIZE,
+    LZ4_STATE_BLOCK_RAW,
+    LZ4_STATE_TOKEN,
+    LZ4_STATE_LITLEN,
+    LZ4_STATE_LITERALS,
+    LZ4_STATE_OFFSET,
+    LZ4_STATE_MATCHLEN,
+    LZ4_STATE_BLOCK_CHECKSUM,
+    LZ4_STATE_CONTENT_CHECKSUM,
+    LZ4_STATE_ERROR
+  };
+
+  struct xxh32_t
+  {
+    uint32_t v[4];
+    uint32_t total;
+    uint8_t  mem[16];
+    uint8_t  memsize;
+  };
+
+  output_cb   _out;
+  uint8_t*    _window = nullptr;
+  size_t      _pos = 0;         // total bytes written to the window
+  size_t      _flushed = 0;     // total bytes handed to the output callback
+  size_t      _frame_start = 0; // _pos value at the start of the current frame
+  uint32_t    _frames = 0;      // fully decoded frames
+
+  lz4_state_t _state = LZ4_STATE_MAGIC;
+  uint8_t     _hdr[20];         // magic, descriptor, block size and checksum fields
+  uint8_t     _hdr_len = 0;
+  uint8_t     _hdr_need = 4;
+
+  uint8_t     _flags = 0;       // FLG byte of the current frame
+  uint32_t    _block_max = 0;
+  uint32_t    _block_left = 0;  // compressed bytes left in the current block
+  uint32_t    _skip_left = 0;   // bytes left in a skippable frame
+  uint8_t     _token = 0;
+  uint32_t    _literals = 0;
+  uint32_t    _match = 0;
+  uint16_t    _offset = 0;
+
+  xxh32_t     _xxh;             // content checksum of the current frame
+  xxh32_t     _block_xxh;       // checksum of the current compressed block
+
+  bool collect( const uint8_t** data, size_t* len );
+  bool parseDescriptor();
+  bool literalsDone();
+  bool blockDone();
+  bool copyLiterals( const uint8_t* src, size_t len );
+  bool copyMatch();
+  bool flush();
+  void expect( lz4_state_t state, uint8_t bytes );
+
+  static void     xxh32_reset( xxh32_t* st );
+  static void     xxh32_update( xxh32_t* st, const uint8_t* data, size_t len );
+  static uint32_t xxh32_digest( xxh32_t* st );
+};
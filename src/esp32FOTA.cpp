@@ -46,6 +46,7 @@
 #endif
 
 #include "esp_ota_ops.h"
+#include <Preferences.h>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
@@ -54,7 +55,10 @@
 static int64_t getHTTPStream( esp32FOTA* fota, int partition );
 static int64_t getFileStream( esp32FOTA* fota, int partition );
 static int64_t getSerialStream( esp32FOTA* fota, int partition );
+static int64_t getMQTTStream( esp32FOTA* fota, int partition );
+static int64_t getMulticastStream( esp32FOTA* fota, int partition );
 static bool WiFiStatusCheck();
+static uint32_t parseRetryAfter( const String& value );
 
 
 SemverClass::SemverClass( const char* version )
@@ -192,6 +196,21 @@ void esp32FOTA::setConfig( FOTAConfig_t cfg )
     _cfg.allow_reuse   = cfg.allow_reuse;
     _cfg.use_http10    = cfg.use_http10;
     _cfg.use_bundled_certs = cfg.use_bundled_certs;
+    _cfg.use_peers     = cfg.use_peers;
+    _cfg.peer_port     = cfg.peer_port;
+    _cfg.check_interval = cfg.check_interval;
+    _cfg.check_jitter  = std::min( cfg.check_jitter, (uint8_t)100 ); // a wider spread would underflow the delay
+    _cfg.max_backoff   = cfg.max_backoff;
+    _cfg.cache_manifest = cfg.cache_manifest;
+    _cfg.manifest_max_age = cfg.manifest_max_age;
+    _cfg.mmap_verify   = cfg.mmap_verify;
+    _cfg.turbo         = cfg.turbo;
+    _cfg.max_flash_block_us = cfg.max_flash_block_us;
+    _cfg.flash_pre_erase = cfg.flash_pre_erase;
+    _cfg.progress_interval = cfg.progress_interval;
+    _cfg.progress_step = cfg.progress_step;
+    setRateLimit( cfg.rate_limit );
+    checkArena();
 }
 
 
@@ -219,6 +238,32 @@ void esp32FOTA::printConfig( FOTAConfig_t *cfg )
 void esp32FOTA::setSignatureLen( size_t len )
 {
     _cfg.signature_len = len;
+    checkArena();
+}
+
+
+void esp32FOTA::setArena( void* buffer, size_t size )
+{
+    _arena.begin( buffer, size );
+    checkArena();
+    // urls are only reassigned afterwards, keep their buffers from now on
+    _firmwareUrl.reserve( FOTA_URL_RESERVE );
+    _flashFileSystemUrl.reserve( FOTA_URL_RESERVE );
+}
+
+
+// the signature, the mmap_verify block table and block hash lists stay in the arena during the whole update,
+// it must fit the configured length and the partition that will be written
+void esp32FOTA::checkArena()
+{
+    if( !_arena.enabled() ) return;
+    const esp_partition_t* next = esp_ota_get_next_update_partition( NULL );
+    size_t app_size = next ? next->size : FOTA_ARENA_APP_SIZE;
+    size_t needed = fota_arena_size( _cfg.signature_len, app_size, FOTA_ARENA_BLOCK_SIZE );
+    if( _arena.size() < needed ) {
+        log_w("Arena is smaller than fota_arena_size(%u, %u, %u) (%u < %u bytes), some updates may fail",
+          (unsigned)_cfg.signature_len, (unsigned)app_size, (unsigned)FOTA_ARENA_BLOCK_SIZE, (unsigned)_arena.size(), (unsigned)needed);
+    }
 }
 
 
@@ -251,9 +296,64 @@ void esp32FOTA::useBundledCerts(bool enable)
 }
 void esp32FOTA::handle()
 {
+  if( _cfg.check_interval > 0 ) {
+      if( !_check_scheduled ) {
+          // first check after boot: spread the fleet over the jitter window, e.g. after a power outage
+          uint32_t window = (uint64_t)_cfg.check_interval * 1000 * _cfg.check_jitter / 100;
+          _last_check      = millis();
+          _check_delay     = window ? esp_random() % window : 0;
+          _check_scheduled = true;
+      }
+      if( getNextCheckDelay() > 0 ) return;
+  }
+
+  bool failed;
   if ( execHTTPcheck() ) {
-      execOTA();
+      failed = !execOTA(); // restarts on success
+  } else {
+      failed = _check_failed;
   }
+
+  if( _cfg.check_interval > 0 ) scheduleCheck( failed );
+}
+
+
+uint32_t esp32FOTA::getNextCheckDelay()
+{
+    if( _cfg.check_interval == 0 || !_check_scheduled ) return 0;
+    uint32_t elapsed = millis() - _last_check;
+    return elapsed >= _check_delay ? 0 : _check_delay - elapsed;
+}
+
+
+// Next check after the interval, or after an exponential backoff on failures,
+// never before the server's Retry-After or Cache-Control max-age.
+void esp32FOTA::scheduleCheck( bool failed )
+{
+    uint64_t delay = _cfg.check_interval;
+
+    if( failed ) {
+        if( _failures < 255 ) _failures++;
+        uint64_t backoff = delay << std::min( _failures, (uint8_t)16 );
+        delay = std::max( delay, std::min( backoff, (uint64_t)_cfg.max_backoff ) );
+    } else {
+        _failures = 0;
+        delay = std::max( delay, (uint64_t)_max_age );
+    }
+
+    uint64_t ms     = delay * 1000;
+    uint64_t spread = ms * _cfg.check_jitter / 100;
+    if( spread ) ms = ms - spread + esp_random() % (2 * spread + 1);
+
+    if( (uint64_t)_retry_after * 1000 > ms ) { // jitter can only push it further
+        ms = (uint64_t)_retry_after * 1000 + ( spread ? esp_random() % (spread + 1) : 0 );
+    }
+
+    _last_check      = millis();
+    _check_delay     = std::min( ms, (uint64_t)0x7fffffff ); // millis() arithmetics
+    _check_scheduled = true;
+
+    log_i("Next manifest check in %u s (failures: %d)", _check_delay / 1000, _failures);
 }
 
 
@@ -266,6 +366,92 @@ bool esp32FOTA::validate_sig( const esp_partition_t* partition, unsigned char *s
         log_e( "Could not find update partition!" );
         return false;
     }
+
+    log_d("Initing mbedtls");
+
+    mbedtls_md_context_t rsa;
+    const mbedtls_md_info_t *mdinfo = mbedtls_md_info_from_type( MBEDTLS_MD_SHA256 );
+    mbedtls_md_init( &rsa );
+    mbedtls_md_setup( &rsa, mdinfo, 0 );
+    mbedtls_md_starts( &rsa );
+
+    FOTAArena::Scope scope( _arena );
+    unsigned char *hash = (unsigned char*)_arena.alloc( mdinfo->size );
+    if(!hash){
+        log_e( "malloc failed" );
+        mbedtls_md_free( &rsa );
+        return false;
+    }
+
+    bool hashed = true;
+    if( _cfg.mmap_verify ) {
+        // hash the mapped partition in place, the written blocks are compared on the way
+        FOTAVerify view( _arena );
+        hashed = ( _verify ? _verify : &view )->check( partition, firmware_size, hash );
+    } else {
+        int bytestoread = SPI_FLASH_SEC_SIZE;
+        int bytesread = 0;
+        int size = firmware_size;
+
+        uint8_t *_buffer = (uint8_t*)_arena.alloc(SPI_FLASH_SEC_SIZE);
+        if(!_buffer){
+            log_e( "malloc failed" );
+            mbedtls_md_free( &rsa );
+            return false;
+        }
+
+        log_d("Parsing content");
+
+        log_v( "Reading partition (%i sectors, sec_size: %i)", size, bytestoread );
+        while( bytestoread > 0 ) {
+            log_v( "Left: %i (%i)               \r", size, bytestoread );
+
+            if( ESP.partitionRead( partition, bytesread, (uint32_t*)_buffer, bytestoread ) ) {
+                // Debug output for the purpose of comparing with file
+                for( int i = 0; i < bytestoread; i++ ) {
+                  if( ( i % 16 ) == 0 ) {
+                    log_v( "\r\n0x%08x\t", i + bytesread );
+                  }
+                  log_v( "%02x ", (uint8_t*)_buffer[i] );
+                }
+
+                mbedtls_md_update( &rsa, (uint8_t*)_buffer, bytestoread );
+
+                bytesread = bytesread + bytestoread;
+                size = size - bytestoread;
+
+                if( size <= SPI_FLASH_SEC_SIZE ) {
+                    bytestoread = size;
+                }
+            } else {
+                log_e( "partitionRead failed!" );
+                mbedtls_md_free( &rsa );
+                return false;
+            }
+        }
+
+        _arena.free( _buffer );
+        mbedtls_md_finish( &rsa, hash );
+    }
+    mbedtls_md_free( &rsa );
+
+    bool ret = hashed && verify_signature( hash, signature );
+    _arena.free( hash );
+    if( ret ) {
+        return true;
+    }
+
+    // validation failed, overwrite the first few bytes so this partition won't boot!
+    log_w( "Validation failed, erasing the invalid partition" );
+    ESP.partitionEraseRange( partition, 0, ENCRYPTED_BLOCK_SIZE);
+
+    return false;
+}
+
+
+// RSA check of a sha256 digest (image or block hash list) with the public key
+bool esp32FOTA::verify_signature( const unsigned char* hash, const unsigned char* signature )
+{
     size_t pubkeylen = _cfg.pub_key ? _cfg.pub_key->size() : 0;
 
     if( pubkeylen <= 1 ) {
@@ -283,7 +469,6 @@ bool esp32FOTA::validate_sig( const esp_partition_t* partition, unsigned char *s
     log_d("Creating mbedtls context");
 
     mbedtls_pk_context pk;
-    mbedtls_md_context_t rsa;
     mbedtls_pk_init( &pk );
 
     log_d("Parsing public key");
@@ -291,83 +476,61 @@ bool esp32FOTA::validate_sig( const esp_partition_t* partition, unsigned char *s
     int ret;
     if( ( ret = mbedtls_pk_parse_public_key( &pk, (const unsigned char*)pubkeystr, pubkeylen ) ) != 0 ) {
         log_e( "Parsing public key failed\n  ! mbedtls_pk_parse_public_key %d (%d bytes)\n%s", ret, pubkeylen, pubkeystr );
+        mbedtls_pk_free( &pk );
         return false;
     }
 
     if( !mbedtls_pk_can_do( &pk, MBEDTLS_PK_RSA ) ) {
         log_e( "Public key is not an rsa key -0x%x", -ret );
+        mbedtls_pk_free( &pk );
         return false;
     }
 
-    log_d("Initing mbedtls");
+    ret = mbedtls_pk_verify( &pk, MBEDTLS_MD_SHA256, hash, 32, signature, _cfg.signature_len );
+    mbedtls_pk_free( &pk );
+    return ret == 0;
+}
 
-    const mbedtls_md_info_t *mdinfo = mbedtls_md_info_from_type( MBEDTLS_MD_SHA256 );
-    mbedtls_md_init( &rsa );
-    mbedtls_md_setup( &rsa, mdinfo, 0 );
-    mbedtls_md_starts( &rsa );
 
-    int bytestoread = SPI_FLASH_SEC_SIZE;
-    int bytesread = 0;
-    int size = firmware_size;
+// Compare the written image with the "sha256" manifest value
+bool esp32FOTA::validate_sha256( const esp_partition_t* partition, const uint8_t* digest, uint32_t firmware_size )
+{
+    if( _cfg.mmap_verify ) {
+        FOTAVerify view( _arena ); // no block digests outside of execOTA()
+        uint8_t hash[32];
+        return ( _verify ? _verify : &view )->check( partition, firmware_size, hash ) && memcmp( hash, digest, sizeof(hash) ) == 0;
+    }
 
-    uint8_t *_buffer = (uint8_t*)malloc(SPI_FLASH_SEC_SIZE);
+    FOTAArena::Scope scope( _arena );
+    uint8_t *_buffer = (uint8_t*)_arena.alloc(SPI_FLASH_SEC_SIZE);
     if(!_buffer){
         log_e( "malloc failed" );
         return false;
     }
 
-    log_d("Parsing content");
-
-    log_v( "Reading partition (%i sectors, sec_size: %i)", size, bytestoread );
-    while( bytestoread > 0 ) {
-        log_v( "Left: %i (%i)               \r", size, bytestoread );
-
-        if( ESP.partitionRead( partition, bytesread, (uint32_t*)_buffer, bytestoread ) ) {
-            // Debug output for the purpose of comparing with file
-            for( int i = 0; i < bytestoread; i++ ) {
-              if( ( i % 16 ) == 0 ) {
-                log_v( "\r\n0x%08x\t", i + bytesread );
-              }
-              log_v( "%02x ", (uint8_t*)_buffer[i] );
-            }
-
-            mbedtls_md_update( &rsa, (uint8_t*)_buffer, bytestoread );
-
-            bytesread = bytesread + bytestoread;
-            size = size - bytestoread;
-
-            if( size <= SPI_FLASH_SEC_SIZE ) {
-                bytestoread = size;
-            }
-        } else {
+    const mbedtls_md_info_t *mdinfo = mbedtls_md_info_from_type( MBEDTLS_MD_SHA256 );
+    mbedtls_md_context_t ctx;
+    mbedtls_md_init( &ctx );
+    mbedtls_md_setup( &ctx, mdinfo, 0 );
+    mbedtls_md_starts( &ctx );
+
+    bool ret = true;
+    for( uint32_t offset = 0; offset < firmware_size; offset += SPI_FLASH_SEC_SIZE ) {
+        size_t len = std::min( (uint32_t)SPI_FLASH_SEC_SIZE, firmware_size - offset );
+        if( !ESP.partitionRead( partition, offset, (uint32_t*)_buffer, len ) ) {
             log_e( "partitionRead failed!" );
-            return false;
+            ret = false;
+            break;
         }
+        mbedtls_md_update( &ctx, _buffer, len );
     }
+    _arena.free( _buffer );
 
-    free( _buffer );
-
-    unsigned char *hash = (unsigned char*)malloc( mdinfo->size );
-    if(!hash){
-        log_e( "malloc failed" );
-        return false;
-    }
-    mbedtls_md_finish( &rsa, hash );
-
-    ret = mbedtls_pk_verify( &pk, MBEDTLS_MD_SHA256, hash, mdinfo->size, (unsigned char*)signature, _cfg.signature_len );
-
-    free( hash );
-    mbedtls_md_free( &rsa );
-    mbedtls_pk_free( &pk );
-    if( ret == 0 ) {
-        return true;
-    }
-
-    // validation failed, overwrite the first few bytes so this partition won't boot!
-    log_w( "Validation failed, erasing the invalid partition" );
-    ESP.partitionEraseRange( partition, 0, ENCRYPTED_BLOCK_SIZE);
+    uint8_t hash[32];
+    mbedtls_md_finish( &ctx, hash );
+    mbedtls_md_free( &ctx );
 
-    return false;
+    return ret && memcmp( hash, digest, sizeof(hash) ) == 0;
 }
 
 
@@ -450,7 +613,7 @@ bool esp32FOTA::setupHTTP( const char* url )
         _http.begin(url);
     }
 
-    if( extraHTTPHeaders.size() > 0 ) {
+    if( extraHTTPHeaders.size() > 0 && !_from_peer ) { // peers are untrusted, don't leak credentials
         // add custom headers provided by user e.g. _http.addHeader("Authorization", "Basic " + auth)
         for( const auto &header : extraHTTPHeaders ) {
             _http.addHeader(header.first, header.second);
@@ -458,7 +621,7 @@ bool esp32FOTA::setupHTTP( const char* url )
     }
 
     // TODO: add more watched headers e.g. Authorization: Signature keyId="rsa-key-1",algorithm="rsa-sha256",signature="Base64(RSA-SHA256(signing string))"
-    const char* get_headers[] = { "Content-Length", "Content-type", "Accept-Ranges" };
+    const char* get_headers[] = { "Content-Length", "Content-type", "Accept-Ranges", "Transfer-Encoding", "Retry-After", "Cache-Control", "ETag", "Last-Modified" };
     _http.collectHeaders( get_headers, sizeof(get_headers)/sizeof(const char*) );
 
     return true;
@@ -477,6 +640,12 @@ void esp32FOTA::setupStream()
             case FOTA_SERIAL_STREAM:
                 setStreamGetter( getSerialStream );
             break;
+            case FOTA_MQTT_STREAM:
+                setStreamGetter( getMQTTStream );
+            break;
+            case FOTA_MULTICAST_STREAM:
+                setStreamGetter( getMulticastStream );
+            break;
             case  FOTA_HTTP_STREAM:
             default:
                 setStreamGetter( getHTTPStream );
@@ -506,6 +675,14 @@ void esp32FOTA::stopStream()
             _http.end();
         break;
         case FOTA_SERIAL_STREAM:
+            _serial.end( false ); // only notifies the host if the transfer was interrupted
+        break;
+        case FOTA_MQTT_STREAM:
+            _mqtt.end( false );
+        break;
+        case FOTA_MULTICAST_STREAM:
+            _multicast.end();
+        break;
         default:
         break;
     }
@@ -519,6 +696,17 @@ bool esp32FOTA::execOTA()
 {
     setupStream();
 
+    // named data partitions first, the new firmware may rely on them
+    bool data_only = _firmwareUrl.isEmpty() && !_partitions.empty();
+    if( !execPartitionsOTA() ) {
+        stopStream();
+        return false;
+    }
+    if( data_only ) {
+        stopStream();
+        return true;
+    }
+
     if( !_flashFileSystemUrl.isEmpty() ) { // a data partition was specified in the json manifest, handle the spiffs partition first
         if( _fs ) { // Possible risk of overwriting certs and signatures, cancel flashing!
             log_e("Cowardly refusing to overwrite U_SPIFFS with %s. Use setCertFileSystem(nullptr) along with setPubKey()/setCAPem() to enable this feature.", _flashFileSystemUrl);
@@ -531,13 +719,55 @@ bool esp32FOTA::execOTA()
         log_i("This update is for U_FLASH only");
     }
     // handle the application partition and restart on success
-    bool ret = execOTA( U_FLASH, true );
+    bool ret = ( _cfg.use_peers && _agent->writesFlash() && execPeerOTA() ) || execOTA( U_FLASH, true );
+
+    stopStream();
+
+    return ret;
+}
+
+bool esp32FOTA::execPeerOTA()
+{
+    if( _stream_type != FOTA_HTTP_STREAM ) return false;
+    if( !_cfg.check_sig ) {
+        log_w("LAN peers are untrusted and only used along with signature checking");
+        return false;
+    }
+    if( !_has_payload_sha256 ) {
+        // any older signed image would pass the signature check
+        log_w("LAN peers are only used when the manifest gives the image sha256");
+        return false;
+    }
+
+    char version[32];
+    semver_render( _payload_sem.ver(), version );
+
+    String url = FOTAPeers::find( _cfg.name, version );
+    if( url.isEmpty() ) return false;
+
+    // peers serve the unpacked image with a signature header
+    String origin_url                 = _firmwareUrl;
+    FOTACompression_t origin_codec    = _compression;
+    bool origin_sig_trailer           = _sig_trailer;
+
+    _firmwareUrl = url;
+    _compression = FOTA_COMPRESSION_NONE;
+    _sig_trailer = false;
+    _from_peer   = true;
 
+    bool ret = execOTA( U_FLASH, true );
     stopStream();
 
+    _firmwareUrl = origin_url;
+    _compression = origin_codec;
+    _sig_trailer = origin_sig_trailer;
+    _from_peer   = false;
+
+    if( !ret ) log_w("Update from peer failed, falling back to %s", _firmwareUrl.c_str());
     return ret;
 }
 
+
 // OTA Logic
 bool esp32FOTA::execSPIFFSOTA()
 {
@@ -576,6 +806,43 @@ bool esp32FOTA::execOTA( int partition, bool restart_after )
         return false; // app partition is mandatory
     }
 
+    // everything allocated from the arena below is released on return
+    FOTAArena::Scope scope( _arena );
+    // application power settings are restored on return
+    FOTATurbo turbo( _cfg.turbo );
+
+    // _verify and _blocks point to locals of this function, _agent may be swapped below,
+    // an update that didn't reach the end is counted as failed
+    struct UpdateScope {
+        esp32FOTA* fota;
+        FOTAAgent* agent;
+        bool succeeded;
+        ~UpdateScope() {
+            fota->_verify = nullptr; fota->_blocks = nullptr; fota->_agent = agent;
+            if( !succeeded ) fota->_metrics.update( false );
+            fota->_metrics.save();
+        }
+    } update_scope { this, _agent, false };
+
+    if( _cfg.max_flash_block_us && _agent == &_default_agent ) {
+        _sliced_agent.writer().setMaxBlockTime( _cfg.max_flash_block_us );
+        _sliced_agent.writer().setPreErase( _cfg.flash_pre_erase );
+        _agent = &_sliced_agent;
+    }
+
+    // file/memory sinks: no partition to check, boot or share with peers, see FOTASinks.hpp
+    bool to_flash = _agent->writesFlash();
+
+    // the block hash list is fetched before the image takes the connection, and replaces the image signature
+    FOTABlockHashes blocks;
+    FOTAArena::unique_ptr<uint8_t> block_list( nullptr, FOTAArena::Deleter{ &_arena } );
+    bool use_blocks = to_flash && partition == U_FLASH && !_from_peer && !_blocksUrl.isEmpty();
+    if( use_blocks ) {
+        if( !loadBlockHashes( blocks, block_list ) ) return false;
+        _blocks = &blocks;
+    }
+    bool image_signed = _cfg.check_sig && !use_blocks;
+
     // call getHTTPStream
     int64_t updateSize = getStream( this, partition );
 
@@ -583,12 +850,22 @@ bool esp32FOTA::execOTA( int partition, bool restart_after )
         log_e("HTTP Error");
         return false;
     }
+    _stream = _throttle.wrap( _stream, _cfg.rate_limit );
+
+    bool size_unknown = (updateSize == UPDATE_SIZE_UNKNOWN); // e.g. chunked transfer
+
+    // a truncated or stale image on the server would only fail after the flash was erased
+    uint32_t expected_size = partition == U_FLASH ? _payload_size : _fs_payload_size;
+    if( expected_size && !size_unknown && !_from_peer && updateSize != expected_size ) {
+        log_e("Image size (%d bytes) doesn't match the manifest (%u bytes)", (int)updateSize, expected_size);
+        return false;
+    }
 
     // some network streams (e.g. Ethernet) can be laggy and need to 'breathe'
     if( ! _stream->available() ) {
-        uint32_t timeout = millis() + _stream_timeout;
+        uint32_t last_data = millis();
         while( ! _stream->available() ) {
-            if( millis()>timeout ) {
+            if( streamStalled( last_data ) ) {
                 log_e("Stream timed out");
                 return false;
             }
@@ -596,75 +873,208 @@ bool esp32FOTA::execOTA( int partition, bool restart_after )
         }
     }
 
-    mode_z = F_isZlibStream();
+    FOTAArena::unique_ptr<FOTADecoder> decoder( nullptr, FOTAArena::Deleter{ &_arena } );
+    const char* codec = nullptr; // zlib/gzip codec of the Update agent
+
+    switch( _compression ) {
+        case FOTA_COMPRESSION_AUTO: // not declared in the manifest, guess from magic byte and url
+            codec  = _agent->detect( _stream, partition == U_SPIFFS ? _flashFileSystemUrl : _firmwareUrl );
+            mode_z = codec != nullptr;
+        break;
+        case FOTA_COMPRESSION_ZLIB:
+        case FOTA_COMPRESSION_GZIP:
+            codec = compressionName(_compression);
+            if( !_agent->supports( codec ) ) {
+                log_e("Image is %s compressed but the Update agent only supports '%s', include the matching library", codec, _agent->compression() );
+                return false;
+            }
+            mode_z = true;
+        break;
+        case FOTA_COMPRESSION_LZ4:
+        case FOTA_COMPRESSION_HEATSHRINK:
+            mode_z = false;
+            decoder = createDecoder( _compression );
+            if( !decoder ) return false;
+        break;
+        case FOTA_COMPRESSION_NONE:
+        default:
+            mode_z = false;
+        break;
+    }
+
+    log_d("compression: %s", decoder ? decoder->name() : mode_z ? codec : "disabled" );
 
-    log_d("compression: %s", mode_z ? "enabled" : "disabled" );
+    if( size_unknown && mode_z ) {
+        log_e("%s compressed streams need a Content-Length, use lz4 or heatshrink compression instead", codec);
+        return false;
+    }
 
-    if( _cfg.check_sig ) {
+    bool sig_trailer = image_signed && _sig_trailer;
+
+    if( use_blocks ) {
         if( mode_z ) {
-            log_e("Compressed && signed image is not (yet) supported");
+            log_e("Block hashes need an uncompressed, lz4 or heatshrink image");
             return false;
         }
-        if( updateSize == UPDATE_SIZE_UNKNOWN || updateSize <= _cfg.signature_len ) {
-            log_e("Malformed signature+fw combo");
+        // a corrupted block is fetched again from the same offset of the raw image
+        blocks.refetch( !decoder && _stream_type == FOTA_HTTP_STREAM && _http.header( "Accept-Ranges" ) == "bytes" && _agent->repairable() );
+    }
+
+    if( image_signed ) {
+        // built-in decoders know the unpacked size, so the signature can cover the unpacked image
+        if( mode_z ) {
+            log_e("Compressed && signed image is not (yet) supported");
             return false;
         }
-        updateSize -= _cfg.signature_len;
+        if( !size_unknown ) {
+            if( updateSize <= _cfg.signature_len ) {
+                log_e("Malformed signature+fw combo");
+                return false;
+            }
+            updateSize -= _cfg.signature_len;
+        }
+    }
+
+    // the target partition size is the only limit when the image size isn't known in advance
+    if( to_flash ) {
+        getPartition( partition );
+        if( partition == U_FLASH && _cfg.use_peers ) _peers.forget( _target_partition );
+    } else {
+        _target_partition = nullptr;
     }
+    if( size_unknown && _target_partition ) {
+        log_d("Unknown image size, partition %s can hold up to %d bytes", _target_partition->label, _target_partition->size);
+    }
+
+    // block digests are collected from what pumpStream() writes, zlib/gzip images are inflated by the agent
+    FOTAVerify verify( _arena );
+    if( _cfg.mmap_verify && !mode_z && _target_partition ) verify.begin( _target_partition->size );
+    _verify = &verify;
+
+    // decoders, unknown sizes, signature trailers, block hashes and digests are handled by pumpStream(), everything else by the Update agent,
+    // signed images written to a sink are hashed on their way through the agent's write()
+    bool use_pump = decoder || size_unknown || sig_trailer || use_blocks || verify.collecting() || ( image_signed && !to_flash );
 
     // If using compression, the size is implicitely unknown
-    size_t fwsize = mode_z ? UPDATE_SIZE_UNKNOWN : updateSize;       // fw_size is unknown if we have a compressed image
+    size_t fwsize = (mode_z || decoder || size_unknown) ? UPDATE_SIZE_UNKNOWN : updateSize;       // fw_size is unknown if we have a compressed image
 
-    bool canBegin = F_canBegin();
+    bool canBegin = _agent->begin( fwsize, partition, mode_z ? codec : nullptr );
 
     if( !canBegin ) {
         log_e("Not enough space to begin OTA, partition size mismatch?");
-        F_abort();
+        _agent->abort();
         if( onUpdateBeginFail ) onUpdateBeginFail( partition );
         return false;
     }
 
-    if( onOTAProgress ) {
-        F_Update.onProgress( onOTAProgress );
-    } else {
-        F_Update.onProgress( [](size_t progress, size_t size) {
-            if( progress >= size ) Serial.println();
-            else if( progress > 0) Serial.print(".");
-        });
-    }
-
-    unsigned char* signature = new unsigned char[_cfg.signature_len];
-    if( _cfg.check_sig ) {
-        _stream->readBytes( signature, _cfg.signature_len );
+    // pumpStream() reports downloaded bytes, the agent reports what it wrote otherwise
+    size_t stream_size = size_unknown ? UPDATE_SIZE_UNKNOWN : updateSize + (sig_trailer ? _cfg.signature_len : 0);
+    size_t progress_size = use_pump ? stream_size : mode_z ? ( partition == U_FLASH && _payload_unpacked_size ? _payload_unpacked_size : UPDATE_SIZE_UNKNOWN ) : updateSize;
+    beginProgress( progress_size );
+    _agent->onProgress( [this, use_pump]( size_t progress, size_t size ) {
+        if( onOTAProgress ) onOTAProgress( progress, size );
+        if( !use_pump ) _progress.update( progress );
+    });
+
+    unsigned char* signature = nullptr;
+    if( image_signed ) {
+        signature = (unsigned char*)_arena.alloc( _cfg.signature_len );
+        if( !signature ) {
+            log_e("Unable to allocate %d bytes for the signature", _cfg.signature_len);
+            _agent->abort();
+            return false;
+        }
+        if( !sig_trailer && _stream->readBytes( signature, _cfg.signature_len ) != _cfg.signature_len ) {
+            log_e("Unable to read signature header");
+            _agent->abort();
+            _arena.free( signature );
+            return false;
+        }
     }
 
     log_i("Begin %s OTA. This may take 2 - 5 mins to complete. Things might be quiet for a while.. Patience!", partition==U_FLASH?"Firmware":"Filesystem");
+    if( _cfg.rate_limit && !size_unknown ) {
+        log_i("Download capped at %u bytes/s, at least %u s", _cfg.rate_limit, (uint32_t)( updateSize / _cfg.rate_limit ));
+    }
 
     // Some activity may appear in the Serial monitor during the update (depends on Update.onProgress)
-    size_t written = F_writeStream();
-
-    if (fwsize == UPDATE_SIZE_UNKNOWN)      // match compressed fw size to responce length
-        fwsize = updateSize;
+    size_t written;
+    bool complete;
+    uint32_t started = millis();
+    if( use_pump ) {
+        complete = pumpStream( decoder.get(), stream_size, sig_trailer ? signature : nullptr, &written );
+    } else {
+        written = _agent->writeStream( *_stream, updateSize );
+        if (fwsize == UPDATE_SIZE_UNKNOWN)      // match compressed fw size to responce length
+            fwsize = updateSize;
+        complete = ( written == fwsize );
+    }
+    _metrics.download( _progress.info().bytes );
 
-    if ( written == fwsize ) {
+    if ( complete ) {
         log_d("Written : %d successfully", written);
         updateSize = written; // flatten value to prevent overflow when checking signature
+        _progress.finish();
+        reportThroughput( written, millis() - started );
     } else {
         log_e("Written only : %d/%d Premature end of stream?", written, updateSize);
-        F_abort();
-        delete[] signature;
+        _agent->abort();
+        _arena.free( signature );
         return false;
     }
 
-    if (!F_UpdateEnd()) {
-        log_e("An Update Error Occurred. Error #: %d", F_Update.getError());
-        delete[] signature;
+    // every block matched its signed digest, or was fetched again: no need to read the image back
+    if( use_blocks && !( blocks.finish() && repairBlocks( blocks ) ) ) {
+        _metrics.verifyFailure();
+        _agent->abort();
+        if( onUpdateCheckFail ) onUpdateCheckFail( partition, -2 ); // CHECK_SIG_ERROR_VALIDATION_FAILED
+        return false;
+    }
+
+    if ( !_agent->end( use_pump && fwsize == UPDATE_SIZE_UNKNOWN ) ) {
+        log_e("An Update Error Occurred. Error #: %d", _agent->getError());
+        _arena.free( signature );
         return false;
     }
 
     if( onUpdateEnd ) onUpdateEnd( partition );
 
-    if( _cfg.check_sig ) { // check signature
+    if( _agent == &_sliced_agent && onTelemetry ) {
+        onTelemetry( "flash.max_us", getFlashStats().max_us );
+        onTelemetry( "flash.p99_us", getFlashStats().percentile( 99 ) );
+    }
+
+    if( verify.collecting() && !image_signed ) { // validate_sig() compares the blocks otherwise
+        getPartition( partition );
+        if( !_target_partition || !verify.check( _target_partition, updateSize, nullptr ) ) {
+            log_e("Written image doesn't match the downloaded data");
+            _metrics.verifyFailure();
+            _agent->abort(); // copies of the image, see FOTATeeAgent.hpp
+            if( _target_partition ) {
+                if( partition == U_FLASH ) esp_ota_set_boot_partition( esp_ota_get_running_partition() );
+                ESP.partitionEraseRange( _target_partition, 0, ENCRYPTED_BLOCK_SIZE );
+            }
+            if( onUpdateCheckFail ) onUpdateCheckFail( partition, -2 ); // CHECK_SIG_ERROR_VALIDATION_FAILED
+            return false;
+        }
+    }
+
+    if( image_signed && !to_flash ) { // sinks: the agent hashed what it wrote
+        uint8_t hash[32];
+        if( !_agent->digest( hash ) || !verify_signature( hash, signature ) ) {
+            log_e("Signature check failed!");
+            _metrics.signatureFailure();
+            _agent->abort(); // discards the stored image
+            _arena.free( signature );
+            if( onUpdateCheckFail ) onUpdateCheckFail( partition, -2 ); // CHECK_SIG_ERROR_VALIDATION_FAILED
+            return false;
+        }
+        log_d("Signature check successful!");
+        _arena.free( signature );
+        image_signed = false;
+    }
+
+    if( image_signed ) { // check signature
 
         log_i("Checking partition %d to validate", partition);
 
@@ -676,7 +1086,8 @@ bool esp32FOTA::execOTA( int partition, bool restart_after )
         if( !_target_partition ) {
             log_e("Can't access partition #%d to check signature!", partition);
             if( onUpdateCheckFail ) onUpdateCheckFail( partition, CHECK_SIG_ERROR_PARTITION_NOT_FOUND );
-            delete[] signature;
+            _agent->abort();
+            _arena.free( signature );
             return false;
         }
 
@@ -695,31 +1106,64 @@ bool esp32FOTA::execOTA( int partition, bool restart_after )
             // during signature validation (crash, oom, power failure).
         }
 
+        // an agent with a digest policy hashed the image on its way to flash, no need to read it back
+        uint8_t streamed_sha256[32];
+        bool sha256_ok = !_from_peer || ( _agent->digest( streamed_sha256 )
+            ? memcmp( streamed_sha256, _payload_sha256, sizeof(streamed_sha256) ) == 0
+            : validate_sha256( _target_partition, _payload_sha256, updateSize ) );
+        if( !sha256_ok ) {
+            log_e("Image sha256 doesn't match the manifest");
+            _metrics.verifyFailure();
+            _agent->abort();
+            _arena.free( signature );
+            esp_partition_erase_range( _target_partition, 0, _target_partition->size );
+            if( onUpdateCheckFail ) onUpdateCheckFail( partition, CHECK_SIG_ERROR_VALIDATION_FAILED );
+            return false;
+        }
+
         if( !validate_sig( _target_partition, signature, updateSize ) ) {
-            delete[] signature;
+            _metrics.signatureFailure();
+            _agent->abort();
+            _arena.free( signature );
             // erase partition
-            esp_partition_erase_range( _target_partition, _target_partition->address, _target_partition->size );
+            esp_partition_erase_range( _target_partition, 0, _target_partition->size );
 
             if( onUpdateCheckFail ) onUpdateCheckFail( partition, CHECK_SIG_ERROR_VALIDATION_FAILED );
 
             log_e("Signature check failed!");
             return false;
         } else {
-            delete[] signature;
             log_d("Signature check successful!");
             if( partition == U_FLASH ) {
                 // Set updated partition as bootable now that it's been verified
                 esp_ota_set_boot_partition( _target_partition );
+                if( _cfg.use_peers ) {
+                    char version[32];
+                    semver_render( _payload_sem.ver(), version );
+                    FOTAPeers::store( _cfg.name, version, _target_partition, updateSize, signature, _cfg.signature_len );
+                }
             }
+            _arena.free( signature );
         }
     }
+    // every check passed: sinks keep the image now (files renamed, serial devices get the last frame)
+    if( !_agent->commit() ) {
+        log_e("Unable to commit the update, error #%d", _agent->getError());
+        _agent->abort();
+        return false;
+    }
+
     log_d("OTA Update complete!");
-    if (F_Update.isFinished()) {
+    if (_agent->isFinished()) {
+
+        update_scope.succeeded = true;
+        _metrics.update( true );
+        _metrics.save(); // before a restart
 
         if( onUpdateFinished ) onUpdateFinished( partition, restart_after );
 
         log_i("Update successfully completed.");
-        if( restart_after ) {
+        if( restart_after && to_flash ) {
             log_i("Rebooting.");
             ESP.restart();
         }
@@ -731,54 +1175,526 @@ bool esp32FOTA::execOTA( int partition, bool restart_after )
 }
 
 
-void esp32FOTA::getPartition( int update_partition )
+// Built-in decoder of lz4/heatshrink images (nullptr on failure), the window comes from the arena when enabled
+FOTAArena::unique_ptr<FOTADecoder> esp32FOTA::createDecoder( FOTACompression_t codec )
 {
-    _target_partition = nullptr;
-    if( update_partition == U_FLASH ) {
-        // select the last-updated OTA partition
-        _target_partition = esp_ota_get_next_update_partition(NULL);
-    } else if( update_partition == U_SPIFFS ) {
-        // iterate through partitions table to find the spiffs/littlefs partition
-        esp_partition_iterator_t iterator = esp_partition_find( ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL );
-        while( iterator != NULL ) {
-            _target_partition = (esp_partition_t *)esp_partition_get( iterator );
-            iterator = esp_partition_next( iterator );
+    FOTAArena::unique_ptr<FOTADecoder> decoder( nullptr, FOTAArena::Deleter{ &_arena } );
+    switch( codec ) {
+        case FOTA_COMPRESSION_LZ4:        decoder = _arena.make<LZ4Decoder>(); break;
+        case FOTA_COMPRESSION_HEATSHRINK: decoder = _arena.make<HeatshrinkDecoder>( _hs_window, _hs_lookahead ); break;
+        default: return decoder;
+    }
+    if( !decoder ) {
+        log_e("Unable to allocate %s decoder", compressionName(codec));
+        return decoder;
+    }
+    if( _arena.enabled() ) { // the window would come from the heap otherwise
+        uint8_t* window = (uint8_t*)_arena.alloc( decoder->bufferSize() );
+        if( !window ) {
+            log_e("No room in the arena for the %s window (%d bytes)", decoder->name(), decoder->bufferSize());
+            decoder.reset();
+            return decoder;
         }
-        esp_partition_iterator_release( iterator );
-    } else {
-        // wut ?
-        log_e("Unhandled partition type #%i, must be one of U_FLASH / U_SPIFFS", update_partition );
+        decoder->setBuffer( window );
     }
+    return decoder;
 }
 
 
-
-bool esp32FOTA::checkJSONManifest(JsonVariant doc)
+// Write the named data partitions of the manifest entry, stops at the first failure
+bool esp32FOTA::execPartitionsOTA()
 {
-    if(strcmp(doc["type"].as<const char *>(), _cfg.name) != 0) {
-        log_d("Payload type in manifest %s doesn't match current firmware %s", doc["type"].as<const char *>(), _cfg.name );
-        log_d("Doesn't match type: %s", _cfg.name );
-        return false;  // Move to the next entry in the manifest
+    setupStream();
+    for( const auto& target : _partitions ) {
+        bool ok = execPartitionOTA( target );
+        _metrics.update( ok );
+        _metrics.save();
+        if( !ok ) return false;
     }
-    log_i("Payload type in manifest %s matches current firmware %s", doc["type"].as<const char *>(), _cfg.name );
+    _partitions.clear();
+    return true;
+}
 
-    _flashFileSystemUrl.clear();
-    _firmwareUrl.clear();
 
-    if(doc["version"].is<uint16_t>()) {
-        uint16_t v = doc["version"].as<uint16_t>();
-        log_d("JSON version: %d (int)", v);
-        _payload_sem = SemverClass(v);
-    } else if (doc["version"].is<const char *>()) {
-        const char* c = doc["version"].as<const char *>();
-        _payload_sem = SemverClass(c);
-        log_d("JSON version: %s (semver)", c );
-    } else {
-        log_e( "Invalid semver format received in manifest. Defaulting to 0" );
-        _payload_sem = SemverClass(0);
+bool esp32FOTA::execPartitionOTA( const FOTAPartitionTarget_t& target )
+{
+    const esp_partition_t* partition = FOTAPartitionAgent::find( target.label.c_str() );
+    if( !FOTAPartitionAgent::writable( partition ) ) {
+        log_e("No writable data partition labelled %s", target.label.c_str());
+        return false;
     }
 
-    debugSemVer("Payload firmware version", _payload_sem.ver() );
+    // forget the recorded content first, an interrupted update is retried on the next check
+    String key = target.label.substring( 0, 15 );
+    Preferences prefs;
+    if( prefs.begin( FOTA_PARTITIONS_NVS, false ) ) {
+        if( prefs.isKey( key.c_str() ) ) prefs.remove( key.c_str() );
+        prefs.end();
+    }
+
+    FOTAArena::Scope scope( _arena );
+    FOTATurbo turbo( _cfg.turbo );
+
+    _partitionUrl = target.url;
+    int64_t size = getStream( this, U_FOTA_PARTITION );
+    if( size <= 0 || _stream == nullptr ) {
+        log_e("Unable to get %s", target.url.c_str());
+        stopStream();
+        return false;
+    }
+    _stream = _throttle.wrap( _stream, _cfg.rate_limit );
+
+    auto decoder = createDecoder( target.compression );
+    if( target.compression != FOTA_COMPRESSION_NONE && !decoder ) {
+        stopStream();
+        return false;
+    }
+
+    log_i("Updating partition %s from %s", target.label.c_str(), target.url.c_str());
+
+    // pumpStream() writes through _agent and bounds the image with _target_partition
+    FOTAPartitionAgent agent( partition, &_arena );
+    FOTAAgent* update_agent = _agent;
+    _agent = &agent;
+    _target_partition = partition;
+    if( onOTAProgress ) agent.onProgress( onOTAProgress );
+    beginProgress( size );
+
+    size_t written = 0;
+    uint32_t started = millis();
+    bool ret = agent.begin( decoder ? UPDATE_SIZE_UNKNOWN : size, U_FOTA_PARTITION, nullptr )
+            && pumpStream( decoder.get(), size, nullptr, &written )
+            && agent.end( decoder || size == UPDATE_SIZE_UNKNOWN );
+    _metrics.download( _progress.info().bytes );
+    if( ret ) {
+        _progress.finish();
+        reportThroughput( written, millis() - started );
+    }
+
+    _agent = update_agent;
+    stopStream();
+
+    if( !ret ) {
+        log_e("Partition %s update failed (error #%d)", target.label.c_str(), agent.getError());
+        agent.abort(); // no partial image
+        if( onUpdateBeginFail && written == 0 ) onUpdateBeginFail( U_FOTA_PARTITION );
+        return false;
+    }
+
+    if( target.has_sha256 ) {
+        if( !validate_sha256( partition, target.sha256, written ) ) {
+            log_e("Partition %s sha256 doesn't match the manifest", target.label.c_str());
+            _metrics.verifyFailure();
+            agent.abort(); // erases the partition
+            if( onUpdateCheckFail ) onUpdateCheckFail( U_FOTA_PARTITION, CHECK_SIG_ERROR_VALIDATION_FAILED );
+            return false;
+        }
+        if( prefs.begin( FOTA_PARTITIONS_NVS, false ) ) {
+            prefs.putBytes( key.c_str(), target.sha256, sizeof(target.sha256) );
+            prefs.end();
+        }
+    }
+
+    log_i("Partition %s updated (%d bytes)", target.label.c_str(), written);
+    if( onUpdateFinished ) onUpdateFinished( U_FOTA_PARTITION, false );
+    return true;
+}
+
+
+// "blocks": [signature] + sha256 of every block_size bytes of the unpacked image
+bool esp32FOTA::loadBlockHashes( FOTABlockHashes& blocks, FOTAArena::unique_ptr<uint8_t>& list )
+{
+    if( _stream_type != FOTA_HTTP_STREAM ) {
+        log_e("Block hash lists are only fetched over HTTP");
+        return false;
+    }
+    getPartition( U_FLASH );
+    if( !_target_partition || _block_size == 0 || _block_size % SPI_FLASH_SEC_SIZE ) {
+        log_e("Invalid block size %u", _block_size);
+        return false;
+    }
+
+    size_t sig_len = _cfg.check_sig ? _cfg.signature_len : 0;
+    size_t max_len = sig_len + ( ( _target_partition->size + _block_size - 1 ) / _block_size ) * 32;
+    list.reset( (uint8_t*)_arena.alloc( max_len ) );
+    if( !list ) {
+        log_e("Unable to allocate %d bytes for the block hash list, see fota_arena_size( %u, %u, %u )", max_len,
+          (unsigned)_cfg.signature_len, (unsigned)_target_partition->size, (unsigned)_block_size);
+        return false;
+    }
+
+    size_t len = fetchHTTP( _blocksUrl.c_str(), list.get(), max_len );
+    if( len <= sig_len || ( len - sig_len ) % 32 ) {
+        log_e("Malformed block hash list (%d bytes)", len);
+        return false;
+    }
+
+    if( _cfg.check_sig ) { // the list is signed like an image, its signature vouches for every block
+        uint8_t hash[32];
+        FOTASha256Digest digest;
+        digest.begin();
+        digest.update( list.get() + sig_len, len - sig_len );
+        if( !digest.finish( hash ) || !verify_signature( hash, list.get() ) ) {
+            log_e("Block hash list signature check failed!");
+            return false;
+        }
+    }
+
+    log_d("%d block hashes of %u bytes", ( len - sig_len ) / 32, _block_size);
+    return blocks.begin( list.get() + sig_len, ( len - sig_len ) / 32, _block_size );
+}
+
+
+// Fetch the corrupted blocks again with Range requests, and rewrite them in place
+bool esp32FOTA::repairBlocks( FOTABlockHashes& blocks )
+{
+    if( blocks.pending() == 0 ) return true;
+
+    getPartition( U_FLASH );
+    FOTAArena::unique_ptr<uint8_t> block( (uint8_t*)_arena.alloc( blocks.blockSize() ), FOTAArena::Deleter{ &_arena } );
+    if( !_target_partition || !block ) {
+        log_e("Unable to allocate %d bytes to fetch blocks again", blocks.blockSize());
+        return false;
+    }
+
+    for( size_t i = 0; i < blocks.pending(); i++ ) {
+        size_t index  = blocks.pendingBlock( i );
+        size_t offset = index * blocks.blockSize();
+        size_t len    = blocks.blockLength( index );
+        if( fetchHTTP( _firmwareUrl.c_str(), block.get(), len, offset ) != len || !blocks.check( index, block.get(), len ) ) {
+            log_e("Unable to fetch block #%d again", index);
+            return false;
+        }
+        if( esp_partition_erase_range( _target_partition, offset, blocks.blockSize() ) != ESP_OK
+         || esp_partition_write( _target_partition, offset, block.get(), len ) != ESP_OK ) {
+            log_e("Unable to rewrite block #%d", index);
+            return false;
+        }
+        if( _verify ) _verify->rewrite( offset, block.get(), len );
+        log_i("Block #%d fetched again and rewritten", index);
+    }
+    blocks.repaired();
+    return true;
+}
+
+
+// GET a small resource into 'buffer': the whole body, or 'len' bytes from range_start.
+// Returns the length read, 0 on failure.
+size_t esp32FOTA::fetchHTTP( const char* url, uint8_t* buffer, size_t len, int64_t range_start )
+{
+    _http.end(); // the image stream is over, or not opened yet
+    if( !setupHTTP( url ) ) return 0;
+
+    if( range_start >= 0 ) {
+        char range[32];
+        snprintf( range, sizeof(range), "bytes=%u-%u", (uint32_t)range_start, (uint32_t)( range_start + len - 1 ) );
+        _http.addHeader( "Range", range );
+    }
+
+    size_t read = 0;
+    int httpCode = _http.GET();
+    if( httpCode == ( range_start >= 0 ? HTTP_CODE_PARTIAL_CONTENT : HTTP_CODE_OK ) ) {
+        int size = _http.getSize();
+        if( size > 0 && (size_t)size <= len && ( range_start < 0 || (size_t)size == len ) ) {
+            Stream* stream = _http.getStreamPtr();
+            stream->setTimeout( _stream_timeout );
+            read = stream->readBytes( buffer, size );
+            if( read != (size_t)size ) read = 0;
+        } else {
+            log_e("Unexpected length %d for %s", size, url);
+        }
+    } else {
+        log_e("Server responded with HTTP Status '%i' for %s", httpCode, url);
+    }
+    _http.end();
+    return read;
+}
+
+
+// Copy the stream into the Update agent, optionally through a built-in decoder.
+// Reads stream_size bytes, or until the end of the body when it's UPDATE_SIZE_UNKNOWN.
+// When 'trailer' is set, the last signature_len bytes are held back from the image
+// and copied there. Returns true if the stream was complete, 'written' is the image size.
+bool esp32FOTA::pumpStream( FOTADecoder* decoder, size_t stream_size, unsigned char* trailer, size_t* written )
+{
+    size_t image_size = 0;
+    size_t max_size   = _target_partition ? _target_partition->size : UPDATE_SIZE_UNKNOWN;
+
+    *written = 0;
+
+    FOTAAgent* agent   = _agent;
+    FOTAVerify* verify = _verify;
+    FOTABlockHashes* blocks = _blocks;
+    FOTADecoder::output_cb output = [&image_size, max_size, agent, verify, blocks]( const uint8_t* data, size_t len ) {
+        if( image_size + len > max_size ) {
+            log_e("Image exceeds partition size (%d bytes)", max_size);
+            return false;
+        }
+        if( blocks && !blocks->update( data, len ) ) {
+            return false;
+        }
+        if( agent->write( data, len ) != len ) {
+            return false;
+        }
+        if( verify ) verify->update( data, len );
+        image_size += len;
+        return true;
+    };
+
+    if( decoder && !decoder->begin( output ) ) {
+        log_e("Unable to start %s decoder", decoder->name());
+        return false;
+    }
+
+    auto feed = [decoder, &output]( const uint8_t* data, size_t len ) {
+        if( len == 0 ) return true;
+        return decoder ? decoder->write( data, len ) : output( data, len );
+    };
+
+    FOTAArena::Scope scope( _arena );
+    uint8_t *_buffer = (uint8_t*)_arena.alloc(FOTA_STREAM_BUFFER_SIZE);
+    if(!_buffer){
+        log_e( "malloc failed" );
+        return false;
+    }
+
+    size_t consumed = 0;
+    size_t tail_len = 0; // bytes held back in 'trailer'
+    bool eof = false;
+    bool failed = false;
+    uint32_t last_data = millis();
+
+    while( stream_size == UPDATE_SIZE_UNKNOWN || consumed < stream_size ) {
+        size_t available = _stream->available();
+        if( !available ) {
+            if( stream_size == UPDATE_SIZE_UNKNOWN && streamEnded() ) {
+                eof = true;
+                break;
+            }
+            if( _throttle.source() == &_chunked && _chunked.failed() ) {
+                failed = true;
+                break;
+            }
+            if( streamStalled( last_data ) ) {
+                log_e("Stream timed out");
+                failed = true;
+                break;
+            }
+            vTaskDelay(1);
+            continue;
+        }
+        size_t toread = std::min( available, (size_t)FOTA_STREAM_BUFFER_SIZE );
+        if( stream_size != UPDATE_SIZE_UNKNOWN ) toread = std::min( toread, stream_size - consumed );
+        size_t bytesread = _stream->readBytes( _buffer, toread );
+        consumed += bytesread;
+        _progress.update( consumed );
+        last_data = millis();
+
+        const uint8_t* data = _buffer;
+        size_t len = bytesread;
+
+        if( trailer ) { // only release what can't be part of the signature
+            size_t sig_len = _cfg.signature_len;
+            if( tail_len + len > sig_len ) {
+                size_t release   = tail_len + len - sig_len;
+                size_t from_tail = std::min( release, tail_len );
+                if( !feed( trailer, from_tail ) ) {
+                    failed = true;
+                    break;
+                }
+                memmove( trailer, trailer + from_tail, tail_len - from_tail );
+                tail_len -= from_tail;
+                if( !feed( data, release - from_tail ) ) {
+                    failed = true;
+                    break;
+                }
+                data += release - from_tail;
+                len  -= release - from_tail;
+            }
+            memcpy( trailer + tail_len, data, len );
+            tail_len += len;
+        } else if( !feed( data, len ) ) {
+            failed = true;
+            break;
+        }
+    }
+
+    _arena.free( _buffer );
+
+    bool complete = !failed && ( stream_size == UPDATE_SIZE_UNKNOWN ? eof : consumed == stream_size );
+
+    if( complete && trailer && tail_len != _cfg.signature_len ) {
+        log_e("Stream too short to hold a signature trailer");
+        complete = false;
+    }
+
+    if( complete && decoder ) {
+        complete = decoder->end();
+        if( complete ) log_d("%s: %d bytes unpacked to %d bytes", decoder->name(), consumed, image_size);
+    }
+
+    if( failed && decoder ) {
+        log_e("%s decoding failed at offset %d", decoder->name(), consumed);
+    }
+
+    *written = image_size;
+    return complete;
+}
+
+
+void esp32FOTA::beginProgress( size_t total )
+{
+    _progress.setPolicy( _cfg.progress_interval, _cfg.progress_step );
+    _progress.setRateCap( _throttle.getRate() );
+    if( onProgressReport ) {
+        _progress.onReport( onProgressReport );
+    } else if( onOTAProgress ) {
+        _progress.onReport( nullptr ); // the application has its own progress display
+    } else {
+        _progress.onReport( FOTAProgress::print );
+    }
+    _progress.begin( total );
+}
+
+
+void esp32FOTA::reportThroughput( size_t bytes, uint32_t elapsed_ms )
+{
+    if( elapsed_ms == 0 ) return;
+    uint32_t throughput = (uint64_t)bytes * 1000 / elapsed_ms;
+    log_i("%d bytes in %u ms (%u bytes/s)", bytes, elapsed_ms, throughput);
+    _metrics.throughput( throughput );
+    if( onTelemetry ) onTelemetry( "ota.throughput", throughput );
+    if( _cfg.rate_limit || bytes < FOTA_TURBO_MIN_SAMPLE ) return; // capped on purpose or too short, not comparable
+
+    if( !_cfg.turbo ) {
+        FOTATurbo::setBaseline( throughput );
+        return;
+    }
+    uint32_t baseline = FOTATurbo::baseline();
+    if( baseline == 0 ) {
+        log_d("No download without turbo to compare with");
+        return;
+    }
+    float gain = 100.0f * ( (float)throughput - baseline ) / baseline;
+    log_i("Turbo: %u bytes/s, %+.0f%% compared with %u bytes/s", throughput, gain, baseline);
+    if( onTelemetry ) {
+        onTelemetry( "turbo.baseline", baseline );
+        onTelemetry( "turbo.gain", gain );
+    }
+}
+
+
+// Only meaningful for streams of unknown length: true when the body is complete
+bool esp32FOTA::streamEnded()
+{
+    if( _throttle.waiting() ) { // data left, held back by the bandwidth cap
+        return false;
+    }
+    if( _throttle.source() == &_chunked ) {
+        return _chunked.finished();
+    }
+    if( _stream_type == FOTA_HTTP_STREAM ) { // body delimited by connection close
+        return !_http.connected();
+    }
+    return false;
+}
+
+
+bool esp32FOTA::streamStalled( uint32_t& last_data )
+{
+    if( _throttle.waiting() ) last_data = millis();
+    if( _throttle.source() == &_multicast && (int32_t)( _multicast.lastPacketMs() - last_data ) > 0 ) {
+        last_data = _multicast.lastPacketMs();
+    }
+    return millis() - last_data >= _stream_timeout;
+}
+
+
+void esp32FOTA::getPartition( int update_partition )
+{
+    _target_partition = nullptr;
+    if( update_partition == U_FLASH ) {
+        // select the last-updated OTA partition
+        _target_partition = esp_ota_get_next_update_partition(NULL);
+    } else if( update_partition == U_SPIFFS ) {
+        // iterate through partitions table to find the spiffs/littlefs partition
+        esp_partition_iterator_t iterator = esp_partition_find( ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL );
+        while( iterator != NULL ) {
+            _target_partition = (esp_partition_t *)esp_partition_get( iterator );
+            iterator = esp_partition_next( iterator );
+        }
+        esp_partition_iterator_release( iterator );
+    } else {
+        // wut ?
+        log_e("Unhandled partition type #%i, must be one of U_FLASH / U_SPIFFS", update_partition );
+    }
+}
+
+
+
+bool esp32FOTA::checkJSONManifest(JsonVariant doc)
+{
+    if(strcmp(doc["type"].as<const char *>(), _cfg.name) != 0) {
+        log_d("Payload type in manifest %s doesn't match current firmware %s", doc["type"].as<const char *>(), _cfg.name );
+        log_d("Doesn't match type: %s", _cfg.name );
+        return false;  // Move to the next entry in the manifest
+    }
+    log_i("Payload type in manifest %s matches current firmware %s", doc["type"].as<const char *>(), _cfg.name );
+
+    _flashFileSystemUrl.clear();
+    _firmwareUrl.clear();
+
+    if(doc["version"].is<uint16_t>()) {
+        uint16_t v = doc["version"].as<uint16_t>();
+        log_d("JSON version: %d (int)", v);
+        _payload_sem = SemverClass(v);
+    } else if (doc["version"].is<const char *>()) {
+        const char* c = doc["version"].as<const char *>();
+        _payload_sem = SemverClass(c);
+        log_d("JSON version: %s (semver)", c );
+    } else {
+        log_e( "Invalid semver format received in manifest. Defaulting to 0" );
+        _payload_sem = SemverClass(0);
+    }
+
+    debugSemVer("Payload firmware version", _payload_sem.ver() );
+
+    _compression = FOTA_COMPRESSION_AUTO;
+    if( doc["compression"].is<const char*>() ) {
+        _compression = compressionFromName( doc["compression"].as<const char*>() );
+        if( _compression == FOTA_COMPRESSION_AUTO ) {
+            log_e("Unsupported compression '%s' in manifest", doc["compression"].as<const char*>() );
+            return false;
+        }
+    }
+    // signature is prepended by default, or appended to the image
+    _sig_trailer = doc["sig_position"].is<const char*>() && strcmp( doc["sig_position"].as<const char*>(), "trailer" ) == 0;
+
+    // optional digest of the unpacked image, binds images downloaded from LAN peers to this manifest entry
+    _has_payload_sha256 = false;
+    if( doc["sha256"].is<const char*>() ) {
+        if( !parseSha256( doc["sha256"].as<const char*>(), _payload_sha256 ) ) {
+            log_e("Invalid sha256 in manifest");
+            return false;
+        }
+        _has_payload_sha256 = true;
+    }
+
+    // optional signed block hash list, each block of the unpacked image is verified as it arrives
+    _blocksUrl  = doc["blocks"].is<const char*>() ? doc["blocks"].as<const char*>() : "";
+    _block_size = doc["block_size"].is<uint32_t>() ? doc["block_size"].as<uint32_t>() : FOTA_BLOCKS_DEFAULT_SIZE;
+
+    // named data partitions, only the ones whose content changed are kept
+    if( !checkPartitions( doc ) ) return false;
+    bool has_partitions = doc["partitions"].is<JsonArray>();
+
+    // optional image sizes, see checkPreflight()
+    _payload_size          = doc["size"].is<uint32_t>()          ? doc["size"].as<uint32_t>()          : 0;
+    _payload_unpacked_size = doc["unpacked_size"].is<uint32_t>() ? doc["unpacked_size"].as<uint32_t>() : 0;
+    _fs_payload_size       = doc["fs_size"].is<uint32_t>()       ? doc["fs_size"].as<uint32_t>()       : 0;
+
+    _hs_window    = doc["hs_window"].is<uint8_t>()    ? doc["hs_window"].as<uint8_t>()    : HEATSHRINK_DEFAULT_WINDOW_SZ2;
+    _hs_lookahead = doc["hs_lookahead"].is<uint8_t>() ? doc["hs_lookahead"].as<uint8_t>() : HEATSHRINK_DEFAULT_LOOKAHEAD_SZ2;
 
     // Memoize some values to help with the decision tree
     bool has_url        = doc["url"].is<const char*>();
@@ -793,8 +1709,8 @@ bool esp32FOTA::checkJSONManifest(JsonVariant doc)
     bool has_fatfs      = doc["fatfs"].is<const char*>();
     bool has_filesystem = has_littlefs || has_spiffs || has_fatfs;
 
-    String protocol(has_tls ? "https" : "http");
-    String flashFSPath  =
+    const char* protocol = has_tls ? "https" : "http";
+    const char* flashFSPath  =
       has_filesystem
       ? (
         has_littlefs
@@ -810,7 +1726,7 @@ bool esp32FOTA::checkJSONManifest(JsonVariant doc)
         has_hostname?"true":"false",
         has_port?"true":"false",
         has_firmware?"true":"false",
-        flashFSPath.c_str()
+        flashFSPath
     );
 
     if( has_url ) { // Basic scenario: a complete URL was provided in the JSON manifest, all other keys will be ignored
@@ -819,10 +1735,21 @@ bool esp32FOTA::checkJSONManifest(JsonVariant doc)
             log_w("Manifest provides both url and host - Using URL");
         }
     } else if( has_firmware && has_hostname && has_port ) { // Precise scenario: Hostname, Port and Firmware Path were provided
-        _firmwareUrl = protocol + "://" + doc["host"].as<const char*>() + ":" + portnum + doc["bin"].as<const char*>();
+        // appended in place: no temporary Strings, the buffers reserved by setArena() are reused
+        char port[7];
+        snprintf( port, sizeof(port), ":%u", portnum );
+        _firmwareUrl = protocol;
+        _firmwareUrl += "://";
+        _firmwareUrl += doc["host"].as<const char*>();
+        _firmwareUrl += port;
         if( has_filesystem ) { // More complex scenario: the manifest also provides a [spiffs, littlefs or fatfs] partition
-            _flashFileSystemUrl = protocol + "://" + doc["host"].as<const char*>() + ":" + portnum + flashFSPath;
+            _flashFileSystemUrl = _firmwareUrl;
+            _flashFileSystemUrl += flashFSPath;
         }
+        _firmwareUrl += doc["bin"].as<const char*>();
+    } else if( has_partitions ) { // Data only: applied when a partition content changed, regardless of the version
+        log_i("Manifest entry only updates data partitions, %d changed", _partitions.size());
+        return !_partitions.empty() && checkPreflight( doc ) && checkRollout( doc );
     } else { // JSON was malformed - no firmware target was provided
         log_e("JSON manifest was missing one of the required keys :(" );
         String prettyJson;
@@ -832,23 +1759,225 @@ bool esp32FOTA::checkJSONManifest(JsonVariant doc)
     }
 
     if (semver_compare(*_payload_sem.ver(), *_cfg.sem.ver()) == 1) {
-        return true;
+        return checkPreflight( doc ) && checkRollout( doc );
     }
 
+    _partitions.clear(); // they come along with the firmware
     return false;
 }
 
 
+// "partitions": [ { "label": "model", "url": "...", "sha256": "...", "compression": "lz4" } ]
+// Partitions are found by label, and skipped when the recorded sha256 of their content matches.
+// An entry listing a partition this device doesn't have is rejected, like a failed preflight check.
+bool esp32FOTA::checkPartitions(JsonVariant doc)
+{
+    _partitions.clear();
+    if( !doc["partitions"].is<JsonArray>() ) return true;
 
+    Preferences prefs;
+    bool has_records = prefs.begin( FOTA_PARTITIONS_NVS, true );
+    bool ret = true;
 
-bool esp32FOTA::execHTTPcheck()
+    for( JsonVariant entry : doc["partitions"].as<JsonArray>() ) {
+        if( !entry["label"].is<const char*>() || !entry["url"].is<const char*>() ) {
+            log_e("Partition entries need a label and a url");
+            ret = false;
+            break;
+        }
+        FOTAPartitionTarget_t target;
+        target.label = entry["label"].as<const char*>();
+        target.url   = entry["url"].as<const char*>();
+
+        if( entry["sha256"].is<const char*>() ) {
+            target.has_sha256 = parseSha256( entry["sha256"].as<const char*>(), target.sha256 );
+            if( !target.has_sha256 ) {
+                log_e("Invalid sha256 for partition %s", target.label.c_str());
+                ret = false;
+                break;
+            }
+        } else if( _cfg.check_sig ) { // data partitions aren't signed, the manifest vouches for them
+            log_e("Partition %s has no sha256, required along with signature checking", target.label.c_str());
+            ret = false;
+            break;
+        }
+
+        if( entry["compression"].is<const char*>() ) {
+            target.compression = compressionFromName( entry["compression"].as<const char*>() );
+            if( target.compression != FOTA_COMPRESSION_NONE && target.compression != FOTA_COMPRESSION_LZ4 && target.compression != FOTA_COMPRESSION_HEATSHRINK ) {
+                log_e("Partition %s: only none, lz4 and heatshrink compressions are supported", target.label.c_str());
+                ret = false;
+                break;
+            }
+        }
+
+        if( !FOTAPartitionAgent::writable( FOTAPartitionAgent::find( target.label.c_str() ) ) ) {
+            log_w("No writable data partition labelled %s", target.label.c_str());
+            ret = false;
+            break;
+        }
+
+        String key = target.label.substring( 0, 15 ); // NVS key length limit
+        uint8_t installed[32];
+        if( target.has_sha256 && has_records && prefs.isKey( key.c_str() )
+         && prefs.getBytes( key.c_str(), installed, sizeof(installed) ) == sizeof(installed)
+         && memcmp( installed, target.sha256, sizeof(installed) ) == 0 ) {
+            log_d("Partition %s is up to date", target.label.c_str());
+            continue;
+        }
+        _partitions.push_back( target );
+    }
+
+    if( has_records ) prefs.end();
+    if( !ret ) _partitions.clear();
+    return ret;
+}
+
+
+bool esp32FOTA::parseSha256( const char* hex, uint8_t* digest )
 {
-    String useURL = String( _cfg.manifest_url );
+    if( strlen( hex ) != 64 ) return false;
+    for( int i=0; i<32; i++ ) {
+        char byte[3] = { hex[i*2], hex[i*2+1], 0 };
+        if( !isxdigit( byte[0] ) || !isxdigit( byte[1] ) ) return false;
+        digest[i] = strtoul( byte, nullptr, 16 );
+    }
+    return true;
+}
 
-    if( useURL.isEmpty() ) {
-      log_e("No manifest_url provided in config, aborting!");
-      return false;
+
+// Optional manifest keys telling if the image can run on this device and fits its partitions,
+// checked before any download so a doomed update doesn't cost a download + flash erase:
+//   "chip": "esp32s3" or [ "esp32", "esp32s3" ], compared with the build target
+//   "min_idf": "4.4.0", minimum ESP-IDF version of the running firmware
+//   "min_bootloader": 2, minimum bootloader project version (ESP-IDF >= 5.3 only)
+//   "size", "unpacked_size", "fs_size": image sizes in bytes, as served and once written to flash
+bool esp32FOTA::checkPreflight(JsonVariant doc)
+{
+    // chip names are compared without case and punctuation, "ESP32-S3" matches "esp32s3"
+    auto chipName = []( const char* name ) {
+        String out;
+        for( const char* c = name; *c; c++ ) {
+            if( isalnum( *c ) ) out += (char)tolower( *c );
+        }
+        return out;
+    };
+
+    if( !doc["chip"].isNull() ) {
+        String target = chipName( CONFIG_IDF_TARGET );
+        bool match = false;
+        if( doc["chip"].is<JsonArray>() ) {
+            for( JsonVariant chip : doc["chip"].as<JsonArray>() ) {
+                if( chip.is<const char*>() && chipName( chip.as<const char*>() ) == target ) match = true;
+            }
+        } else if( doc["chip"].is<const char*>() ) {
+            match = chipName( doc["chip"].as<const char*>() ) == target;
+        }
+        if( !match ) {
+            log_w("Preflight: image isn't built for this chip (%s)", CONFIG_IDF_TARGET);
+            return false;
+        }
+    }
+
+    if( doc["min_idf"].is<const char*>() ) {
+        SemverClass min_idf( doc["min_idf"].as<const char*>() );
+        SemverClass idf( ESP_IDF_VERSION_MAJOR, ESP_IDF_VERSION_MINOR, ESP_IDF_VERSION_PATCH );
+        if( semver_compare( *idf.ver(), *min_idf.ver() ) < 0 ) {
+            log_w("Preflight: image needs ESP-IDF %s, running %s", doc["min_idf"].as<const char*>(), esp_get_idf_version());
+            return false;
+        }
+    }
+
+    if( doc["min_bootloader"].is<uint32_t>() ) {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 3, 0)
+        esp_bootloader_desc_t desc;
+        if( esp_ota_get_bootloader_description( NULL, &desc ) != ESP_OK ) {
+            log_w("Preflight: bootloader has no description, can't check min_bootloader");
+            return false;
+        }
+        if( desc.version < doc["min_bootloader"].as<uint32_t>() ) {
+            log_w("Preflight: image needs bootloader version %u, running %u", doc["min_bootloader"].as<uint32_t>(), desc.version);
+            return false;
+        }
+#else
+        log_w("Preflight: bootloader version can't be read with this ESP-IDF version, ignoring min_bootloader");
+#endif
+    }
+
+    // file/memory sinks have their own limits, checked when the image begins
+    if( !_agent->writesFlash() ) return true;
+
+    // bytes written to flash: unpacked_size, or the served size of an uncompressed image
+    size_t signature_len = _cfg.check_sig ? _cfg.signature_len : 0;
+    bool plain           = _compression == FOTA_COMPRESSION_NONE || _compression == FOTA_COMPRESSION_AUTO;
+    uint32_t app_size    = _payload_unpacked_size ? _payload_unpacked_size : plain && _payload_size > signature_len ? _payload_size - signature_len : 0;
+    uint32_t fs_size     = plain && _fs_payload_size > signature_len ? _fs_payload_size - signature_len : 0;
+
+    if( app_size ) {
+        getPartition( U_FLASH );
+        if( !_target_partition || app_size > _target_partition->size ) {
+            log_e("Preflight: firmware image (%u bytes) doesn't fit the app partition (%u bytes)", app_size, _target_partition ? _target_partition->size : 0);
+            return false;
+        }
+    }
+    if( fs_size && !_flashFileSystemUrl.isEmpty() ) {
+        getPartition( U_SPIFFS );
+        if( !_target_partition || fs_size > _target_partition->size ) {
+            log_e("Preflight: filesystem image (%u bytes) doesn't fit the data partition (%u bytes)", fs_size, _target_partition ? _target_partition->size : 0);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// "rollout": percentage of the fleet getting this entry, "salt": optional bucket shuffler.
+// The bucket is stable for a given salt, so devices stay included while the percentage ramps up.
+bool esp32FOTA::checkRollout(JsonVariant doc)
+{
+    if( !doc["rollout"].is<float>() ) return true;
+
+    float rollout = doc["rollout"].as<float>();
+    if( rollout >= 100 ) return true;
+    if( !( rollout > 0 ) ) rollout = 0; // negative or NaN: nobody yet
+
+    // default salt changes with each release so the same devices aren't always first
+    String salt;
+    if( doc["salt"].is<const char*>() ) {
+        salt = doc["salt"].as<const char*>();
+    } else {
+        char version[32];
+        semver_render( _payload_sem.ver(), version );
+        salt = String(_cfg.name) + "-" + version;
+    }
+
+    uint32_t bucket = getRolloutBucket( salt.c_str() );
+    bool included = bucket < (uint32_t)(rollout * 100);
+
+    log_i("Rollout %.2f%%, device bucket %u/10000 (salt: %s): %s", rollout, bucket, salt.c_str(), included ? "included" : "not yet");
+    return included;
+}
+
+
+// FNV-1a of "salt:deviceid", folded into 10000 buckets (0.01% steps)
+uint32_t esp32FOTA::getRolloutBucket( const char* salt )
+{
+    String key = String(salt) + ":" + getDeviceID();
+    uint32_t hash = 2166136261UL;
+    for( size_t i=0; i<key.length(); i++ ) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619UL;
     }
+    return hash % 10000;
+}
+
+
+
+
+String esp32FOTA::getManifestQueryURL()
+{
+    String useURL = String( _cfg.manifest_url );
 
     // being deprecated, soon unsupported!
     // if( useURL.isEmpty() && !checkURL.isEmpty() ) {
@@ -862,17 +1991,44 @@ bool esp32FOTA::execHTTPcheck()
     //     _cfg.use_device_id = useDeviceID;
     // }
 
-    if (_cfg.use_device_id) {
+    if (!useURL.isEmpty() && _cfg.use_device_id) {
         // URL may already have GET values
         String argseparator = (useURL.indexOf('?') != -1 ) ? "&" : "?";
         useURL += argseparator + "id=" + getDeviceID();
     }
+    return useURL;
+}
+
+
+bool esp32FOTA::execHTTPcheck()
+{
+    String useURL = getManifestQueryURL();
+
+    _check_failed = true; // until a manifest is parsed
+    _retry_after  = 0;
+    _max_age      = 0;
+
+    if( useURL.isEmpty() ) {
+      log_e("No manifest_url provided in config, aborting!");
+      return false;
+    }
+
+    bool cached = _cfg.cache_manifest && _manifest_cache.load( useURL.c_str() );
+
+    if( cached && _manifest_cache.fresh() ) {
+        log_i("Cached manifest is still fresh for %u s, skipping network", _manifest_cache.secondsLeft());
+        _metrics.check( true );
+        _metrics.save();
+        return checkManifest( _manifest_cache.body(), _manifest_cache.length(), _manifest_cache.msgpack() );
+    }
 
     if ( isConnected && !isConnected() ) { // Check the current connection status
         log_i("Connection check requested but network not ready - skipping");
         return false;  // WiFi not connected
     }
 
+    if( _cfg.use_peers && !_peers.serving() ) servePeers();
+
     log_i("Getting HTTP: %s", useURL.c_str());
 
     if(! setupHTTP( useURL.c_str() ) ) {
@@ -880,32 +2036,98 @@ bool esp32FOTA::execHTTPcheck()
       return false;
     }
 
+    // binary manifests are smaller and faster to parse, JSON is still accepted
+    _http.addHeader( "Accept", FOTA_MSGPACK_MIME ", application/json;q=0.9" );
+
+    if( cached ) { // stale: conditional fetch
+        if( _manifest_cache.etag()[0] ) _http.addHeader( "If-None-Match", _manifest_cache.etag() );
+        if( _manifest_cache.lastModified()[0] ) _http.addHeader( "If-Modified-Since", _manifest_cache.lastModified() );
+    }
+
     int httpCode = _http.GET();  //Make the request
+    _metrics.check( false );
 
-    // only handle 200/301, fail on everything else
-    if( httpCode != HTTP_CODE_OK && httpCode != HTTP_CODE_MOVED_PERMANENTLY ) {
+    // only handle 200/301/304, fail on everything else
+    bool not_modified = cached && httpCode == HTTP_CODE_NOT_MODIFIED;
+    if( httpCode != HTTP_CODE_OK && httpCode != HTTP_CODE_MOVED_PERMANENTLY && !not_modified ) {
         // This error may be a false positive or a consequence of the network being disconnected.
         // Since the network is controlled from outside this class, only significant error messages are reported.
         if( httpCode > 0 ) {
             log_e("Error on HTTP request (httpCode=%i)", httpCode);
+            _retry_after = parseRetryAfter( _http.header( "Retry-After" ) ); // e.g. 429 or 503
         } else {
             log_d("Unknown HTTP response");
         }
+        _metrics.httpError( httpCode );
+        _metrics.save();
         _http.end();
         return false;
     }
 
+    String cacheControl = _http.header( "Cache-Control" );
+    int maxAge = cacheControl.indexOf( "max-age=" );
+    bool no_cache = cacheControl.indexOf( "no-cache" ) > -1 || cacheControl.indexOf( "no-store" ) > -1;
+    if( maxAge > -1 && !no_cache ) {
+        _max_age = cacheControl.substring( maxAge + 8 ).toInt();
+    }
+    uint32_t freshness = no_cache ? 0 : maxAge > -1 ? _max_age : _cfg.manifest_max_age;
+
+    if( not_modified ) {
+        _http.end();
+        log_i("Manifest not modified, using the cached one");
+        _metrics.notModified();
+        _metrics.save();
+        _manifest_cache.touch( freshness );
+        return checkManifest( _manifest_cache.body(), _manifest_cache.length(), _manifest_cache.msgpack() );
+    }
+
+    String contentType = _http.header( "Content-type" );
+    // the path, without the query string added by use_device_id or present in the manifest url
+    int query = useURL.indexOf( '?' );
+    String path = query > -1 ? useURL.substring( 0, query ) : useURL;
+    // application/msgpack, application/x-msgpack, application/vnd.msgpack, or a static file served as octet-stream
+    bool msgpack = contentType.indexOf( "msgpack" ) > -1 || ( contentType.indexOf( "json" ) < 0 && path.endsWith( ".msgpack" ) );
+
+    _metrics.save();
+
+    if( _cfg.cache_manifest ) {
+        String body = _http.getString();
+        String etag = _http.header( "ETag" );
+        String lastModified = _http.header( "Last-Modified" );
+        _http.end();
+        bool ret = checkManifest( body.c_str(), body.length(), msgpack );
+        if( !_check_failed ) _manifest_cache.store( useURL.c_str(), etag, lastModified, body, msgpack, freshness );
+        return ret;
+    }
+
+    bool ret = checkManifest( nullptr, 0, msgpack );
+    _http.end();  // We're done with HTTP - free the resources
+    return ret;
+}
+
+
+// Parse the manifest and look for a matching entry, _check_failed tells if the parsing failed.
+// MessagePack manifests have the same structure as JSON ones and end up in the same document.
+bool esp32FOTA::checkManifest( const char* body, size_t len, bool msgpack )
+{
     // TODO: use payload.length() to speculate on JSONResult buffer size
-    #define JSON_FW_BUFF_SIZE 2048
-    DynamicJsonDocument JSONResult( JSON_FW_BUFF_SIZE );
-    DeserializationError err = deserializeJson( JSONResult, _http.getStream() );
+    _partitions.clear();
+
+    FOTAArena::Scope scope( _arena );
+    BasicJsonDocument<FOTAArena::JsonAllocator> JSONResult( JSON_FW_BUFF_SIZE, FOTAArena::JsonAllocator( &_arena ) );
+    DeserializationError err;
+    if( msgpack ) {
+        err = body ? deserializeMsgPack( JSONResult, (const uint8_t*)body, len ) : deserializeMsgPack( JSONResult, _http.getStream() );
+    } else {
+        err = body ? deserializeJson( JSONResult, body, len ) : deserializeJson( JSONResult, _http.getStream() );
+    }
 
     if (err) {  // Check for errors in parsing, or JSON length may exceed buffer size
-        log_e("JSON Parsing failed (%s, in=%d bytes, buff=%d bytes):", err.c_str(), _http.getSize(), JSON_FW_BUFF_SIZE );
+        log_e("%s Parsing failed (%s, in=%d bytes, buff=%d bytes):", msgpack ? "MessagePack" : "JSON", err.c_str(), body ? len : _http.getSize(), JSON_FW_BUFF_SIZE );
         return false;
     }
 
-    _http.end();  // We're done with HTTP - free the resources
+    _check_failed = false;
 
     if (JSONResult.is<JsonArray>()) {
         // Although improbable given the size on JSONResult buffer, we already received an array of multiple firmware types and/or versions
@@ -925,6 +2147,31 @@ bool esp32FOTA::execHTTPcheck()
 }
 
 
+const char* esp32FOTA::compressionName( FOTACompression_t codec )
+{
+    switch( codec ) {
+        case FOTA_COMPRESSION_NONE:       return "none";
+        case FOTA_COMPRESSION_ZLIB:       return "zlib";
+        case FOTA_COMPRESSION_GZIP:       return "gzip";
+        case FOTA_COMPRESSION_LZ4:        return "lz4";
+        case FOTA_COMPRESSION_HEATSHRINK: return "heatshrink";
+        case FOTA_COMPRESSION_AUTO:
+        default:                          return "auto";
+    }
+}
+
+
+// returns FOTA_COMPRESSION_AUTO for unknown names
+FOTACompression_t esp32FOTA::compressionFromName( const char* name )
+{
+    const FOTACompression_t codecs[] = { FOTA_COMPRESSION_NONE, FOTA_COMPRESSION_ZLIB, FOTA_COMPRESSION_GZIP, FOTA_COMPRESSION_LZ4, FOTA_COMPRESSION_HEATSHRINK };
+    for( auto codec : codecs ) {
+        if( strcasecmp( name, compressionName(codec) ) == 0 ) return codec;
+    }
+    return FOTA_COMPRESSION_AUTO;
+}
+
+
 String esp32FOTA::getDeviceID()
 {
     char deviceid[21];
@@ -940,6 +2187,9 @@ String esp32FOTA::getDeviceID()
 bool esp32FOTA::forceUpdate(const char* firmwareURL, bool validate )
 {
     _firmwareUrl = firmwareURL;
+    _payload_size = 0; // not from a manifest
+    _blocksUrl.clear();
+    _partitions.clear();
     _cfg.check_sig = validate;
     return execOTA();
 }
@@ -949,6 +2199,9 @@ bool esp32FOTA::forceUpdateSPIFFS(const char* firmwareURL, bool validate )
 {
     _firmwareUrl = firmwareURL;
     _flashFileSystemUrl = firmwareURL;
+    _payload_size = _fs_payload_size = 0; // not from a manifest
+    _blocksUrl.clear();
+    _partitions.clear();
     _cfg.check_sig = validate;
     return execSPIFFSOTA();
 }
@@ -1014,7 +2267,7 @@ void esp32FOTA::debugSemVer( const char* label, semver_t* version )
 static int64_t getHTTPStream( esp32FOTA* fota, int partition )
 {
 
-    const char* url = partition==U_SPIFFS ? fota->getFlashFS_URL() : fota->getFirmwareURL();
+    const char* url = fota->getPath( partition );
 
     log_d("Opening item %s\n", url );
 
@@ -1053,6 +2306,7 @@ static int64_t getHTTPStream( esp32FOTA* fota, int partition )
             case 418: log_e("Status: 418 (I'm a teapot), Brit alert!"); break;
             case 429: log_e("Status: 429 (Too many requests), throttle things down?"); break;
             case 500: log_e("Status: 500 (Internal Server Error), you broke the webs!"); break;
+            case 503: log_e("Status: 503 (Service Unavailable), come back later"); break;
             default:
                 // This error may be a false positive or a consequence of the network being disconnected.
                 // Since the network is controlled from outside this class, only significant error messages are reported.
@@ -1064,21 +2318,38 @@ static int64_t getHTTPStream( esp32FOTA* fota, int partition )
             break;
         }
 
+        fota->getMetrics().httpError( httpCode );
+
+        // honoured by the poll scheduler, see esp32FOTA::handle()
+        fota->setRetryAfter( parseRetryAfter( fota->getHTTPCLient()->header( "Retry-After" ) ) );
+
         return -1;
     }
 
-    // TODO: Not all streams respond with a content length.
-    // TODO: Set updateSize to UPDATE_SIZE_UNKNOWN when content type is valid.
+    String transferEncoding = fota->getHTTPCLient()->header( "Transfer-Encoding" );
+    transferEncoding.toLowerCase();
+    bool chunked = transferEncoding.indexOf("chunked") > -1;
 
     // check updateSize and content type
-    if( updateSize<=0 ) {
+    if( updateSize==0 ) {
         log_e("There was no content in the http response: (length: %" PRId64 ", contentType: %s)\n", updateSize, contentType.c_str());
         return -1;
     }
 
-    log_d("updateSize : %" PRId64 ", contentType: %s", updateSize, contentType.c_str());
+    if( updateSize<0 ) {
+        // Not all streams respond with a content length: the body is either chunked
+        // or delimited by the connection close, the partition size will be the limit.
+        log_d("Unknown content length (%s), contentType: %s", chunked ? "chunked" : "until close", contentType.c_str());
+        updateSize = UPDATE_SIZE_UNKNOWN;
+    } else {
+        log_d("updateSize : %" PRId64 ", contentType: %s", updateSize, contentType.c_str());
+    }
 
-    fota->setFotaStream( fota->getHTTPCLient()->getStreamPtr() );
+    if( chunked ) {
+        fota->setFotaStream( fota->getChunkedStream()->wrap( fota->getHTTPCLient()->getStreamPtr() ) );
+    } else {
+        fota->setFotaStream( fota->getHTTPCLient()->getStreamPtr() );
+    }
 
     return updateSize;
 }
@@ -1094,7 +2365,7 @@ static int64_t getFileStream( esp32FOTA* fota, int partition)
       return -1;
     }
 
-    const char* path = partition==U_SPIFFS ? fota->getFlashFS_URL() : fota->getFirmwareURL();
+    const char* path = fota->getPath( partition );
     log_d("Opening item %s\n", path );
 
     fs::File* file = (fs::File*)fota->getFotaStreamPtr();
@@ -1124,7 +2395,105 @@ static int64_t getFileStream( esp32FOTA* fota, int partition)
 
 static int64_t getSerialStream( esp32FOTA* fota, int partition)
 {
-    return -1;
+    if( partition == U_FOTA_PARTITION ) {
+        log_e("Named partitions can't be requested over the serial protocol");
+        return -1;
+    }
+
+    SerialFrameStream* link = fota->getSerialLink();
+    uint8_t target = partition==U_SPIFFS ? FOTA_SERIAL_TARGET_FILESYSTEM : FOTA_SERIAL_TARGET_FIRMWARE;
+
+    log_d("Requesting %s image from the serial host", partition==U_SPIFFS ? "filesystem" : "firmware" );
+
+    int64_t updateSize = link->begin( target, fota->getStreamTimeout() );
+
+    if( updateSize <= 0 ) {
+        fota->setFotaStream( nullptr );
+        return -1;
+    }
+
+    fota->setFotaStream( link );
+    return updateSize;
+}
+
+
+
+static int64_t getMQTTStream( esp32FOTA* fota, int partition)
+{
+    if( partition == U_FOTA_PARTITION ) {
+        log_e("Named partitions can't be requested over MQTT");
+        return -1;
+    }
+
+    MQTTChunkStream* link = fota->getMQTTLink();
+    uint8_t target = partition==U_SPIFFS ? FOTA_MQTT_TARGET_FILESYSTEM : FOTA_MQTT_TARGET_FIRMWARE;
+
+    log_d("Requesting %s image over MQTT", partition==U_SPIFFS ? "filesystem" : "firmware" );
+
+    int64_t updateSize = link->begin( target, fota->getStreamTimeout() );
+
+    if( updateSize <= 0 ) {
+        fota->setFotaStream( nullptr );
+        return -1;
+    }
+
+    link->setTimeout( fota->getStreamTimeout() ); // chunks lost during a reconnection are sent again
+    fota->setFotaStream( link );
+    return updateSize;
+}
+
+
+
+static int64_t getMulticastStream( esp32FOTA* fota, int partition)
+{
+    const char* url = fota->getPath( partition ); // udp://<group>:<port> from the manifest
+
+    log_d("Joining the broadcast of %s", url );
+
+    MulticastFECStream* link = fota->getMulticastLink();
+    int64_t updateSize = link->begin( url, fota->getStreamTimeout() );
+
+    if( updateSize <= 0 ) {
+        fota->setFotaStream( nullptr );
+        return -1;
+    }
+
+    link->setTimeout( fota->getStreamTimeout() ); // counted from the last packet heard
+    fota->setFotaStream( link );
+    return updateSize;
+}
+
+
+
+// Retry-After is either delay-seconds or an HTTP-date, the latter needs the system clock to be set.
+static uint32_t parseRetryAfter( const String& value )
+{
+    if( value.isEmpty() ) return 0;
+    if( isdigit( value[0] ) ) return value.toInt();
+
+    // IMF-fixdate, e.g. "Wed, 21 Oct 2015 07:28:00 GMT"
+    int d, y, H, M, S;
+    char mon[4];
+    if( sscanf( value.c_str(), "%*3s, %d %3s %d %d:%d:%d", &d, mon, &y, &H, &M, &S ) != 6 ) return 0;
+    const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const char* m = strstr( months, mon );
+    if( !m || (m - months) % 3 ) return 0;
+    int month = (m - months) / 3 + 1;
+
+    // days since epoch, Howard Hinnant's days_from_civil()
+    y -= month <= 2;
+    int era = y / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t when = (int64_t)(era * 146097 + doe - 719468) * 86400 + H * 3600 + M * 60 + S;
+
+    time_t now = time( nullptr );
+    if( now < 1600000000 ) { // clock not set
+        log_d("Ignoring Retry-After date, system time is not set");
+        return 0;
+    }
+    return when > now ? when - now : 0;
 }
 
 
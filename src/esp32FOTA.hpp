@@ -37,7 +37,20 @@ extern "C" {
   #include "semver/semver.h"
 }
 
+#include "codecs/lz4.hpp"
+#include "codecs/heatshrink.hpp"
+#include "streams/ChunkedStream.hpp"
+#include "streams/SerialFrameStream.hpp"
+#include "streams/MQTTChunkStream.hpp"
+#include "streams/MulticastFECStream.hpp"
+#include "streams/ThrottledStream.hpp"
+#include "peers/FOTAPeers.hpp"
+#include "cache/ManifestCache.hpp"
+#include "memory/FOTAArena.hpp"
+
 #include <map>
+#include <memory>
+#include <vector>
 #include <WiFi.h>
 
 // arduino-esp32 core 2.x => 3.x migration
@@ -96,66 +109,82 @@ extern "C" {
 #endif
 
 
-#if __has_include(<flashz.hpp>)
-  #pragma message "Using FlashZ as Update agent"
-  #include <flashz.hpp>
-  #define F_Compression "zlib"
-  #define F_hasZlib() true
-  #define F_Update FlashZ::getInstance()
-  #define F_UpdateEnd() (mode_z ? F_Update.endz() : F_Update.end())
-  #define F_abort() if (mode_z) F_Update.abortz(); else F_Update.abort()
-  #define F_writeStream() (mode_z ? F_Update.writezStream(*_stream, updateSize) : F_Update.writeStream(*_stream))
-  // #define DEBUG_ESP32_FLASHZ
-  #if !defined DEBUG_ESP32_FLASHZ
-    #define F_isZlibStream() (_stream->peek() == ZLIB_HEADER && ((partition == U_SPIFFS && _flashFileSystemUrl.indexOf("zz")>-1) || (partition == U_FLASH && _firmwareUrl.indexOf("zz")>-1)))
-    #define F_canBegin() (mode_z ? F_Update.beginz(UPDATE_SIZE_UNKNOWN, partition) : F_Update.begin(updateSize, partition))
-  #else
-    __attribute__((unused)) static bool F_canBegin_cb(bool mode_z, int updateSize, int partition) { // implement debug here
-      return (mode_z ? F_Update.beginz(UPDATE_SIZE_UNKNOWN, partition) : F_Update.begin(updateSize, partition));
-    }
-    __attribute__((unused)) static bool F_isZlibStream_cb( Stream* stream, int partition, String flashFileSystemUrl, String firmwareUrl ) { // implement debug here
-      return (stream->peek() == ZLIB_HEADER && ((partition == U_SPIFFS && flashFileSystemUrl.indexOf("zz")>-1) || (partition == U_FLASH && firmwareUrl.indexOf("zz")>-1)));
-    }
-    #define F_isZlibStream() F_isZlibStream_cb( _stream, partition, _flashFileSystemUrl, _firmwareUrl )
-    #define F_canBegin() F_canBegin_cb(mode_z, updateSize, partition)
-  #endif
+#include "update/FOTAUpdateAgent.hpp"
+#include "update/FOTAPartitionAgent.hpp"
+#include "update/FOTAVerify.hpp"
+#include "update/FOTABlockHashes.hpp"
+#include "update/FOTATurbo.hpp"
+#include "update/FOTASlicedWriter.hpp"
+#include "update/FOTASinks.hpp"
+#include "update/FOTASerialWriter.hpp"
+#include "update/FOTATeeAgent.hpp"
+#include "update/FOTAProgress.hpp"
+#include "metrics/FOTAMetrics.hpp"
 
-#elif __has_include("ESP32-targz.h")
+#if defined FOTA_HAS_FLASHZ
+  #pragma message "Using FlashZ as Update agent"
+#endif
+#if defined FOTA_HAS_TARGZ
   #pragma message "Using GzUpdateClass as Update agent"
-  #include <ESP32-targz.h>
-  #define F_Compression "gzip"
-  #define F_hasZlib() true
-  #define F_Update GzUpdateClass::getInstance()
-  #define F_UpdateEnd() (mode_z ? F_Update.endgz() : F_Update.end())
-  #define F_abort() if (mode_z) F_Update.abortgz(); else F_Update.abort()
-  #define F_writeStream() (mode_z ? F_Update.writeGzStream(*_stream, updateSize) : F_Update.writeStream(*_stream))
-  // #define DEBUG_ESP32_TARGZ
-  #if !defined DEBUG_ESP32_TARGZ
-    #define F_isZlibStream() (_stream->peek() == 0x1f && ((partition == U_SPIFFS && _flashFileSystemUrl.indexOf("gz")>-1) || (partition == U_FLASH && _firmwareUrl.indexOf("gz")>-1)) )
-    #define F_canBegin() (mode_z ? F_Update.begingz(UPDATE_SIZE_UNKNOWN, partition) : F_Update.begin(updateSize, partition))
-  #else
-    __attribute__((unused)) static bool F_canBegin_cb(bool mode_z, int updateSize, int partition) { // implement debug here
-      return (mode_z ? F_Update.begingz(UPDATE_SIZE_UNKNOWN, partition) : F_Update.begin(updateSize, partition));
-    }
-    __attribute__((unused)) static bool F_isZlibStream_cb( Stream* stream, int partition, String flashFileSystemUrl, String firmwareUrl ) { // implement debug here
-      return (stream->peek() == 0x1f && ((partition == U_SPIFFS && flashFileSystemUrl.indexOf("gz")>-1) || (partition == U_FLASH && firmwareUrl.indexOf("gz")>-1)) );
-    }
-    #define F_isZlibStream() F_isZlibStream_cb( _stream, partition, _flashFileSystemUrl, _firmwareUrl )
-    #define F_canBegin() F_canBegin_cb(mode_z, updateSize, partition)
-  #endif
-#else
-  #include <Update.h>
-  #define F_Compression "none"
-  #define F_Update Update
-  #define F_hasZlib() false
-  #define F_isZlibStream() false
-  #define F_canBegin() F_Update.begin(updateSize, partition)
-  #define F_UpdateEnd() F_Update.end()
-  #define F_abort() F_Update.abort()
-  #define F_writeStream() F_Update.writeStream(*_stream);
 #endif
 
 #define FW_SIGNATURE_LENGTH     512
+#define FOTA_MSGPACK_MIME       "application/msgpack"
+#define FOTA_STREAM_BUFFER_SIZE 1024 // read chunk of pumpStream(): built-in decoders, unknown sizes, signature trailers
+#ifndef JSON_FW_BUFF_SIZE
+  #define JSON_FW_BUFF_SIZE     2048 // manifest document, large multi-entry manifests need more
+#endif
+#define FOTA_URL_RESERVE        256  // firmware/filesystem url capacity reserved by setArena()
+
+// Arena needed by setArena(): the manifest check and the update run one after the other, an update keeps
+// the signature and the decoder during the whole transfer, then either the stream buffer or the sector
+// buffer of the signature check.
+// Built-in decoders need their window from the arena: 64KB for lz4, define FOTA_ARENA_DECODER_WINDOW
+// to (1 << hs_window) when only heatshrink images are served, or to 0 without compressed images.
+#ifndef FOTA_ARENA_DECODER_WINDOW
+  #define FOTA_ARENA_DECODER_WINDOW LZ4_WINDOW_SIZE
+#endif
+#define FOTA_ARENA_SECTOR_SIZE 4096 // SPI_FLASH_SEC_SIZE
+// cfg.mmap_verify collects a CRC of every 4KB block of the image in the arena, 1KB per MB of app partition:
+// the default fits the OTA slots of 4MB flash partition schemes, define the size of the largest app partition otherwise
+#ifndef FOTA_ARENA_APP_SIZE
+  #define FOTA_ARENA_APP_SIZE 0x200000
+#endif
+// block hash lists ("blocks" manifest key) keep the signed list, 32 bytes per block of the app partition, during
+// the whole update, and a block buffer to fetch corrupted blocks again: define the "block_size" of the served
+// lists, 0 without them
+#ifndef FOTA_ARENA_BLOCK_SIZE
+  #define FOTA_ARENA_BLOCK_SIZE 0
+#endif
+
+constexpr size_t fota_arena_max( size_t a, size_t b ) { return a > b ? a : b; }
+
+constexpr size_t FOTA_ARENA_CHECK_SIZE   = FOTA_ARENA_ALIGN( JSON_FW_BUFF_SIZE );
+constexpr size_t FOTA_ARENA_DECODER_SIZE = FOTA_ARENA_DECODER_WINDOW == 0 ? 0 :
+  FOTA_ARENA_ALIGN( fota_arena_max( sizeof(LZ4Decoder), sizeof(HeatshrinkDecoder) ) ) + FOTA_ARENA_ALIGN( FOTA_ARENA_DECODER_WINDOW );
+constexpr size_t fota_arena_blocks_list( size_t signature_len, size_t app_size, size_t block_size )
+{
+  return block_size == 0 ? 0 : FOTA_ARENA_ALIGN( signature_len + ( app_size + block_size - 1 ) / block_size * 32 );
+}
+// arena for signatures of signature_len bytes, e.g. fota_arena_size( 1024 ) with RSA-8192 keys, written to an app
+// partition of app_size bytes: its mmap_verify block table is counted, and its block hash list when block_size
+// isn't 0, e.g. fota_arena_size( 512, 0x1E0000, 4096 ). The block buffer of repairs stays until the end of the
+// update, along with the signature check buffers.
+constexpr size_t fota_arena_size( size_t signature_len, size_t app_size = FOTA_ARENA_APP_SIZE, size_t block_size = FOTA_ARENA_BLOCK_SIZE )
+{
+  return fota_arena_max( FOTA_ARENA_CHECK_SIZE, FOTA_ARENA_ALIGN( FOTAVerify::tableSize( app_size ) )
+    + fota_arena_blocks_list( signature_len, app_size, block_size )
+    + FOTA_ARENA_ALIGN( signature_len ) + FOTA_ARENA_DECODER_SIZE
+    + fota_arena_max( FOTA_ARENA_ALIGN( FOTA_STREAM_BUFFER_SIZE ),
+        FOTA_ARENA_ALIGN( block_size ) + FOTA_ARENA_ALIGN( FOTA_ARENA_SECTOR_SIZE ) + FOTA_ARENA_ALIGN( 64 ) ) )
+    + FOTA_ARENA_ALIGNMENT;
+}
+constexpr size_t FOTA_ARENA_SIZE = fota_arena_size( FW_SIGNATURE_LENGTH );
+
+// -DFOTA_ARENA_BUDGET=<bytes> fails the build when the arena outgrows the RAM set aside for it
+#if defined FOTA_ARENA_BUDGET
+  static_assert( FOTA_ARENA_SIZE <= FOTA_ARENA_BUDGET, "FOTA_ARENA_SIZE exceeds FOTA_ARENA_BUDGET, see FOTA_ARENA_DECODER_WINDOW" );
+#endif
 
 struct SemverClass
 {
@@ -223,15 +252,56 @@ struct FOTAConfig_t
   bool         allow_reuse { true };
   bool         use_http10 { false }; // Use HTTP 1.0 (WARNING: setting to 'true' disables chunked transfers)
   bool         use_bundled_certs { false };   // use built-in ESP-IDF CA bundle
+  bool         use_peers { false }; // serve verified images to LAN peers and download from them first (requires check_sig)
+  uint16_t     peer_port { FOTA_PEER_PORT };
+  uint32_t     check_interval { 0 }; // seconds between two manifest checks in handle(), 0 = check on every call
+  uint8_t      check_jitter { 10 };  // +/- percentage of randomness applied to the check delay
+  uint32_t     max_backoff { 86400 }; // seconds, upper bound of the exponential backoff after failures
+  bool         cache_manifest { false }; // keep the last manifest in RTC memory/NVS, see ManifestCache.hpp
+  uint32_t     manifest_max_age { 3600 }; // seconds, manifest freshness when the server doesn't send "Cache-Control: max-age"
+  bool         mmap_verify { false }; // check the written image through a memory-mapped view of the partition, see FOTAVerify.hpp
+  uint32_t     rate_limit { 0 }; // bytes per second, download bandwidth cap (0 = unlimited), see setRateLimit()
+  bool         turbo { false }; // WiFi power save off and max CPU frequency during updates, see FOTATurbo.hpp
+  uint32_t     max_flash_block_us { 0 }; // bound flash operations to this duration with the default agent (0 = Update library), see FOTASlicedWriter.hpp
+  bool         flash_pre_erase { false }; // with max_flash_block_us: erase the image sectors before the download, which then only programs
+  uint32_t     progress_interval { 1000 }; // ms between two progress reports (0 = only progress_step), see setProgressReportCb()
+  uint8_t      progress_step { 0 }; // percent between two progress reports (0 = only progress_interval)
   FOTAConfig_t() = default;
 };
 
 
+// Compression codec of an image, declared by the "compression" manifest key
+enum FOTACompression_t
+{
+  FOTA_COMPRESSION_AUTO,      // not declared: legacy detection from magic byte + url extension (zlib/gzip only)
+  FOTA_COMPRESSION_NONE,
+  FOTA_COMPRESSION_ZLIB,      // requires esp32-flashz
+  FOTA_COMPRESSION_GZIP,      // requires ESP32-targz
+  FOTA_COMPRESSION_LZ4,       // built-in, 64KB window
+  FOTA_COMPRESSION_HEATSHRINK // built-in, low RAM (window size set by "hs_window")
+};
+
+
+// Named data partition listed in the "partitions" manifest key
+struct FOTAPartitionTarget_t
+{
+  String            label;
+  String            url;
+  uint8_t           sha256[32];
+  bool              has_sha256 = false;
+  FOTACompression_t compression = FOTA_COMPRESSION_NONE; // none, lz4 or heatshrink
+};
+
+#define FOTA_PARTITIONS_NVS "fota-parts" // sha256 of the installed partition contents
+
+
 enum FOTAStreamType_t
 {
   FOTA_HTTP_STREAM,
   FOTA_FILE_STREAM,
-  FOTA_SERIAL_STREAM
+  FOTA_SERIAL_STREAM,
+  FOTA_MQTT_STREAM,
+  FOTA_MULTICAST_STREAM
 };
 
 
@@ -262,13 +332,26 @@ public:
 
   void handle();
 
+  // poll scheduler (cfg.check_interval), e.g. esp_sleep_enable_timer_wakeup( FOTA.getNextCheckDelay() * 1000ULL )
+  uint32_t getNextCheckDelay(); // ms until handle() checks the manifest again
+  uint8_t  getFailureCount() { return _failures; }
+
+  // cfg.cache_manifest: when true, execHTTPcheck() won't use the network, e.g. skip bringing up WiFi after deep sleep
+  bool manifestCacheFresh() { return _cfg.cache_manifest && _manifest_cache.load( getManifestQueryURL().c_str() ) && _manifest_cache.fresh(); }
+  void clearManifestCache() { _manifest_cache.clear(); }
+
   bool execOTA();
   bool execSPIFFSOTA();
   bool execOTA( int partition, bool restart_after = true );
   bool execHTTPcheck();
+  // evaluate a manifest received by other means, like execHTTPcheck() once the manifest is downloaded
+  bool execManifestCheck( const char* body, size_t len, bool msgpack = false ) { return body && checkManifest( body, len, msgpack ); }
 
   void useDeviceId( bool use=true ) { _cfg.use_device_id = use; }
 
+  // staged rollouts: this device gets an update when its bucket (0-9999) is below "rollout" x 100
+  uint32_t getRolloutBucket( const char* salt );
+
   // config setter
   void setConfig( FOTAConfig_t cfg );
   void printConfig( FOTAConfig_t *cfg=nullptr );
@@ -293,7 +376,11 @@ public:
   void useBundledCerts(bool enable = true);
 
   typedef std::function<void(size_t,size_t)> ProgressCallback_cb; // size_t progress, size_t size
-  void setProgressCb(ProgressCallback_cb fn) { onOTAProgress = fn; } // callback setter
+  void setProgressCb(ProgressCallback_cb fn) { onOTAProgress = fn; } // callback setter, called for every chunk written
+
+  // bytes, percent, throughput and ETA every cfg.progress_interval ms or cfg.progress_step percent, see FOTAProgress.hpp
+  typedef FOTAProgress::report_cb ProgressReport_cb; // const FOTAProgressInfo& info
+  void setProgressReportCb(ProgressReport_cb fn) { onProgressReport = fn; } // callback setter
 
   // when Update.begin() returned false
   typedef std::function<void(int)> UpdateBeginFail_cb; // int partition (U_FLASH or U_SPIFFS)
@@ -311,6 +398,11 @@ public:
   typedef std::function<void(int,bool)> UpdateFinished_cb; // int partition (U_FLASH or U_SPIFFS), bool restart_after
   void setUpdateFinishedCb(UpdateFinished_cb fn) { onUpdateFinished = fn; } // callback setter
 
+  // update figures: "ota.throughput" (bytes/s), "turbo.baseline" (bytes/s), "turbo.gain" (%),
+  // "flash.max_us" and "flash.p99_us" (cfg.max_flash_block_us)
+  typedef std::function<void(const char*,float)> Telemetry_cb; // const char* name, float value
+  void setTelemetryCb(Telemetry_cb fn) { onTelemetry = fn; } // callback setter
+
   // stream getter
   typedef std::function<int64_t(esp32FOTA*,int)> getStream_cb; // esp32FOTA* this, int partition (U_FLASH or U_SPIFFS), returns stream size
   void setStreamGetter( getStream_cb fn ) { getStream = fn; } // callback setter
@@ -323,16 +415,60 @@ public:
   typedef std::function<bool()> isConnected_cb; //
   void setStatusChecker( isConnected_cb fn ) { isConnected = fn; } // callback setter
 
+  // override the compression codec e.g. when using forceUpdate(), otherwise set by the manifest
+  void setCompression( FOTACompression_t codec ) { _compression = codec; }
+  FOTACompression_t getCompression() { return _compression; }
+  static const char* compressionName( FOTACompression_t codec );
+  static FOTACompression_t compressionFromName( const char* name );
+
+  // Update agent: writer, zlib/gzip support and digest, see FOTAUpdateAgent.hpp
+  void setUpdateAgent( FOTAAgent* agent ) { _agent = agent ? agent : &_default_agent; }
+  FOTAAgent* getUpdateAgent() { return _agent; }
+  // checks, updates, failures and throughput since the first boot (or reset()), see FOTAMetrics.hpp
+  FOTAMetrics& getMetrics() { return _metrics; }
+  // duration of the flash operations of the last update made with cfg.max_flash_block_us
+  const FOTAFlashStats& getFlashStats() { return _sliced_agent.writer().stats(); }
+  // sector erases made before the download with cfg.flash_pre_erase
+  const FOTAFlashStats& getFlashEraseStats() { return _sliced_agent.writer().eraseStats(); }
+
+  // carve the buffers of checks and updates from this memory instead of the heap, e.g.:
+  //   static uint8_t fota_arena[FOTA_ARENA_SIZE]; FOTA.setArena( fota_arena, sizeof(fota_arena) );
+  // FOTA_ARENA_SIZE fits 512 bytes signatures and the mmap_verify table of a FOTA_ARENA_APP_SIZE partition,
+  // see fota_arena_size() for longer keys. Block hash lists need more: the list and a block buffer, define
+  // FOTA_ARENA_BLOCK_SIZE to their block_size or use fota_arena_size( 512, partition size, block_size ).
+  // mbedtls and HTTPClient still allocate internally. Call with nullptr to go back to the heap.
+  void setArena( void* buffer, size_t size );
+  FOTAArena* getArena() { return &_arena; }
+
+  // start serving the last verified image to LAN peers, done by execHTTPcheck() when cfg.use_peers is set
+  bool servePeers() { return _peers.begin( _cfg.name, _cfg.peer_port ); }
+
   // updating from a File or from Serial?
   void setStreamType( FOTAStreamType_t stream_type ) { _stream_type = stream_type; }
   void setStreamTimeout( uint32_t timeout ) { _stream_timeout = timeout; }
+  // download bandwidth cap in bytes per second (0 = unlimited), also applies to a download in progress
+  void setRateLimit( uint32_t rate ) { _cfg.rate_limit = rate; _throttle.setRate( rate ); _progress.setRateCap( rate ); }
+  uint32_t getRateLimit() { return _cfg.rate_limit; }
+  uint32_t getStreamTimeout() { return _stream_timeout; }
+
+  // port used by FOTA_SERIAL_STREAM, e.g. setSerialPort( &Serial1 ) after Serial1.begin( 2000000 )
+  void setSerialPort( Stream* port, uint8_t window=FOTA_SERIAL_WINDOW, uint16_t max_payload=FOTA_SERIAL_MAX_PAYLOAD ) { _serial.setPort( port, window, max_payload ); }
+  // FOTA_MQTT_STREAM: the application's MQTT client publishes on "<prefix>/up" and hands the
+  // messages of "<prefix>/down" to feedMQTT(), poll lets clients like PubSubClient run their loop()
+  void setMQTT( MQTTChunkStream::publish_cb publish, const char* prefix, MQTTChunkStream::poll_cb poll=nullptr, uint8_t window=FOTA_MQTT_WINDOW, uint16_t chunk=FOTA_MQTT_CHUNK ) { _mqtt.setPublisher( publish, prefix, window, chunk ); _mqtt.setPoll( poll ); }
+  void feedMQTT( const char* topic, const uint8_t* payload, size_t len ) { _mqtt.feed( topic, payload, len ); }
 
   const char*       getManifestURL()   { return _manifestUrl.c_str(); }
   const char*       getFirmwareURL()   { return _firmwareUrl.c_str(); }
   const char*       getFlashFS_URL()   { return _flashFileSystemUrl.c_str(); }
-  const char*       getPath(int part)  { return part==U_SPIFFS ? getFlashFS_URL() : getFirmwareURL(); }
+  const char*       getPartitionURL()  { return _partitionUrl.c_str(); } // named partition being updated
+  const char*       getPath(int part)  { return part==U_SPIFFS ? getFlashFS_URL() : part==U_FOTA_PARTITION ? getPartitionURL() : getFirmwareURL(); }
 
-  bool              zlibSupported()         { return mode_z; }
+  // named data partitions of the last manifest entry that need updating, written first by execOTA()
+  const std::vector<FOTAPartitionTarget_t>& getPartitionTargets() { return _partitions; }
+  bool execPartitionsOTA();
+
+  bool              zlibSupported()         { return strcmp( _agent->compression(), "none" ) != 0; }
 
   int               getPayloadVersion();
   void              getPayloadVersion(char * version_string);
@@ -340,6 +476,10 @@ public:
   FOTAConfig_t      getConfig()        { return _cfg; };
   FOTAStreamType_t  getStreamType()    { return _stream_type; }
   HTTPClient*       getHTTPCLient()    { return &_http; }
+  ChunkedStream*    getChunkedStream() { return &_chunked; }
+  SerialFrameStream* getSerialLink()   { return &_serial; }
+  MQTTChunkStream*  getMQTTLink()      { return &_mqtt; }
+  MulticastFECStream* getMulticastLink() { return &_multicast; }
   ClientSecure*     getWiFiClient()    { return &_client; }
   fs::File*         getFotaFilePtr()   { return &_file; }
   Stream*           getFotaStreamPtr() { return _stream; }
@@ -348,6 +488,8 @@ public:
   // internals but need to be exposed to the callbacks
   bool setupHTTP( const char* url );
   void setFotaStream( Stream* stream ) { _stream = stream; }
+  void setRetryAfter( uint32_t seconds ) { _retry_after = seconds; } // server asked to come back later
+  uint32_t getRetryAfter() { return _retry_after; } // seconds, "Retry-After" of the last failed request (0 = none)
 
   //[[deprecated("Use setManifestURL( String ) or cfg.manifest_url with setConfig( FOTAConfig_t )")]] String checkURL = "";
   //[[deprecated("Use cfg.use_device_id with setConfig( FOTAConfig_t )")]] bool useDeviceID = false;
@@ -359,8 +501,45 @@ private:
   ClientSecure _client;
   Stream *_stream;
   fs::File _file;
-
-  bool mode_z  = F_hasZlib();
+  ChunkedStream _chunked; // wraps the http stream for "Transfer-Encoding: chunked" responses
+  SerialFrameStream _serial; // FOTA_SERIAL_STREAM link
+  MQTTChunkStream _mqtt; // FOTA_MQTT_STREAM link
+  MulticastFECStream _multicast; // FOTA_MULTICAST_STREAM receiver
+  ThrottledStream _throttle; // wraps the image stream, cfg.rate_limit
+  FOTAProgress    _progress; // rate-limited progress reports of the current download
+  FOTAMetrics     _metrics; // cumulative counters, persisted in NVS
+  FOTAPeers _peers;
+  ManifestCache _manifest_cache;
+  bool _from_peer = false; // current download comes from an untrusted LAN peer
+
+  bool mode_z  = false; // zlib/gzip image handled by the Update agent
+  FOTADefaultAgent _default_agent;
+  FOTAAgent* _agent = &_default_agent;
+  FOTASlicedAgent _sliced_agent; // replaces the default agent when cfg.max_flash_block_us is set
+
+  FOTAArena _arena; // heap when no buffer was provided
+
+  FOTACompression_t _compression = FOTA_COMPRESSION_AUTO;
+  uint8_t _hs_window    = HEATSHRINK_DEFAULT_WINDOW_SZ2;
+  uint8_t _hs_lookahead = HEATSHRINK_DEFAULT_LOOKAHEAD_SZ2;
+  bool _sig_trailer = false; // signature is appended to the image instead of prepended
+  uint8_t _payload_sha256[32];
+  bool _has_payload_sha256 = false; // "sha256" manifest key
+  uint32_t _payload_size = 0;          // "size" manifest key: bytes served at the firmware url, 0 = unknown
+  uint32_t _payload_unpacked_size = 0; // "unpacked_size" manifest key: bytes written to the app partition
+  uint32_t _fs_payload_size = 0;       // "fs_size" manifest key: bytes served at the filesystem url
+  String   _blocksUrl;                 // "blocks" manifest key: block hash list of the firmware, see FOTABlockHashes.hpp
+  uint32_t _block_size = FOTA_BLOCKS_DEFAULT_SIZE; // "block_size" manifest key
+
+  // poll scheduler state, see handle()
+  bool     _check_scheduled = false;
+  uint32_t _last_check = 0;   // millis()
+  uint32_t _check_delay = 0;  // ms after _last_check
+  uint8_t  _failures = 0;     // consecutive failed checks/updates
+  bool     _check_failed = false; // last execHTTPcheck() didn't get a manifest
+  uint32_t _retry_after = 0;  // seconds, "Retry-After" of the last response
+  uint32_t _max_age = 0;      // seconds, "Cache-Control: max-age" of the last manifest
+  void scheduleCheck( bool failed );
 
   FOTAStreamType_t _stream_type = FOTA_HTTP_STREAM; // defaults to HTTP
   uint32_t _stream_timeout = 10000; // max wait for stream->available()
@@ -376,15 +555,19 @@ private:
   String _manifestUrl;
   String _firmwareUrl;
   String _flashFileSystemUrl;
+  String _partitionUrl;
+  std::vector<FOTAPartitionTarget_t> _partitions;
 
   fs::FS *_fs = FOTA_FS; // default filesystem for certificate validation
 
   // custom callbacks provided by user
   ProgressCallback_cb onOTAProgress; // this is passed to Update.onProgress()
+  ProgressReport_cb   onProgressReport; // rate-limited progress, defaults to FOTAProgress::print() without onOTAProgress
   UpdateBeginFail_cb  onUpdateBeginFail; // when Update.begin() returned false
   UpdateEnd_cb        onUpdateEnd; // after Update.end() and before validate_sig()
   UpdateCheckFail_cb  onUpdateCheckFail; // validate_sig() error handling, mixed situations
   UpdateFinished_cb   onUpdateFinished; // update successful
+  Telemetry_cb        onTelemetry; // update figures
   getStream_cb        getStream; // optional stream getter, defaults to http.getStreamPtr()
   endStream_cb        endStream; // optional stream closer, defaults to http.end()
   isConnected_cb      isConnected; // optional connection checker, defaults to WiFi.status()==WL_CONNECTED
@@ -392,14 +575,47 @@ private:
   std::map<String,String> extraHTTPHeaders; // this holds the extra http headers defined by the user
 
   String getDeviceID();
+  String getManifestQueryURL(); // manifest_url + device id
+  bool checkManifest( const char* body, size_t len, bool msgpack ); // reads the http stream when body is nullptr
   bool checkJSONManifest(JsonVariant JSONDocument);
+  bool checkRollout(JsonVariant JSONDocument);
+  bool checkPreflight(JsonVariant JSONDocument);
+  bool checkPartitions(JsonVariant JSONDocument);
+  bool execPartitionOTA( const FOTAPartitionTarget_t& target );
+  FOTAArena::unique_ptr<FOTADecoder> createDecoder( FOTACompression_t codec );
+  static bool parseSha256( const char* hex, uint8_t* digest );
   void debugSemVer( const char* label, semver_t* version );
   void getPartition( int update_partition );
+  // warn when the arena can't hold a signature of the configured length
+  void checkArena();
 
   bool validate_sig( const esp_partition_t* partition, unsigned char *signature, uint32_t firmware_size );
+  bool validate_sha256( const esp_partition_t* partition, const uint8_t* digest, uint32_t firmware_size );
+  bool verify_signature( const unsigned char* hash, const unsigned char* signature );
+
+  // block hash list of the firmware: fetched and signature-checked before the download,
+  // corrupted blocks are fetched again with Range requests and rewritten before Update.end()
+  bool loadBlockHashes( FOTABlockHashes& blocks, FOTAArena::unique_ptr<uint8_t>& list );
+  bool repairBlocks( FOTABlockHashes& blocks );
+  size_t fetchHTTP( const char* url, uint8_t* buffer, size_t len, int64_t range_start = -1 );
+
+  // try a LAN peer advertising the manifest version before the manifest url
+  bool execPeerOTA();
+
+  // copy the stream into the Update agent, through a built-in decoder if any
+  bool pumpStream( FOTADecoder* decoder, size_t stream_size, unsigned char* trailer, size_t* written );
+  bool streamEnded();
+  // no data for _stream_timeout ms since last_data, waiting on the bandwidth cap
+  // or on multicast packets that don't complete a group yet doesn't count
+  bool streamStalled( uint32_t& last_data );
+  // telemetry and turbo baseline after a download
+  void beginProgress( size_t total );
+  void reportThroughput( size_t bytes, uint32_t elapsed_ms );
 
   // temporary partition holder for signature check operations
   const esp_partition_t* _target_partition = nullptr;
+  FOTAVerify* _verify = nullptr; // block digests of the image being written, only set during execOTA()
+  FOTABlockHashes* _blocks = nullptr; // block hash list of the image being written, only set during execOTA()
 
   // This is kept for legacy behaviour, use setPubKey() and setRootCA() with
   // CryptoMemAsset ot CryptoFileAsset instead
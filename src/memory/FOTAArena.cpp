@@ -0,0 +1,55 @@
+/*
+   esp32 firmware OTA
+   Update arena, see FOTAArena.hpp
+*/
+
+#include "FOTAArena.hpp"
+
+
+void FOTAArena::begin( void* buffer, size_t size )
+{
+    // the buffer start may not be aligned, e.g. a uint8_t array
+    uintptr_t start = FOTA_ARENA_ALIGN( (uintptr_t)buffer );
+    size_t    skip  = buffer ? start - (uintptr_t)buffer : 0;
+    _base = buffer && size > skip ? (uint8_t*)start : nullptr;
+    _size = _base ? size - skip : 0;
+    _used = _peak = 0;
+    _last = nullptr;
+}
+
+
+void* FOTAArena::alloc( size_t size )
+{
+    if( !_base ) return malloc( size );
+    size_t aligned = FOTA_ARENA_ALIGN( size );
+    if( aligned > _size - _used ) {
+        log_e("Arena exhausted: %d bytes requested, %d/%d bytes used", size, _used, _size);
+        return nullptr;
+    }
+    _last  = _base + _used;
+    _used += aligned;
+    if( _used > _peak ) _peak = _used;
+    return _last;
+}
+
+
+void* FOTAArena::realloc( void* ptr, size_t size )
+{
+    if( !owns( ptr ) ) {
+        if( ptr || !_base ) return ::realloc( ptr, size );
+        return alloc( size );
+    }
+    if( ptr != _last ) return nullptr;
+    size_t offset  = _last - _base;
+    size_t aligned = FOTA_ARENA_ALIGN( size );
+    if( aligned > _size - offset ) return nullptr;
+    _used = offset + aligned;
+    if( _used > _peak ) _peak = _used;
+    return ptr;
+}
+
+
+void FOTAArena::free( void* ptr )
+{
+    if( ptr && !owns( ptr ) ) ::free( ptr );
+}
@@ -0,0 +1,95 @@
+/*
+   esp32 firmware OTA
+   Update arena.
+
+   A bump allocator over a buffer reserved by the application at boot, so the
+   buffers of a check/update are carved from memory that can't fragment after
+   weeks of uptime. Allocations are released all at once when the Scope that
+   made them ends, free() only releases heap blocks.
+
+   Without a buffer (begin() not called) the arena falls back to the heap, so
+   the same code paths serve both modes.
+
+     static uint8_t fota_arena[FOTA_ARENA_SIZE];
+     FOTA.setArena( fota_arena, sizeof(fota_arena) );
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <memory>
+#include <new>
+
+#define FOTA_ARENA_ALIGNMENT 8
+#define FOTA_ARENA_ALIGN(n) ( ( (size_t)(n) + FOTA_ARENA_ALIGNMENT - 1 ) & ~(size_t)( FOTA_ARENA_ALIGNMENT - 1 ) )
+
+
+class FOTAArena
+{
+public:
+  FOTAArena() { }
+
+  void begin( void* buffer, size_t size );
+  void end() { begin( nullptr, 0 ); }
+  bool enabled() { return _base != nullptr; }
+
+  // nullptr when exhausted, heap allocation when disabled
+  void* alloc( size_t size );
+  // grows or shrinks the last allocation in place, other arena blocks can't be resized
+  void* realloc( void* ptr, size_t size );
+  // heap blocks are freed, arena blocks wait for the end of their Scope
+  void free( void* ptr );
+  bool owns( const void* ptr ) { return _base && ptr >= _base && ptr < _base + _size; }
+
+  size_t size() { return _size; }
+  size_t used() { return _used; }
+  size_t peak() { return _peak; } // high water mark since begin(), compare with FOTA_ARENA_SIZE
+
+  // releases everything allocated during its lifetime
+  class Scope
+  {
+  public:
+    Scope( FOTAArena& arena ) : _arena(arena), _mark(arena._used), _last(arena._last) { }
+    ~Scope() { _arena._used = _mark; _arena._last = _last; }
+  private:
+    FOTAArena& _arena;
+    size_t     _mark;
+    uint8_t*   _last;
+  };
+
+  // unique_ptr for objects built with make()
+  struct Deleter
+  {
+    FOTAArena* arena;
+    template<typename T> void operator()( T* ptr ) const
+    {
+      if( !ptr ) return;
+      ptr->~T();
+      arena->free( ptr );
+    }
+  };
+  template<typename T> using unique_ptr = std::unique_ptr<T, Deleter>;
+
+  template<typename T, typename... Args> unique_ptr<T> make( Args&&... args )
+  {
+    void* ptr = alloc( sizeof(T) );
+    return unique_ptr<T>( ptr ? new( ptr ) T( std::forward<Args>(args)... ) : nullptr, Deleter{ this } );
+  }
+
+  // ArduinoJson allocator, e.g. BasicJsonDocument<FOTAArena::JsonAllocator> doc( size, FOTAArena::JsonAllocator( &arena ) )
+  struct JsonAllocator
+  {
+    FOTAArena* arena;
+    JsonAllocator( FOTAArena* a = nullptr ) : arena(a) { }
+    void* allocate( size_t size ) { return arena ? arena->alloc( size ) : malloc( size ); }
+    void  deallocate( void* ptr ) { if( arena ) arena->free( ptr ); else ::free( ptr ); }
+    void* reallocate( void* ptr, size_t size ) { return arena ? arena->realloc( ptr, size ) : ::realloc( ptr, size ); }
+  };
+
+private:
+  uint8_t* _base = nullptr;
+  size_t   _size = 0;
+  size_t   _used = 0;
+  size_t   _peak = 0;
+  uint8_t* _last = nullptr; // last allocation, the only one realloc() can resize
+};
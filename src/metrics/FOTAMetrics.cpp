@@ -0,0 +1,199 @@
+/*
+   esp32 firmware OTA
+   Cumulative update metrics, see FOTAMetrics.hpp
+*/
+
+#include "FOTAMetrics.hpp"
+#include <Preferences.h>
+
+
+void FOTAMetrics::load()
+{
+    if( _loaded ) return;
+    _loaded = true;
+    Preferences prefs;
+    if( !prefs.begin( FOTA_METRICS_NVS, true ) ) return;
+    FOTAMetricsData stored;
+    if( prefs.getBytesLength( "data" ) == sizeof(stored)
+     && prefs.getBytes( "data", &stored, sizeof(stored) ) == sizeof(stored)
+     && stored.version == FOTA_METRICS_VERSION ) {
+        _data = stored;
+    } else {
+        log_d("No stored metrics, starting from zero");
+    }
+    prefs.end();
+}
+
+
+void FOTAMetrics::save()
+{
+    if( !_dirty ) return;
+    Preferences prefs;
+    if( !prefs.begin( FOTA_METRICS_NVS, false ) ) {
+        log_w("Unable to save the metrics");
+        return;
+    }
+    _data.version = FOTA_METRICS_VERSION;
+    prefs.putBytes( "data", &_data, sizeof(_data) );
+    prefs.end();
+    _dirty = false;
+}
+
+
+void FOTAMetrics::reset()
+{
+    memset( &_data, 0, sizeof(_data) );
+    _loaded = true;
+    _dirty = false;
+    Preferences prefs;
+    if( prefs.begin( FOTA_METRICS_NVS, false ) ) {
+        prefs.clear();
+        prefs.end();
+    }
+}
+
+
+void FOTAMetrics::check( bool cached )
+{
+    load();
+    if( cached ) _data.checks_cached++;
+    else _data.checks++;
+    changed();
+}
+
+
+void FOTAMetrics::notModified()
+{
+    load();
+    _data.not_modified++;
+    changed();
+}
+
+
+void FOTAMetrics::httpError( int code )
+{
+    load();
+    changed();
+    for( auto& entry : _data.http_errors ) {
+        if( entry.count && entry.code != code ) continue;
+        entry.code = code;
+        entry.count++;
+        return;
+    }
+    _data.http_errors_other++;
+}
+
+
+void FOTAMetrics::update( bool succeeded )
+{
+    load();
+    if( succeeded ) _data.updates_succeeded++;
+    else _data.updates_failed++;
+    changed();
+}
+
+
+void FOTAMetrics::signatureFailure()
+{
+    load();
+    _data.signature_failures++;
+    changed();
+}
+
+
+void FOTAMetrics::verifyFailure()
+{
+    load();
+    _data.verify_failures++;
+    changed();
+}
+
+
+void FOTAMetrics::download( size_t bytes )
+{
+    if( bytes == 0 ) return;
+    load();
+    _data.bytes += bytes;
+    changed();
+}
+
+
+void FOTAMetrics::throughput( uint32_t bytes_per_second )
+{
+    load();
+    size_t i = 0;
+    while( i < FOTA_METRICS_BUCKETS - 1 && bytes_per_second > bucketBound( i ) ) i++;
+    _data.throughput[i]++;
+    _data.throughput_sum += bytes_per_second;
+    _data.throughput_count++;
+    changed();
+}
+
+
+uint32_t FOTAMetrics::averageThroughput()
+{
+    load();
+    return _data.throughput_count ? _data.throughput_sum / _data.throughput_count : 0;
+}
+
+
+static size_t printCounter( Print& out, const char* name, const char* help, uint64_t value )
+{
+    return out.printf("# HELP esp32fota_%s %s\n# TYPE esp32fota_%s counter\nesp32fota_%s %llu\n", name, help, name, name, (unsigned long long)value);
+}
+
+
+size_t FOTAMetrics::printPrometheus( Print& out )
+{
+    load();
+    size_t n = 0;
+    n += printCounter( out, "checks_total", "Manifest requests", _data.checks );
+    n += printCounter( out, "checks_cached_total", "Checks answered by a fresh cached manifest", _data.checks_cached );
+    n += printCounter( out, "not_modified_total", "Manifest requests answered with 304 Not Modified", _data.not_modified );
+    n += printCounter( out, "updates_succeeded_total", "Successful updates", _data.updates_succeeded );
+    n += printCounter( out, "updates_failed_total", "Failed updates", _data.updates_failed );
+    n += printCounter( out, "signature_failures_total", "Images rejected by the signature check", _data.signature_failures );
+    n += printCounter( out, "verify_failures_total", "Images rejected by a sha256 or block hash check", _data.verify_failures );
+    n += printCounter( out, "downloaded_bytes_total", "Bytes downloaded by updates", _data.bytes );
+
+    n += out.print("# HELP esp32fota_http_errors_total Failed HTTP requests by status code\n# TYPE esp32fota_http_errors_total counter\n");
+    for( const auto& entry : _data.http_errors ) {
+        if( entry.count ) n += out.printf("esp32fota_http_errors_total{code=\"%d\"} %u\n", entry.code, entry.count);
+    }
+    if( _data.http_errors_other ) n += out.printf("esp32fota_http_errors_total{code=\"other\"} %u\n", _data.http_errors_other);
+
+    n += out.print("# HELP esp32fota_throughput_bytes_per_second Download throughput of successful updates\n# TYPE esp32fota_throughput_bytes_per_second histogram\n");
+    uint32_t cumulative = 0;
+    for( size_t i = 0; i < FOTA_METRICS_BUCKETS; i++ ) {
+        cumulative += _data.throughput[i];
+        if( i < FOTA_METRICS_BUCKETS - 1 ) n += out.printf("esp32fota_throughput_bytes_per_second_bucket{le=\"%u\"} %u\n", bucketBound( i ), cumulative);
+        else n += out.printf("esp32fota_throughput_bytes_per_second_bucket{le=\"+Inf\"} %u\n", cumulative);
+    }
+    n += out.printf("esp32fota_throughput_bytes_per_second_sum %llu\n", (unsigned long long)_data.throughput_sum);
+    n += out.printf("esp32fota_throughput_bytes_per_second_count %u\n", _data.throughput_count);
+    return n;
+}
+
+
+size_t FOTAMetrics::printJSON( Print& out )
+{
+    load();
+    size_t n = 0;
+    n += out.printf("{\"checks\":%u,\"checks_cached\":%u,\"not_modified\":%u,", _data.checks, _data.checks_cached, _data.not_modified);
+    n += out.printf("\"updates_succeeded\":%u,\"updates_failed\":%u,", _data.updates_succeeded, _data.updates_failed);
+    n += out.printf("\"signature_failures\":%u,\"verify_failures\":%u,", _data.signature_failures, _data.verify_failures);
+    n += out.printf("\"downloaded_bytes\":%llu,\"http_errors\":{", (unsigned long long)_data.bytes);
+    const char* sep = "";
+    for( const auto& entry : _data.http_errors ) {
+        if( !entry.count ) continue;
+        n += out.printf("%s\"%d\":%u", sep, entry.code, entry.count);
+        sep = ",";
+    }
+    if( _data.http_errors_other ) n += out.printf("%s\"other\":%u", sep, _data.http_errors_other);
+    n += out.printf("},\"throughput\":{\"average\":%u,\"count\":%u,\"buckets\":[", averageThroughput(), _data.throughput_count);
+    for( size_t i = 0; i < FOTA_METRICS_BUCKETS; i++ ) {
+        n += out.printf("%s%u", i ? "," : "", _data.throughput[i]);
+    }
+    n += out.print("]}}");
+    return n;
+}
@@ -0,0 +1,79 @@
+/*
+   esp32 firmware OTA
+   Cumulative update metrics.
+
+   Counters and a throughput histogram updated by execHTTPcheck() and
+   execOTA(), kept in NVS across reboots: one blob, written at the end of
+   a check or an update when something changed. Exported as Prometheus
+   text (exposition format 0.0.4) or JSON, for the application to serve
+   or upload:
+
+     StreamString text;
+     FOTA.getMetrics().printPrometheus( text );
+
+   HTTP failures are counted by status code, the first FOTA_METRICS_HTTP_CODES
+   distinct codes get their own counter, later ones are counted as "other".
+   Negative codes are HTTPClient transport errors (e.g. -1: connection refused).
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#define FOTA_METRICS_NVS        "fota-metrics"
+#define FOTA_METRICS_VERSION    1
+#define FOTA_METRICS_HTTP_CODES 8
+#define FOTA_METRICS_BUCKETS    10 // throughput histogram: 4KB/s .. 1MB/s, +Inf
+
+
+struct FOTAMetricsData
+{
+  uint8_t  version;
+  uint32_t checks;            // manifest requests
+  uint32_t checks_cached;     // checks answered by a fresh cached manifest, without network
+  uint32_t not_modified;      // 304 answers to conditional manifest requests
+  uint32_t updates_succeeded;
+  uint32_t updates_failed;
+  uint32_t signature_failures;
+  uint32_t verify_failures;   // sha256, block hashes or written image mismatch
+  uint64_t bytes;             // downloaded by updates, failed ones included
+  struct { int16_t code; uint32_t count; } http_errors[FOTA_METRICS_HTTP_CODES];
+  uint32_t http_errors_other;
+  uint32_t throughput[FOTA_METRICS_BUCKETS]; // per bucket, not cumulative
+  uint64_t throughput_sum;    // bytes/s
+  uint32_t throughput_count;
+};
+
+
+class FOTAMetrics
+{
+public:
+  FOTAMetrics() { memset( &_data, 0, sizeof(_data) ); }
+
+  void check( bool cached );
+  void notModified();
+  void httpError( int code );
+  void update( bool succeeded );
+  void signatureFailure();
+  void verifyFailure();
+  void download( size_t bytes );
+  void throughput( uint32_t bytes_per_second );
+
+  void save();  // writes NVS if something changed
+  void reset(); // clears the counters and NVS
+
+  const FOTAMetricsData& data() { load(); return _data; }
+  uint32_t averageThroughput(); // bytes/s, 0 = no successful download yet
+  static uint32_t bucketBound( size_t i ) { return 4096UL << i; } // upper bound, the last bucket has none
+
+  size_t printPrometheus( Print& out );
+  size_t printJSON( Print& out );
+
+private:
+  FOTAMetricsData _data;
+  bool _loaded = false; // NVS isn't available yet when global objects are constructed
+  bool _dirty = false;
+
+  void load();
+  void changed() { _dirty = true; }
+};
@@ -0,0 +1,224 @@
+/*
+   esp32 firmware OTA
+   LAN peer distribution, see FOTAPeers.hpp
+*/
+
+#include "FOTAPeers.hpp"
+#include <ESPmDNS.h>
+#include <Preferences.h>
+#include <WiFi.h>
+#include <vector>
+
+#define FOTA_PEER_CHUNK_SIZE 4096
+
+
+bool FOTAPeers::store( const char* type, const char* version, const esp_partition_t* partition, uint32_t size, const uint8_t* signature, size_t signature_len )
+{
+    if( !partition || !signature || !signature_len ) return false;
+    Preferences prefs;
+    if( !prefs.begin( FOTA_PEER_NVS, false ) ) {
+        log_e("Unable to open NVS namespace %s", FOTA_PEER_NVS);
+        return false;
+    }
+    prefs.clear();
+    bool ret = prefs.putString( "type", type ) > 0
+            && prefs.putString( "ver", version ) > 0
+            && prefs.putString( "label", partition->label ) > 0
+            && prefs.putUInt( "size", size ) > 0
+            && prefs.putBytes( "sig", signature, signature_len ) == signature_len;
+    if( !ret ) {
+        log_e("Unable to store peer image record");
+        prefs.clear();
+    } else {
+        log_d("Stored peer image: %s %s on %s (%d bytes)", type, version, partition->label, size);
+    }
+    prefs.end();
+    return ret;
+}
+
+
+bool FOTAPeers::load( const char* type )
+{
+    Preferences prefs;
+    if( !prefs.begin( FOTA_PEER_NVS, true ) ) return false;
+    bool ret = false;
+    if( prefs.isKey( "sig" ) && prefs.getString( "type" ) == type ) {
+        _version       = prefs.getString( "ver" );
+        _label         = prefs.getString( "label" );
+        _size          = prefs.getUInt( "size" );
+        _signature_len = prefs.getBytesLength( "sig" );
+        if( _signature ) free( _signature );
+        _signature = (uint8_t*)malloc( _signature_len );
+        ret = _signature && prefs.getBytes( "sig", _signature, _signature_len ) == _signature_len;
+    }
+    prefs.end();
+    if( !ret ) return false;
+
+    const esp_partition_t* partition = esp_partition_find_first( ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, _label.c_str() );
+    if( !partition || _size == 0 || _size > partition->size ) {
+        log_w("Stored peer image doesn't fit partition %s", _label.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+void FOTAPeers::forget( const esp_partition_t* partition )
+{
+    if( !partition ) return;
+    Preferences prefs;
+    if( !prefs.begin( FOTA_PEER_NVS, false ) ) return;
+    if( prefs.getString( "label" ) == partition->label ) {
+        _valid = false;
+        prefs.clear();
+        log_d("Peer image on %s is about to be overwritten, not serving it anymore", partition->label);
+    }
+    prefs.end();
+}
+
+
+bool FOTAPeers::startMDNS()
+{
+    static bool started = false;
+    if( !started ) {
+        // may already be running (e.g. ArduinoOTA), services can still be added
+        if( !MDNS.begin( WiFi.getHostname() ) ) log_d("MDNS.begin() failed, assuming it's already running");
+        started = true;
+    }
+    return started;
+}
+
+
+bool FOTAPeers::begin( const char* type, uint16_t port )
+{
+    if( _server ) {
+        if( _valid ) return true;
+        end(); // forget() was called: serve the image stored since, if any
+    }
+    if( !type || !load( type ) ) {
+        log_d("No verified image to serve to peers");
+        return false;
+    }
+
+    _server = new WebServer( port );
+    _server->on( FOTA_PEER_PATH, HTTP_GET, [this]() { handleImage(); } );
+    _server->onNotFound( [this]() { _server->send( 404 ); } );
+    _server->begin();
+
+    if( xTaskCreate( task, "fota-peer", 4096, this, 1, &_task ) != pdPASS ) {
+        log_e("Unable to start the peer server task");
+        end();
+        return false;
+    }
+
+    startMDNS();
+    MDNS.addService( FOTA_PEER_SERVICE, "tcp", port );
+    MDNS.addServiceTxt( FOTA_PEER_SERVICE, "tcp", "type", type );
+    MDNS.addServiceTxt( FOTA_PEER_SERVICE, "tcp", "ver", _version.c_str() );
+
+    _valid = true;
+    log_i("Serving %s %s to LAN peers on port %d", type, _version.c_str(), port);
+    return true;
+}
+
+
+void FOTAPeers::end()
+{
+    _valid = false;
+    if( _task ) {
+        vTaskDelete( _task );
+        _task = nullptr;
+    }
+    if( _server ) {
+        _server->stop();
+        delete _server;
+        _server = nullptr;
+    }
+    if( _signature ) {
+        free( _signature );
+        _signature = nullptr;
+    }
+}
+
+
+void FOTAPeers::task( void* arg )
+{
+    FOTAPeers* peers = (FOTAPeers*)arg;
+    for(;;) {
+        peers->_server->handleClient();
+        vTaskDelay(2);
+    }
+}
+
+
+void FOTAPeers::handleImage()
+{
+    const esp_partition_t* partition = _valid ? esp_partition_find_first( ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, _label.c_str() ) : nullptr;
+    if( !partition ) {
+        _server->send( 404 );
+        return;
+    }
+
+    uint8_t* buffer = (uint8_t*)malloc( FOTA_PEER_CHUNK_SIZE );
+    if( !buffer ) {
+        _server->send( 503 );
+        return;
+    }
+
+    log_d("Serving %s to %s", _label.c_str(), _server->client().remoteIP().toString().c_str());
+
+    // same layout as a signed image: signature header followed by the firmware
+    _server->setContentLength( _signature_len + _size );
+    _server->send( 200, "application/octet-stream", "" );
+    auto client = _server->client();
+    client.write( _signature, _signature_len );
+
+    uint32_t offset = 0;
+    while( offset < _size && _valid && client.connected() ) {
+        size_t len = std::min( (uint32_t)FOTA_PEER_CHUNK_SIZE, _size - offset );
+        if( !ESP.partitionRead( partition, offset, (uint32_t*)buffer, len ) ) {
+            log_e("partitionRead failed!");
+            break;
+        }
+        if( client.write( buffer, len ) != len ) break;
+        offset += len;
+    }
+    free( buffer );
+
+    if( offset < _size ) log_w("Peer transfer interrupted at %d/%d", offset, _size);
+}
+
+
+String FOTAPeers::find( const char* type, const char* version )
+{
+    startMDNS();
+    int n = MDNS.queryService( FOTA_PEER_SERVICE, "tcp" );
+    if( n <= 0 ) return String();
+
+    std::vector<int> matches;
+    IPAddress self = WiFi.localIP();
+    for( int i=0; i<n; i++ ) {
+#if ESP_ARDUINO_VERSION_MAJOR >= 3
+        IPAddress ip = MDNS.address(i);
+#else
+        IPAddress ip = MDNS.IP(i);
+#endif
+        if( ip == self ) continue;
+        if( MDNS.txt( i, "type" ) == type && MDNS.txt( i, "ver" ) == version ) matches.push_back( i );
+    }
+    if( matches.empty() ) {
+        log_d("%d peers found, none has %s %s", n, type, version);
+        return String();
+    }
+
+    // spread the load across the peers
+    int i = matches[ esp_random() % matches.size() ];
+#if ESP_ARDUINO_VERSION_MAJOR >= 3
+    IPAddress ip = MDNS.address(i);
+#else
+    IPAddress ip = MDNS.IP(i);
+#endif
+    String url = String("http://") + ip.toString() + ":" + String( MDNS.port(i) ) + FOTA_PEER_PATH;
+    log_i("Found peer %s for %s %s", url.c_str(), type, version);
+    return url;
+}
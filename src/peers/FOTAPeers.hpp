@@ -0,0 +1,63 @@
+/*
+   esp32 firmware OTA
+   LAN peer distribution.
+
+   A device that has flashed and verified an image keeps its signature in NVS
+   and serves "signature + image" (read back from the partition) over HTTP,
+   advertised with mDNS as _esp32fota._tcp along with its firmware type and
+   version. Devices looking for the same type/version pick a random peer
+   before falling back to the manifest URL.
+
+   Peers are untrusted: they're only asked when the signature check is
+   enabled and the manifest provides the "sha256" of the image, which the
+   written partition must match (a signature alone allows downgrades).
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <WebServer.h>
+
+#define FOTA_PEER_PORT     3233
+#define FOTA_PEER_SERVICE  "esp32fota"
+#define FOTA_PEER_PATH     "/firmware.img"
+#define FOTA_PEER_NVS      "fota-peer"
+
+
+class FOTAPeers
+{
+public:
+  FOTAPeers() { }
+  ~FOTAPeers() { end(); }
+
+  // remember a verified image, it becomes servable on the next begin()
+  static bool store( const char* type, const char* version, const esp_partition_t* partition, uint32_t size, const uint8_t* signature, size_t signature_len );
+  // stop serving the image held by this partition (e.g. before overwriting it)
+  void forget( const esp_partition_t* partition );
+
+  // serve the stored image if it matches the firmware type, returns false if there's nothing to serve;
+  // reloads the stored record when the image was forgotten since
+  bool begin( const char* type, uint16_t port=FOTA_PEER_PORT );
+  void end();
+  bool serving() { return _server != nullptr && _valid; }
+
+  // returns the image url of a random peer advertising type/version, or an empty string
+  static String find( const char* type, const char* version );
+
+private:
+
+  WebServer*     _server = nullptr;
+  TaskHandle_t   _task = nullptr;
+  volatile bool  _valid = false;
+  String         _version;
+  String         _label;
+  uint32_t       _size = 0;
+  uint8_t*       _signature = nullptr;
+  size_t         _signature_len = 0;
+
+  bool load( const char* type );
+  void handleImage();
+  static void task( void* arg );
+  static bool startMDNS();
+};
@@ -0,0 +1,124 @@
+/*
+   esp32 firmware OTA
+   HTTP/1.1 chunked transfer decoder, see ChunkedStream.hpp
+*/
+
+#include "ChunkedStream.hpp"
+
+
+ChunkedStream* ChunkedStream::wrap( Stream* source )
+{
+    _source     = source;
+    _state      = source ? CHUNK_STATE_SIZE : CHUNK_STATE_ERROR;
+    _chunk_left = 0;
+    _digits     = 0;
+    _line_len   = 0;
+    if( source ) setTimeout( source->getTimeout() );
+    return this;
+}
+
+
+void ChunkedStream::parse()
+{
+    while( _state != CHUNK_STATE_DATA && _state != CHUNK_STATE_DONE && _state != CHUNK_STATE_ERROR && _source->available() > 0 ) {
+        int c = _source->read();
+        if( c < 0 ) return;
+        switch( _state ) {
+            case CHUNK_STATE_SIZE:
+                if( isxdigit(c) ) {
+                    if( ++_digits > 8 ) {
+                        log_e("Chunk size overflow");
+                        _state = CHUNK_STATE_ERROR;
+                        break;
+                    }
+                    _chunk_left = (_chunk_left << 4) | (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+                } else if( c == ';' || c == ' ' || c == '\t' ) {
+                    _state = CHUNK_STATE_EXTENSION;
+                } else if( c == '\r' ) {
+                    // wait for LF
+                } else if( c == '\n' && _digits > 0 ) {
+                    _state = _chunk_left ? CHUNK_STATE_DATA : CHUNK_STATE_TRAILER;
+                } else {
+                    log_e("Malformed chunk header (0x%02x)", c);
+                    _state = CHUNK_STATE_ERROR;
+                }
+            break;
+            case CHUNK_STATE_EXTENSION:
+                if( c == '\n' ) {
+                    _state = _chunk_left ? CHUNK_STATE_DATA : CHUNK_STATE_TRAILER;
+                }
+            break;
+            case CHUNK_STATE_DATA_END:
+                if( c == '\n' ) {
+                    _state      = CHUNK_STATE_SIZE;
+                    _chunk_left = 0;
+                    _digits     = 0;
+                } else if( c != '\r' ) {
+                    log_e("Missing CRLF after chunk data");
+                    _state = CHUNK_STATE_ERROR;
+                }
+            break;
+            case CHUNK_STATE_TRAILER:
+                if( c == '\n' ) {
+                    if( _line_len == 0 ) {
+                        _state = CHUNK_STATE_DONE;
+                    }
+                    _line_len = 0;
+                } else if( c != '\r' ) {
+                    _line_len++;
+                }
+            break;
+            default:
+            break;
+        }
+    }
+}
+
+
+int ChunkedStream::available()
+{
+    if( !_source ) return 0;
+    parse();
+    if( _state != CHUNK_STATE_DATA ) return 0;
+    return std::min( (size_t)_chunk_left, (size_t)std::max( _source->available(), 0 ) );
+}
+
+
+int ChunkedStream::read()
+{
+    if( !available() ) return -1;
+    int c = _source->read();
+    if( c >= 0 && --_chunk_left == 0 ) _state = CHUNK_STATE_DATA_END;
+    return c;
+}
+
+
+int ChunkedStream::peek()
+{
+    if( !available() ) return -1;
+    return _source->peek();
+}
+
+
+// Bulk read with the same semantics as Stream::readBytes(): waits up to
+// getTimeout() ms for more data, chunk framing is never copied.
+size_t ChunkedStream::readBytes( char* buffer, size_t length )
+{
+    size_t total = 0;
+    unsigned long start = millis();
+    while( total < length ) {
+        size_t n = available();
+        if( n == 0 ) {
+            if( finished() || failed() || millis() - start >= getTimeout() ) break;
+            delay(1);
+            continue;
+        }
+        n = _source->readBytes( buffer + total, std::min( n, length - total ) );
+        if( n == 0 ) break;
+        total += n;
+        _chunk_left -= n;
+        if( _chunk_left == 0 ) _state = CHUNK_STATE_DATA_END;
+        start = millis();
+    }
+    return total;
+}
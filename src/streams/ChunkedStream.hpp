@@ -0,0 +1,56 @@
+/*
+   esp32 firmware OTA
+   HTTP/1.1 chunked transfer decoder.
+
+   HTTPClient::getStreamPtr() returns the raw connection, so when a server
+   answers with "Transfer-Encoding: chunked" the chunk framing is mixed with
+   the payload. This Stream strips it and reports the end of the body with
+   finished(), which is the only way to know the image size in that case.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+
+class ChunkedStream : public Stream
+{
+public:
+  ChunkedStream() { }
+
+  // start decoding a new body
+  ChunkedStream* wrap( Stream* source );
+  // last chunk and trailers received
+  bool finished() { return _state == CHUNK_STATE_DONE; }
+  bool failed() { return _state == CHUNK_STATE_ERROR; }
+
+  int available();
+  int read();
+  int peek();
+  size_t readBytes( char* buffer, size_t length );
+  size_t readBytes( uint8_t* buffer, size_t length ) { return readBytes( (char*)buffer, length ); }
+  size_t write( uint8_t ) { return 0; } // read only
+  void flush() { }
+
+private:
+
+  enum chunk_state_t
+  {
+    CHUNK_STATE_SIZE,      // hex size line
+    CHUNK_STATE_EXTENSION, // ";name=value" until end of line
+    CHUNK_STATE_DATA,
+    CHUNK_STATE_DATA_END,  // CRLF after data
+    CHUNK_STATE_TRAILER,   // header lines after the last chunk, until an empty line
+    CHUNK_STATE_DONE,
+    CHUNK_STATE_ERROR
+  };
+
+  Stream*       _source = nullptr;
+  chunk_state_t _state = CHUNK_STATE_DONE;
+  uint32_t      _chunk_left = 0;
+  uint8_t       _digits = 0;
+  size_t        _line_len = 0; // trailer line length, empty line ends the body
+
+  // consume framing bytes until payload is available, never blocks
+  void parse();
+};
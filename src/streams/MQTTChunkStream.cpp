@@ -0,0 +1,283 @@
+/*
+   esp32 firmware OTA
+   Image transfer over MQTT, see MQTTChunkStream.hpp
+*/
+
+#include "MQTTChunkStream.hpp"
+
+#define FOTA_MQTT_HEADER 9 // type, session, seq
+
+
+static inline uint32_t get_le32( const uint8_t* p )
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static inline void put_le32( uint8_t* p, uint32_t v )
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+
+MQTTChunkStream::~MQTTChunkStream()
+{
+    release();
+    if( _lock ) vSemaphoreDelete( _lock );
+}
+
+
+void MQTTChunkStream::setPublisher( publish_cb publish, const char* prefix, uint8_t window, uint16_t chunk )
+{
+    release();
+    _publish = publish;
+    _up      = String( prefix ) + "/up";
+    _down    = String( prefix ) + "/down";
+    _window  = std::max( (uint8_t)1, std::min( window, (uint8_t)32 ) ); // one bit per chunk in the ACK bitmap
+    _chunk   = std::max( chunk, (uint16_t)64 );
+    if( !_lock ) _lock = xSemaphoreCreateMutex();
+}
+
+
+bool MQTTChunkStream::allocate()
+{
+    if( _slots ) return true;
+    _slots    = (uint8_t*)malloc( _window * _chunk );
+    _slot_len = (uint16_t*)malloc( _window * sizeof(uint16_t) );
+    if( !_slots || !_slot_len ) {
+        log_e("Unable to allocate %d bytes for the MQTT window", _window * _chunk);
+        release();
+        return false;
+    }
+    return true;
+}
+
+
+void MQTTChunkStream::release()
+{
+    if( _lock ) xSemaphoreTake( _lock, portMAX_DELAY );
+    if( _slots ) free( _slots );
+    if( _slot_len ) free( (void*)_slot_len );
+    _slots    = nullptr;
+    _slot_len = nullptr;
+    _open     = false;
+    if( _lock ) xSemaphoreGive( _lock );
+}
+
+
+int64_t MQTTChunkStream::begin( uint8_t target, uint32_t timeout )
+{
+    if( !_publish || !_lock ) {
+        log_e("No MQTT publisher, use setMQTT()");
+        return -1;
+    }
+    if( !allocate() ) return -1;
+
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    memset( (void*)_slot_len, 0, _window * sizeof(uint16_t) );
+    _next = _read_pos = _frames = _total = _delivered = _duplicates = 0;
+    _open     = false;
+    _aborted  = false;
+    _ack_due  = false;
+    _session  = esp_random();
+    xSemaphoreGive( _lock );
+
+    uint8_t req[4] = { target, _window, (uint8_t)(_chunk & 0xff), (uint8_t)(_chunk >> 8) };
+    uint32_t start = millis();
+    uint32_t last_req = 0;
+
+    while( !_open && !_aborted ) {
+        if( millis() - start > timeout ) {
+            log_e("No answer from the MQTT sender");
+            return -1;
+        }
+        if( last_req == 0 || millis() - last_req >= FOTA_MQTT_REQ_INTERVAL ) {
+            send( FOTA_MQTT_REQ, 0, req, sizeof(req) );
+            last_req = millis();
+        }
+        poll();
+        if( !_open ) vTaskDelay(1);
+    }
+
+    if( _aborted ) {
+        log_e("MQTT transfer aborted by the sender");
+        return -1;
+    }
+
+    sendAck(); // OPEN received
+    log_d("MQTT image: %d bytes in %d chunks (window=%d)", _total, _frames, _window);
+    return _total;
+}
+
+
+void MQTTChunkStream::end( bool success )
+{
+    bool interrupted = !_open || _delivered < _total;
+    if( _publish && _slots && !success && !_aborted && interrupted ) {
+        send( FOTA_MQTT_ABORT, _next, nullptr, 0 );
+    }
+    release();
+}
+
+
+void MQTTChunkStream::feed( const char* topic, const uint8_t* payload, size_t len )
+{
+    if( !_lock || len < FOTA_MQTT_HEADER || _down != topic ) return;
+
+    uint8_t type     = payload[0];
+    uint32_t session = get_le32( &payload[1] );
+    uint32_t seq     = get_le32( &payload[5] );
+    const uint8_t* data = payload + FOTA_MQTT_HEADER;
+    len -= FOTA_MQTT_HEADER;
+
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    if( _slots && session == _session ) {
+        _last_rx = millis();
+        switch( type ) {
+            case FOTA_MQTT_OPEN:
+                if( len < 4 ) break;
+                if( !_open ) {
+                    _total  = get_le32( data );
+                    _frames = (_total + _chunk - 1) / _chunk;
+                    _open   = _total > 0;
+                }
+                _ack_due = true; // also answers a repeated OPEN
+            break;
+            case FOTA_MQTT_DATA:
+            {
+                if( !_open || seq >= _frames ) break;
+                if( seq < _next || (seq - _next < _window && _slot_len[seq % _window] > 0) ) {
+                    _duplicates++; // our ACK was lost or late, repeat it
+                    _ack_due = true;
+                    break;
+                }
+                if( seq - _next >= _window ) { // sender ignored the window
+                    _ack_due = true;
+                    break;
+                }
+                uint32_t expected = std::min( (uint32_t)_chunk, _total - seq * _chunk );
+                if( len != expected ) {
+                    log_w("Chunk %d has a bad length (%d instead of %d)", seq, len, expected);
+                    break;
+                }
+                memcpy( &_slots[(seq % _window) * _chunk], data, len );
+                _slot_len[seq % _window] = len;
+                if( seq != _next ) _ack_due = true; // tells the sender about the hole
+            }
+            break;
+            case FOTA_MQTT_ABORT:
+                _aborted = true;
+            break;
+            default:
+            break;
+        }
+    }
+    xSemaphoreGive( _lock );
+}
+
+
+// Lets the client deliver messages, sends the ACKs feed() asked for (publishing stays in this task).
+void MQTTChunkStream::poll()
+{
+    if( _poll ) _poll();
+    uint32_t now = millis();
+    if( _ack_due ) {
+        sendAck();
+    } else if( _open && _delivered < _total && now - _last_rx >= FOTA_MQTT_ACK_INTERVAL && now - _last_ack >= FOTA_MQTT_ACK_INTERVAL ) {
+        sendAck(); // the sender may have lost our last ACK
+    }
+}
+
+
+void MQTTChunkStream::send( uint8_t type, uint32_t seq, const uint8_t* payload, uint8_t len )
+{
+    uint8_t message[FOTA_MQTT_HEADER + 8];
+    message[0] = type;
+    put_le32( &message[1], _session );
+    put_le32( &message[5], seq );
+    if( len ) memcpy( &message[FOTA_MQTT_HEADER], payload, std::min( len, (uint8_t)8 ) );
+    if( !_publish( _up.c_str(), message, FOTA_MQTT_HEADER + std::min( len, (uint8_t)8 ) ) ) {
+        log_w("Unable to publish on %s", _up.c_str());
+    }
+}
+
+
+void MQTTChunkStream::sendAck()
+{
+    _ack_due = false;
+    uint32_t sack = 0;
+    for( uint8_t i=0; i<_window; i++ ) {
+        if( _next + i < _frames && _slot_len[(_next + i) % _window] > 0 ) sack |= 1UL << i;
+    }
+    uint8_t payload[5];
+    put_le32( payload, sack );
+    payload[4] = _window;
+    send( FOTA_MQTT_ACK, _next, payload, sizeof(payload) );
+    _last_ack = millis();
+}
+
+
+void MQTTChunkStream::consumed( size_t len )
+{
+    _read_pos  += len;
+    _delivered += len;
+    if( _read_pos < _slot_len[_next % _window] ) return;
+    // slot is free again: open the window
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    _slot_len[_next % _window] = 0;
+    _read_pos = 0;
+    _next++;
+    xSemaphoreGive( _lock );
+    sendAck();
+    if( _delivered == _total ) {
+        uint8_t status = 0; // image received
+        send( FOTA_MQTT_FIN, _next, &status, 1 );
+    }
+}
+
+
+int MQTTChunkStream::available()
+{
+    if( !headReady() ) poll();
+    if( !headReady() ) return 0;
+    return _slot_len[_next % _window] - _read_pos;
+}
+
+
+int MQTTChunkStream::read()
+{
+    if( !available() ) return -1;
+    uint8_t c = _slots[(_next % _window) * _chunk + _read_pos];
+    consumed( 1 );
+    return c;
+}
+
+
+int MQTTChunkStream::peek()
+{
+    if( !available() ) return -1;
+    return _slots[(_next % _window) * _chunk + _read_pos];
+}
+
+
+// Bulk read with the same semantics as Stream::readBytes(): waits up to
+// getTimeout() ms for more data.
+size_t MQTTChunkStream::readBytes( char* buffer, size_t length )
+{
+    size_t total = 0;
+    unsigned long start = millis();
+    while( total < length ) {
+        size_t n = available();
+        if( n == 0 ) {
+            if( _aborted || !_open || _delivered == _total || millis() - start >= getTimeout() ) break;
+            vTaskDelay(1);
+            continue;
+        }
+        n = std::min( n, length - total );
+        memcpy( buffer + total, &_slots[(_next % _window) * _chunk + _read_pos], n );
+        consumed( n );
+        total += n;
+        start = millis();
+    }
+    return total;
+}
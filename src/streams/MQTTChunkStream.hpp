@@ -0,0 +1,113 @@
+/*
+   esp32 firmware OTA
+   Image transfer over an existing MQTT connection, for FOTA_MQTT_STREAM.
+
+   The library has no MQTT client of its own: the application publishes
+   through a callback (PubSubClient, AsyncMqttClient, esp-mqtt...), and hands
+   the messages of the "<prefix>/down" topic to feed(). Device messages go to
+   "<prefix>/up". Every message is:
+
+     | type (1) | session (4, LE) | seq (4, LE) | payload |
+
+   1) the device publishes REQ { target (1), window (1), chunk size (2) }
+      with a random session id until the sender answers OPEN { image size (4) }
+   2) the sender publishes DATA messages, chunk #n carries image bytes from
+      n * chunk size, up to 'window' chunks ahead of the last ACK
+   3) the device answers with ACK { sack bitmap (4), window (1) }, seq = first
+      chunk not consumed yet: when a chunk was consumed by the Update agent,
+      on chunks received out of order or twice, and again after
+      FOTA_MQTT_ACK_INTERVAL ms without data.
+      Missing chunks (QoS 0 message lost on a reconnection) are sent again.
+   4) the device publishes FIN { status (1) } when the whole image was read,
+      ABORT from either side gives up
+
+   Messages of another session are ignored. MQTT client buffers must hold a
+   DATA message (chunk size + 9 bytes + topic), e.g. PubSubClient's
+   setBufferSize(). See tools/mqtt_fota.py for the sender side.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#define FOTA_MQTT_WINDOW       4    // chunks buffered by the device, max 32
+#define FOTA_MQTT_CHUNK        2048 // bytes per DATA message
+#define FOTA_MQTT_REQ_INTERVAL 2000 // ms between two REQ messages while waiting for the sender
+#define FOTA_MQTT_ACK_INTERVAL 1000 // ms without data before the last ACK is repeated
+
+#define FOTA_MQTT_REQ   0x01
+#define FOTA_MQTT_OPEN  0x02
+#define FOTA_MQTT_DATA  0x03
+#define FOTA_MQTT_ACK   0x04
+#define FOTA_MQTT_FIN   0x05
+#define FOTA_MQTT_ABORT 0x06
+
+#define FOTA_MQTT_TARGET_FIRMWARE   0
+#define FOTA_MQTT_TARGET_FILESYSTEM 1
+
+
+class MQTTChunkStream : public Stream
+{
+public:
+  typedef std::function<bool(const char* topic, const uint8_t* payload, size_t len)> publish_cb;
+  typedef std::function<void()> poll_cb;
+
+  MQTTChunkStream() { }
+  ~MQTTChunkStream();
+
+  void setPublisher( publish_cb publish, const char* prefix, uint8_t window=FOTA_MQTT_WINDOW, uint16_t chunk=FOTA_MQTT_CHUNK );
+  // called while waiting for messages, for clients delivering them from their loop(), e.g. [](){ mqtt.loop(); }
+  void setPoll( poll_cb poll ) { _poll = poll; }
+  const String& downTopic() { return _down; } // to subscribe to
+
+  // message received by the MQTT client, from any task
+  void feed( const char* topic, const uint8_t* payload, size_t len );
+
+  // request an image from the sender, returns its size or -1 on timeout/abort
+  int64_t begin( uint8_t target, uint32_t timeout );
+  // free buffers, the sender is told to give up when the transfer failed midway
+  void end( bool success );
+
+  int available();
+  int read();
+  int peek();
+  size_t readBytes( char* buffer, size_t length );
+  size_t readBytes( uint8_t* buffer, size_t length ) { return readBytes( (char*)buffer, length ); }
+  size_t write( uint8_t ) { return 0; } // read only
+  void flush() { }
+
+  uint32_t duplicates() { return _duplicates; } // chunks received twice
+
+private:
+  publish_cb _publish;
+  poll_cb    _poll;
+  String     _up;
+  String     _down;
+  uint8_t    _window = FOTA_MQTT_WINDOW;
+  uint16_t   _chunk = FOTA_MQTT_CHUNK;
+  SemaphoreHandle_t _lock = nullptr; // feed() may run in the MQTT client task
+
+  // reorder buffer, chunk #n lives in slot n % window
+  uint8_t*   _slots = nullptr;
+  volatile uint16_t* _slot_len = nullptr; // 0 = free
+  uint32_t   _session = 0;
+  volatile uint32_t _next = 0;  // first chunk not consumed yet
+  uint16_t   _read_pos = 0;     // read offset in the slot of chunk _next
+  uint32_t   _frames = 0;       // chunks in the image
+  uint32_t   _total = 0;        // image size
+  uint32_t   _delivered = 0;
+  volatile bool _open = false;
+  volatile bool _aborted = false;
+  volatile bool _ack_due = false;
+  volatile uint32_t _last_rx = 0;
+  uint32_t   _last_ack = 0;
+  uint32_t   _duplicates = 0;
+
+  bool allocate();
+  void release();
+  void poll();
+  void send( uint8_t type, uint32_t seq, const uint8_t* payload, uint8_t len );
+  void sendAck();
+  bool headReady() { return _open && _next < _frames && _slot_len[_next % _window] > 0; }
+  void consumed( size_t len );
+};
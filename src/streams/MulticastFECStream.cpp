@@ -0,0 +1,398 @@
+/*
+   esp32 firmware OTA
+   Multicast image reception, see MulticastFECStream.hpp
+*/
+
+#include "MulticastFECStream.hpp"
+#include "SerialFrameStream.hpp" // fota_crc32()
+
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+
+
+static void gf_init()
+{
+    if( gf_exp[0] ) return; // built on first use
+    uint16_t x = 1;
+    for( int i=0; i<255; i++ ) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if( x & 0x100 ) x ^= 0x11d;
+    }
+    gf_exp[510] = gf_exp[511] = gf_exp[0];
+}
+
+
+uint8_t fota_gf_mul( uint8_t a, uint8_t b )
+{
+    gf_init();
+    return ( a && b ) ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+
+uint8_t fota_gf_inv( uint8_t a )
+{
+    gf_init();
+    return a ? gf_exp[255 - gf_log[a]] : 0;
+}
+
+
+void fota_gf_mul_add( uint8_t* dst, const uint8_t* src, uint8_t c, size_t len )
+{
+    if( c == 0 ) return;
+    gf_init();
+    uint8_t lc = gf_log[c];
+    for( size_t i=0; i<len; i++ ) {
+        if( src[i] ) dst[i] ^= gf_exp[gf_log[src[i]] + lc];
+    }
+}
+
+
+// Gauss-Jordan elimination, matrix is destroyed
+bool fota_gf_invert( uint8_t* matrix, uint8_t* inverse, uint8_t n )
+{
+    memset( inverse, 0, n * n );
+    for( uint8_t i=0; i<n; i++ ) inverse[i * n + i] = 1;
+
+    for( uint8_t col=0; col<n; col++ ) {
+        uint8_t pivot = col;
+        while( pivot < n && matrix[pivot * n + col] == 0 ) pivot++;
+        if( pivot == n ) return false;
+        if( pivot != col ) {
+            for( uint8_t i=0; i<n; i++ ) {
+                std::swap( matrix[pivot * n + i], matrix[col * n + i] );
+                std::swap( inverse[pivot * n + i], inverse[col * n + i] );
+            }
+        }
+        uint8_t c = fota_gf_inv( matrix[col * n + col] );
+        for( uint8_t i=0; i<n; i++ ) {
+            matrix[col * n + i]  = fota_gf_mul( matrix[col * n + i], c );
+            inverse[col * n + i] = fota_gf_mul( inverse[col * n + i], c );
+        }
+        for( uint8_t row=0; row<n; row++ ) {
+            uint8_t f = matrix[row * n + col];
+            if( row == col || f == 0 ) continue;
+            fota_gf_mul_add( &matrix[row * n], &matrix[col * n], f, n );
+            fota_gf_mul_add( &inverse[row * n], &inverse[col * n], f, n );
+        }
+    }
+    return true;
+}
+
+
+static inline uint16_t get_le16( const uint8_t* p )
+{
+    return p[0] | (p[1] << 8);
+}
+
+
+static inline uint32_t get_le32( const uint8_t* p )
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+int64_t MulticastFECStream::begin( const char* url, uint32_t timeout )
+{
+    end();
+
+    // udp://239.255.70.1:5007
+    const char* host = strncmp( url, "udp://", 6 ) == 0 ? url + 6 : nullptr;
+    const char* colon = host ? strchr( host, ':' ) : nullptr;
+    IPAddress group;
+    if( !colon || !group.fromString( String( host ).substring( 0, colon - host ) ) || group[0] < 224 || group[0] > 239 ) {
+        log_e("Invalid multicast url '%s', expected udp://<group address>:<port>", url);
+        return -1;
+    }
+    uint16_t port = atoi( colon + 1 );
+
+    _packet = (uint8_t*)malloc( FOTA_MULTICAST_HEADER + FOTA_MULTICAST_MAX_PACKET );
+    if( !_packet ) {
+        log_e("Unable to allocate the packet buffer");
+        return -1;
+    }
+    if( !_udp.beginMulticast( group, port ) ) {
+        log_e("Unable to join %s:%d", group.toString().c_str(), port);
+        end();
+        return -1;
+    }
+    _joined = true;
+    _next = _read_pos = _delivered = _crc = 0;
+    _packets = _recovered = _waits = 0;
+    _failed = _passed = false;
+
+    log_d("Listening to %s:%d", group.toString().c_str(), port);
+    uint32_t start = millis();
+    while( !_data || _failed ) {
+        if( _failed || millis() - start > timeout ) {
+            if( !_failed ) log_e("No image broadcast on %s:%d", group.toString().c_str(), port);
+            end();
+            return -1;
+        }
+        if( !receive() ) vTaskDelay(1);
+    }
+    _last_rx = millis();
+    return _total;
+}
+
+
+void MulticastFECStream::end()
+{
+    if( _data && _groups ) {
+        log_d("%d packets, %d rebuilt from parity, %d groups waited for another round", _packets, _recovered, _waits);
+    }
+    if( _joined ) _udp.stop();
+    if( _packet ) free( _packet );
+    if( _data ) free( _data );
+    if( _groups ) free( _groups );
+    if( _matrix ) free( _matrix );
+    _packet  = _data = _matrix = nullptr;
+    _groups  = nullptr;
+    _joined  = false;
+}
+
+
+// reads all the pending datagrams: the socket only queues a few of them
+bool MulticastFECStream::receive()
+{
+    bool got = false;
+    int len;
+    while( !_failed && ( len = _udp.parsePacket() ) > 0 ) {
+        if( len > FOTA_MULTICAST_HEADER + FOTA_MULTICAST_MAX_PACKET ) continue;
+        if( _udp.read( _packet, len ) == len && parse( len ) ) got = true;
+    }
+    return got;
+}
+
+
+bool MulticastFECStream::parse( size_t len )
+{
+    const uint8_t* p = _packet;
+    if( len < FOTA_MULTICAST_HEADER || p[0] != 'F' || p[1] != 'M' || p[2] != FOTA_MULTICAST_VERSION ) return false;
+
+    uint8_t  k       = p[3];
+    uint8_t  m       = p[4];
+    uint8_t  index   = p[5];
+    uint16_t size    = get_le16( &p[6] );
+    uint32_t session = get_le32( &p[8] );
+    uint32_t total   = get_le32( &p[12] );
+    uint32_t group   = get_le32( &p[16] );
+
+    if( len != FOTA_MULTICAST_HEADER + (size_t)size ) return false;
+    uint32_t crc = fota_crc32( 0, p, FOTA_MULTICAST_HEADER - 4 );
+    if( fota_crc32( crc, p + FOTA_MULTICAST_HEADER, size ) != get_le32( &p[20] ) ) {
+        log_v("Dropping packet with bad CRC");
+        return false;
+    }
+
+    if( !_data ) { // first packet: lock onto its image
+        if( k == 0 || k > FOTA_MULTICAST_MAX_K || m > FOTA_MULTICAST_MAX_M || size == 0 || size > FOTA_MULTICAST_MAX_PACKET
+         || k * size > FOTA_MULTICAST_MAX_GROUP || total == 0 ) {
+            log_e("Unsupported broadcast: k=%d m=%d packets of %d bytes", k, m, size);
+            return false;
+        }
+        _k = k;
+        _m = m;
+        _size = size;
+        _total = total;
+        _group_bytes = k * size;
+        _count = ( total + _group_bytes - 1 ) / _group_bytes;
+        _data   = (uint8_t*)malloc( _window * _group_bytes );
+        _groups = (Group*)malloc( _window * sizeof(Group) );
+        _matrix = m ? (uint8_t*)malloc( 2 * m * m ) : nullptr;
+        if( !_data || !_groups || ( m && !_matrix ) ) {
+            log_e("Unable to allocate %d bytes for %d groups", _window * _group_bytes, _window);
+            _failed = true; // begin() gives up
+            return false;
+        }
+        for( uint8_t i=0; i<_window; i++ ) _groups[i].number = UINT32_MAX;
+        _session = session;
+        log_i("Broadcast image: %d bytes, %d groups of %d+%d packets of %d bytes", total, _count, k, m, size);
+    } else if( session != _session || k != _k || m != _m || size != _size || total != _total ) {
+        return false; // another image on the same group
+    }
+    if( index >= k + m || group >= _count ) return false;
+
+    _packets++;
+    _last_rx = millis();
+    store( group, index, p + FOTA_MULTICAST_HEADER );
+    return true;
+}
+
+
+void MulticastFECStream::reset( Group& g, uint32_t number )
+{
+    g.number  = number;
+    g.count   = 0;
+    g.seen    = 0;
+    g.decoded = false;
+    memset( g.index, 0xff, sizeof(g.index) );
+    if( number != _count - 1 ) return;
+    // data packets past the end of the image are zeroes, they aren't sent
+    uint8_t* data = _data + ( number % _window ) * _group_bytes;
+    for( uint8_t j=0; j<_k; j++ ) {
+        if( number * _group_bytes + j * _size < _total ) continue;
+        memset( data + j * _size, 0, _size );
+        g.index[j] = j;
+        g.seen |= 1ULL << j;
+        g.count++;
+    }
+}
+
+
+// Data packet j is stored at position j. A parity packet takes the position of
+// a missing data packet, decode() replaces it with the data packet it rebuilds.
+void MulticastFECStream::store( uint32_t number, uint8_t index, const uint8_t* payload )
+{
+    if( number < _next ) return; // already read
+    if( number - _next >= _window ) {
+        Group& head = _groups[_next % _window];
+        if( !_passed && ( head.number != _next || head.count < _k ) ) {
+            _passed = true; // next round
+            _waits++;
+        }
+        return;
+    }
+
+    Group& g = _groups[number % _window];
+    if( g.number != number ) reset( g, number );
+    if( g.count >= _k || ( g.seen >> index ) & 1 ) return;
+
+    uint8_t* data = _data + ( number % _window ) * _group_bytes;
+    uint8_t pos = 0;
+    while( g.index[pos] != 0xff ) pos++; // first free position
+    if( index < _k && g.index[index] != 0xff ) { // held by a parity packet, move it
+        memcpy( data + pos * _size, data + index * _size, _size );
+        g.index[pos] = g.index[index];
+    }
+    if( index < _k ) pos = index;
+
+    memcpy( data + pos * _size, payload, _size );
+    g.index[pos] = index;
+    g.seen |= 1ULL << index;
+    g.count++;
+}
+
+
+// parity q = sum( cauchy(q, j) * data j ): the contribution of the known data
+// packets is removed, then the remaining e x e system is solved
+bool MulticastFECStream::decode( Group& g, uint8_t* data )
+{
+    uint8_t lost[FOTA_MULTICAST_MAX_K];
+    uint8_t e = 0;
+    for( uint8_t j=0; j<_k; j++ ) {
+        if( g.index[j] >= _k ) lost[e++] = j;
+    }
+    if( e == 0 ) return true;
+
+    for( uint8_t a=0; a<e; a++ ) {
+        uint8_t q = g.index[lost[a]] - _k;
+        for( uint8_t j=0; j<_k; j++ ) {
+            if( g.index[j] == j ) fota_gf_mul_add( data + lost[a] * _size, data + j * _size, fota_gf_cauchy( _k, q, j ), _size );
+        }
+    }
+
+    uint8_t* matrix  = _matrix;
+    uint8_t* inverse = _matrix + e * e;
+    for( uint8_t a=0; a<e; a++ ) {
+        for( uint8_t b=0; b<e; b++ ) matrix[a * e + b] = fota_gf_cauchy( _k, g.index[lost[a]] - _k, lost[b] );
+    }
+    if( !fota_gf_invert( matrix, inverse, e ) ) {
+        log_e("Group %d can't be decoded", g.number);
+        return false;
+    }
+
+    uint8_t r[FOTA_MULTICAST_MAX_M];
+    for( uint16_t i=0; i<_size; i++ ) {
+        for( uint8_t a=0; a<e; a++ ) r[a] = data[lost[a] * _size + i];
+        for( uint8_t b=0; b<e; b++ ) {
+            uint8_t v = 0;
+            for( uint8_t a=0; a<e; a++ ) v ^= fota_gf_mul( inverse[b * e + a], r[a] );
+            data[lost[b] * _size + i] = v;
+        }
+    }
+    for( uint8_t a=0; a<e; a++ ) g.index[lost[a]] = lost[a];
+    _recovered += e;
+    return true;
+}
+
+
+bool MulticastFECStream::headReady()
+{
+    if( !_data || _failed || _next >= _count ) return false;
+    Group& g = _groups[_next % _window];
+    if( g.number != _next || g.count < _k ) return false;
+    if( !g.decoded ) {
+        if( !decode( g, headData() ) ) {
+            _failed = true;
+            return false;
+        }
+        g.decoded = true;
+        _crc = fota_crc32( _crc, headData(), headLength() );
+        if( _next == _count - 1 && _crc != _session ) {
+            log_e("Rebuilt image doesn't match its crc32");
+            _failed = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void MulticastFECStream::consumed( size_t len )
+{
+    _read_pos  += len;
+    _delivered += len;
+    if( _read_pos < headLength() ) return;
+    _read_pos = 0;
+    _next++; // its slot now waits for group _next + window - 1
+    _passed = false;
+}
+
+
+int MulticastFECStream::available()
+{
+    if( _data ) receive();
+    if( !headReady() ) return 0;
+    return headLength() - _read_pos;
+}
+
+
+int MulticastFECStream::read()
+{
+    if( !available() ) return -1;
+    uint8_t c = headData()[_read_pos];
+    consumed( 1 );
+    return c;
+}
+
+
+int MulticastFECStream::peek()
+{
+    if( !available() ) return -1;
+    return headData()[_read_pos];
+}
+
+
+// Bulk read with the same semantics as Stream::readBytes(), except the
+// getTimeout() ms count from the last packet heard: waiting for the next
+// round of the carousel isn't a timeout.
+size_t MulticastFECStream::readBytes( char* buffer, size_t length )
+{
+    size_t total = 0;
+    while( total < length ) {
+        size_t n = available();
+        if( n == 0 ) {
+            if( _failed || !_data || _delivered == _total || millis() - _last_rx >= getTimeout() ) break;
+            vTaskDelay(1);
+            continue;
+        }
+        n = std::min( n, length - total );
+        memcpy( buffer + total, headData() + _read_pos, n );
+        consumed( n );
+        total += n;
+    }
+    return total;
+}
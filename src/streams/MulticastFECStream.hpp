@@ -0,0 +1,127 @@
+/*
+   esp32 firmware OTA
+   Image broadcast over UDP multicast with forward error correction, for
+   FOTA_MULTICAST_STREAM.
+
+   The manifest announces the group with a "udp://239.255.70.1:5007" url, the
+   sender loops over the image (carousel) and any number of devices listen,
+   without requests nor acknowledgements. The image is cut in groups of k
+   packets of the same size, each followed by m parity packets of a
+   systematic Reed-Solomon code (Cauchy matrix over GF(256)): any k of the
+   k+m packets of a group rebuild it. Every packet is:
+
+     | "FM" (2) | version (1) | k (1) | m (1) | index (1) | payload size (2, LE) |
+     | session (4, LE) | image size (4, LE) | group (4, LE) | crc32 (4, LE) | payload |
+
+   index < k are data packets (image bytes from (group * k + index) * payload
+   size, the last group is padded with zeroes), index >= k are parity packets.
+   The crc32 covers the header up to the crc and the payload. The session is
+   the crc32 of the whole image: the device locks onto the first session it
+   hears, and checks the rebuilt image against it.
+
+   Groups are handed to the Update agent in order, so flash is still written
+   sequentially: the device buffers 'window' groups from the first one not
+   read yet, a group missing more than m packets is completed on the next
+   round of the carousel. See tools/multicast_fota.py for the sender.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#define FOTA_MULTICAST_WINDOW    2     // groups buffered by the device
+#define FOTA_MULTICAST_MAX_K     32    // data packets per group
+#define FOTA_MULTICAST_MAX_M     32    // parity packets per group
+#define FOTA_MULTICAST_MAX_GROUP 32768 // bytes of data per group (k * payload size)
+#define FOTA_MULTICAST_MAX_PACKET 1472 // payload bytes, fits an unfragmented UDP datagram
+#define FOTA_MULTICAST_HEADER    24
+#define FOTA_MULTICAST_VERSION   1
+
+
+// GF(256) arithmetic of the code, polynomial 0x11d, same as tools/multicast_fota.py
+uint8_t fota_gf_mul( uint8_t a, uint8_t b );
+uint8_t fota_gf_inv( uint8_t a );
+// coefficient of data packet j in parity packet i of a group of k data packets
+inline uint8_t fota_gf_cauchy( uint8_t k, uint8_t i, uint8_t j ) { return fota_gf_inv( (k + i) ^ j ); }
+// dst ^= c * src
+void fota_gf_mul_add( uint8_t* dst, const uint8_t* src, uint8_t c, size_t len );
+// inverse of an n x n matrix, false if it's singular (matrix is destroyed)
+bool fota_gf_invert( uint8_t* matrix, uint8_t* inverse, uint8_t n );
+
+
+class MulticastFECStream : public Stream
+{
+public:
+  MulticastFECStream() { }
+  ~MulticastFECStream() { end(); }
+
+  void setWindow( uint8_t groups ) { _window = std::max( (uint8_t)1, groups ); }
+
+  // join the group of a "udp://address:port" url, returns the image size or -1
+  // when no packet was heard within timeout ms
+  int64_t begin( const char* url, uint32_t timeout );
+  // leave the group, free buffers
+  void end();
+
+  int available();
+  int read();
+  int peek();
+  size_t readBytes( char* buffer, size_t length );
+  size_t readBytes( uint8_t* buffer, size_t length ) { return readBytes( (char*)buffer, length ); }
+  size_t write( uint8_t ) { return 0; } // read only
+  void flush() { }
+
+  uint32_t packets()   { return _packets; }   // valid packets of the session
+  uint32_t recovered() { return _recovered; } // data packets rebuilt from parity
+  uint32_t waits()     { return _waits; }     // groups completed on a later round
+  // millis() of the last valid packet of the session: the sender is alive even
+  // when no byte is readable, e.g. while a group waits for the next round
+  uint32_t lastPacketMs() { if( _data ) receive(); return _last_rx; }
+
+private:
+  struct Group {
+    uint32_t number;  // image group held by this slot
+    uint8_t  count;   // packets stored
+    uint64_t seen;    // packet indexes stored
+    uint8_t  index[FOTA_MULTICAST_MAX_K]; // packet stored at each data position, 0xff = none
+    bool     decoded;
+  };
+
+  WiFiUDP  _udp;
+  bool     _joined = false;
+  uint8_t  _window = FOTA_MULTICAST_WINDOW;
+  uint8_t* _packet = nullptr; // receive buffer
+  uint8_t* _data = nullptr;   // window * k * payload size
+  Group*   _groups = nullptr;
+  uint8_t* _matrix = nullptr; // decoding, 2 * m * m
+
+  uint32_t _session = 0;      // crc32 of the image
+  uint32_t _total = 0;        // image size
+  uint8_t  _k = 0;
+  uint8_t  _m = 0;
+  uint16_t _size = 0;         // payload size
+  uint32_t _group_bytes = 0;  // k * payload size
+  uint32_t _count = 0;        // groups in the image
+
+  uint32_t _next = 0;         // first group not read yet
+  uint32_t _read_pos = 0;     // read offset in group _next
+  uint32_t _delivered = 0;
+  uint32_t _crc = 0;          // of the decoded groups
+  bool     _failed = false;
+  uint32_t _last_rx = 0;
+  bool     _passed = false;   // the sender went past the window while _next was incomplete
+  uint32_t _packets = 0;
+  uint32_t _recovered = 0;
+  uint32_t _waits = 0;
+
+  bool receive();
+  bool parse( size_t len );
+  void store( uint32_t number, uint8_t index, const uint8_t* payload );
+  void reset( Group& g, uint32_t number );
+  bool decode( Group& g, uint8_t* data );
+  bool headReady();
+  size_t headLength() { return std::min( _group_bytes, _total - _next * _group_bytes ); }
+  uint8_t* headData() { return _data + ( _next % _window ) * _group_bytes; }
+  void consumed( size_t len );
+};
@@ -0,0 +1,338 @@
+/*
+   esp32 firmware OTA
+   Framed serial transfer, see SerialFrameStream.hpp
+*/
+
+#include "SerialFrameStream.hpp"
+
+#define FOTA_SERIAL_SOF1 0xA5
+#define FOTA_SERIAL_SOF2 0x5A
+
+
+static uint32_t crc32_table[256];
+
+
+uint32_t fota_crc32( uint32_t crc, const uint8_t* data, size_t len )
+{
+    if( crc32_table[1] == 0 ) { // built on first use
+        for( uint32_t i=0; i<256; i++ ) {
+            uint32_t c = i;
+            for( int k=0; k<8; k++ ) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            crc32_table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while( len-- ) crc = crc32_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+static inline uint32_t get_le32( const uint8_t* p )
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static inline void put_le32( uint8_t* p, uint32_t v )
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+
+void SerialFrameStream::setPort( Stream* port, uint8_t window, uint16_t max_payload )
+{
+    release();
+    _port        = port;
+    _window      = std::max( (uint8_t)1, std::min( window, (uint8_t)32 ) ); // one bit per frame in the ACK bitmap
+    _max_payload = std::max( max_payload, (uint16_t)16 );
+}
+
+
+bool SerialFrameStream::allocate()
+{
+    if( _slots ) return true;
+    _slots      = (uint8_t*)malloc( _window * _max_payload );
+    _slot_len   = (uint16_t*)malloc( _window * sizeof(uint16_t) );
+    _rx_payload = (uint8_t*)malloc( _max_payload );
+    if( !_slots || !_slot_len || !_rx_payload ) {
+        log_e("Unable to allocate %d bytes for the serial window", _window * _max_payload + _max_payload );
+        release();
+        return false;
+    }
+    return true;
+}
+
+
+void SerialFrameStream::release()
+{
+    if( _slots ) free( _slots );
+    if( _slot_len ) free( _slot_len );
+    if( _rx_payload ) free( _rx_payload );
+    _slots      = nullptr;
+    _slot_len   = nullptr;
+    _rx_payload = nullptr;
+    _open       = false;
+}
+
+
+int64_t SerialFrameStream::begin( uint8_t target, uint32_t timeout )
+{
+    if( !_port ) {
+        log_e("No serial port, use setSerialPort()");
+        return -1;
+    }
+    if( !allocate() ) return -1;
+
+    memset( _slot_len, 0, _window * sizeof(uint16_t) );
+    _next = _read_pos = _frames = _total = _delivered = _duplicates = 0;
+    _open     = false;
+    _aborted  = false;
+    _rx_state = RX_SOF1;
+
+    uint8_t req[4] = { target, _window, (uint8_t)(_max_payload & 0xff), (uint8_t)(_max_payload >> 8) };
+    uint32_t start = millis();
+    uint32_t last_req = 0;
+
+    while( !_open && !_aborted ) {
+        if( millis() - start > timeout ) {
+            log_e("No answer from the serial host");
+            return -1;
+        }
+        if( last_req == 0 || millis() - last_req >= FOTA_SERIAL_REQ_INTERVAL ) {
+            sendFrame( FOTA_SERIAL_FRAME_REQ, 0, req, sizeof(req) );
+            last_req = millis();
+        }
+        poll();
+        if( !_open ) vTaskDelay(1);
+    }
+
+    if( _aborted ) {
+        log_e("Serial transfer aborted by the host");
+        return -1;
+    }
+
+    log_d("Serial image: %d bytes in %d frames (window=%d)", _total, _frames, _window);
+    return _total;
+}
+
+
+void SerialFrameStream::end( bool success )
+{
+    bool interrupted = !_open || _delivered < _total;
+    if( _port && _slots && !success && !_aborted && interrupted ) {
+        sendFrame( FOTA_SERIAL_FRAME_ABORT, _next, nullptr, 0 );
+    }
+    release();
+}
+
+
+// Feed incoming bytes to the frame parser, never blocks.
+void SerialFrameStream::poll()
+{
+    if( !_port || !_slots ) return;
+
+    bool got_bytes = false;
+    int avail;
+
+    while( (avail = _port->available()) > 0 ) {
+        got_bytes = true;
+        if( _rx_state == RX_PAYLOAD ) { // bulk copy
+            size_t n = std::min( (size_t)avail, (size_t)(_rx_len - _rx_pos) );
+            n = _port->readBytes( _rx_payload + _rx_pos, n );
+            if( n == 0 ) break;
+            _rx_pos += n;
+            if( _rx_pos == _rx_len ) {
+                _rx_state = RX_CRC;
+                _rx_pos   = 0;
+            }
+            continue;
+        }
+        int c = _port->read();
+        if( c < 0 ) break;
+        switch( _rx_state ) {
+            case RX_SOF1:
+                if( c == FOTA_SERIAL_SOF1 ) _rx_state = RX_SOF2;
+            break;
+            case RX_SOF2:
+                if( c == FOTA_SERIAL_SOF2 ) {
+                    _rx_state = RX_HEADER;
+                    _rx_pos   = 0;
+                } else if( c != FOTA_SERIAL_SOF1 ) {
+                    _rx_state = RX_SOF1;
+                }
+            break;
+            case RX_HEADER:
+                _rx_header[_rx_pos++] = c;
+                if( _rx_pos == sizeof(_rx_header) ) {
+                    _rx_len = _rx_header[5] | (_rx_header[6] << 8);
+                    _rx_pos = 0;
+                    if( _rx_len > _max_payload ) { // garbage, resync
+                        _rx_state = RX_SOF1;
+                    } else {
+                        _rx_state = _rx_len ? RX_PAYLOAD : RX_CRC;
+                    }
+                }
+            break;
+            case RX_CRC:
+                _rx_crc[_rx_pos++] = c;
+                if( _rx_pos == sizeof(_rx_crc) ) {
+                    uint32_t crc = fota_crc32( 0, _rx_header, sizeof(_rx_header) );
+                    crc = fota_crc32( crc, _rx_payload, _rx_len );
+                    if( crc == get_le32( _rx_crc ) ) {
+                        onFrame( _rx_header[0], get_le32( &_rx_header[1] ), _rx_payload, _rx_len );
+                    } else {
+                        log_v("Dropping frame with bad CRC");
+                    }
+                    _rx_state = RX_SOF1;
+                }
+            break;
+            default:
+            break;
+        }
+    }
+
+    uint32_t now = millis();
+    if( got_bytes ) {
+        _last_rx = now;
+    } else if( _open && _delivered < _total && now - _last_rx >= FOTA_SERIAL_ACK_INTERVAL && now - _last_ack >= FOTA_SERIAL_ACK_INTERVAL ) {
+        sendAck(); // the host may have lost our last ACK
+    }
+}
+
+
+void SerialFrameStream::onFrame( uint8_t type, uint32_t seq, const uint8_t* payload, uint16_t len )
+{
+    switch( type ) {
+        case FOTA_SERIAL_FRAME_OPEN:
+            if( len < 4 ) return;
+            if( !_open ) {
+                _total  = get_le32( payload );
+                _frames = (_total + _max_payload - 1) / _max_payload;
+                _open   = _total > 0;
+            }
+            sendAck(); // also answers a retransmitted OPEN
+        break;
+        case FOTA_SERIAL_FRAME_DATA:
+        {
+            if( !_open ) return;
+            if( seq >= _frames ) {
+                log_v("Frame %d beyond the end of the image", seq);
+                return;
+            }
+            if( seq < _next || (seq - _next < _window && _slot_len[seq % _window] > 0) ) {
+                _duplicates++; // our ACK was lost or late, repeat it
+                sendAck();
+                return;
+            }
+            if( seq - _next >= _window ) { // host ignored the window
+                sendAck();
+                return;
+            }
+            uint32_t expected = std::min( (uint32_t)_max_payload, _total - seq * _max_payload );
+            if( len != expected ) {
+                log_w("Frame %d has a bad length (%d instead of %d)", seq, len, expected);
+                return;
+            }
+            memcpy( &_slots[(seq % _window) * _max_payload], payload, len );
+            _slot_len[seq % _window] = len;
+            sendAck();
+        }
+        break;
+        case FOTA_SERIAL_FRAME_ABORT:
+            _aborted = true;
+        break;
+        default:
+        break;
+    }
+}
+
+
+void SerialFrameStream::sendFrame( uint8_t type, uint32_t seq, const uint8_t* payload, uint16_t len )
+{
+    uint8_t header[9] = { FOTA_SERIAL_SOF1, FOTA_SERIAL_SOF2, type, 0, 0, 0, 0, (uint8_t)(len & 0xff), (uint8_t)(len >> 8) };
+    put_le32( &header[3], seq );
+    uint8_t crc[4];
+    uint32_t c = fota_crc32( 0, &header[2], sizeof(header)-2 );
+    put_le32( crc, fota_crc32( c, payload, len ) );
+    _port->write( header, sizeof(header) );
+    if( len ) _port->write( payload, len );
+    _port->write( crc, sizeof(crc) );
+}
+
+
+void SerialFrameStream::sendAck()
+{
+    uint32_t sack = 0;
+    for( uint8_t i=0; i<_window; i++ ) {
+        if( _next + i < _frames && _slot_len[(_next + i) % _window] > 0 ) sack |= 1UL << i;
+    }
+    uint8_t payload[5];
+    put_le32( payload, sack );
+    payload[4] = _window;
+    sendFrame( FOTA_SERIAL_FRAME_ACK, _next, payload, sizeof(payload) );
+    _last_ack = millis();
+}
+
+
+void SerialFrameStream::consumed( size_t len )
+{
+    _read_pos  += len;
+    _delivered += len;
+    if( _read_pos < _slot_len[_next % _window] ) return;
+    // slot is free again: open the window
+    _slot_len[_next % _window] = 0;
+    _read_pos = 0;
+    _next++;
+    sendAck();
+    if( _delivered == _total ) {
+        uint8_t status = 0; // image received
+        sendFrame( FOTA_SERIAL_FRAME_FIN, _next, &status, 1 );
+    }
+}
+
+
+int SerialFrameStream::available()
+{
+    if( !headReady() ) poll();
+    if( !headReady() ) return 0;
+    return _slot_len[_next % _window] - _read_pos;
+}
+
+
+int SerialFrameStream::read()
+{
+    if( !available() ) return -1;
+    uint8_t c = _slots[(_next % _window) * _max_payload + _read_pos];
+    consumed( 1 );
+    return c;
+}
+
+
+int SerialFrameStream::peek()
+{
+    if( !available() ) return -1;
+    return _slots[(_next % _window) * _max_payload + _read_pos];
+}
+
+
+// Bulk read with the same semantics as Stream::readBytes(): waits up to
+// getTimeout() ms for more data.
+size_t SerialFrameStream::readBytes( char* buffer, size_t length )
+{
+    size_t total = 0;
+    unsigned long start = millis();
+    while( total < length ) {
+        size_t n = available();
+        if( n == 0 ) {
+            if( _aborted || !_open || _delivered == _total || millis() - start >= getTimeout() ) break;
+            vTaskDelay(1);
+            continue;
+        }
+        n = std::min( n, length - total );
+        memcpy( buffer + total, &_slots[(_next % _window) * _max_payload + _read_pos], n );
+        consumed( n );
+        total += n;
+        start = millis();
+    }
+    return total;
+}
@@ -0,0 +1,117 @@
+/*
+   esp32 firmware OTA
+   Framed, windowed and CRC-checked serial transfer for FOTA_SERIAL_STREAM.
+
+   Every frame is:
+
+     | 0xA5 0x5A | type (1) | seq (4, LE) | len (2, LE) | payload (len) | crc32 (4, LE) |
+
+   crc32 (IEEE 802.3, same as zlib) covers type, seq, len and payload.
+
+   1) the device sends REQ { target (1), window (1), max payload (2) } until
+      the host answers OPEN { image size (4) }
+   2) the host streams DATA frames, frame #n carries image bytes starting at
+      n * max_payload, up to 'window' frames ahead of the last ACK
+   3) the device answers every change with ACK { seq = first frame not yet
+      consumed, sack bitmap (4), window (1) }, bit i of the bitmap telling
+      that frame seq+i is already buffered. Missing frames are retransmitted
+      selectively, and frames are only freed when the Update agent consumed
+      them, which gives flow control while flash writes are in progress.
+   4) the device sends FIN { status (1) } when the update is over
+
+   See tools/serial_fota.py for the host side.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#define FOTA_SERIAL_WINDOW       8    // frames buffered by the device, max 32
+#define FOTA_SERIAL_MAX_PAYLOAD  1024 // bytes per DATA frame
+#define FOTA_SERIAL_REQ_INTERVAL 500  // ms between two REQ frames while waiting for the host
+#define FOTA_SERIAL_ACK_INTERVAL 50   // ms of rx silence before the last ACK is repeated
+
+#define FOTA_SERIAL_FRAME_REQ    0x01
+#define FOTA_SERIAL_FRAME_OPEN   0x02
+#define FOTA_SERIAL_FRAME_DATA   0x03
+#define FOTA_SERIAL_FRAME_ACK    0x04
+#define FOTA_SERIAL_FRAME_FIN    0x05
+#define FOTA_SERIAL_FRAME_ABORT  0x06
+
+#define FOTA_SERIAL_TARGET_FIRMWARE   0
+#define FOTA_SERIAL_TARGET_FILESYSTEM 1
+
+
+uint32_t fota_crc32( uint32_t crc, const uint8_t* data, size_t len );
+
+
+class SerialFrameStream : public Stream
+{
+public:
+  SerialFrameStream() { }
+  ~SerialFrameStream() { release(); }
+
+  void setPort( Stream* port, uint8_t window=FOTA_SERIAL_WINDOW, uint16_t max_payload=FOTA_SERIAL_MAX_PAYLOAD );
+  Stream* getPort() { return _port; }
+
+  // request an image from the host, returns its size or -1 on timeout/abort
+  int64_t begin( uint8_t target, uint32_t timeout );
+  // free buffers, the host is told to give up when the transfer failed midway
+  void end( bool success );
+
+  int available();
+  int read();
+  int peek();
+  size_t readBytes( char* buffer, size_t length );
+  size_t readBytes( uint8_t* buffer, size_t length ) { return readBytes( (char*)buffer, length ); }
+  size_t write( uint8_t ) { return 0; } // read only, the link is driven by frames
+  void flush() { }
+
+  uint32_t retransmits() { return _duplicates; } // frames received twice
+
+private:
+
+  enum rx_state_t
+  {
+    RX_SOF1,
+    RX_SOF2,
+    RX_HEADER,
+    RX_PAYLOAD,
+    RX_CRC
+  };
+
+  Stream*   _port = nullptr;
+  uint8_t   _window = FOTA_SERIAL_WINDOW;
+  uint16_t  _max_payload = FOTA_SERIAL_MAX_PAYLOAD;
+
+  // reorder buffer, frame #n lives in slot n % window
+  uint8_t*  _slots = nullptr;
+  uint16_t* _slot_len = nullptr; // 0 = free
+  uint32_t  _next = 0;           // first frame not consumed yet
+  uint16_t  _read_pos = 0;       // read offset in the slot of frame _next
+  uint32_t  _frames = 0;         // frames in the image
+  uint32_t  _total = 0;          // image size
+  uint32_t  _delivered = 0;
+  bool      _open = false;
+  bool      _aborted = false;
+
+  // receiver state machine
+  rx_state_t _rx_state = RX_SOF1;
+  uint8_t   _rx_header[7];       // type, seq, len
+  uint8_t*  _rx_payload = nullptr;
+  uint16_t  _rx_len = 0;
+  uint16_t  _rx_pos = 0;
+  uint8_t   _rx_crc[4];
+  uint32_t  _last_rx = 0;
+  uint32_t  _last_ack = 0;
+  uint32_t  _duplicates = 0;
+
+  bool allocate();
+  void release();
+  void poll();
+  void onFrame( uint8_t type, uint32_t seq, const uint8_t* payload, uint16_t len );
+  void sendFrame( uint8_t type, uint32_t seq, const uint8_t* payload, uint16_t len );
+  void sendAck();
+  bool headReady() { return _open && _next < _frames && _slot_len[_next % _window] > 0; }
+  void consumed( size_t len );
+};
@@ -0,0 +1,96 @@
+/*
+   esp32 firmware OTA
+   Download bandwidth cap, see ThrottledStream.hpp
+*/
+
+#include "ThrottledStream.hpp"
+
+
+ThrottledStream* ThrottledStream::wrap( Stream* source, uint32_t rate )
+{
+    _source = source;
+    _rate   = rate;
+    _tokens = burst();
+    _credit = 0;
+    _last   = micros();
+    if( source ) setTimeout( source->getTimeout() );
+    return this;
+}
+
+
+void ThrottledStream::setRate( uint32_t rate )
+{
+    refill();
+    _rate   = rate;
+    _tokens = std::min( _tokens, burst() );
+}
+
+
+void ThrottledStream::refill()
+{
+    uint32_t now = micros();
+    _credit += (uint64_t)( now - _last ) * _rate;
+    _last = now;
+    uint64_t tokens = _tokens + _credit / 1000000;
+    _credit %= 1000000;
+    if( tokens >= burst() ) {
+        tokens  = burst();
+        _credit = 0; // a full bucket doesn't save up for later
+    }
+    _tokens = tokens;
+}
+
+
+int ThrottledStream::available()
+{
+    if( !_source ) return 0;
+    int n = _source->available();
+    if( !_rate || n <= 0 ) return n;
+    refill();
+    // wait for a decent amount of tokens rather than releasing a few bytes at a time
+    if( _tokens < std::min( (uint32_t)n, (uint32_t)FOTA_THROTTLE_MIN_BURST ) ) return 0;
+    return std::min( (uint32_t)n, _tokens );
+}
+
+
+int ThrottledStream::read()
+{
+    if( available() <= 0 ) return -1;
+    int c = _source->read();
+    if( c >= 0 && _rate ) _tokens--;
+    return c;
+}
+
+
+int ThrottledStream::peek()
+{
+    return _source ? _source->peek() : -1;
+}
+
+
+// Same semantics as Stream::readBytes(), except that waiting for
+// tokens doesn't count in the getTimeout() ms allowed for data to arrive.
+size_t ThrottledStream::readBytes( char* buffer, size_t length )
+{
+    if( !_source ) return 0;
+    size_t total = 0;
+    unsigned long start = millis();
+    while( total < length ) {
+        if( !_rate ) { // cap lifted during the download
+            return total + _source->readBytes( buffer + total, length - total );
+        }
+        size_t n = available();
+        if( n == 0 ) {
+            if( waiting() ) start = millis();
+            else if( millis() - start >= getTimeout() ) break;
+            delay(1);
+            continue;
+        }
+        n = _source->readBytes( buffer + total, std::min( n, length - total ) );
+        if( n == 0 ) break;
+        _tokens -= std::min( (uint32_t)n, _tokens );
+        total += n;
+        start = millis();
+    }
+    return total;
+}
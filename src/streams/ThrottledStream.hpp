@@ -0,0 +1,52 @@
+/*
+   esp32 firmware OTA
+   Download bandwidth cap (cfg.rate_limit).
+
+   Token bucket in front of the image stream: bytes are only released as
+   tokens accumulate at 'rate' bytes per second, so the socket is drained
+   at that pace and the TCP window throttles the server, leaving room for
+   the application traffic. The bucket holds FOTA_THROTTLE_BURST_MS worth
+   of tokens. A rate of 0 passes everything through.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#define FOTA_THROTTLE_BURST_MS  100 // bucket depth
+#define FOTA_THROTTLE_MIN_BURST 512 // bytes, avoids tiny reads at low rates
+
+
+class ThrottledStream : public Stream
+{
+public:
+  ThrottledStream() { }
+
+  // start releasing a new body, tokens are reset
+  ThrottledStream* wrap( Stream* source, uint32_t rate );
+  Stream* source() { return _source; }
+
+  // bytes per second, can be changed while a download is in progress
+  void setRate( uint32_t rate );
+  uint32_t getRate() { return _rate; }
+  // source has data waiting for tokens
+  bool waiting() { return _source && _rate && _tokens < burst() && _source->available() > 0; }
+
+  int available();
+  int read();
+  int peek();
+  size_t readBytes( char* buffer, size_t length );
+  size_t readBytes( uint8_t* buffer, size_t length ) { return readBytes( (char*)buffer, length ); }
+  size_t write( uint8_t ) { return 0; } // read only
+  void flush() { }
+
+private:
+  Stream*  _source = nullptr;
+  uint32_t _rate = 0;
+  uint32_t _tokens = 0;
+  uint32_t _last = 0;     // micros() of the last refill
+  uint64_t _credit = 0;   // rate * us not yet converted to tokens
+
+  uint32_t burst() { return std::max( (uint32_t)FOTA_THROTTLE_MIN_BURST, (uint32_t)( (uint64_t)_rate * FOTA_THROTTLE_BURST_MS / 1000 ) ); }
+  void refill();
+};
@@ -0,0 +1,103 @@
+/*
+   esp32 firmware OTA
+   Per-block verification, see FOTABlockHashes.hpp
+*/
+
+#include "FOTABlockHashes.hpp"
+
+// arduino-esp32 core 2.x => 3.x migration
+#if !defined SPI_FLASH_SEC_SIZE
+  #include "spi_flash_mmap.h"
+#endif
+
+
+bool FOTABlockHashes::begin( const uint8_t* hashes, size_t count, size_t block_size )
+{
+    if( !hashes || count == 0 || block_size == 0 || block_size % SPI_FLASH_SEC_SIZE != 0 ) {
+        log_e("Invalid block hash list (%d blocks of %d bytes)", count, block_size);
+        return false;
+    }
+    _hashes     = hashes;
+    _count      = count;
+    _block_size = block_size;
+    _refetch    = false;
+    _written    = 0;
+    _bad_count  = 0;
+    _finished   = _failed = false;
+    return _digest.begin();
+}
+
+
+bool FOTABlockHashes::compareBlock( size_t index, const uint8_t* digest )
+{
+    return memcmp( digest, _hashes + index * 32, 32 ) == 0;
+}
+
+
+bool FOTABlockHashes::update( const uint8_t* data, size_t len )
+{
+    if( !_hashes ) return true;
+    if( _failed ) return false;
+    while( len > 0 ) {
+        size_t index  = _written / _block_size;
+        size_t offset = _written % _block_size;
+        if( index >= _count ) {
+            log_e("Image is longer than its %d listed blocks", _count);
+            _failed = true;
+            return false;
+        }
+        size_t chunk = std::min( len, _block_size - offset );
+        _digest.update( data, chunk );
+        _written += chunk;
+        data     += chunk;
+        len      -= chunk;
+        if( offset + chunk < _block_size ) break;
+
+        uint8_t digest[32];
+        bool hashed = _digest.finish( digest ) && _digest.begin();
+        if( hashed && compareBlock( index, digest ) ) continue;
+
+        if( _refetch && index > 0 && index < _count - 1 && _bad_count < FOTA_BLOCKS_MAX_REFETCH ) {
+            log_w("Block #%d is corrupted, will be fetched again", index);
+            _bad[_bad_count++] = index;
+            continue;
+        }
+        log_e("Block #%d is corrupted, aborting", index);
+        _failed = true;
+        return false;
+    }
+    return true;
+}
+
+
+bool FOTABlockHashes::finish()
+{
+    if( !_hashes || _failed ) return false;
+    size_t index = _written / _block_size;
+    if( _written % _block_size ) { // last block is shorter
+        uint8_t digest[32];
+        if( !_digest.finish( digest ) || !compareBlock( index, digest ) ) {
+            log_e("Block #%d is corrupted, aborting", index);
+            _failed = true;
+            return false;
+        }
+        index++;
+    }
+    if( index != _count ) {
+        log_e("Image has %d blocks, %d are listed", index, _count);
+        _failed = true;
+        return false;
+    }
+    _finished = true;
+    return true;
+}
+
+
+bool FOTABlockHashes::check( size_t index, const uint8_t* data, size_t len )
+{
+    if( !_hashes || index >= _count ) return false;
+    uint8_t digest[32];
+    if( !_digest.begin() ) return false;
+    _digest.update( data, len );
+    return _digest.finish( digest ) && compareBlock( index, digest );
+}
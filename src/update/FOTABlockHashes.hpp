@@ -0,0 +1,65 @@
+/*
+   esp32 firmware OTA
+   Per-block verification of an image ("blocks" manifest key).
+
+   The block hash list holds the sha256 of every block_size bytes of the
+   unpacked image, the last block being shorter if needed. When signature
+   checking is enabled the list is signed like an image (signature header
+   followed by the digests), so checking the list signature once vouches
+   for every block, and each block is verified as soon as it was received.
+
+   A mismatching block fails the update right away, unless it can be
+   re-fetched later with a Range request: uncompressed images only, and
+   not the first nor the last block, which the Update library still holds
+   in its buffers at the end of the stream.
+*/
+
+#pragma once
+
+#include "FOTAUpdateAgent.hpp"
+
+#define FOTA_BLOCKS_DEFAULT_SIZE 4096 // must be a multiple of the flash sector size
+#define FOTA_BLOCKS_MAX_REFETCH  8    // give up when more blocks than this are corrupted
+
+
+class FOTABlockHashes
+{
+public:
+  // 'hashes' holds 'count' sha256 digests and must outlive the update
+  bool begin( const uint8_t* hashes, size_t count, size_t block_size );
+  void end() { _hashes = nullptr; }
+  // corrupted blocks can be fetched again (uncompressed images from servers accepting ranges)
+  void refetch( bool enable ) { _refetch = enable; }
+  bool active() { return _hashes != nullptr; }
+
+  // image data, in order: false when a block doesn't match and can't be re-fetched
+  bool update( const uint8_t* data, size_t len );
+  // checks the last block and the block count, false if the image is incomplete or corrupted
+  bool finish();
+
+  // blocks waiting for a re-fetch, see check() and repaired()
+  size_t pending() { return _bad_count; }
+  size_t pendingBlock( size_t i ) { return _bad[i]; }
+  size_t blockSize() { return _block_size; }
+  size_t blockLength( size_t index ) { return std::min( _block_size, _written - index * _block_size ); }
+  // compare a re-fetched block with its digest
+  bool check( size_t index, const uint8_t* data, size_t len );
+  void repaired() { _bad_count = 0; }
+
+  // every block was received and matched, the image doesn't need to be read back
+  bool complete() { return _hashes && _finished && !_failed && _bad_count == 0; }
+
+private:
+  bool compareBlock( size_t index, const uint8_t* digest );
+
+  FOTASha256Digest _digest;
+  const uint8_t* _hashes = nullptr;
+  size_t _count = 0;
+  size_t _block_size = FOTA_BLOCKS_DEFAULT_SIZE;
+  size_t _written = 0;   // image bytes received
+  size_t _bad[FOTA_BLOCKS_MAX_REFETCH];
+  size_t _bad_count = 0;
+  bool   _refetch = false;
+  bool   _finished = false;
+  bool   _failed = false;
+};
@@ -0,0 +1,140 @@
+/*
+   esp32 firmware OTA
+   Raw data partition writer, see FOTAPartitionAgent.hpp
+*/
+
+#include "FOTAPartitionAgent.hpp"
+
+// arduino-esp32 core 2.x => 3.x migration
+#if !defined SPI_FLASH_SEC_SIZE
+  #include "spi_flash_mmap.h"
+#endif
+
+#define FOTA_PARTITION_STREAM_CHUNK 512
+
+
+bool FOTAPartitionAgent::writable( const esp_partition_t* partition )
+{
+    if( !partition || partition->type != ESP_PARTITION_TYPE_DATA ) return false;
+    switch( partition->subtype ) {
+        case ESP_PARTITION_SUBTYPE_DATA_OTA:
+        case ESP_PARTITION_SUBTYPE_DATA_PHY:
+        case ESP_PARTITION_SUBTYPE_DATA_NVS:
+        case ESP_PARTITION_SUBTYPE_DATA_NVS_KEYS:
+        case ESP_PARTITION_SUBTYPE_DATA_EFUSE_EM:
+            return false;
+        default:
+            return true;
+    }
+}
+
+
+const esp_partition_t* FOTAPartitionAgent::find( const char* label )
+{
+    return esp_partition_find_first( ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label );
+}
+
+
+bool FOTAPartitionAgent::begin( size_t size, int /*partition*/, const char* codec )
+{
+    _written = _erased = 0;
+    _finished = false;
+    _error = UPDATE_ERROR_OK;
+    if( codec ) {
+        log_e("%s compressed images can't be written to data partitions, use lz4 or heatshrink compression", codec);
+        _error = UPDATE_ERROR_BAD_ARGUMENT;
+        return false;
+    }
+    if( !writable( _partition ) ) {
+        log_e("Partition can't be updated");
+        _error = UPDATE_ERROR_BAD_ARGUMENT;
+        return false;
+    }
+    if( size != UPDATE_SIZE_UNKNOWN && size > _partition->size ) {
+        log_e("Image (%d bytes) doesn't fit partition %s (%d bytes)", size, _partition->label, _partition->size);
+        _error = UPDATE_ERROR_SIZE;
+        return false;
+    }
+    _size = size;
+    return true;
+}
+
+
+size_t FOTAPartitionAgent::write( const uint8_t* data, size_t len )
+{
+    if( _error ) return 0;
+    size_t max = _size == UPDATE_SIZE_UNKNOWN ? _partition->size : _size;
+    if( _written + len > max ) {
+        log_e("Image exceeds %d bytes", max);
+        _error = UPDATE_ERROR_SPACE;
+        return 0;
+    }
+    // erase the sectors this write reaches, the rest of the partition is left untouched
+    if( _written + len > _erased ) {
+        size_t erase = ( ( _written + len - _erased + SPI_FLASH_SEC_SIZE - 1 ) / SPI_FLASH_SEC_SIZE ) * SPI_FLASH_SEC_SIZE;
+        erase = std::min( erase, (size_t)_partition->size - _erased );
+        if( esp_partition_erase_range( _partition, _erased, erase ) != ESP_OK ) {
+            log_e("Erase failed at offset %d", _erased);
+            _error = UPDATE_ERROR_ERASE;
+            return 0;
+        }
+        _erased += erase;
+    }
+    if( esp_partition_write( _partition, _written, data, len ) != ESP_OK ) {
+        log_e("Write failed at offset %d", _written);
+        _error = UPDATE_ERROR_WRITE;
+        return 0;
+    }
+    _written += len;
+    if( _progress ) _progress( _written, _size == UPDATE_SIZE_UNKNOWN ? _partition->size : _size );
+    return len;
+}
+
+
+size_t FOTAPartitionAgent::writeStream( Stream& stream, size_t size )
+{
+    FOTAArena heap; // not begun: plain heap
+    FOTAArena& arena = _arena ? *_arena : heap;
+    uint8_t* buffer = (uint8_t*)arena.alloc( FOTA_PARTITION_STREAM_CHUNK );
+    if( !buffer ) {
+        _error = UPDATE_ERROR_SPACE;
+        return 0;
+    }
+    size_t total = 0;
+    while( total < size ) {
+        size_t len = stream.readBytes( buffer, std::min( size - total, (size_t)FOTA_PARTITION_STREAM_CHUNK ) );
+        if( len == 0 ) {
+            _error = UPDATE_ERROR_STREAM;
+            break;
+        }
+        if( write( buffer, len ) != len ) break;
+        total += len;
+    }
+    arena.free( buffer );
+    return total;
+}
+
+
+bool FOTAPartitionAgent::end( bool evenIfRemaining )
+{
+    if( _error ) return false;
+    if( _size != UPDATE_SIZE_UNKNOWN && _written != _size && !evenIfRemaining ) {
+        log_e("Premature end: %d/%d bytes", _written, _size);
+        _error = UPDATE_ERROR_SIZE;
+        return false;
+    }
+    _finished = true;
+    return true;
+}
+
+
+// also after end(), when the sha256 of the partition doesn't match
+void FOTAPartitionAgent::abort()
+{
+    if( _erased && esp_partition_erase_range( _partition, 0, _partition->size ) != ESP_OK ) {
+        log_e("Unable to erase partition %s", _partition->label);
+    }
+    _erased = _written = 0;
+    _finished = false;
+    _error = UPDATE_ERROR_ABORT;
+}
@@ -0,0 +1,58 @@
+/*
+   esp32 firmware OTA
+   Raw data partition writer.
+
+   The Update library only handles app and SPIFFS/FAT partitions, this agent
+   writes any data partition found by label (e.g. ML models, calibration
+   tables), erasing flash sectors just ahead of the data. abort() erases the
+   whole partition once it was touched, e.g. after a failed download or sha256
+   check, rather than leaving a partial image. Only esp_partition_* calls
+   touch the flash, see tools/host/partition_test.cpp for a host build over
+   file-backed partitions.
+*/
+
+#pragma once
+
+#include "FOTAUpdateAgent.hpp"
+#include <esp_partition.h>
+#include "../memory/FOTAArena.hpp"
+
+#define U_FOTA_PARTITION 1000 // execOTA() partition number of named data partitions, next to U_FLASH/U_SPIFFS
+
+
+class FOTAPartitionAgent : public FOTAAgent
+{
+public:
+  // writeStream() takes its buffer from the arena (heap when nullptr or disabled)
+  FOTAPartitionAgent( const esp_partition_t* partition, FOTAArena* arena = nullptr ) : _partition(partition), _arena(arena) { }
+
+  // data partitions, except the ones holding system data (nvs, otadata, phy, ...)
+  static bool writable( const esp_partition_t* partition );
+  static const esp_partition_t* find( const char* label );
+
+  const char* compression() { return "none"; }
+  bool supports( const char* /*codec*/ ) { return false; }
+  const char* detect( Stream* /*stream*/, const String& /*url*/ ) { return nullptr; }
+
+  bool    begin( size_t size, int partition, const char* codec );
+  size_t  write( const uint8_t* data, size_t len );
+  size_t  writeStream( Stream& stream, size_t size );
+  bool    end( bool evenIfRemaining );
+  void    abort();
+  bool    isFinished() { return _finished; }
+  uint8_t getError() { return _error; }
+  void    onProgress( progress_cb fn ) { _progress = fn; }
+  bool    digest( uint8_t* /*sha256*/ ) { return false; }
+
+  size_t  written() { return _written; }
+
+private:
+  const esp_partition_t* _partition;
+  FOTAArena* _arena;
+  progress_cb _progress;
+  size_t  _size = 0;     // UPDATE_SIZE_UNKNOWN: up to the partition size
+  size_t  _written = 0;
+  size_t  _erased = 0;   // bytes erased from the partition start
+  uint8_t _error = 0;    // UPDATE_ERROR_* codes of the Update library
+  bool    _finished = false;
+};
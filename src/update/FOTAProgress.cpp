@@ -0,0 +1,92 @@
+/*
+   esp32 firmware OTA
+   Rate-limited progress reports, see FOTAProgress.hpp
+*/
+
+#include "FOTAProgress.hpp"
+#include <Update.h>
+
+
+void FOTAProgress::begin( size_t total )
+{
+    _info = FOTAProgressInfo {};
+    _info.total   = total;
+    _info.percent = total == UPDATE_SIZE_UNKNOWN ? -1 : 0;
+    _info.eta     = -1;
+    _started = _sampled = _reported = millis();
+    _sample_bytes = 0;
+    _reported_percent = -1;
+    _active = true;
+    send( _started ); // 0%
+}
+
+
+void FOTAProgress::sample( uint32_t now )
+{
+    uint32_t dt = now - _sampled;
+    if( dt < FOTA_PROGRESS_SAMPLE_MS ) return;
+    uint32_t rate = (uint64_t)( _info.bytes - _sample_bytes ) * 1000 / dt;
+    if( _sample_bytes == 0 ) _info.rate = rate; // first sample
+    else _info.rate = ( (uint64_t)rate * FOTA_PROGRESS_SMOOTHING + (uint64_t)_info.rate * ( 10 - FOTA_PROGRESS_SMOOTHING ) ) / 10;
+    _sampled = now;
+    _sample_bytes = _info.bytes;
+}
+
+
+void FOTAProgress::update( size_t bytes )
+{
+    if( !_active ) return;
+    uint32_t now = millis();
+    _info.bytes = bytes;
+    sample( now );
+
+    bool due = _interval == 0 && _step == 0;
+    if( _interval && now - _reported >= _interval ) due = true;
+    if( _info.total != UPDATE_SIZE_UNKNOWN && _info.total > 0 ) {
+        _info.percent = (uint64_t)std::min( bytes, _info.total ) * 100 / _info.total;
+        if( _step && _info.percent >= _reported_percent + _step && _info.percent < 100 ) due = true; // finish() reports 100%
+    }
+    if( due ) send( now );
+}
+
+
+void FOTAProgress::finish()
+{
+    if( !_active ) return;
+    uint32_t now = millis();
+    _info.done = true;
+    if( _info.total != UPDATE_SIZE_UNKNOWN ) _info.percent = 100;
+    if( now != _started ) _info.rate = (uint64_t)_info.bytes * 1000 / ( now - _started ); // exact average
+    send( now );
+    _active = false;
+}
+
+
+void FOTAProgress::send( uint32_t now )
+{
+    _info.elapsed = now - _started;
+    uint32_t rate = _cap ? std::min( _info.rate, _cap ) : _info.rate;
+    if( _info.done ) {
+        _info.eta = 0;
+    } else if( _info.total != UPDATE_SIZE_UNKNOWN && rate > 0 ) {
+        _info.eta = ( _info.total - std::min( _info.bytes, _info.total ) + rate - 1 ) / rate;
+    } else {
+        _info.eta = -1;
+    }
+    _reported = now;
+    _reported_percent = _info.percent;
+    if( _report ) _report( _info );
+}
+
+
+void FOTAProgress::print( const FOTAProgressInfo& info )
+{
+    if( info.percent >= 0 ) {
+        Serial.printf("OTA %3d%% %u/%u bytes, %u KB/s", info.percent, info.bytes, info.total, info.rate / 1024);
+    } else {
+        Serial.printf("OTA %u bytes, %u KB/s", info.bytes, info.rate / 1024);
+    }
+    if( info.done ) Serial.printf(", done in %u s\n", info.elapsed / 1000);
+    else if( info.eta >= 0 ) Serial.printf(", ETA %d s\n", info.eta);
+    else Serial.println();
+}
@@ -0,0 +1,71 @@
+/*
+   esp32 firmware OTA
+   Rate-limited progress reports (cfg.progress_interval, cfg.progress_step).
+
+   Update agents call their progress callback for every chunk they write,
+   printing or drawing that often slows fast downloads down. This layer
+   counts the downloaded bytes and only reports every 'interval' ms or
+   'step' percent, whichever comes first, with a smoothed throughput
+   (EWMA of FOTA_PROGRESS_SAMPLE_MS samples) and an ETA.
+
+   Compressed or chunked images may not have a known size: percent and
+   ETA are then -1, bytes and throughput are still reported. The ETA
+   never assumes more than the bandwidth cap (cfg.rate_limit).
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+
+#define FOTA_PROGRESS_SAMPLE_MS 250 // throughput sampling period
+#define FOTA_PROGRESS_SMOOTHING 3   // weight of a new sample, in tenths
+
+
+struct FOTAProgressInfo
+{
+  size_t   bytes;   // downloaded so far
+  size_t   total;   // UPDATE_SIZE_UNKNOWN (0xFFFFFFFF) when the size isn't known
+  int8_t   percent; // -1 when the size isn't known
+  uint32_t rate;    // bytes per second, smoothed
+  int32_t  eta;     // seconds left, -1 when unknown
+  uint32_t elapsed; // ms since the download started
+  bool     done;
+};
+
+
+class FOTAProgress
+{
+public:
+  typedef std::function<void(const FOTAProgressInfo&)> report_cb;
+
+  void onReport( report_cb fn ) { _report = fn; }
+  // report every 'interval' ms and/or every 'step' percent, both 0 = every update
+  void setPolicy( uint32_t interval, uint8_t step ) { _interval = interval; _step = step; }
+  // bytes per second, ETAs don't assume more (0 = no cap)
+  void setRateCap( uint32_t rate ) { _cap = rate; }
+
+  void begin( size_t total );
+  void update( size_t bytes ); // bytes downloaded since begin()
+  void finish();               // final report, once
+  const FOTAProgressInfo& info() { return _info; }
+
+  // default report: one line on Serial
+  static void print( const FOTAProgressInfo& info );
+
+private:
+  report_cb        _report;
+  FOTAProgressInfo _info {};
+  uint32_t _interval = 1000;
+  uint8_t  _step = 0;
+  uint32_t _cap = 0;
+  uint32_t _started = 0;
+  uint32_t _sampled = 0;     // time of the last throughput sample
+  size_t   _sample_bytes = 0;
+  uint32_t _reported = 0;    // time of the last report
+  int8_t   _reported_percent = -1;
+  bool     _active = false;
+
+  void sample( uint32_t now );
+  void send( uint32_t now );
+};
@@ -0,0 +1,328 @@
+/*
+   esp32 firmware OTA
+   Serial link sink, see FOTASerialWriter.hpp
+*/
+
+#include "FOTASerialWriter.hpp"
+
+#define FOTA_SERIAL_SOF1  0xA5
+#define FOTA_SERIAL_SOF2  0x5A
+#define FOTA_SERIAL_CHUNK 512 // writeStream() buffer
+
+
+static inline uint32_t get_le32( const uint8_t* p )
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static inline void put_le32( uint8_t* p, uint32_t v )
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+
+void FOTASerialWriter::release()
+{
+    if( _slots ) free( _slots );
+    _slots = nullptr;
+}
+
+
+bool FOTASerialWriter::fail( uint8_t error )
+{
+    if( _port && _slots ) sendFrame( FOTA_SERIAL_FRAME_ABORT, _base, nullptr, 0 );
+    release();
+    _error = error;
+    return false;
+}
+
+
+bool FOTASerialWriter::begin( size_t size, int partition )
+{
+    release();
+    _base = _next = _fill = _sacked = _written = _retransmits = 0;
+    _rx_pos   = 0;
+    _finished = _ended = _fin = false;
+    _error    = UPDATE_ERROR_OK;
+
+    if( !_port ) {
+        log_e("No serial port, see setPort()");
+        return fail( UPDATE_ERROR_STREAM );
+    }
+    if( size == UPDATE_SIZE_UNKNOWN || size == 0 ) {
+        log_e("Serial devices need the image size first");
+        return fail( UPDATE_ERROR_SIZE );
+    }
+    _size = size;
+    uint8_t target = partition == U_SPIFFS ? FOTA_SERIAL_TARGET_FILESYSTEM : FOTA_SERIAL_TARGET_FIRMWARE;
+
+    // the device asks for an image, with its window and frame size
+    uint8_t type;
+    uint32_t seq;
+    const uint8_t* payload;
+    uint16_t len;
+    uint32_t start = millis();
+    bool requested = false;
+    while( !requested ) {
+        if( millis() - start > _timeout ) {
+            log_e("No request from the serial device");
+            return fail( UPDATE_ERROR_STREAM );
+        }
+        while( !requested && _port->available() > 0 ) {
+            int c = _port->read();
+            if( c < 0 || !receive( c, type, seq, payload, len ) ) continue;
+            if( type != FOTA_SERIAL_FRAME_REQ || len < 4 ) continue;
+            if( payload[0] != target ) {
+                log_w("Serial device requested target %d, sending %d", payload[0], target);
+                sendFrame( FOTA_SERIAL_FRAME_ABORT, 0, nullptr, 0 );
+                continue;
+            }
+            _window      = std::max( (uint8_t)1, std::min( payload[1], (uint8_t)32 ) ); // one bit per frame in the ACK bitmap
+            _max_payload = std::max( (uint16_t)( payload[2] | (payload[3] << 8) ), (uint16_t)16 );
+            requested    = true;
+        }
+        if( !requested ) vTaskDelay(1);
+    }
+
+    _slots = (uint8_t*)malloc( _window * _max_payload );
+    if( !_slots ) {
+        log_e("Unable to allocate %d bytes for the serial window", _window * _max_payload);
+        _error = UPDATE_ERROR_SPACE;
+        return false;
+    }
+    _frames = ( _size + _max_payload - 1 ) / _max_payload;
+
+    // OPEN until acknowledged
+    uint8_t open[4];
+    put_le32( open, _size );
+    start = millis();
+    uint32_t last_open = 0;
+    _last_rx = 0;
+    while( _last_rx == 0 ) {
+        if( millis() - start > _timeout ) {
+            log_e("Serial device didn't acknowledge OPEN");
+            return fail( UPDATE_ERROR_STREAM );
+        }
+        if( last_open == 0 || millis() - last_open >= FOTA_SERIAL_RTO ) {
+            sendFrame( FOTA_SERIAL_FRAME_OPEN, 0, open, sizeof(open) );
+            last_open = millis();
+        }
+        if( !poll() ) return false;
+        if( _last_rx == 0 ) vTaskDelay(1);
+    }
+    _last_progress = millis();
+    log_d("Serial image: %d bytes in %d frames (window=%d)", _size, _frames, _window);
+    return true;
+}
+
+
+// Parses one byte, returns true when it completes a valid frame (payload points to the receive buffer)
+bool FOTASerialWriter::receive( uint8_t c, uint8_t& type, uint32_t& seq, const uint8_t*& payload, uint16_t& len )
+{
+    if( _rx_pos == 0 && c != FOTA_SERIAL_SOF1 ) return false;
+    if( _rx_pos == 1 && c != FOTA_SERIAL_SOF2 ) {
+        _rx_pos = c == FOTA_SERIAL_SOF1 ? 1 : 0;
+        return false;
+    }
+    _rx[_rx_pos++] = c;
+    if( _rx_pos < 9 ) return false;
+    len = _rx[7] | (_rx[8] << 8);
+    if( 13u + len > sizeof(_rx) ) { // not a device frame, resync
+        _rx_pos = 0;
+        return false;
+    }
+    if( _rx_pos < 13u + len ) return false;
+    _rx_pos = 0;
+    if( fota_crc32( 0, &_rx[2], 7 + len ) != get_le32( &_rx[9 + len] ) ) {
+        log_v("Dropping frame with bad CRC");
+        return false;
+    }
+    type    = _rx[2];
+    seq     = get_le32( &_rx[3] );
+    payload = &_rx[9];
+    return true;
+}
+
+
+bool FOTASerialWriter::poll()
+{
+    uint8_t type;
+    uint32_t seq;
+    const uint8_t* payload;
+    uint16_t len;
+    while( _port->available() > 0 ) {
+        int c = _port->read();
+        if( c < 0 ) break;
+        if( !receive( c, type, seq, payload, len ) ) continue;
+        _last_rx = millis();
+        switch( type ) {
+            case FOTA_SERIAL_FRAME_ACK:
+                if( len >= 5 ) onAck( seq, get_le32( payload ) );
+            break;
+            case FOTA_SERIAL_FRAME_FIN:
+                _fin = true;
+            break;
+            case FOTA_SERIAL_FRAME_ABORT:
+                log_e("Serial device aborted at frame %d", seq);
+                release(); // no ABORT back
+                _error = UPDATE_ERROR_ABORT;
+                return false;
+            default: // repeated REQ
+            break;
+        }
+    }
+    return true;
+}
+
+
+void FOTASerialWriter::onAck( uint32_t seq, uint32_t sack )
+{
+    if( seq < _base ) return; // late ACK
+    uint32_t now = millis();
+    if( seq > _base || __builtin_popcount( sack ) > __builtin_popcount( _sacked ) ) _last_progress = now;
+    _base   = std::min( seq, _next );
+    _sacked = sack;
+
+    // a hole is reported when a later frame arrives, a frame missing from an ACK
+    // sent long after it was transmitted is lost too (tail loss)
+    uint32_t highest = _sacked ? _base + 31 - __builtin_clz( _sacked ) : _base;
+    for( uint32_t s = _base; s < _next; s++ ) {
+        if( s - _base < 32 && ( _sacked >> ( s - _base ) & 1 ) ) continue;
+        uint32_t age = now - _sent_at[s % _window];
+        if( ( s < highest && age > FOTA_SERIAL_HOLE_GAP ) || age > FOTA_SERIAL_TAIL_GAP ) {
+            transmit( s );
+            _retransmits++;
+        }
+    }
+}
+
+
+bool FOTASerialWriter::wait( uint32_t frames )
+{
+    while( _base < frames ) {
+        if( !poll() ) return false;
+        uint32_t now = millis();
+        if( now - _last_progress > FOTA_SERIAL_RTO ) {
+            // nothing moved: send everything outstanding again
+            for( uint32_t s = _base; s < _next; s++ ) {
+                if( s - _base < 32 && ( _sacked >> ( s - _base ) & 1 ) ) continue;
+                transmit( s );
+                _retransmits++;
+            }
+            _last_progress = now;
+        }
+        if( now - _last_rx > _timeout ) {
+            log_e("Serial device stopped answering");
+            return fail( UPDATE_ERROR_STREAM );
+        }
+        if( _base < frames ) vTaskDelay(1);
+    }
+    return true;
+}
+
+
+void FOTASerialWriter::transmit( uint32_t seq )
+{
+    sendFrame( FOTA_SERIAL_FRAME_DATA, seq, &_slots[(seq % _window) * _max_payload], frameLength( seq ) );
+    _sent_at[seq % _window] = millis();
+}
+
+
+void FOTASerialWriter::sendFrame( uint8_t type, uint32_t seq, const uint8_t* payload, uint16_t len )
+{
+    uint8_t header[9] = { FOTA_SERIAL_SOF1, FOTA_SERIAL_SOF2, type, 0, 0, 0, 0, (uint8_t)(len & 0xff), (uint8_t)(len >> 8) };
+    put_le32( &header[3], seq );
+    uint8_t crc[4];
+    uint32_t c = fota_crc32( 0, &header[2], sizeof(header)-2 );
+    put_le32( crc, fota_crc32( c, payload, len ) );
+    _port->write( header, sizeof(header) );
+    if( len ) _port->write( payload, len );
+    _port->write( crc, sizeof(crc) );
+}
+
+
+size_t FOTASerialWriter::write( const uint8_t* data, size_t len )
+{
+    if( _error || !_slots ) return 0;
+    if( _written + len > _size ) {
+        log_e("Image exceeds %d bytes", _size);
+        fail( UPDATE_ERROR_SPACE );
+        return 0;
+    }
+    size_t total = 0;
+    while( total < len ) {
+        // the slot of _next is free once the device consumed frame _next - window
+        if( !wait( _next + 1 > _window ? _next + 1 - _window : 0 ) ) return total;
+        size_t n = std::min( len - total, (size_t)( frameLength( _next ) - _fill ) );
+        memcpy( &_slots[(_next % _window) * _max_payload + _fill], data + total, n );
+        _fill    += n;
+        _written += n;
+        total    += n;
+        // the last frame is held back until commit(): the device can't finish an unverified image
+        if( _fill == frameLength( _next ) && _next + 1 < _frames ) {
+            transmit( _next++ );
+            _fill = 0;
+        }
+    }
+    if( !poll() ) return 0;
+    if( _progress ) _progress( _written, _size );
+    return total;
+}
+
+
+size_t FOTASerialWriter::writeStream( Stream& stream )
+{
+    uint8_t chunk[FOTA_SERIAL_CHUNK];
+    size_t total = 0;
+    while( _written < _size ) {
+        size_t n = stream.readBytes( chunk, std::min( sizeof(chunk), (size_t)( _size - _written ) ) );
+        if( n == 0 ) break;
+        if( write( chunk, n ) != n ) break;
+        total += n;
+    }
+    return total;
+}
+
+
+bool FOTASerialWriter::end( bool /*evenIfRemaining*/ )
+{
+    if( _error || !_slots ) return false;
+    if( _written != _size ) { // the device expects the announced size
+        log_e("Premature end: %d/%d bytes", _written, _size);
+        return fail( UPDATE_ERROR_SIZE );
+    }
+    // every frame but the last one is consumed, the device waits for it
+    if( !wait( _next ) ) return false;
+    _ended = true;
+    return true;
+}
+
+
+bool FOTASerialWriter::commit()
+{
+    if( _error || !_ended ) return false;
+    _ended = false;
+    transmit( _next++ );
+    if( !wait( _frames ) ) return false;
+    // FIN follows the last ACK
+    uint32_t start = millis();
+    while( !_fin && millis() - start < 1000 ) {
+        if( !poll() ) return false;
+        if( !_fin ) vTaskDelay(1);
+    }
+    if( !_fin ) log_w("No FIN from the serial device");
+    log_d("%d bytes sent, %d frames retransmitted", _size, _retransmits);
+    release();
+    _finished = true;
+    return true;
+}
+
+
+// also after end(): the device still waits for the last frame and gets ABORT instead
+void FOTASerialWriter::abort()
+{
+    if( _slots ) fail( UPDATE_ERROR_ABORT );
+    _finished = _ended = false;
+    _error = UPDATE_ERROR_ABORT;
+}
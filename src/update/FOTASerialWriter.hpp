@@ -0,0 +1,97 @@
+/*
+   esp32 firmware OTA
+   Update sink: a device on a serial port (host side of FOTA_SERIAL_STREAM).
+
+   A gateway forwards the image it downloads to an MCU running esp32FOTA
+   with setSerialPort(): the writer waits for the device REQ frame, answers
+   OPEN with the image size, then sends DATA frames with the selective
+   repeat rules of tools/serial_fota.py. write() blocks while the device
+   window is full, so the device flash speed paces the transfer.
+
+   The protocol announces the size first: images of unknown size (chunked
+   transfers) can't be forwarded. The last DATA frame is held back: end()
+   returns once the device consumed the others, commit() sends it and waits
+   for FIN, abort() sends ABORT instead and the device discards the image.
+   The device waits for that frame up to its stream timeout, while the
+   gateway checks the signature. The device also checks the signature on
+   its own.
+
+     static FOTASerialSink mcu;
+     mcu.writer().setPort( &Serial2 );
+*/
+
+#pragma once
+
+#include "FOTAUpdateAgent.hpp"
+#include "../streams/SerialFrameStream.hpp"
+
+#define FOTA_SERIAL_HOLE_GAP 20  // ms, a frame missing from an ACK when a later one arrived is lost
+#define FOTA_SERIAL_TAIL_GAP 100 // ms, a frame missing from an ACK sent long after it is lost too
+#define FOTA_SERIAL_RTO      300 // ms without progress before every outstanding frame is sent again
+
+
+// Writer policy: serial link
+class FOTASerialWriter
+{
+public:
+  static constexpr bool flash = false;
+
+  ~FOTASerialWriter() { release(); }
+
+  // timeout: wait for the device request, and longest silence of the device during the transfer
+  void setPort( Stream* port, uint32_t timeout = 10000 ) { _port = port; _timeout = timeout; }
+
+  bool   begin( size_t size, int partition );
+  size_t write( const uint8_t* data, size_t len );
+  size_t writeStream( Stream& stream );
+  bool   end( bool evenIfRemaining ); // every frame but the last one delivered
+  bool   commit();                     // last frame, then FIN
+  void   abort();                      // ABORT frame, until commit()
+  bool   isFinished() { return _finished; }
+  uint8_t getError() { return _error; }
+  void   onProgress( FOTAAgent::progress_cb fn ) { _progress = fn; }
+
+  uint32_t retransmits() { return _retransmits; }
+
+private:
+  Stream*  _port = nullptr;
+  uint32_t _timeout = 10000;
+  FOTAAgent::progress_cb _progress;
+
+  // frame #n lives in slot n % window until the device consumed it
+  uint8_t* _slots = nullptr;
+  uint32_t _sent_at[32];         // ms, last transmission of each slot
+  uint8_t  _window = FOTA_SERIAL_WINDOW;
+  uint16_t _max_payload = FOTA_SERIAL_MAX_PAYLOAD;
+  uint32_t _size = 0;
+  uint32_t _frames = 0;
+  uint32_t _base = 0;            // first frame not consumed by the device
+  uint32_t _next = 0;            // next frame to fill
+  uint16_t _fill = 0;            // bytes in the slot of _next
+  uint32_t _sacked = 0;          // bitmap of the frames buffered by the device from _base
+  uint32_t _written = 0;
+  uint32_t _last_rx = 0;
+  uint32_t _last_progress = 0;
+  uint32_t _retransmits = 0;
+  uint8_t  _error = 0;           // UPDATE_ERROR_* codes of the Update library
+  bool     _finished = false;
+  bool     _ended = false;       // the last frame waits for commit()
+  bool     _fin = false;         // device sent FIN
+
+  // receiver state, device frames are small (REQ, ACK, FIN, ABORT)
+  uint8_t  _rx[24];
+  uint8_t  _rx_pos = 0;
+
+  void release();
+  bool poll();                   // handles incoming frames, false when the device aborted
+  bool receive( uint8_t c, uint8_t& type, uint32_t& seq, const uint8_t*& payload, uint16_t& len );
+  void onAck( uint32_t seq, uint32_t sack );
+  void sendFrame( uint8_t type, uint32_t seq, const uint8_t* payload, uint16_t len );
+  void transmit( uint32_t seq );
+  uint16_t frameLength( uint32_t seq ) { return std::min( (uint32_t)_max_payload, _size - seq * _max_payload ); }
+  bool wait( uint32_t frames );  // until the device consumed up to 'frames'
+  bool fail( uint8_t error );
+};
+
+
+typedef FOTAUpdateAgent<FOTASerialWriter, FOTANoInflate, FOTASha256Digest> FOTASerialSink;
@@ -0,0 +1,212 @@
+/*
+   esp32 firmware OTA
+   Update sinks, see FOTASinks.hpp
+*/
+
+#include "FOTASinks.hpp"
+
+#define FOTA_SINK_CHUNK 512 // writeStream() buffer
+
+
+void FOTAFileWriter::setFile( fs::FS& fs, const char* path, const char* fs_path )
+{
+    _fs       = &fs;
+    _app_path = path ? path : "";
+    _fs_path  = fs_path ? fs_path : "";
+}
+
+
+bool FOTAFileWriter::begin( size_t size, int partition )
+{
+    _written  = 0;
+    _size     = size;
+    _ended    = _finished = false;
+    _error    = UPDATE_ERROR_OK;
+    _path     = partition == U_SPIFFS ? _fs_path : partition == U_FLASH ? _app_path : "";
+
+    if( !_fs || _path.isEmpty() ) {
+        log_e("No file for partition %d, see setFile()", partition);
+        _error = UPDATE_ERROR_NO_PARTITION;
+        return false;
+    }
+    _file = _fs->open( partPath(), FILE_WRITE );
+    if( !_file ) {
+        log_e("Unable to create %s", partPath().c_str());
+        _error = UPDATE_ERROR_WRITE;
+        return false;
+    }
+    log_d("Writing %s", _path.c_str());
+    return true;
+}
+
+
+size_t FOTAFileWriter::write( const uint8_t* data, size_t len )
+{
+    if( _error || !_file ) return 0;
+    if( _size != UPDATE_SIZE_UNKNOWN && _written + len > _size ) {
+        log_e("Image exceeds %d bytes", _size);
+        _error = UPDATE_ERROR_SPACE;
+        return 0;
+    }
+    size_t written = _file.write( data, len );
+    _written += written;
+    if( written != len ) {
+        log_e("Write failed at offset %d (file system full?)", _written);
+        _error = UPDATE_ERROR_WRITE;
+    }
+    if( _progress ) _progress( _written, _size );
+    return written;
+}
+
+
+size_t FOTAFileWriter::writeStream( Stream& stream )
+{
+    uint8_t chunk[FOTA_SINK_CHUNK];
+    size_t total = 0;
+    while( _size == UPDATE_SIZE_UNKNOWN || _written < _size ) {
+        size_t want = sizeof(chunk);
+        if( _size != UPDATE_SIZE_UNKNOWN ) want = std::min( want, _size - _written );
+        size_t n = stream.readBytes( chunk, want );
+        if( n == 0 ) break;
+        if( write( chunk, n ) != n ) break;
+        total += n;
+    }
+    return total;
+}
+
+
+bool FOTAFileWriter::end( bool evenIfRemaining )
+{
+    if( _error || !_file ) return false;
+    if( _size != UPDATE_SIZE_UNKNOWN && _written != _size && !evenIfRemaining ) {
+        log_e("Premature end: %d/%d bytes", _written, _size);
+        abort();
+        _error = UPDATE_ERROR_SIZE;
+        return false;
+    }
+    _file.close();
+    _ended = true;
+    return true;
+}
+
+
+// the previous file is only replaced once the new one was verified
+bool FOTAFileWriter::commit()
+{
+    if( _error || !_ended ) return false;
+    _ended = false;
+    if( _fs->exists( _path.c_str() ) ) _fs->remove( _path.c_str() );
+    if( !_fs->rename( partPath().c_str(), _path.c_str() ) ) {
+        log_e("Unable to rename %s", partPath().c_str());
+        _fs->remove( partPath().c_str() );
+        _error = UPDATE_ERROR_WRITE;
+        return false;
+    }
+    _finished = true;
+    return true;
+}
+
+
+void FOTAFileWriter::abort()
+{
+    if( _file ) _file.close();
+    if( _fs && !_path.isEmpty() && !_finished ) _fs->remove( partPath().c_str() );
+    _ended = _finished = false;
+    _error = UPDATE_ERROR_ABORT;
+}
+
+
+void FOTAMemoryWriter::setBuffer( uint8_t* buffer, size_t capacity )
+{
+    if( _owned ) free( _data );
+    _data     = buffer;
+    _capacity = buffer ? capacity : 0;
+    _owned    = buffer == nullptr;
+    _len      = 0;
+}
+
+
+bool FOTAMemoryWriter::reserve( size_t capacity )
+{
+    if( capacity <= _capacity ) return true;
+    if( !_owned || ( _max && capacity > _max ) ) return false;
+    uint8_t* data = (uint8_t*)realloc( _data, capacity );
+    if( !data ) return false;
+    _data     = data;
+    _capacity = capacity;
+    return true;
+}
+
+
+bool FOTAMemoryWriter::begin( size_t size, int partition )
+{
+    _len       = 0;
+    _size      = size;
+    _partition = partition;
+    _finished  = false;
+    _error     = UPDATE_ERROR_OK;
+    // size hint: one allocation when the size is known
+    if( size != UPDATE_SIZE_UNKNOWN && !reserve( size ) ) {
+        log_e("No room for %d bytes", size);
+        _error = UPDATE_ERROR_SPACE;
+        return false;
+    }
+    return true;
+}
+
+
+size_t FOTAMemoryWriter::write( const uint8_t* data, size_t len )
+{
+    if( _error ) return 0;
+    if( _size != UPDATE_SIZE_UNKNOWN && _len + len > _size ) {
+        log_e("Image exceeds %d bytes", _size);
+        _error = UPDATE_ERROR_SPACE;
+        return 0;
+    }
+    if( _len + len > _capacity && !reserve( std::max( _len + len, _capacity * 2 ) ) && !reserve( _len + len ) ) {
+        log_e("No room for %d more bytes", len);
+        _error = UPDATE_ERROR_SPACE;
+        return 0;
+    }
+    memcpy( _data + _len, data, len );
+    _len += len;
+    if( _progress ) _progress( _len, _size );
+    return len;
+}
+
+
+size_t FOTAMemoryWriter::writeStream( Stream& stream )
+{
+    uint8_t chunk[FOTA_SINK_CHUNK];
+    size_t total = 0;
+    while( _size == UPDATE_SIZE_UNKNOWN || _len < _size ) {
+        size_t want = sizeof(chunk);
+        if( _size != UPDATE_SIZE_UNKNOWN ) want = std::min( want, _size - _len );
+        size_t n = stream.readBytes( chunk, want );
+        if( n == 0 ) break;
+        if( write( chunk, n ) != n ) break;
+        total += n;
+    }
+    return total;
+}
+
+
+bool FOTAMemoryWriter::end( bool evenIfRemaining )
+{
+    if( _error ) return false;
+    if( _size != UPDATE_SIZE_UNKNOWN && _len != _size && !evenIfRemaining ) {
+        log_e("Premature end: %d/%d bytes", _len, _size);
+        _error = UPDATE_ERROR_SIZE;
+        return false;
+    }
+    _finished = true;
+    return true;
+}
+
+
+void FOTAMemoryWriter::abort()
+{
+    _len      = 0;
+    _finished = false;
+    _error    = UPDATE_ERROR_ABORT;
+}
@@ -0,0 +1,118 @@
+/*
+   esp32 firmware OTA
+   Update sinks: images written somewhere else than the app/filesystem partitions.
+
+   A sink is an Update agent whose Writer policy stores the plain image
+   (after lz4/heatshrink decompression), the manifest, transports, bandwidth
+   cap and signature checks are unchanged:
+
+   - FOTAFlashSink:  FOTADefaultAgent, the Update library (default)
+   - FOTAFileSink:   a file on any fs::FS (SD, LittleFS...), e.g. an archive
+     for a co-processor, written to "<path>.part" and renamed by commit()
+   - FOTAMemorySink: a RAM buffer, caller provided or grown on the heap,
+     e.g. for tests or to forward a small image over SPI/UART afterwards
+
+     static FOTAFileSink sink;
+     sink.writer().setFile( SD, "/mcu/firmware.bin" );
+     FOTA.setUpdateAgent( &sink );
+
+   Sinks that don't write flash (FOTAWritesFlash<Writer> is false) skip the
+   partition checks and the restart, and are hashed as they're written: a
+   signed image is checked after end(), then commit() keeps it, or abort()
+   discards it if the signature doesn't match. The previous file stays in
+   place until commit(). Block hash lists, LAN peers and zlib/gzip images
+   (esp32-flashz, ESP32-targz) need the flash sink.
+
+   begin() gets the image size when it's known (UPDATE_SIZE_UNKNOWN otherwise)
+   and the partition it's meant for: U_FLASH or U_SPIFFS.
+*/
+
+#pragma once
+
+#include "FOTAUpdateAgent.hpp"
+#include <FS.h>
+
+
+// Writer policy: a file
+class FOTAFileWriter
+{
+public:
+  static constexpr bool flash = false;
+
+  // target of U_FLASH images, and of U_SPIFFS ones when fs_path is set
+  void setFile( fs::FS& fs, const char* path, const char* fs_path = nullptr );
+
+  bool   begin( size_t size, int partition );
+  size_t write( const uint8_t* data, size_t len );
+  size_t writeStream( Stream& stream );
+  bool   end( bool evenIfRemaining ); // closes "<path>.part"
+  bool   commit();                     // replaces the file with "<path>.part"
+  void   abort();                      // removes "<path>.part", e.g. after a signature mismatch
+  bool   isFinished() { return _finished; }
+  uint8_t getError() { return _error; }
+  void   onProgress( FOTAAgent::progress_cb fn ) { _progress = fn; }
+
+  const String& path() { return _path; } // file of the last image
+
+private:
+  fs::FS*  _fs = nullptr;
+  String   _app_path;
+  String   _fs_path;
+  String   _path;
+  fs::File _file;
+  FOTAAgent::progress_cb _progress;
+  size_t   _size = 0;
+  size_t   _written = 0;
+  uint8_t  _error = 0; // UPDATE_ERROR_* codes of the Update library
+  bool     _ended = false;    // "<path>.part" holds the whole image
+  bool     _finished = false; // committed
+
+  String partPath() { return _path + ".part"; }
+};
+
+
+// Writer policy: RAM
+class FOTAMemoryWriter
+{
+public:
+  static constexpr bool flash = false;
+
+  ~FOTAMemoryWriter() { if( _owned ) free( _data ); }
+
+  // fixed buffer, images larger than 'capacity' fail (UPDATE_ERROR_SPACE), heap buffer when not set
+  void setBuffer( uint8_t* buffer, size_t capacity );
+  // heap buffer limit
+  void setMaxSize( size_t max_size ) { _max = max_size; }
+
+  bool   begin( size_t size, int partition );
+  size_t write( const uint8_t* data, size_t len );
+  size_t writeStream( Stream& stream );
+  bool   end( bool evenIfRemaining );
+  void   abort();
+  bool   isFinished() { return _finished; }
+  uint8_t getError() { return _error; }
+  void   onProgress( FOTAAgent::progress_cb fn ) { _progress = fn; }
+
+  const uint8_t* data() { return _data; }
+  size_t size() { return _len; }
+  int    partition() { return _partition; }
+
+private:
+  uint8_t* _data = nullptr;
+  size_t   _capacity = 0;
+  size_t   _len = 0;
+  size_t   _size = 0;
+  size_t   _max = 0;  // 0 = as long as the heap allows
+  int      _partition = 0;
+  bool     _owned = true; // _data comes from the heap
+  bool     _finished = false;
+  uint8_t  _error = 0;
+  FOTAAgent::progress_cb _progress;
+
+  bool reserve( size_t capacity );
+};
+
+
+typedef FOTADefaultAgent FOTAFlashSink;
+typedef FOTAUpdateAgent<FOTAFileWriter, FOTANoInflate, FOTASha256Digest> FOTAFileSink;
+typedef FOTAUpdateAgent<FOTAMemoryWriter, FOTANoInflate, FOTASha256Digest> FOTAMemorySink;
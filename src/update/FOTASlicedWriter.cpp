@@ -0,0 +1,222 @@
+/*
+   esp32 firmware OTA
+   Latency-bounded writer policy, see FOTASlicedWriter.hpp
+*/
+
+#include "FOTASlicedWriter.hpp"
+#include "esp_ota_ops.h"
+
+#define FOTA_IMAGE_MAGIC     0xE9 // ESP_IMAGE_HEADER_MAGIC
+#define FOTA_ENCRYPTED_BLOCK 16   // encrypted partitions are written by 16 bytes blocks
+
+
+void FOTAFlashStats::add( uint32_t us )
+{
+    size_t i = 0;
+    while( i < FOTA_LATENCY_BUCKETS - 1 && us >= bound( i ) ) i++;
+    buckets[i]++;
+    ops++;
+    max_us = std::max( max_us, us );
+}
+
+
+uint32_t FOTAFlashStats::percentile( uint8_t percent ) const
+{
+    uint64_t target = ( (uint64_t)ops * percent + 99 ) / 100;
+    uint64_t count = 0;
+    for( size_t i = 0; i < FOTA_LATENCY_BUCKETS - 1; i++ ) {
+        count += buckets[i];
+        if( count >= target ) return bound( i );
+    }
+    return max_us;
+}
+
+
+bool FOTASlicedWriter::begin( size_t size, int partition )
+{
+    _buffered = _received = _flushed = _erased = 0;
+    _slice    = FOTA_SLICE_MIN;
+    _finished = _warned = false;
+    _error    = UPDATE_ERROR_OK;
+    _size     = size;
+    _stats.reset();
+    _erase_stats.reset();
+
+    _app = partition == U_FLASH;
+    if( _app ) {
+        _partition = esp_ota_get_next_update_partition( NULL );
+    } else if( partition == U_SPIFFS ) {
+        _partition = esp_partition_find_first( ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL );
+        if( !_partition ) _partition = esp_partition_find_first( ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT, NULL );
+    } else {
+        _partition = nullptr;
+    }
+    if( !_partition ) {
+        log_e("No partition to update");
+        _error = UPDATE_ERROR_NO_PARTITION;
+        return false;
+    }
+    if( size != UPDATE_SIZE_UNKNOWN && size > _partition->size ) {
+        log_e("Image (%d bytes) doesn't fit partition %s (%d bytes)", size, _partition->label, _partition->size);
+        _error = UPDATE_ERROR_SIZE;
+        return false;
+    }
+    if( !_buffer ) _buffer = (uint8_t*)malloc( FOTA_SLICE_MAX );
+    if( !_buffer ) {
+        log_e("Unable to allocate %d bytes", FOTA_SLICE_MAX);
+        _error = UPDATE_ERROR_SPACE;
+        return false;
+    }
+    log_d("Writing %s, flash operations under %u us", _partition->label, _budget);
+
+    if( _pre_erase && size != UPDATE_SIZE_UNKNOWN ) {
+        size_t len = ( size + FOTA_SLICE_MAX - 1 ) & ~(size_t)( FOTA_SLICE_MAX - 1 );
+        while( _erased < len ) {
+            if( !erase( _erase_stats, _erased ) ) return false;
+            _erased += FOTA_SLICE_MAX;
+        }
+        log_d("%u sectors erased, max %u us", _erase_stats.erases, _erase_stats.max_us);
+    }
+    return true;
+}
+
+
+uint32_t FOTASlicedWriter::timed( FOTAFlashStats& stats, esp_err_t& err, size_t offset, const uint8_t* data, size_t len )
+{
+    uint32_t start = micros();
+    err = data ? esp_partition_write( _partition, offset, data, len ) : esp_partition_erase_range( _partition, offset, len );
+    uint32_t elapsed = micros() - start;
+    stats.add( elapsed );
+    yield(); // waiting tasks run between two flash operations
+    return elapsed;
+}
+
+
+bool FOTASlicedWriter::erase( FOTAFlashStats& stats, size_t offset )
+{
+    esp_err_t err;
+    uint32_t elapsed = timed( stats, err, offset, nullptr, FOTA_SLICE_MAX );
+    stats.erases++;
+    if( err != ESP_OK ) {
+        log_e("Erase failed at offset %d", offset);
+        _error = UPDATE_ERROR_ERASE;
+        return false;
+    }
+    if( &stats == &_stats && elapsed > _budget && !_warned ) { // erases of begin() are out of the download
+        log_w("Sector erase took %u us, over the %u us budget", elapsed, _budget);
+        _warned = true;
+    }
+    return true;
+}
+
+
+// erase the next sector, then program the buffer by slices
+bool FOTASlicedWriter::flush()
+{
+    if( _buffered == 0 ) return true;
+    if( _flushed + _buffered > _partition->size ) {
+        log_e("Image exceeds partition size (%d bytes)", _partition->size);
+        _error = UPDATE_ERROR_SPACE;
+        return false;
+    }
+
+    if( _flushed >= _erased && !erase( _stats, _flushed ) ) return false;
+
+    esp_err_t err;
+    size_t len = ( _buffered + FOTA_ENCRYPTED_BLOCK - 1 ) & ~(size_t)( FOTA_ENCRYPTED_BLOCK - 1 );
+    memset( _buffer + _buffered, 0xff, len - _buffered );
+    for( size_t pos = 0; pos < len; ) {
+        size_t n = std::min( _slice, len - pos );
+        uint32_t elapsed = timed( _stats, err, _flushed + pos, _buffer + pos, n );
+        if( err != ESP_OK ) {
+            log_e("Write failed at offset %d", _flushed + pos);
+            _error = UPDATE_ERROR_WRITE;
+            return false;
+        }
+        pos += n;
+        // programming time is roughly proportional to the length
+        if( elapsed > _budget && _slice > FOTA_SLICE_MIN ) _slice /= 2;
+        else if( elapsed * 2 < _budget && _slice < FOTA_SLICE_MAX ) _slice *= 2;
+    }
+
+    _flushed += FOTA_SLICE_MAX;
+    _buffered = 0;
+    if( _progress ) _progress( _received, _size == UPDATE_SIZE_UNKNOWN ? _partition->size : _size );
+    return true;
+}
+
+
+size_t FOTASlicedWriter::write( const uint8_t* data, size_t len )
+{
+    if( _error || !_partition ) return 0;
+    if( _app && _received == 0 && len > 0 && data[0] != FOTA_IMAGE_MAGIC ) {
+        log_e("Invalid image magic byte 0x%02x", data[0]);
+        _error = UPDATE_ERROR_MAGIC_BYTE;
+        return 0;
+    }
+    if( _size != UPDATE_SIZE_UNKNOWN && _received + len > _size ) {
+        log_e("Image exceeds %d bytes", _size);
+        _error = UPDATE_ERROR_SPACE;
+        return 0;
+    }
+    size_t total = 0;
+    while( total < len ) {
+        size_t n = std::min( len - total, (size_t)FOTA_SLICE_MAX - _buffered );
+        memcpy( _buffer + _buffered, data + total, n );
+        _buffered += n;
+        _received += n;
+        total     += n;
+        if( _buffered == FOTA_SLICE_MAX && !flush() ) return 0;
+    }
+    return total;
+}
+
+
+size_t FOTASlicedWriter::writeStream( Stream& stream )
+{
+    uint8_t chunk[FOTA_SLICE_MIN];
+    size_t total = 0;
+    while( _size == UPDATE_SIZE_UNKNOWN || _received < _size ) {
+        size_t want = sizeof(chunk);
+        if( _size != UPDATE_SIZE_UNKNOWN ) want = std::min( want, _size - _received );
+        size_t n = stream.readBytes( chunk, want );
+        if( n == 0 ) {
+            if( _size != UPDATE_SIZE_UNKNOWN ) _error = UPDATE_ERROR_STREAM;
+            break;
+        }
+        if( write( chunk, n ) != n ) break;
+        total += n;
+    }
+    return total;
+}
+
+
+bool FOTASlicedWriter::end( bool evenIfRemaining )
+{
+    if( _error || !_partition ) return false;
+    if( _size != UPDATE_SIZE_UNKNOWN && _received != _size && !evenIfRemaining ) {
+        log_e("Premature end: %d/%d bytes", _received, _size);
+        _error = UPDATE_ERROR_SIZE;
+        return false;
+    }
+    if( !flush() ) return false;
+    // checks the image before marking it bootable, like Update.end()
+    if( _app && esp_ota_set_boot_partition( _partition ) != ESP_OK ) {
+        log_e("Unable to activate %s", _partition->label);
+        _error = UPDATE_ERROR_ACTIVATE;
+        return false;
+    }
+    log_d("%u flash operations, max %u us, 99%% under %u us", _stats.ops, _stats.max_us, _stats.percentile( 99 ));
+    _finished = true;
+    free( _buffer );
+    _buffer = nullptr;
+    return true;
+}
+
+
+void FOTASlicedWriter::abort()
+{
+    _error = UPDATE_ERROR_ABORT;
+    free( _buffer );
+    _buffer = nullptr;
+}
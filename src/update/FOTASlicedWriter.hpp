@@ -0,0 +1,101 @@
+/*
+   esp32 firmware OTA
+   Latency-bounded writer policy (cfg.max_flash_block_us).
+
+   Flash erase and program operations disable the instruction cache: code
+   running from flash, and interrupts not placed in IRAM, wait until they're
+   over. The Update library programs 4KB at once, this writer keeps every
+   flash operation under a time budget instead:
+
+   - one sector erase at a time, the smallest erase the flash can do,
+   - programs split in slices, halved when an operation exceeds the budget
+     and doubled when it takes less than half of it (256 bytes to 4KB),
+   - a yield() after each operation, so waiting tasks run in between.
+
+   Sector erases can't be split: when they exceed the budget, enabling
+   CONFIG_SPI_FLASH_AUTO_SUSPEND (ESP-IDF builds) lets interrupts run during
+   erases. setPreErase() (cfg.flash_pre_erase) moves them out of the
+   download instead: begin() erases the sectors of the image one at a time,
+   like esp_ota_begin() does, then the download only programs. Each
+   operation is timed in FOTAFlashStats, see getFlashStats(); erases made by
+   begin() are in eraseStats(). tools/host/flash_latency_bench.cpp measures
+   this writer against a flash timing model.
+
+   zlib/gzip images inflated by esp32-flashz or ESP32-targz are written
+   by these libraries, without slicing.
+*/
+
+#pragma once
+
+#include "FOTAUpdateAgent.hpp"
+#include <esp_partition.h>
+
+#define FOTA_SLICE_MIN       256  // flash page
+#define FOTA_SLICE_MAX       4096 // SPI_FLASH_SEC_SIZE
+#define FOTA_LATENCY_BUCKETS 11
+
+
+// Duration of flash operations
+struct FOTAFlashStats
+{
+  uint32_t ops;
+  uint32_t erases;
+  uint32_t max_us;
+  uint32_t buckets[FOTA_LATENCY_BUCKETS]; // below bound(i), the last one has no upper bound
+
+  FOTAFlashStats() { reset(); }
+  static uint32_t bound( size_t i ) { return 125UL << i; } // 125us .. 64ms
+  void reset() { memset( this, 0, sizeof(*this) ); }
+  void add( uint32_t us );
+  // duration under which 'percent' of the operations completed (bucket bound)
+  uint32_t percentile( uint8_t percent ) const;
+};
+
+
+// Writer policy, see FOTAUpdateAgent.hpp
+class FOTASlicedWriter
+{
+public:
+  ~FOTASlicedWriter() { free( _buffer ); }
+
+  void setMaxBlockTime( uint32_t us ) { _budget = us; }
+  // erase the sectors of images of known size in begin()
+  void setPreErase( bool pre_erase ) { _pre_erase = pre_erase; }
+  const FOTAFlashStats& stats() { return _stats; }            // during the download
+  const FOTAFlashStats& eraseStats() { return _erase_stats; } // erases made by begin()
+
+  bool   begin( size_t size, int partition );
+  size_t write( const uint8_t* data, size_t len );
+  size_t writeStream( Stream& stream );
+  bool   end( bool evenIfRemaining );
+  void   abort();
+  bool   isFinished() { return _finished; }
+  uint8_t getError() { return _error; }
+  void   onProgress( FOTAAgent::progress_cb fn ) { _progress = fn; }
+
+private:
+  const esp_partition_t* _partition = nullptr;
+  FOTAAgent::progress_cb _progress;
+  uint8_t* _buffer = nullptr;  // one sector
+  size_t   _buffered = 0;
+  size_t   _received = 0;
+  size_t   _flushed = 0;       // sector aligned
+  size_t   _erased = 0;        // bytes erased by begin()
+  size_t   _size = 0;
+  size_t   _slice = FOTA_SLICE_MIN;
+  uint32_t _budget = 1000;     // us
+  bool     _app = false;
+  bool     _pre_erase = false;
+  bool     _finished = false;
+  bool     _warned = false;
+  uint8_t  _error = 0;         // UPDATE_ERROR_* codes of the Update library
+  FOTAFlashStats _stats;
+  FOTAFlashStats _erase_stats;
+
+  bool flush();
+  bool erase( FOTAFlashStats& stats, size_t offset );
+  uint32_t timed( FOTAFlashStats& stats, esp_err_t& err, size_t offset, const uint8_t* data, size_t len ); // erase when data is nullptr
+};
+
+
+typedef FOTAUpdateAgent<FOTASlicedWriter, FOTADefaultInflate, FOTANoDigest> FOTASlicedAgent;
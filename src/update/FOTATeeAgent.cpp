@@ -0,0 +1,201 @@
+/*
+   esp32 firmware OTA
+   Tee agent, see FOTATeeAgent.hpp
+*/
+
+#include "FOTATeeAgent.hpp"
+
+
+FOTATeeAgent::~FOTATeeAgent()
+{
+    close( true );
+}
+
+
+bool FOTATeeAgent::add( FOTAAgent* sink, size_t buffer )
+{
+    if( !sink || _count >= FOTA_TEE_MAX_SINKS ) {
+        log_e("Tee sinks are limited to %d, see FOTA_TEE_MAX_SINKS", FOTA_TEE_MAX_SINKS);
+        return false;
+    }
+    _sinks[_count++] = { this, sink, std::max( buffer, (size_t)FOTA_TEE_CHUNK ), nullptr, nullptr, UPDATE_ERROR_OK, false, false, false, false };
+    return true;
+}
+
+
+bool FOTATeeAgent::begin( size_t size, int partition, const char* codec )
+{
+    close( true ); // previous update that wasn't ended
+    for( size_t i = 0; i < _count; i++ ) {
+        if( _sinks[i].ended ) _sinks[i].agent->abort(); // nor committed
+        _sinks[i].ended = false;
+    }
+    if( codec ) {
+        log_e("%s compressed images can't be teed, use lz4 or heatshrink compression", codec);
+        return false;
+    }
+    if( !_primary->begin( size, partition, nullptr ) ) return false;
+
+    _size      = size;
+    _partition = partition;
+    _even      = false;
+    _aborting  = false;
+    for( size_t i = 0; i < _count; i++ ) {
+        Sink& sink   = _sinks[i];
+        sink.error   = UPDATE_ERROR_OK;
+        sink.closing = sink.done = sink.ended = false;
+        sink.buffer  = xStreamBufferCreate( sink.buffer_size, 1 );
+        if( !sink.buffer ) {
+            log_w("Unable to allocate %d bytes for sink #%d, skipped", sink.buffer_size, i);
+            sink.error = UPDATE_ERROR_SPACE;
+            continue;
+        }
+        if( xTaskCreate( task, "fota-tee", FOTA_TEE_TASK_STACK, &sink, 1, &sink.task ) != pdPASS ) {
+            log_w("Unable to start the task of sink #%d, skipped", i);
+            vStreamBufferDelete( sink.buffer );
+            sink.buffer = nullptr;
+            sink.error  = UPDATE_ERROR_SPACE;
+            continue;
+        }
+        sink.running = true;
+    }
+    return true;
+}
+
+
+size_t FOTATeeAgent::write( const uint8_t* data, size_t len )
+{
+    size_t written = _primary->write( data, len );
+    // blocks only while a sink is more than its buffer behind
+    for( size_t i = 0; i < _count; i++ ) {
+        Sink& sink = _sinks[i];
+        for( size_t sent = 0; sink.running && !sink.error && sent < written; ) {
+            size_t n = xStreamBufferSend( sink.buffer, data + sent, written - sent, pdMS_TO_TICKS( _stall_ms ) );
+            if( n == 0 ) {
+                log_w("Sink #%d stalled for %u ms, dropped", i, _stall_ms);
+                sink.error = UPDATE_ERROR_STREAM;
+            }
+            sent += n;
+        }
+    }
+    return written;
+}
+
+
+size_t FOTATeeAgent::writeStream( Stream& stream, size_t size )
+{
+    uint8_t chunk[FOTA_TEE_CHUNK];
+    size_t total = 0;
+    while( size == UPDATE_SIZE_UNKNOWN || total < size ) {
+        size_t want = sizeof(chunk);
+        if( size != UPDATE_SIZE_UNKNOWN ) want = std::min( want, size - total );
+        size_t n = stream.readBytes( chunk, want );
+        if( n == 0 ) break;
+        if( write( chunk, n ) != n ) break;
+        total += n;
+    }
+    return total;
+}
+
+
+bool FOTATeeAgent::end( bool evenIfRemaining )
+{
+    bool ret = _primary->end( evenIfRemaining );
+    _even = evenIfRemaining;
+    close( !ret ); // sinks only keep an image the primary accepted
+    for( size_t i = 0; i < _count; i++ ) {
+        if( _sinks[i].error ) log_w("Sink #%d failed, error #%d", i, _sinks[i].error);
+    }
+    return ret;
+}
+
+
+// the image passed its checks: the primary decides, sinks are best effort
+bool FOTATeeAgent::commit()
+{
+    if( !_primary->commit() ) {
+        abort();
+        return false;
+    }
+    for( size_t i = 0; i < _count; i++ ) {
+        Sink& sink = _sinks[i];
+        if( !sink.ended ) continue;
+        sink.ended = false;
+        if( !sink.agent->commit() ) {
+            sink.error = sink.agent->getError() ? sink.agent->getError() : UPDATE_ERROR_WRITE;
+            log_w("Sink #%d didn't commit, error #%d", i, sink.error);
+        }
+    }
+    return true;
+}
+
+
+void FOTATeeAgent::abort()
+{
+    _primary->abort();
+    close( true );
+    // also called after end(), e.g. when the image signature didn't match: sinks discard what they got
+    for( size_t i = 0; i < _count; i++ ) {
+        if( _sinks[i].ended ) _sinks[i].agent->abort();
+        _sinks[i].ended = false;
+        _sinks[i].error = UPDATE_ERROR_ABORT;
+    }
+}
+
+
+void FOTATeeAgent::close( bool abort )
+{
+    _aborting = abort;
+    for( size_t i = 0; i < _count; i++ ) _sinks[i].closing = true;
+    for( size_t i = 0; i < _count; i++ ) {
+        Sink& sink = _sinks[i];
+        if( !sink.running ) continue;
+        while( !sink.done ) vTaskDelay(1);
+        vStreamBufferDelete( sink.buffer );
+        sink.buffer  = nullptr;
+        sink.task    = nullptr;
+        sink.running = false;
+    }
+}
+
+
+void FOTATeeAgent::task( void* arg )
+{
+    Sink* sink = (Sink*)arg;
+    sink->tee->run( *sink );
+    sink->done = true;
+    vTaskDelete( NULL );
+}
+
+
+void FOTATeeAgent::run( Sink& sink )
+{
+    size_t index = &sink - _sinks;
+    bool begun = sink.agent->begin( _size, _partition, nullptr );
+    if( !begun ) {
+        log_w("Sink #%d didn't begin, error #%d", index, sink.agent->getError());
+        sink.error = sink.agent->getError() ? sink.agent->getError() : UPDATE_ERROR_ABORT;
+    }
+
+    // a failed sink keeps draining its buffer, so write() never waits for it
+    uint8_t chunk[FOTA_TEE_CHUNK];
+    while( true ) {
+        size_t n = xStreamBufferReceive( sink.buffer, chunk, sizeof(chunk), pdMS_TO_TICKS( 10 ) );
+        if( n && !sink.error && sink.agent->write( chunk, n ) != n ) {
+            log_w("Sink #%d write failed, error #%d", index, sink.agent->getError());
+            sink.error = sink.agent->getError() ? sink.agent->getError() : UPDATE_ERROR_WRITE;
+        }
+        if( n == 0 && sink.closing && ( _aborting || xStreamBufferBytesAvailable( sink.buffer ) == 0 ) ) break;
+    }
+
+    if( begun ) {
+        if( _aborting || sink.error ) {
+            sink.agent->abort();
+        } else if( sink.agent->end( _even ) ) {
+            sink.ended = true;
+        } else {
+            sink.error = sink.agent->getError() ? sink.agent->getError() : UPDATE_ERROR_ABORT;
+        }
+    }
+    if( _aborting && !sink.error ) sink.error = UPDATE_ERROR_ABORT;
+}
@@ -0,0 +1,110 @@
+/*
+   esp32 firmware OTA
+   Tee agent: one download written to several sinks at once.
+
+   A gateway updating itself and the MCUs next to it downloads the image
+   once: the primary agent (usually the local partition) is written by the
+   update task, every other sink gets its own stream buffer and task, so a
+   slow sink (UART at 115200 bauds) only holds the download back once its
+   buffer is full. The lag of a sink is bounded by its buffer size.
+
+     static FOTADefaultAgent local;
+     static FOTASerialSink mcu1, mcu2;
+     static FOTAFileSink archive;
+     static FOTATeeAgent tee( &local );
+     mcu1.writer().setPort( &Serial1 );
+     mcu2.writer().setPort( &Serial2 );
+     archive.writer().setFile( SD, "/fw/gateway.bin" );
+     tee.add( &mcu1 ); tee.add( &mcu2 ); tee.add( &archive, 32768 );
+     FOTA.setUpdateAgent( &tee );
+
+   Sinks get the plain image: lz4/heatshrink images are decoded before the
+   tee, zlib/gzip ones can't be teed (esp32-flashz and ESP32-targz write flash
+   themselves). The primary decides the outcome of the update (progress,
+   digest, signature check), other sinks are best effort:
+
+   - a sink failing, or not taking data for setStallTimeout() ms, is dropped
+     from the transfer and the others go on, see sinkError(),
+   - end() waits for every sink to take the whole image, without
+     committing it: once the image passed its checks, commit() commits the
+     primary then the sinks, abort() aborts them all instead (archived
+     ".part" files are removed, serial devices get ABORT in place of their
+     last frame),
+   - block hash repairs are rewritten in the local partition only, so the
+     tee turns them off (repairable() is false).
+*/
+
+#pragma once
+
+#include "FOTAUpdateAgent.hpp"
+#include <freertos/stream_buffer.h>
+
+#ifndef FOTA_TEE_MAX_SINKS
+  #define FOTA_TEE_MAX_SINKS 4   // besides the primary
+#endif
+#define FOTA_TEE_BUFFER     16384 // bytes, default lag bound of a sink
+#define FOTA_TEE_CHUNK      1024  // bytes moved to a sink at once
+#define FOTA_TEE_TASK_STACK 6144  // FS writes on SD need more than a serial port
+
+
+class FOTATeeAgent : public FOTAAgent
+{
+public:
+  FOTATeeAgent( FOTAAgent* primary ) : _primary(primary) { }
+  ~FOTATeeAgent();
+
+  // false when FOTA_TEE_MAX_SINKS are already set
+  bool add( FOTAAgent* sink, size_t buffer = FOTA_TEE_BUFFER );
+  // longest wait for a sink whose buffer is full, before it's dropped
+  void setStallTimeout( uint32_t ms ) { _stall_ms = ms; }
+
+  size_t     sinks() { return _count; }
+  FOTAAgent* sink( size_t i ) { return i < _count ? _sinks[i].agent : nullptr; }
+  // UPDATE_ERROR_* code of a sink after end() and commit(), 0 when it kept the whole image
+  uint8_t    sinkError( size_t i ) { return i < _count ? _sinks[i].error : UPDATE_ERROR_BAD_ARGUMENT; }
+
+  const char* compression() { return "none"; }
+  bool supports( const char* /*codec*/ ) { return false; }
+  const char* detect( Stream* /*stream*/, const String& /*url*/ ) { return nullptr; }
+
+  bool    begin( size_t size, int partition, const char* codec );
+  size_t  write( const uint8_t* data, size_t len );
+  size_t  writeStream( Stream& stream, size_t size );
+  bool    end( bool evenIfRemaining );
+  bool    commit();
+  void    abort();
+  bool    isFinished() { return _primary->isFinished(); }
+  uint8_t getError() { return _primary->getError(); }
+  void    onProgress( progress_cb fn ) { _primary->onProgress( fn ); }
+  bool    digest( uint8_t* sha256 ) { return _primary->digest( sha256 ); }
+  bool    writesFlash() { return _primary->writesFlash(); }
+  bool    repairable() { return false; }
+
+private:
+  struct Sink
+  {
+    FOTATeeAgent*        tee;
+    FOTAAgent*           agent;
+    size_t               buffer_size;
+    StreamBufferHandle_t buffer;
+    TaskHandle_t         task;
+    volatile uint8_t     error;    // UPDATE_ERROR_* code, the sink task only drains its buffer once set
+    volatile bool        closing;  // no more data, the task ends or aborts the sink
+    volatile bool        done;     // the task is over
+    volatile bool        ended;    // the sink accepted the whole image, commit() or abort() pending
+    bool                 running;
+  };
+
+  FOTAAgent* _primary;
+  Sink       _sinks[FOTA_TEE_MAX_SINKS];
+  size_t     _count = 0;
+  size_t     _size = 0;
+  int        _partition = 0;
+  uint32_t   _stall_ms = 10000;
+  volatile bool _even = false;     // end( evenIfRemaining )
+  volatile bool _aborting = false;
+
+  static void task( void* arg );
+  void run( Sink& sink );
+  void close( bool abort );        // waits for every sink task
+};
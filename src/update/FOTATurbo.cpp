@@ -0,0 +1,51 @@
+/*
+   esp32 firmware OTA
+   "Turbo" resource profile, see FOTATurbo.hpp
+*/
+
+#include "FOTATurbo.hpp"
+#include <Preferences.h>
+
+
+void FOTATurbo::begin()
+{
+    if( _active ) return;
+    _cpu_mhz = getCpuFrequencyMhz();
+    _ps      = WiFi.getSleep();
+    _active  = true;
+
+    if( _ps != WIFI_PS_NONE ) WiFi.setSleep( WIFI_PS_NONE );
+    if( _cpu_mhz < FOTA_TURBO_CPU_MHZ && !setCpuFrequencyMhz( FOTA_TURBO_CPU_MHZ ) ) {
+        log_w("Unable to run the CPU at %d MHz", FOTA_TURBO_CPU_MHZ);
+    }
+    log_d("Turbo on (CPU %u => %u MHz, WiFi power save %d => off)", _cpu_mhz, getCpuFrequencyMhz(), _ps);
+}
+
+
+void FOTATurbo::end()
+{
+    if( !_active ) return;
+    _active = false;
+    if( getCpuFrequencyMhz() != _cpu_mhz ) setCpuFrequencyMhz( _cpu_mhz );
+    if( _ps != WIFI_PS_NONE ) WiFi.setSleep( _ps );
+    log_d("Turbo off");
+}
+
+
+uint32_t FOTATurbo::baseline()
+{
+    Preferences prefs;
+    if( !prefs.begin( FOTA_TURBO_NVS, true ) ) return 0;
+    uint32_t throughput = prefs.getUInt( "base", 0 );
+    prefs.end();
+    return throughput;
+}
+
+
+void FOTATurbo::setBaseline( uint32_t throughput )
+{
+    Preferences prefs;
+    if( !prefs.begin( FOTA_TURBO_NVS, false ) ) return;
+    prefs.putUInt( "base", throughput );
+    prefs.end();
+}
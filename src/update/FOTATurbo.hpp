@@ -0,0 +1,57 @@
+/*
+   esp32 firmware OTA
+   "Turbo" resource profile (cfg.turbo).
+
+   Applications often pick settings for idle efficiency: WiFi modem sleep,
+   a low CPU frequency. For the duration of an update, this guard turns
+   power save off and runs the CPU at its maximum frequency, then puts the
+   application settings back when it goes out of scope, whatever the exit
+   path (abort, failed signature, ...).
+
+   The lwIP TCP window is a build option of the precompiled arduino-esp32
+   libraries (CONFIG_LWIP_TCP_WND_DEFAULT), it can't be changed at runtime.
+
+   Download throughputs without turbo are recorded in NVS, so the gain of
+   the next turbo update can be reported (see setTelemetryCb()).
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#define FOTA_TURBO_NVS "fota-turbo"
+#define FOTA_TURBO_MIN_SAMPLE 65536 // bytes, smaller downloads don't tell much about throughput
+
+#ifndef FOTA_TURBO_CPU_MHZ
+  #if defined CONFIG_IDF_TARGET_ESP32C2
+    #define FOTA_TURBO_CPU_MHZ 120
+  #elif defined CONFIG_IDF_TARGET_ESP32C3 || defined CONFIG_IDF_TARGET_ESP32C6
+    #define FOTA_TURBO_CPU_MHZ 160
+  #elif defined CONFIG_IDF_TARGET_ESP32H2
+    #define FOTA_TURBO_CPU_MHZ 96
+  #else
+    #define FOTA_TURBO_CPU_MHZ 240
+  #endif
+#endif
+
+
+class FOTATurbo
+{
+public:
+  FOTATurbo( bool enable ) { if( enable ) begin(); }
+  ~FOTATurbo() { end(); }
+
+  void begin();
+  void end(); // restores the application settings
+  bool active() { return _active; }
+
+  // bytes/s of the last download made without turbo (and without rate limit), 0 = unknown
+  static uint32_t baseline();
+  static void setBaseline( uint32_t throughput );
+
+private:
+  bool           _active = false;
+  uint32_t       _cpu_mhz = 0;
+  wifi_ps_type_t _ps = WIFI_PS_NONE;
+};
@@ -0,0 +1,43 @@
+/*
+   esp32 firmware OTA
+   Update agent, see FOTAUpdateAgent.hpp
+*/
+
+#include "FOTAUpdateAgent.hpp"
+
+// mbedtls 2.x (arduino-esp32 core 2.x) names the int returning functions *_ret
+#if MBEDTLS_VERSION_MAJOR < 3
+  #define fota_sha256_starts mbedtls_sha256_starts_ret
+  #define fota_sha256_update mbedtls_sha256_update_ret
+  #define fota_sha256_finish mbedtls_sha256_finish_ret
+#else
+  #define fota_sha256_starts mbedtls_sha256_starts
+  #define fota_sha256_update mbedtls_sha256_update
+  #define fota_sha256_finish mbedtls_sha256_finish
+#endif
+
+
+bool FOTASha256Digest::begin()
+{
+    mbedtls_sha256_free( &_ctx );
+    mbedtls_sha256_init( &_ctx );
+    _ok = fota_sha256_starts( &_ctx, 0 ) == 0; // 0: SHA-256, not SHA-224
+    if( !_ok ) log_e("Unable to start sha256");
+    return _ok;
+}
+
+
+void FOTASha256Digest::update( const uint8_t* data, size_t len )
+{
+    if( _ok && len && fota_sha256_update( &_ctx, data, len ) != 0 ) _ok = false;
+}
+
+
+// false if any step failed, sha256 is zeroed then so it can't match by accident
+bool FOTASha256Digest::finish( uint8_t* sha256 )
+{
+    bool ok = _ok && fota_sha256_finish( &_ctx, sha256 ) == 0;
+    if( !ok ) memset( sha256, 0, 32 );
+    _ok = false;
+    return ok;
+}
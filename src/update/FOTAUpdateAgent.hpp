@@ -0,0 +1,309 @@
+/*
+   esp32 firmware OTA
+   Update agent: writer x decompressor x digest policies.
+
+   esp32FOTA drives an FOTAAgent, FOTAUpdateAgent<Writer, Inflate, Digest>
+   composes it at compile time from:
+
+   - Writer: stores plain image data, FOTAUpdateWriter uses the Update library.
+   - Inflate: handles zlib/gzip images on its own, FOTANoInflate,
+     FOTAFlashZInflate (esp32-flashz), FOTATargzInflate (ESP32-targz), or
+     FOTAInflateEither<A,B> to support two of them in the same build.
+   - Digest: hashes what goes through write(), FOTANoDigest or FOTASha256Digest,
+     begin() and finish() return false when no digest can be computed.
+
+   Branches of unused policies are constants and get compiled out. The
+   default agent (FOTADefaultAgent) depends on the visible libraries, like
+   the former F_* macros, others can be set with esp32FOTA::setUpdateAgent():
+
+     static FOTAUpdateAgent<FOTAUpdateWriter, FOTAInflateEither<FOTAFlashZInflate, FOTATargzInflate>, FOTASha256Digest> agent;
+     FOTA.setUpdateAgent( &agent );
+
+   Policies only need the members used below, e.g. a RAM Writer is enough
+   to run the whole engine on the host, see FOTASinks.hpp.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <Update.h>
+#include <type_traits>
+#include <utility>
+#include "mbedtls/sha256.h"
+#include "mbedtls/version.h"
+
+#if __has_include(<flashz.hpp>)
+  #include <flashz.hpp>
+  #define FOTA_HAS_FLASHZ
+#endif
+#if __has_include("ESP32-targz.h")
+  #include <ESP32-targz.h>
+  #define FOTA_HAS_TARGZ
+#endif
+
+
+// Interface used by esp32FOTA
+class FOTAAgent
+{
+public:
+  typedef std::function<void(size_t,size_t)> progress_cb;
+
+  virtual ~FOTAAgent() { }
+  // supported zlib/gzip codecs, e.g. "zlib", "zlib,gzip" or "none"
+  virtual const char* compression() = 0;
+  virtual bool supports( const char* codec ) = 0;
+  // codec of a compressed stream guessed from its first byte and url, nullptr for plain images
+  virtual const char* detect( Stream* stream, const String& url ) = 0;
+
+  // codec == nullptr: plain image, written with write() or writeStream()
+  virtual bool   begin( size_t size, int partition, const char* codec ) = 0;
+  virtual size_t write( const uint8_t* data, size_t len ) = 0;
+  virtual size_t writeStream( Stream& stream, size_t size ) = 0;
+  virtual bool   end( bool evenIfRemaining ) = 0;
+  // called once the image passed every check: sinks keep it apart until then, e.g.
+  // a file is only renamed now, and abort() after end() still discards it
+  virtual bool   commit() { return true; }
+  virtual void   abort() = 0;
+  virtual bool   isFinished() = 0;
+  virtual uint8_t getError() = 0;
+  virtual void   onProgress( progress_cb fn ) = 0;
+
+  // digest of everything passed to write() since begin(), false if unavailable
+  virtual bool digest( uint8_t* sha256 ) = 0;
+
+  // false when images go somewhere else than the app/filesystem partitions, see FOTASinks.hpp
+  virtual bool writesFlash() { return true; }
+  // false when blocks fetched again can't be rewritten everywhere the image went, see FOTATeeAgent.hpp
+  virtual bool repairable() { return true; }
+};
+
+
+// Writer policies storing images out of flash declare 'static constexpr bool flash = false'
+template <class Writer, class = void>
+struct FOTAWritesFlash : std::true_type { };
+template <class Writer>
+struct FOTAWritesFlash<Writer, decltype( void( Writer::flash ) )> : std::integral_constant<bool, Writer::flash> { };
+
+
+// Writer policies holding the image back until it's verified have 'bool commit()'
+template <class Writer, class = void>
+struct FOTAWriterCommit { static bool commit( Writer& ) { return true; } };
+template <class Writer>
+struct FOTAWriterCommit<Writer, decltype( void( std::declval<Writer&>().commit() ) )> { static bool commit( Writer& writer ) { return writer.commit(); } };
+
+
+// Writer policy: the Update library
+struct FOTAUpdateWriter
+{
+  bool   begin( size_t size, int partition ) { return Update.begin( size, partition ); }
+  size_t write( const uint8_t* data, size_t len ) { return Update.write( (uint8_t*)data, len ); }
+  size_t writeStream( Stream& stream ) { return Update.writeStream( stream ); }
+  bool   end( bool evenIfRemaining ) { return Update.end( evenIfRemaining ); }
+  void   abort() { Update.abort(); }
+  bool   isFinished() { return Update.isFinished(); }
+  uint8_t getError() { return Update.getError(); }
+  void   onProgress( FOTAAgent::progress_cb fn ) { Update.onProgress( fn ); }
+};
+
+
+// Inflate policies, each one is a complete Update agent for its codec
+struct FOTANoInflate
+{
+  static constexpr bool enabled = false;
+  static const char* name() { return "none"; }
+  bool supports( const char* /*codec*/ ) { return false; }
+  const char* detect( Stream* /*stream*/, const String& /*url*/ ) { return nullptr; }
+  bool   begin( int /*partition*/, const char* /*codec*/ ) { return false; }
+  size_t writeStream( Stream& /*stream*/, size_t /*size*/ ) { return 0; }
+  bool   end() { return false; }
+  void   abort() { }
+  bool   isFinished() { return false; }
+  uint8_t getError() { return 0; }
+  void   onProgress( FOTAAgent::progress_cb /*fn*/ ) { }
+};
+
+
+#if defined FOTA_HAS_FLASHZ
+struct FOTAFlashZInflate
+{
+  static constexpr bool enabled = true;
+  static const char* name() { return "zlib"; }
+  bool supports( const char* codec ) { return strcmp( codec, name() ) == 0; }
+  const char* detect( Stream* stream, const String& url ) { return stream->peek() == ZLIB_HEADER && url.indexOf("zz") > -1 ? name() : nullptr; }
+  bool   begin( int partition, const char* /*codec*/ ) { return FlashZ::getInstance().beginz( UPDATE_SIZE_UNKNOWN, partition ); }
+  size_t writeStream( Stream& stream, size_t size ) { return FlashZ::getInstance().writezStream( stream, size ); }
+  bool   end() { return FlashZ::getInstance().endz(); }
+  void   abort() { FlashZ::getInstance().abortz(); }
+  bool   isFinished() { return FlashZ::getInstance().isFinished(); }
+  uint8_t getError() { return FlashZ::getInstance().getError(); }
+  void   onProgress( FOTAAgent::progress_cb fn ) { FlashZ::getInstance().onProgress( fn ); }
+};
+#endif
+
+
+#if defined FOTA_HAS_TARGZ
+struct FOTATargzInflate
+{
+  static constexpr bool enabled = true;
+  static const char* name() { return "gzip"; }
+  bool supports( const char* codec ) { return strcmp( codec, name() ) == 0; }
+  const char* detect( Stream* stream, const String& url ) { return stream->peek() == 0x1f && url.indexOf("gz") > -1 ? name() : nullptr; }
+  bool   begin( int partition, const char* /*codec*/ ) { return GzUpdateClass::getInstance().begingz( UPDATE_SIZE_UNKNOWN, partition ); }
+  size_t writeStream( Stream& stream, size_t size ) { return GzUpdateClass::getInstance().writeGzStream( stream, size ); }
+  bool   end() { return GzUpdateClass::getInstance().endgz(); }
+  void   abort() { GzUpdateClass::getInstance().abortgz(); }
+  bool   isFinished() { return GzUpdateClass::getInstance().isFinished(); }
+  uint8_t getError() { return GzUpdateClass::getInstance().getError(); }
+  void   onProgress( FOTAAgent::progress_cb fn ) { GzUpdateClass::getInstance().onProgress( fn ); }
+};
+#endif
+
+
+// Two codecs in the same build, the one matching the codec name handles the image
+template <class A, class B>
+struct FOTAInflateEither
+{
+  static constexpr bool enabled = A::enabled || B::enabled;
+  static const char* name()
+  {
+    static const String names = String( A::name() ) + "," + B::name();
+    return names.c_str();
+  }
+  bool supports( const char* codec ) { return _a.supports( codec ) || _b.supports( codec ); }
+  const char* detect( Stream* stream, const String& url )
+  {
+    const char* codec = _a.detect( stream, url );
+    return codec ? codec : _b.detect( stream, url );
+  }
+  bool begin( int partition, const char* codec )
+  {
+    _use_b = !_a.supports( codec );
+    return _use_b ? _b.begin( partition, codec ) : _a.begin( partition, codec );
+  }
+  size_t writeStream( Stream& stream, size_t size ) { return _use_b ? _b.writeStream( stream, size ) : _a.writeStream( stream, size ); }
+  bool   end() { return _use_b ? _b.end() : _a.end(); }
+  void   abort() { if( _use_b ) _b.abort(); else _a.abort(); }
+  bool   isFinished() { return _use_b ? _b.isFinished() : _a.isFinished(); }
+  uint8_t getError() { return _use_b ? _b.getError() : _a.getError(); }
+  void   onProgress( FOTAAgent::progress_cb fn ) { _a.onProgress( fn ); _b.onProgress( fn ); }
+private:
+  A _a;
+  B _b;
+  bool _use_b = false;
+};
+
+
+// Digest policies
+struct FOTANoDigest
+{
+  static constexpr bool enabled = false;
+  bool begin() { return false; }
+  void update( const uint8_t* /*data*/, size_t /*len*/ ) { }
+  bool finish( uint8_t* /*sha256*/ ) { return false; }
+};
+
+
+struct FOTASha256Digest
+{
+  static constexpr bool enabled = true;
+  FOTASha256Digest() { mbedtls_sha256_init( &_ctx ); }
+  ~FOTASha256Digest() { mbedtls_sha256_free( &_ctx ); }
+  FOTASha256Digest( const FOTASha256Digest& ) = delete;
+  FOTASha256Digest& operator=( const FOTASha256Digest& ) = delete;
+  bool begin();
+  void update( const uint8_t* data, size_t len );
+  bool finish( uint8_t* sha256 );
+private:
+  // part of the agent: hashing doesn't touch the heap, unlike the mbedtls_md_* layer
+  mbedtls_sha256_context _ctx;
+  bool _ok = false; // hash started
+};
+
+
+template <class Writer, class Inflate, class Digest>
+class FOTAUpdateAgent : public FOTAAgent
+{
+public:
+  const char* compression() { return Inflate::enabled ? Inflate::name() : "none"; }
+  bool supports( const char* codec ) { return Inflate::enabled && _inflate.supports( codec ); }
+  const char* detect( Stream* stream, const String& url ) { return Inflate::enabled ? _inflate.detect( stream, url ) : nullptr; }
+
+  bool begin( size_t size, int partition, const char* codec )
+  {
+    _inflating = Inflate::enabled && codec != nullptr;
+    _hashing   = Digest::enabled && !_inflating && _digest.begin();
+    bool ret   = _inflating ? _inflate.begin( partition, codec ) : _writer.begin( size, partition );
+    if( !ret ) _hashing = false;
+    return ret;
+  }
+
+  size_t write( const uint8_t* data, size_t len )
+  {
+    size_t written = _writer.write( data, len );
+    if( _hashing ) _digest.update( data, written );
+    return written;
+  }
+
+  size_t writeStream( Stream& stream, size_t size )
+  {
+    _hashing = false; // the data doesn't go through write()
+    return _inflating ? _inflate.writeStream( stream, size ) : _writer.writeStream( stream );
+  }
+
+  bool end( bool evenIfRemaining )
+  {
+    bool ret = _inflating ? _inflate.end() : _writer.end( evenIfRemaining );
+    if( _hashing ) _hashing = _digest.finish( _sha256 ) && ret; // digest() then reports the failure
+    return ret;
+  }
+
+  bool commit() { return _inflating || FOTAWriterCommit<Writer>::commit( _writer ); }
+
+  void abort()
+  {
+    _hashing = false;
+    if( _inflating ) _inflate.abort(); else _writer.abort();
+  }
+
+  bool    isFinished() { return _inflating ? _inflate.isFinished() : _writer.isFinished(); }
+  uint8_t getError()   { return _inflating ? _inflate.getError() : _writer.getError(); }
+
+  void onProgress( progress_cb fn )
+  {
+    _writer.onProgress( fn );
+    if( Inflate::enabled ) _inflate.onProgress( fn );
+  }
+
+  bool digest( uint8_t* sha256 )
+  {
+    if( !_hashing ) return false;
+    memcpy( sha256, _sha256, sizeof(_sha256) );
+    return true;
+  }
+
+  bool writesFlash() { return FOTAWritesFlash<Writer>::value; }
+
+  // policy settings, e.g. agent.writer().setMaxBlockTime( 500 )
+  Writer& writer() { return _writer; }
+
+private:
+  Writer  _writer;
+  Inflate _inflate;
+  Digest  _digest;
+  bool    _inflating = false;
+  bool    _hashing = false;
+  uint8_t _sha256[32];
+};
+
+
+#if defined FOTA_HAS_FLASHZ && defined FOTA_HAS_TARGZ
+  typedef FOTAInflateEither<FOTAFlashZInflate, FOTATargzInflate> FOTADefaultInflate;
+#elif defined FOTA_HAS_FLASHZ
+  typedef FOTAFlashZInflate FOTADefaultInflate;
+#elif defined FOTA_HAS_TARGZ
+  typedef FOTATargzInflate FOTADefaultInflate;
+#else
+  typedef FOTANoInflate FOTADefaultInflate;
+#endif
+
+typedef FOTAUpdateAgent<FOTAUpdateWriter, FOTADefaultInflate, FOTANoDigest> FOTADefaultAgent;
@@ -0,0 +1,121 @@
+/*
+   esp32 firmware OTA
+   Written image verification, see FOTAVerify.hpp
+*/
+
+#include "FOTAVerify.hpp"
+#include "../streams/SerialFrameStream.hpp" // fota_crc32()
+#include <esp_idf_version.h>
+
+// arduino-esp32 core 2.x => 3.x migration
+#if __has_include("md_wrap.h")
+  #include "md_wrap.h"
+#else
+  #include "mbedtls/md.h"
+#endif
+
+#if ESP_IDF_VERSION_MAJOR >= 5
+  typedef esp_partition_mmap_handle_t fota_mmap_handle_t;
+  #define FOTA_MMAP_DATA   ESP_PARTITION_MMAP_DATA
+  #define fota_munmap( h ) esp_partition_munmap( h )
+#else
+  #include "esp_spi_flash.h"
+  typedef spi_flash_mmap_handle_t fota_mmap_handle_t;
+  #define FOTA_MMAP_DATA   SPI_FLASH_MMAP_DATA
+  #define fota_munmap( h ) spi_flash_munmap( h )
+#endif
+
+
+bool FOTAVerify::begin( size_t max_size )
+{
+    _arena.free( _crcs );
+    _written  = 0;
+    _overflow = false;
+    _blocks   = tableSize( max_size ) / sizeof(uint32_t);
+    _crcs     = (uint32_t*)_arena.alloc( _blocks * sizeof(uint32_t) );
+    if( !_crcs ) {
+        log_w("Unable to allocate %d block digests (see fota_arena_size()), only a signature will check the written image", _blocks);
+        _blocks = 0;
+        return false;
+    }
+    return true;
+}
+
+
+void FOTAVerify::update( const uint8_t* data, size_t len )
+{
+    if( !_crcs ) return;
+    while( len > 0 ) {
+        size_t block  = _written / FOTA_VERIFY_BLOCK_SIZE;
+        size_t offset = _written % FOTA_VERIFY_BLOCK_SIZE;
+        if( block >= _blocks ) {
+            _overflow = true;
+            return;
+        }
+        size_t chunk = std::min( len, (size_t)FOTA_VERIFY_BLOCK_SIZE - offset );
+        _crcs[block] = fota_crc32( offset ? _crcs[block] : 0, data, chunk );
+        _written += chunk;
+        data     += chunk;
+        len      -= chunk;
+    }
+}
+
+
+void FOTAVerify::rewrite( size_t offset, const uint8_t* data, size_t len )
+{
+    if( !_crcs || offset % FOTA_VERIFY_BLOCK_SIZE || offset + len > _written ) return;
+    for( size_t pos = 0; pos < len; pos += FOTA_VERIFY_BLOCK_SIZE ) {
+        size_t chunk = std::min( (size_t)FOTA_VERIFY_BLOCK_SIZE, len - pos );
+        _crcs[( offset + pos ) / FOTA_VERIFY_BLOCK_SIZE] = fota_crc32( 0, data + pos, chunk );
+    }
+}
+
+
+bool FOTAVerify::check( const esp_partition_t* partition, size_t size, uint8_t* sha256 )
+{
+    if( !partition || size > partition->size ) return false;
+
+    bool blocks = _crcs && !_overflow;
+    if( blocks && size != _written ) {
+        log_e("Verifying %d bytes but %d were written", size, _written);
+        return false;
+    }
+
+    mbedtls_md_context_t ctx;
+    if( sha256 ) {
+        mbedtls_md_init( &ctx );
+        mbedtls_md_setup( &ctx, mbedtls_md_info_from_type( MBEDTLS_MD_SHA256 ), 0 );
+        mbedtls_md_starts( &ctx );
+    }
+
+    bool ret = true;
+    for( size_t offset = 0; offset < size && ret; offset += FOTA_VERIFY_MMAP_WINDOW ) {
+        size_t len = std::min( (size_t)FOTA_VERIFY_MMAP_WINDOW, size - offset );
+        const void* ptr;
+        fota_mmap_handle_t handle;
+        if( esp_partition_mmap( partition, offset, len, FOTA_MMAP_DATA, &ptr, &handle ) != ESP_OK ) {
+            log_e("Unable to map %s at offset %d", partition->label, offset);
+            ret = false;
+            break;
+        }
+        const uint8_t* data = (const uint8_t*)ptr;
+        if( sha256 ) mbedtls_md_update( &ctx, data, len );
+        for( size_t pos = 0; blocks && pos < len; pos += FOTA_VERIFY_BLOCK_SIZE ) {
+            size_t block = ( offset + pos ) / FOTA_VERIFY_BLOCK_SIZE;
+            size_t chunk = std::min( (size_t)FOTA_VERIFY_BLOCK_SIZE, len - pos );
+            if( fota_crc32( 0, data + pos, chunk ) != _crcs[block] ) {
+                log_e("Flash block #%d (offset 0x%x of %s) doesn't match the written data", block, offset + pos, partition->label);
+                ret = false;
+                break;
+            }
+        }
+        fota_munmap( handle );
+    }
+
+    if( sha256 ) {
+        mbedtls_md_finish( &ctx, sha256 );
+        mbedtls_md_free( &ctx );
+    }
+    if( ret ) log_d("Verified %d bytes of %s through mmap%s", size, partition->label, blocks ? ", block digests match" : "");
+    return ret;
+}
@@ -0,0 +1,50 @@
+/*
+   esp32 firmware OTA
+   Written image verification (cfg.mmap_verify).
+
+   While the image is written, a CRC32 of every 4KB block is collected. After
+   writing, the partition is mapped with esp_partition_mmap() in 256KB
+   windows and hashed in place: no RAM buffer, no copy. Each block is also
+   compared with its CRC, so flash programming errors are caught (and
+   located) even when no signature is checked.
+   Reads go through the flash cache, so encrypted partitions are verified
+   against the plain image.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include "../memory/FOTAArena.hpp"
+
+#define FOTA_VERIFY_BLOCK_SIZE  4096
+#define FOTA_VERIFY_MMAP_WINDOW 0x40000 // multiple of the 64KB MMU page and of the block size
+
+
+class FOTAVerify
+{
+public:
+  FOTAVerify( FOTAArena& arena ) : _arena(arena) { }
+  ~FOTAVerify() { _arena.free( _crcs ); }
+
+  // allocate the block table for images up to max_size bytes
+  bool begin( size_t max_size );
+  // data written to the partition, in order
+  void update( const uint8_t* data, size_t len );
+  // data rewritten after it went through update(), offset is a multiple of the block size
+  void rewrite( size_t offset, const uint8_t* data, size_t len );
+  bool collecting() { return _crcs != nullptr; }
+
+  // Maps the first 'size' bytes of the partition, computes their sha256 (unless sha256 is nullptr)
+  // and compares the collected block CRCs. False on mismatch or when the partition can't be mapped.
+  bool check( const esp_partition_t* partition, size_t size, uint8_t* sha256 );
+
+  static constexpr size_t tableSize( size_t max_size ) { return ( ( max_size + FOTA_VERIFY_BLOCK_SIZE - 1 ) / FOTA_VERIFY_BLOCK_SIZE ) * sizeof(uint32_t); }
+
+private:
+  FOTAArena& _arena;
+  uint32_t*  _crcs = nullptr;
+  size_t     _blocks = 0;   // table capacity
+  size_t     _written = 0;
+  bool       _overflow = false;
+};
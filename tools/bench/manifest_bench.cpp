@@ -0,0 +1,152 @@
+/*
+   esp32 firmware OTA
+   Host microbenchmark of manifest matching, the counterpart of
+   examples/microBenchmark for manifests of 1, 100 and 10k entries.
+
+   Each check does what checkManifest() does with a manifest received by
+   execManifestCheck(): a document allocated for the check, deserializeJson(),
+   then the entries are scanned by "type" until the firmware matches, and
+   the version of the matching entry is parsed like SemverClass does and
+   compared with the current one. Reports ns/op and heap allocations/op
+   (malloc, calloc and realloc calls, counted by interposing glibc's
+   allocator), like tools/bench/semver_bench.c.
+
+   The document is sized per manifest: the one the device would allocate
+   (JSON_FW_BUFF_SIZE) when the manifest fits, otherwise it's doubled until
+   the manifest parses, and the -D JSON_FW_BUFF_SIZE needed on the device is
+   printed. Needs ArduinoJson 6, the library dependency (header only):
+
+     g++ -O2 -I<ArduinoJson>/src -Isrc/semver tools/bench/manifest_bench.cpp src/semver/semver.c -o manifest_bench
+     ./manifest_bench [iterations]
+
+   e.g. -I.pio/libdeps/<env>/ArduinoJson/src or -I$HOME/Arduino/libraries/ArduinoJson/src.
+   Exits with 1 when a manifest doesn't match.
+*/
+
+#if !__has_include(<ArduinoJson.h>)
+  #error "ArduinoJson 6 not found, add -I<path to ArduinoJson>/src"
+#endif
+
+#include <ArduinoJson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include "semver.h"
+
+#ifndef JSON_FW_BUFF_SIZE
+  #define JSON_FW_BUFF_SIZE 2048 // esp32FOTA.hpp default
+#endif
+
+extern "C" void* __libc_malloc( size_t size );
+extern "C" void* __libc_calloc( size_t n, size_t size );
+extern "C" void* __libc_realloc( void* ptr, size_t size );
+extern "C" void  __libc_free( void* ptr );
+
+static unsigned long allocs = 0;
+
+extern "C" void* malloc( size_t size ) { allocs++; return __libc_malloc( size ); }
+extern "C" void* calloc( size_t n, size_t size ) { allocs++; return __libc_calloc( n, size ); }
+extern "C" void* realloc( void* ptr, size_t size ) { allocs++; return __libc_realloc( ptr, size ); }
+extern "C" void  free( void* ptr ) { __libc_free( ptr ); }
+
+#define FIRMWARE_TYPE "esp32-fota-bench"
+
+static volatile int sink; // keeps results alive
+
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+// entries - 1 firmware types that don't match, then the matching one, same as examples/microBenchmark
+static std::string make_manifest( unsigned entries, bool host_port_bin )
+{
+    std::string json = "[";
+    for( unsigned i = 0; i < entries; i++ ) {
+        bool match = i == entries - 1;
+        json += "{\"type\":\"";
+        json += match ? FIRMWARE_TYPE : "esp32-fota-other-" + std::to_string( i );
+        json += "\",\"version\":\"1.2.4\",";
+        if( host_port_bin ) json += "\"host\":\"server.local\",\"port\":80,\"bin\":\"/fota/firmware-1.2.4.bin\"}";
+        else json += "\"url\":\"http://server.local/fota/firmware-1.2.4.bin\"}";
+        if( !match ) json += ",";
+    }
+    json += "]";
+    return json;
+}
+
+
+// 1: newer firmware found, 0: no match or invalid JSON, -1: doesn't fit a document of this capacity
+static int check( const std::string& json, size_t capacity, const semver_t& current )
+{
+    DynamicJsonDocument doc( capacity );
+    DeserializationError err = deserializeJson( doc, json.c_str(), json.size() );
+    if( err ) return err.code() == DeserializationError::NoMemory ? -1 : 0;
+
+    for( JsonVariant entry : doc.as<JsonArray>() ) {
+        const char* type = entry["type"].as<const char*>();
+        if( !type || strcmp( type, FIRMWARE_TYPE ) != 0 ) continue;
+
+        semver_t payload = semver_t();
+        if( !entry["version"].is<const char*>() || semver_parse_version( entry["version"].as<const char*>(), &payload ) ) return 0;
+        bool has_target = entry["url"].is<const char*>()
+          || ( entry["host"].is<const char*>() && entry["port"].is<uint16_t>() && entry["bin"].is<const char*>() );
+        int newer = semver_compare( payload, current ) == 1;
+        semver_free( &payload );
+        return has_target && newer;
+    }
+    return 0;
+}
+
+
+static bool bench( unsigned entries, bool host_port_bin, unsigned long iterations, const semver_t& current )
+{
+    std::string json = make_manifest( entries, host_port_bin );
+    char name[48];
+    snprintf( name, sizeof(name), "manifest_%u_%s", entries, host_port_bin ? "host" : "url" );
+
+    size_t capacity = JSON_FW_BUFF_SIZE;
+    while( check( json, capacity, current ) < 0 ) capacity *= 2;
+    if( capacity > JSON_FW_BUFF_SIZE ) {
+        DynamicJsonDocument doc( capacity );
+        deserializeJson( doc, json.c_str(), json.size() );
+        printf("%-20s %8zu bytes of JSON, needs -D JSON_FW_BUFF_SIZE=%zu on the device (default %d)\n",
+            name, json.size(), doc.memoryUsage(), JSON_FW_BUFF_SIZE);
+    }
+    if( check( json, capacity, current ) != 1 ) {
+        printf("%-20s FAIL: the last entry doesn't match\n", name);
+        return false;
+    }
+
+    unsigned long a = allocs;
+    double start = now_ns();
+    for( unsigned long i = 0; i < iterations; i++ ) {
+        sink += check( json, capacity, current );
+    }
+    double ns = ( now_ns() - start ) / iterations;
+    printf("%-20s %8zu byte document %14.1f ns/op %6.2f allocs/op\n", name, capacity, ns, (double)( allocs - a ) / iterations);
+    return true;
+}
+
+
+int main( int argc, char** argv )
+{
+    unsigned long iterations = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 100000;
+    semver_t current = semver_t();
+    semver_parse_version( "1.0.0", &current );
+
+    bool ok = true;
+    for( bool host_port_bin : { false, true } ) {
+        ok = bench( 1, host_port_bin, iterations, current ) && ok;
+        ok = bench( 100, host_port_bin, iterations / 100 + 1, current ) && ok;
+        ok = bench( 10000, host_port_bin, iterations / 10000 + 1, current ) && ok;
+    }
+    semver_free( &current );
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,123 @@
+/*
+   esp32 firmware OTA
+   Host microbenchmark of the semver functions used by manifest checks.
+
+   SemverClass( const char* ) runs semver_parse_version(), the manifest
+   version is then compared with semver_compare(). Reports ns/op and
+   heap allocations/op (malloc, calloc and realloc calls, counted by
+   interposing glibc's allocator):
+
+     cc -O2 -Isrc/semver tools/bench/semver_bench.c src/semver/semver.c -o semver_bench
+     ./semver_bench [iterations]
+
+   The ESP32 runs these at a fraction of the host speed, compare ratios
+   between runs rather than absolute figures, see examples/microBenchmark
+   for the on-device numbers.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "semver.h"
+
+extern void* __libc_malloc( size_t size );
+extern void* __libc_calloc( size_t n, size_t size );
+extern void* __libc_realloc( void* ptr, size_t size );
+extern void  __libc_free( void* ptr );
+
+static unsigned long allocs = 0;
+
+void* malloc( size_t size ) { allocs++; return __libc_malloc( size ); }
+void* calloc( size_t n, size_t size ) { allocs++; return __libc_calloc( n, size ); }
+void* realloc( void* ptr, size_t size ) { allocs++; return __libc_realloc( ptr, size ); }
+void  free( void* ptr ) { __libc_free( ptr ); }
+
+
+static const char* versions[] = {
+  "1.2.3",
+  "10.20.30",
+  "1.2.3-rc.1",
+  "1.2.3-alpha.1.beta+build.2024.10.18",
+  "2.0.0+sha.5114f85",
+};
+#define VERSIONS ( sizeof(versions) / sizeof(versions[0]) )
+
+static volatile int sink; // keeps results alive
+
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static void report( const char* name, const char* version, unsigned long iterations, double start, unsigned long allocs_start )
+{
+  double ns = ( now_ns() - start ) / iterations;
+  printf("%-22s %-60s %10.1f ns/op %6.2f allocs/op\n", name, version, ns, (double)( allocs - allocs_start ) / iterations);
+}
+
+
+int main( int argc, char** argv )
+{
+  unsigned long iterations = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 1000000;
+  semver_t parsed[VERSIONS];
+  char rendered[128];
+
+  for( size_t v = 0; v < VERSIONS; v++ ) {
+    memset( &parsed[v], 0, sizeof(semver_t) );
+    if( semver_parse( versions[v], &parsed[v] ) ) printf("%s: invalid\n", versions[v]);
+  }
+
+  for( size_t v = 0; v < VERSIONS; v++ ) {
+    semver_t ver = { 0 };
+    unsigned long a = allocs;
+    double start = now_ns();
+    int errors = 0;
+    for( unsigned long i = 0; i < iterations; i++ ) {
+      errors += semver_parse_version( versions[v], &ver ) != 0;
+    }
+    report( "semver_parse_version", versions[v], iterations, start, a );
+    if( errors ) printf("%22s %s is rejected: SemverClass defaults to 0.0.0\n", "", versions[v]);
+  }
+
+  for( size_t v = 0; v < VERSIONS; v++ ) {
+    unsigned long a = allocs;
+    double start = now_ns();
+    for( unsigned long i = 0; i < iterations; i++ ) {
+      semver_t ver = { 0 };
+      sink += semver_parse( versions[v], &ver );
+      semver_free( &ver );
+    }
+    report( "semver_parse+free", versions[v], iterations, start, a );
+  }
+
+  for( size_t v = 0; v < VERSIONS; v++ ) {
+    size_t w = ( v + 1 ) % VERSIONS;
+    unsigned long a = allocs;
+    double start = now_ns();
+    for( unsigned long i = 0; i < iterations; i++ ) {
+      sink += semver_compare( parsed[v], parsed[w] );
+    }
+    char pair[96];
+    snprintf( pair, sizeof(pair), "%s vs %s", versions[v], versions[w] );
+    report( "semver_compare", pair, iterations, start, a );
+  }
+
+  for( size_t v = 0; v < VERSIONS; v++ ) {
+    unsigned long a = allocs;
+    double start = now_ns();
+    for( unsigned long i = 0; i < iterations; i++ ) {
+      rendered[0] = '\0'; // semver_render() appends
+      semver_render( &parsed[v], rendered );
+    }
+    report( "semver_render", versions[v], iterations, start, a );
+  }
+
+  for( size_t v = 0; v < VERSIONS; v++ ) semver_free( &parsed[v] );
+  return 0;
+}
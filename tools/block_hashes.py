@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+"""
+Build the block hash list of an esp32FOTA image ("blocks" manifest key).
+
+The list is the sha256 of every block_size bytes of the unpacked image (the
+last block may be shorter), optionally preceded by an RSA signature of those
+digests, exactly like a signed image:
+
+  $ python3 block_hashes.py firmware.bin firmware.blocks
+  $ python3 block_hashes.py firmware.bin firmware.blocks --key priv_key.pem
+  $ python3 block_hashes.py firmware.bin --verify firmware.blocks [--pubkey rsa_key.pub]
+
+Serve firmware.bin itself (no signature header) at the manifest "url", signing
+needs the openssl command line tool. The block size must be a multiple of the
+4KB flash sector, and match the "block_size" manifest key when not 4096.
+"""
+
+import argparse
+import hashlib
+import os
+import subprocess
+import sys
+import tempfile
+
+SECTOR_SIZE = 4096
+
+
+def block_digests(image, block_size):
+    return b"".join(hashlib.sha256(image[i:i + block_size]).digest() for i in range(0, len(image), block_size))
+
+
+def openssl(args, data):
+    with tempfile.NamedTemporaryFile(delete=False) as f:
+        f.write(data)
+    try:
+        return subprocess.run(["openssl", "dgst", "-sha256"] + args + ["-binary", f.name],
+                              check=False, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    finally:
+        os.unlink(f.name)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", help="unpacked firmware image")
+    parser.add_argument("output", nargs="?", help="block hash list to write")
+    parser.add_argument("--block-size", type=int, default=SECTOR_SIZE, help="bytes per block (default: 4096)")
+    parser.add_argument("--key", help="RSA private key (PEM) signing the list")
+    parser.add_argument("--verify", metavar="LIST", help="compare the image with an existing list")
+    parser.add_argument("--pubkey", help="RSA public key (PEM) checking the signature of --verify")
+    parser.add_argument("--sig-len", type=int, default=512, help="signature length of --verify (default: 512)")
+    args = parser.parse_args()
+
+    if args.block_size <= 0 or args.block_size % SECTOR_SIZE:
+        parser.error("the block size must be a multiple of %d" % SECTOR_SIZE)
+
+    image = open(args.image, "rb").read()
+    digests = block_digests(image, args.block_size)
+    count = len(digests) // 32
+
+    if args.verify:
+        data = open(args.verify, "rb").read()
+        signature = b""
+        if args.pubkey:
+            signature, data = data[:args.sig_len], data[args.sig_len:]
+        if data != digests:
+            bad = [i for i in range(count) if data[i * 32:i * 32 + 32] != digests[i * 32:i * 32 + 32]]
+            sys.exit("%s: %d/%d blocks differ, first: #%d" % (args.verify, len(bad), count, bad[0] if bad else count))
+        if args.pubkey:
+            with tempfile.NamedTemporaryFile(delete=False) as f:
+                f.write(signature)
+            try:
+                result = openssl(["-verify", args.pubkey, "-signature", f.name], digests)
+            finally:
+                os.unlink(f.name)
+            if result.returncode != 0:
+                sys.exit("%s: bad signature" % args.verify)
+        print("%s: %d blocks of %d bytes match" % (args.verify, count, args.block_size), file=sys.stderr)
+        return
+
+    if not args.output:
+        parser.error("an output file is required")
+
+    signature = b""
+    if args.key:
+        result = openssl(["-sign", args.key, "-keyform", "PEM"], digests)
+        if result.returncode != 0:
+            sys.exit(result.stderr.decode(errors="replace"))
+        signature = result.stdout
+
+    with open(args.output, "wb") as f:
+        f.write(signature + digests)
+    print("%s: %d blocks of %d bytes%s" % (args.output, count, args.block_size,
+          ", %d bytes signature" % len(signature) if signature else ""), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,341 @@
+#!/usr/bin/env python3
+"""
+Local esp32FOTA server with scripted faults.
+
+Every scenario has its own manifest and image url, so a single server runs
+the whole matrix: http://HOST:PORT/s/<scenario>/manifest.json
+
+  baseline    clean download
+  throttled   bandwidth capped at --rate bytes/s
+  disconnect  the first attempt is cut at half the image, Content-Length announced
+  truncated   the image is served without its last 10%, Content-Length matching
+  bitflip     one bit flipped in the middle of the image
+  redirects   3 redirects before the image, with "?raw=true" urls like GitHub
+  no_length   no Content-Length, the body ends when the connection closes
+  chunked     Transfer-Encoding: chunked
+  busy        the first 2 attempts get 429 Too Many Requests with Retry-After
+
+A device running examples/faultScenarios walks through the scenarios and
+reports each result (POST /result/<scenario>), the server then prints the
+completion time and the wasted bytes (served bytes that didn't end up in a
+successful update) of each scenario:
+
+  $ python3 fault_server.py firmware.bin --host 192.168.1.10
+  $ python3 fault_server.py firmware.bin --smoke
+
+--smoke fetches every scenario with a minimal HTTP client: a smoke test of
+the server, checking that each fault is served as scripted. It doesn't run
+esp32FOTA, only a device does. Only the standard library is needed.
+"""
+
+import argparse
+import http.client
+import json
+import sys
+import threading
+import time
+import urllib.parse
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+# name: (expected result, description)
+SCENARIOS = {
+    "baseline": ("ok", "clean download"),
+    "throttled": ("ok", "bandwidth cap"),
+    "disconnect": ("ok", "cut at 50% on the first attempt"),
+    "truncated": ("reject", "last 10% missing"),
+    "bitflip": ("reject", "one bit flipped"),
+    "redirects": ("ok", "3 redirects"),
+    "no_length": ("ok", "no Content-Length"),
+    "chunked": ("ok", "chunked transfer"),
+    "busy": ("ok", "429 + Retry-After twice"),
+}
+
+REDIRECTS = 3
+BUSY_ATTEMPTS = 2
+CHUNK = 1460
+
+
+class Stats:
+    def __init__(self, name):
+        self.name = name
+        self.requests = 0  # image requests
+        self.sent = 0      # image bytes
+        self.started = None
+        self.result = None  # dict reported by the device
+
+    def start(self):
+        if self.started is None:
+            self.started = time.monotonic()
+
+
+class Server(ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, address, args, image):
+        super().__init__(address, Handler)
+        self.args = args
+        self.image = image
+        self.lock = threading.Lock()
+        self.stats = {name: Stats(name) for name in args.scenarios}
+        self.done = threading.Event()
+
+    def base_url(self):
+        return "http://%s:%d" % (self.args.host, self.server_address[1])
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, fmt, *args):
+        if self.server.args.verbose:
+            sys.stderr.write("%s %s\n" % (self.address_string(), fmt % args))
+
+    def reply(self, code, body=b"", content_type="text/plain", headers=()):
+        self.send_response(code)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        for name, value in headers:
+            self.send_header(name, value)
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_GET(self):
+        url = urllib.parse.urlparse(self.path)
+        parts = url.path.strip("/").split("/")
+        server = self.server
+
+        if parts == ["scenarios"]:
+            return self.reply(200, ("\n".join(server.stats) + "\n").encode())
+        if len(parts) != 3 or parts[0] != "s" or parts[1] not in server.stats:
+            return self.reply(404, b"not found\n")
+
+        stats = server.stats[parts[1]]
+        if parts[2] == "manifest.json":
+            with server.lock:
+                stats.start()
+            return self.manifest(stats)
+        if parts[2] == "firmware.bin":
+            return self.firmware(stats, 0)
+        if parts[2].startswith("r") and parts[2][1:].isdigit():
+            return self.firmware(stats, int(parts[2][1:]))
+        return self.reply(404, b"not found\n")
+
+    def manifest(self, stats):
+        args = self.server.args
+        url = "%s/s/%s/firmware.bin" % (self.server.base_url(), stats.name)
+        if stats.name == "redirects":
+            url += "?raw=true"
+        entry = {"type": args.type, "version": args.version, "url": url}
+        self.reply(200, json.dumps(entry).encode(), "application/json")
+
+    def firmware(self, stats, hop):
+        server = self.server
+        name = stats.name
+        image = server.image
+
+        if name == "redirects" and hop < REDIRECTS:
+            location = "%s/s/%s/r%d?raw=true" % (server.base_url(), name, hop + 1)
+            return self.reply(302, b"", headers=[("Location", location)])
+
+        with server.lock:
+            stats.requests += 1
+            attempt = stats.requests
+
+        if name == "busy" and attempt <= BUSY_ATTEMPTS:
+            return self.reply(429, b"slow down\n", headers=[("Retry-After", str(server.args.retry_after))])
+
+        body = image
+        if name == "truncated":
+            body = image[:len(image) * 9 // 10]
+        elif name == "bitflip":
+            flipped = bytearray(image)
+            flipped[len(image) // 2] ^= 0x10
+            body = bytes(flipped)
+        cut = len(body) // 2 if name == "disconnect" and attempt == 1 else None
+        rate = server.args.rate if name == "throttled" else 0
+
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        if name == "chunked":
+            self.send_header("Transfer-Encoding", "chunked")
+        elif name == "no_length":
+            self.send_header("Connection", "close")
+            self.close_connection = True
+        else:
+            self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+
+        started = time.monotonic()
+        pos = 0
+        try:
+            while pos < len(body):
+                end = min(pos + CHUNK, len(body))
+                if cut is not None and end > cut:
+                    end = cut
+                data = body[pos:end]
+                if name == "chunked":
+                    self.wfile.write(b"%x\r\n%s\r\n" % (len(data), data))
+                else:
+                    self.wfile.write(data)
+                pos = end
+                with server.lock:
+                    stats.sent += len(data)
+                if cut is not None and pos >= cut:
+                    self.close_connection = True
+                    return
+                if rate:
+                    delay = started + pos / rate - time.monotonic()
+                    if delay > 0:
+                        time.sleep(delay)
+            if name == "chunked":
+                self.wfile.write(b"0\r\n\r\n")
+        except (BrokenPipeError, ConnectionResetError):
+            self.close_connection = True
+
+    def do_POST(self):
+        url = urllib.parse.urlparse(self.path)
+        parts = url.path.strip("/").split("/")
+        length = int(self.headers.get("Content-Length") or 0)
+        if length:
+            self.rfile.read(length)
+        if len(parts) != 2 or parts[0] != "result" or parts[1] not in self.server.stats:
+            return self.reply(404, b"not found\n")
+        query = urllib.parse.parse_qs(url.query)
+        result = {
+            "ok": query.get("ok", ["0"])[0] == "1",
+            "ms": int(query.get("ms", ["0"])[0]),
+            "attempts": int(query.get("attempts", ["1"])[0]),
+        }
+        with self.server.lock:
+            stats = self.server.stats[parts[1]]
+            stats.result = result
+            if stats.started is not None:
+                result["server_ms"] = int((time.monotonic() - stats.started) * 1000)
+            finished = all(s.result for s in self.server.stats.values())
+        self.reply(200, b"ok\n")
+        print_row(stats, len(self.server.image))
+        if finished:
+            self.server.done.set()
+
+
+def wasted(stats, image_size):
+    ok = stats.result and stats.result["ok"]
+    return stats.sent - image_size if ok else stats.sent
+
+
+def print_header():
+    print("%-11s %-8s %-6s %8s %9s %10s %10s  %s" % (
+        "scenario", "expected", "result", "attempts", "time (s)", "served", "wasted", ""))
+
+
+def print_row(stats, image_size):
+    expected = SCENARIOS[stats.name][0]
+    result = stats.result
+    if not result:
+        print("%-11s %-8s %-6s" % (stats.name, expected, "-"))
+        return
+    got = "ok" if result["ok"] else "reject"
+    seconds = (result["ms"] or result.get("server_ms", 0)) / 1000
+    print("%-11s %-8s %-6s %8d %9.1f %10d %10d  %s" % (
+        stats.name, expected, got, result["attempts"], seconds, stats.sent,
+        wasted(stats, image_size), "PASS" if got == expected else "FAIL"))
+    sys.stdout.flush()
+
+
+def print_report(server):
+    """Rows are printed as results arrive, only list the scenarios left without one."""
+    failures = 0
+    for stats in server.stats.values():
+        if not stats.result:
+            print_row(stats, len(server.image))
+        if not stats.result or ("ok" if stats.result["ok"] else "reject") != SCENARIOS[stats.name][0]:
+            failures += 1
+    print("%d/%d scenarios as expected" % (len(server.stats) - failures, len(server.stats)))
+    return failures
+
+
+def smoke(server):
+    """Minimal client: follows redirects, honours Retry-After, retries 3 times."""
+    host, port = "127.0.0.1", server.server_address[1]
+    image = server.image
+    for name in server.stats:
+        started = time.monotonic()
+        conn = http.client.HTTPConnection(host, port, timeout=10)
+        conn.request("GET", "/s/%s/manifest.json" % name)
+        url = json.loads(conn.getresponse().read())["url"]
+        conn.close()
+        ok = False
+        attempts = 0
+        while attempts < 3 and not ok:
+            attempts += 1
+            path = urllib.parse.urlparse(url).path + "?" + (urllib.parse.urlparse(url).query or "")
+            for _ in range(REDIRECTS + 2):
+                conn = http.client.HTTPConnection(host, port, timeout=10)
+                conn.request("GET", path)
+                response = conn.getresponse()
+                if response.status in (301, 302):
+                    location = urllib.parse.urlparse(response.getheader("Location"))
+                    path = location.path + "?" + location.query
+                    response.read()
+                    conn.close()
+                    continue
+                break
+            if response.status == 429:
+                response.read()
+                time.sleep(int(response.getheader("Retry-After", "1")))
+                continue
+            try:
+                data = response.read()
+            except http.client.IncompleteRead:
+                data = b""
+            conn.close()
+            ok = data == image
+            if not ok and name in ("truncated", "bitflip"):
+                break  # a device rejects these, no point retrying
+        query = urllib.parse.urlencode({"ok": int(ok), "ms": int((time.monotonic() - started) * 1000), "attempts": attempts})
+        conn = http.client.HTTPConnection(host, port, timeout=10)
+        conn.request("POST", "/result/%s?%s" % (name, query))
+        conn.getresponse().read()
+        conn.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("firmware", help="image served by every scenario")
+    parser.add_argument("--host", default="127.0.0.1", help="address of this server in the manifest urls")
+    parser.add_argument("--port", type=int, default=8000)
+    parser.add_argument("--type", default="esp32-fota-http", help="firmware type of the manifests")
+    parser.add_argument("--version", default="999.0.0", help="version of the manifests, above the device's")
+    parser.add_argument("--rate", type=int, default=32768, help="bytes/s of the throttled scenario")
+    parser.add_argument("--retry-after", type=int, default=3, help="seconds, Retry-After of the busy scenario")
+    parser.add_argument("--scenarios", default=",".join(SCENARIOS), help="comma separated subset")
+    parser.add_argument("--smoke", action="store_true", help="fetch the scenarios with a minimal local client and exit")
+    parser.add_argument("-v", "--verbose", action="store_true", help="log requests")
+    args = parser.parse_args()
+
+    args.scenarios = [s for s in args.scenarios.split(",") if s]
+    unknown = [s for s in args.scenarios if s not in SCENARIOS]
+    if unknown:
+        parser.error("unknown scenario(s): %s" % ", ".join(unknown))
+    image = open(args.firmware, "rb").read()
+
+    server = Server(("", args.port), args, image)
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+    print("Serving %s (%d bytes), manifests at %s/s/<scenario>/manifest.json" % (
+        args.firmware, len(image), server.base_url()), file=sys.stderr)
+    print_header()
+
+    try:
+        if args.smoke:
+            smoke(server)
+        else:
+            server.done.wait()
+    except KeyboardInterrupt:
+        pass
+    server.shutdown()
+    return 1 if print_report(server) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
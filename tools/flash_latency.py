@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""
+Latency distribution of flash writes during updates (cfg.max_flash_block_us),
+see src/update/FOTASlicedWriter.hpp.
+
+  report    summarise the "latency,..." lines printed by examples/flashLatency
+
+  $ python3 flash_latency.py report capture.log
+
+Without a device, tools/host/flash_latency_bench.cpp runs the C++ writer
+against a flash timing model.
+
+Histograms use the buckets of FOTAFlashStats: below 125us, 250us, ... 64ms,
+and a last one without upper bound. Percentiles are bucket bounds.
+
+Only the standard library is needed.
+"""
+
+import argparse
+import sys
+
+BUCKETS = 11
+
+
+def bound(i):
+    return 125 << i
+
+
+class Histogram:
+    def __init__(self, label):
+        self.label = label
+        self.count = 0
+        self.max_us = 0
+        self.buckets = [0] * BUCKETS
+
+    def add(self, us):
+        i = 0
+        while i < BUCKETS - 1 and us >= bound(i):
+            i += 1
+        self.buckets[i] += 1
+        self.count += 1
+        self.max_us = max(self.max_us, us)
+
+    def percentile(self, permille):
+        target = (self.count * permille + 999) // 1000
+        total = 0
+        for i in range(BUCKETS - 1):
+            total += self.buckets[i]
+            if total >= target:
+                return bound(i)
+        return self.max_us
+
+    def print(self):
+        print("%s: %d samples, max %dus, p50 <%dus, p99 <%dus, p99.9 <%dus" % (
+            self.label, self.count, self.max_us, self.percentile(500),
+            self.percentile(990), self.percentile(999)))
+        width = max(self.buckets) or 1
+        for i, n in enumerate(self.buckets):
+            if i < BUCKETS - 1:
+                name = "<%6dus" % bound(i)
+            else:
+                name = ">=%5dus" % bound(i - 1)
+            bar = "#" * ((n * 40 + width - 1) // width)
+            print("  %s %8d %s" % (name, n, bar))
+        print()
+
+
+def parse(path):
+    histograms = []
+    with open(path, errors="replace") as f:
+        for line in f:
+            # serial captures may have a timestamp or log prefix
+            start = line.find("latency,")
+            if start < 0:
+                continue
+            fields = line[start:].strip().split(",")
+            if len(fields) != 4 + BUCKETS:
+                continue
+            try:
+                values = [int(v) for v in fields[2:]]
+            except ValueError:
+                continue
+            h = Histogram(fields[1])
+            h.count, h.max_us, h.buckets = values[0], values[1], values[2:]
+            histograms.append(h)
+    return histograms
+
+
+def report(args):
+    found = False
+    for path in args.captures:
+        histograms = parse(path)
+        if not histograms:
+            print("%s: no latency lines" % path, file=sys.stderr)
+            continue
+        found = True
+        if len(args.captures) > 1:
+            print("== %s" % path)
+        for h in histograms:
+            h.print()
+    return 0 if found else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("report", help="summarise captured serial output")
+    p.add_argument("captures", nargs="+", help="serial output of examples/flashLatency")
+    p.set_defaults(func=report)
+
+    args = parser.parse_args()
+    return args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
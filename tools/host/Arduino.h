@@ -0,0 +1,110 @@
+/*
+   esp32 firmware OTA
+   Host shim of the Arduino-ESP32 core.
+
+   Just enough of Arduino.h to build the codecs, transports, sinks and
+   writers of src/ on Linux, with the tools/host programs: String, Stream,
+   timing and logging. Implementations are in tools/host/host.cpp.
+
+   Log levels are selected at run time with FOTA_LOG=e|w|i|d|v (default: w).
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#define ESP_ARDUINO_VERSION_MAJOR 3
+
+#define log_e(format, ...) host_log( 'e', format, ##__VA_ARGS__ )
+#define log_w(format, ...) host_log( 'w', format, ##__VA_ARGS__ )
+#define log_i(format, ...) host_log( 'i', format, ##__VA_ARGS__ )
+#define log_d(format, ...) host_log( 'd', format, ##__VA_ARGS__ )
+#define log_v(format, ...) host_log( 'v', format, ##__VA_ARGS__ )
+
+void host_log( char level, const char* format, ... );
+
+unsigned long millis();
+unsigned long micros();
+void delay( uint32_t ms );
+void yield();
+uint32_t esp_random();
+
+
+class String : public std::string
+{
+public:
+  String() { }
+  String( const char* s ) : std::string( s ? s : "" ) { }
+  String( const std::string& s ) : std::string( s ) { }
+  String( char c ) : std::string( 1, c ) { }
+  String( int v ) : std::string( std::to_string( v ) ) { }
+  String( unsigned int v ) : std::string( std::to_string( v ) ) { }
+  String( long v ) : std::string( std::to_string( v ) ) { }
+  String( unsigned long v ) : std::string( std::to_string( v ) ) { }
+
+  bool isEmpty() const { return empty(); }
+  int  indexOf( char c, unsigned from = 0 ) const { return pos( find( c, from ) ); }
+  int  indexOf( const char* s, unsigned from = 0 ) const { return pos( find( s, from ) ); }
+  int  indexOf( const String& s, unsigned from = 0 ) const { return pos( find( s, from ) ); }
+  int  lastIndexOf( char c ) const { return pos( rfind( c ) ); }
+  bool startsWith( const String& s ) const { return compare( 0, s.size(), s ) == 0; }
+  bool endsWith( const String& s ) const { return size() >= s.size() && compare( size() - s.size(), s.size(), s ) == 0; }
+  bool equals( const String& s ) const { return *this == s; }
+  String substring( unsigned from ) const { return from < size() ? substr( from ) : std::string(); }
+  String substring( unsigned from, unsigned to ) const { return from < to && from < size() ? substr( from, to - from ) : std::string(); }
+  long toInt() const { return atol( c_str() ); }
+  char charAt( unsigned i ) const { return i < size() ? (*this)[i] : 0; }
+
+private:
+  static int pos( size_t p ) { return p == npos ? -1 : (int)p; }
+};
+
+
+class Print
+{
+public:
+  virtual ~Print() { }
+  virtual size_t write( uint8_t c ) = 0;
+  virtual size_t write( const uint8_t* data, size_t len )
+  {
+    size_t n = 0;
+    while( n < len && write( data[n] ) ) n++;
+    return n;
+  }
+  size_t write( const char* s ) { return write( (const uint8_t*)s, strlen( s ) ); }
+  size_t print( const char* s ) { return write( s ); }
+  size_t print( const String& s ) { return write( (const uint8_t*)s.c_str(), s.length() ); }
+  size_t println( const char* s = "" ) { return print( s ) + write( "\r\n" ); }
+  size_t println( const String& s ) { return print( s ) + write( "\r\n" ); }
+  virtual void flush() { }
+};
+
+
+// readBytes() waits up to getTimeout() ms for each byte, like the core
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  void setTimeout( unsigned long ms ) { _timeout = ms; }
+  unsigned long getTimeout() { return _timeout; }
+
+  virtual size_t readBytes( char* buffer, size_t length );
+  virtual size_t readBytes( uint8_t* buffer, size_t length ) { return readBytes( (char*)buffer, length ); }
+
+protected:
+  unsigned long _timeout = 1000;
+  int timedRead();
+};
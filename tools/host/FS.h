@@ -0,0 +1,74 @@
+/*
+   esp32 firmware OTA
+   Host shim of fs::FS over a directory of the host file system.
+
+     fs::FS sd( "/tmp/sdcard" ); // "/mcu/firmware.bin" is /tmp/sdcard/mcu/firmware.bin
+
+   Files are shared handles like the core ones: copies refer to the same
+   open file, which is closed by close() or when the last copy goes away.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <memory>
+
+#define FILE_READ   "r"
+#define FILE_WRITE  "w"
+#define FILE_APPEND "a"
+
+namespace fs
+{
+
+class File : public Stream
+{
+public:
+  File() { }
+  File( FILE* file, const String& path ) : _file( file, fclose ), _path( path ) { }
+
+  explicit operator bool() const { return _file != nullptr; }
+
+  size_t write( uint8_t c ) { return write( &c, 1 ); }
+  size_t write( const uint8_t* data, size_t len ) { return _file ? fwrite( data, 1, len, _file.get() ) : 0; }
+  int    available() { return _file ? (int)( size() - position() ) : 0; }
+  int    read() { return _file ? fgetc( _file.get() ) : -1; }
+  int    peek();
+  size_t read( uint8_t* buffer, size_t len ) { return _file ? fread( buffer, 1, len, _file.get() ) : 0; }
+  size_t readBytes( char* buffer, size_t len ) { return read( (uint8_t*)buffer, len ); }
+  void   flush() { if( _file ) fflush( _file.get() ); }
+  bool   seek( uint32_t pos ) { return _file && fseek( _file.get(), pos, SEEK_SET ) == 0; }
+  size_t position() { return _file ? ftell( _file.get() ) : 0; }
+  size_t size();
+  void   close() { _file.reset(); }
+  const char* path() const { return _path.c_str(); }
+
+private:
+  std::shared_ptr<FILE> _file;
+  String _path;
+};
+
+
+class FS
+{
+public:
+  FS( const char* root ) : _root( root ) { }
+
+  File open( const char* path, const char* mode = FILE_READ, bool create = false );
+  File open( const String& path, const char* mode = FILE_READ, bool create = false ) { return open( path.c_str(), mode, create ); }
+  bool exists( const char* path );
+  bool exists( const String& path ) { return exists( path.c_str() ); }
+  bool remove( const char* path );
+  bool remove( const String& path ) { return remove( path.c_str() ); }
+  bool rename( const char* from, const char* to );
+  bool rename( const String& from, const String& to ) { return rename( from.c_str(), to.c_str() ); }
+  bool mkdir( const char* path );
+
+private:
+  String _root;
+  String real( const char* path ) { return _root + ( path[0] == '/' ? "" : "/" ) + path; }
+};
+
+} // namespace fs
+
+using fs::FS;
+using fs::File;
@@ -0,0 +1,78 @@
+/*
+   esp32 firmware OTA
+   Two Streams connected back to back, like a UART between two chips, for
+   host programs running both ends of a transport in one process:
+
+     HostPipe link;
+     gateway.writer().setPort( &link.a );
+     device.setPort( &link.b );
+
+   Thread safe, one thread per end. Each direction can lose bytes, see
+   setLoss(), the frames of the serial protocol then fail their CRC.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <deque>
+#include <mutex>
+#include <random>
+
+class HostPipeEnd : public Stream
+{
+public:
+  HostPipeEnd( std::deque<uint8_t>& rx, std::deque<uint8_t>& tx, std::mutex& lock ) : _rx(rx), _tx(tx), _lock(lock) { }
+
+  // probability of losing each written byte
+  void setLoss( double loss, uint32_t seed = 1 ) { _loss = loss; _rng.seed( seed ); }
+
+  int available()
+  {
+    std::lock_guard<std::mutex> guard( _lock );
+    return _rx.size();
+  }
+  int read()
+  {
+    std::lock_guard<std::mutex> guard( _lock );
+    if( _rx.empty() ) return -1;
+    int c = _rx.front();
+    _rx.pop_front();
+    return c;
+  }
+  int peek()
+  {
+    std::lock_guard<std::mutex> guard( _lock );
+    return _rx.empty() ? -1 : _rx.front();
+  }
+  size_t write( uint8_t c ) { return write( &c, 1 ); }
+  size_t write( const uint8_t* data, size_t len )
+  {
+    std::lock_guard<std::mutex> guard( _lock );
+    for( size_t i = 0; i < len; i++ ) {
+      if( _loss > 0 && std::uniform_real_distribution<double>( 0, 1 )( _rng ) < _loss ) continue;
+      _tx.push_back( data[i] );
+    }
+    return len;
+  }
+
+private:
+  std::deque<uint8_t>& _rx;
+  std::deque<uint8_t>& _tx;
+  std::mutex&          _lock;
+  double               _loss = 0;
+  std::mt19937         _rng;
+};
+
+
+class HostPipe
+{
+public:
+  HostPipe() : a( _b_to_a, _a_to_b, _lock ), b( _a_to_b, _b_to_a, _lock ) { }
+
+private:
+  std::mutex          _lock;
+  std::deque<uint8_t> _a_to_b, _b_to_a;
+
+public:
+  HostPipeEnd a, b;
+};
@@ -0,0 +1,51 @@
+/*
+   esp32 firmware OTA
+   Host shim of the Update library: its constants, and an Update object that
+   refuses every image (FOTAUpdateWriter only needs to compile on the host,
+   host programs use the other writer policies).
+*/
+
+#pragma once
+
+#include <Arduino.h>
+
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+
+#define U_FLASH   0
+#define U_SPIFFS  100
+#define U_AUTH    200
+
+#define UPDATE_ERROR_OK           (0)
+#define UPDATE_ERROR_WRITE        (1)
+#define UPDATE_ERROR_ERASE        (2)
+#define UPDATE_ERROR_READ         (3)
+#define UPDATE_ERROR_SPACE        (4)
+#define UPDATE_ERROR_SIZE         (5)
+#define UPDATE_ERROR_STREAM       (6)
+#define UPDATE_ERROR_MD5          (7)
+#define UPDATE_ERROR_MAGIC_BYTE   (8)
+#define UPDATE_ERROR_ACTIVATE     (9)
+#define UPDATE_ERROR_NO_PARTITION (10)
+#define UPDATE_ERROR_BAD_ARGUMENT (11)
+#define UPDATE_ERROR_ABORT        (12)
+
+
+class UpdateClass
+{
+public:
+  typedef std::function<void(size_t, size_t)> THandlerFunction_Progress;
+
+  bool   begin( size_t, int = U_FLASH ) { _error = UPDATE_ERROR_NO_PARTITION; return false; }
+  size_t write( uint8_t*, size_t ) { return 0; }
+  size_t writeStream( Stream& ) { return 0; }
+  bool   end( bool = false ) { return false; }
+  void   abort() { _error = UPDATE_ERROR_ABORT; }
+  bool   isFinished() { return false; }
+  uint8_t getError() { return _error; }
+  UpdateClass& onProgress( THandlerFunction_Progress ) { return *this; }
+
+private:
+  uint8_t _error = UPDATE_ERROR_OK;
+};
+
+extern UpdateClass Update;
@@ -0,0 +1,53 @@
+/*
+   esp32 firmware OTA
+   Host shim of the WiFi library of the Arduino-ESP32 core.
+
+   IPAddress and the multicast receive side of WiFiUDP, what
+   MulticastFECStream uses, over a non blocking BSD socket. The group is
+   joined on the interface of FOTA_MULTICAST_IF=<address> (default: the one
+   of the route to the group), e.g. FOTA_MULTICAST_IF=127.0.0.1 to receive a
+   sender on the same host. Implementations are in tools/host/host.cpp.
+*/
+
+#pragma once
+
+#include <Arduino.h>
+#include <vector>
+
+class IPAddress
+{
+public:
+  IPAddress() { }
+  IPAddress( uint8_t a, uint8_t b, uint8_t c, uint8_t d ) : _bytes{ a, b, c, d } { }
+
+  bool fromString( const char* address );
+  bool fromString( const String& address ) { return fromString( address.c_str() ); }
+  String toString() const;
+
+  uint8_t operator[]( int index ) const { return _bytes[index]; }
+  uint8_t& operator[]( int index ) { return _bytes[index]; }
+
+private:
+  uint8_t _bytes[4] = { 0, 0, 0, 0 };
+};
+
+
+class WiFiUDP
+{
+public:
+  ~WiFiUDP() { stop(); }
+
+  uint8_t beginMulticast( IPAddress address, uint16_t port );
+  void stop();
+
+  // size of the next datagram, 0 when none is pending
+  int parsePacket();
+  int read( uint8_t* buffer, size_t len );
+  int read( char* buffer, size_t len ) { return read( (uint8_t*)buffer, len ); }
+  int available() { return _rx.size() - _pos; }
+
+private:
+  int                  _fd = -1;
+  std::vector<uint8_t> _rx;
+  size_t               _pos = 0;
+};
@@ -0,0 +1,120 @@
+/*
+   esp32 firmware OTA
+   Host benchmark of the policy based Update agent.
+
+   Instantiates FOTAUpdateAgent with the RAM writer and each digest policy,
+   feeds it an image by chunks of the sizes the transports use, and checks
+   the result against the reference: image bytes, SHA-256 (FIPS 180-4 known
+   answers first, then a one shot digest of the image). Reports MB/s per
+   chunk size, the cost of the digest is the difference between both lines:
+
+     g++ -std=gnu++17 -O2 -Itools/host -Isrc -o /tmp/agent_bench \
+       tools/host/agent_bench.cpp src/update/FOTAUpdateAgent.cpp src/update/FOTASinks.cpp tools/host/host.cpp -lpthread
+     /tmp/agent_bench [image_kb]
+
+   Exits with 1 when a check fails. Host figures only compare the policies,
+   flash writes dominate on the ESP32.
+*/
+
+#include <Arduino.h>
+#include <chrono>
+#include <vector>
+#include "update/FOTASinks.hpp"
+
+typedef FOTAUpdateAgent<FOTAMemoryWriter, FOTANoInflate, FOTANoDigest> PlainAgent;
+
+static int failures = 0;
+
+static void check( bool ok, const char* what )
+{
+    if( !ok ) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static String hex( const uint8_t* sha256 )
+{
+    char out[65];
+    for( int i = 0; i < 32; i++ ) snprintf( out + i * 2, 3, "%02x", sha256[i] );
+    return out;
+}
+
+static String oneShot( const uint8_t* data, size_t len )
+{
+    FOTASha256Digest digest;
+    uint8_t sha256[32];
+    if( !digest.begin() ) return "";
+    digest.update( data, len );
+    return digest.finish( sha256 ) ? hex( sha256 ) : "";
+}
+
+
+static void knownAnswers()
+{
+    std::string million( 1000000, 'a' );
+    check( oneShot( (const uint8_t*)"", 0 ) == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", "sha256('')" );
+    check( oneShot( (const uint8_t*)"abc", 3 ) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", "sha256('abc')" );
+    check( oneShot( (const uint8_t*)"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56 )
+        == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1", "sha256(448 bits)" );
+    check( oneShot( (const uint8_t*)million.c_str(), million.size() ) == "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", "sha256(1M 'a')" );
+}
+
+
+template <class Agent>
+static double run( Agent& agent, const std::vector<uint8_t>& image, size_t chunk, const String& expected, bool hashed )
+{
+    auto start = std::chrono::steady_clock::now();
+    bool ok = agent.begin( image.size(), U_FLASH, nullptr );
+    for( size_t done = 0; ok && done < image.size(); ) {
+        size_t n = std::min( chunk, image.size() - done );
+        ok = agent.write( image.data() + done, n ) == n;
+        done += n;
+    }
+    ok = ok && agent.end( false ) && agent.commit();
+    double s = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+    check( ok && agent.isFinished(), "agent accepted the image" );
+    check( agent.writer().size() == image.size() && memcmp( agent.writer().data(), image.data(), image.size() ) == 0, "image bytes" );
+    uint8_t sha256[32];
+    check( agent.digest( sha256 ) == hashed, "digest availability" );
+    if( hashed ) check( hex( sha256 ) == expected, "image digest" );
+    return image.size() / s / 1e6;
+}
+
+
+int main( int argc, char** argv )
+{
+    size_t kb = argc > 1 ? atoi( argv[1] ) : 1024;
+    std::vector<uint8_t> image( kb * 1024 );
+    uint32_t x = 0x12345678;
+    for( auto& b : image ) { x = x * 1103515245 + 12345; b = x >> 24; }
+
+    knownAnswers();
+    String expected = oneShot( image.data(), image.size() );
+
+    static const size_t chunks[] = { 64, 512, 1460, 4096 };
+    printf("%8s  %12s  %12s\n", "chunk", "no digest", "sha256");
+    for( size_t chunk : chunks ) {
+        PlainAgent plain;
+        FOTAMemorySink hashed;
+        double plain_mbs = 0, hashed_mbs = 0;
+        for( int i = 0; i < 5; i++ ) {
+            plain_mbs  = std::max( plain_mbs, run( plain, image, chunk, expected, false ) );
+            hashed_mbs = std::max( hashed_mbs, run( hashed, image, chunk, expected, true ) );
+        }
+        printf("%8zu  %7.0f MB/s  %7.0f MB/s\n", chunk, plain_mbs, hashed_mbs);
+    }
+
+    // a sink reused after an aborted update starts a fresh digest
+    FOTAMemorySink agent;
+    agent.begin( image.size(), U_FLASH, nullptr );
+    agent.write( image.data(), 1000 );
+    agent.abort();
+    uint8_t sha256[32];
+    check( !agent.digest( sha256 ), "no digest after abort()" );
+    run( agent, image, 1460, expected, true );
+
+    printf(failures ? "%d check(s) failed\n" : "all checks passed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,14 @@
+/*
+   esp32 firmware OTA
+   Host shim of the OTA API: the next update partition is the first app
+   partition with an OTA subtype that isn't the running one ("ota_0" runs).
+*/
+
+#pragma once
+
+#include "esp_partition.h"
+
+const esp_partition_t* esp_ota_get_running_partition();
+const esp_partition_t* esp_ota_get_next_update_partition( const esp_partition_t* start );
+esp_err_t esp_ota_set_boot_partition( const esp_partition_t* partition );
+const esp_partition_t* esp_ota_get_boot_partition();
@@ -0,0 +1,77 @@
+/*
+   esp32 firmware OTA
+   Host shim of the ESP-IDF partition API, over partitions backed by files.
+
+   Host programs declare their partition table first:
+
+     host_partition_add( "model", ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, 0x40000, "/tmp/model.bin" );
+
+   Partitions behave like NOR flash: erases set whole 4KB sectors to 0xff,
+   writes can only clear bits, so data written over sectors that weren't
+   erased comes out corrupted. host_flash_timing() makes each operation
+   busy-wait like the chip would, for latency benchmarks.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK                0
+#define ESP_FAIL              -1
+#define ESP_ERR_NO_MEM        0x101
+#define ESP_ERR_INVALID_ARG   0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE  0x104
+#define ESP_ERR_NOT_FOUND     0x105
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum {
+  ESP_PARTITION_TYPE_APP  = 0x00,
+  ESP_PARTITION_TYPE_DATA = 0x01,
+  ESP_PARTITION_TYPE_ANY  = 0xff,
+} esp_partition_type_t;
+
+typedef enum {
+  ESP_PARTITION_SUBTYPE_APP_FACTORY   = 0x00,
+  ESP_PARTITION_SUBTYPE_APP_OTA_0     = 0x10,
+  ESP_PARTITION_SUBTYPE_APP_OTA_1     = 0x11,
+  ESP_PARTITION_SUBTYPE_DATA_OTA      = 0x00,
+  ESP_PARTITION_SUBTYPE_DATA_PHY      = 0x01,
+  ESP_PARTITION_SUBTYPE_DATA_NVS      = 0x02,
+  ESP_PARTITION_SUBTYPE_DATA_COREDUMP = 0x03,
+  ESP_PARTITION_SUBTYPE_DATA_NVS_KEYS = 0x04,
+  ESP_PARTITION_SUBTYPE_DATA_EFUSE_EM = 0x05,
+  ESP_PARTITION_SUBTYPE_DATA_UNDEFINED = 0x06,
+  ESP_PARTITION_SUBTYPE_DATA_FAT      = 0x81,
+  ESP_PARTITION_SUBTYPE_DATA_SPIFFS   = 0x82,
+  ESP_PARTITION_SUBTYPE_DATA_LITTLEFS = 0x83,
+  ESP_PARTITION_SUBTYPE_ANY           = 0xff,
+} esp_partition_subtype_t;
+
+typedef struct {
+  void*                   flash_chip;
+  esp_partition_type_t    type;
+  esp_partition_subtype_t subtype;
+  uint32_t                address;
+  uint32_t                size;
+  uint32_t                erase_size;
+  char                    label[17];
+  bool                    encrypted;
+  bool                    readonly;
+} esp_partition_t;
+
+const esp_partition_t* esp_partition_find_first( esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label );
+esp_err_t esp_partition_read( const esp_partition_t* partition, size_t offset, void* dst, size_t size );
+esp_err_t esp_partition_write( const esp_partition_t* partition, size_t offset, const void* src, size_t size );
+esp_err_t esp_partition_erase_range( const esp_partition_t* partition, size_t offset, size_t size );
+
+
+// host only: a partition of 'size' bytes (multiple of 4KB), kept in 'path' or in RAM when it's nullptr
+const esp_partition_t* host_partition_add( const char* label, esp_partition_type_t type, esp_partition_subtype_t subtype, uint32_t size, const char* path = nullptr );
+
+// host only: busy-wait durations of the flash operations, 0 to disable (default)
+void host_flash_timing( uint32_t erase_sector_us, uint32_t program_page_us );
@@ -0,0 +1,85 @@
+/*
+   esp32 firmware OTA
+   Host benchmark of FOTASlicedWriter against a flash timing model.
+
+   The esp_partition shim busy-waits like the chip: a fixed time per sector
+   erase, and per 256 bytes page programmed. The same image is written
+   three times through the C++ writer, and its own FOTAFlashStats are
+   printed:
+
+   - burst:     no budget, 4KB programs like the Update library
+   - sliced:    cfg.max_flash_block_us, programs split under the budget
+   - pre-erase: sliced + cfg.flash_pre_erase, sectors erased by begin()
+
+   Sector erases can't be sliced: with pre-erase they leave the download
+   phase (the "download" line) for the begin() phase ("begin erases").
+   The written partition is compared with the image after each run:
+
+     g++ -std=gnu++17 -O2 -Itools/host -Isrc -o /tmp/flash_latency_bench \
+       tools/host/flash_latency_bench.cpp src/update/FOTASlicedWriter.cpp tools/host/host.cpp -lpthread
+     /tmp/flash_latency_bench [image_kb] [budget_us] [erase_us] [page_us]
+
+   Defaults: 256KB, 1000us, 45000us per sector, 700us per page. Exits with
+   1 when an image doesn't read back.
+*/
+
+#include <Arduino.h>
+#include <vector>
+#include "update/FOTASlicedWriter.hpp"
+
+static void print( const char* label, const FOTAFlashStats& stats )
+{
+    printf("  %-14s %6u ops %5u erases, max %6u us, p50 <%6u us, p99 <%6u us\n", label,
+        stats.ops, stats.erases, stats.max_us, stats.percentile( 50 ), stats.percentile( 99 ));
+}
+
+
+static bool run( const char* label, const esp_partition_t* target, const std::vector<uint8_t>& image, uint32_t budget, bool pre_erase )
+{
+    FOTASlicedWriter writer;
+    writer.setMaxBlockTime( budget );
+    writer.setPreErase( pre_erase );
+
+    uint32_t start = millis();
+    bool ok = writer.begin( image.size(), U_FLASH );
+    uint32_t erased = millis();
+    for( size_t done = 0; ok && done < image.size(); done += 1460 ) { // TCP segments
+        size_t n = std::min( (size_t)1460, image.size() - done );
+        ok = writer.write( image.data() + done, n ) == n;
+    }
+    ok = ok && writer.end( false );
+    uint32_t finished = millis();
+
+    std::vector<uint8_t> back( image.size() );
+    esp_partition_read( target, 0, back.data(), back.size() );
+    ok = ok && back == image;
+
+    printf("%s: %s, begin %u ms, download %u ms\n", label, ok ? "image ok" : "IMAGE MISMATCH", erased - start, finished - erased);
+    print( "download", writer.stats() );
+    if( pre_erase ) print( "begin erases", writer.eraseStats() );
+    return ok;
+}
+
+
+int main( int argc, char** argv )
+{
+    size_t   kb       = argc > 1 ? atoi( argv[1] ) : 256;
+    uint32_t budget   = argc > 2 ? atoi( argv[2] ) : 1000;
+    uint32_t erase_us = argc > 3 ? atoi( argv[3] ) : 45000;
+    uint32_t page_us  = argc > 4 ? atoi( argv[4] ) : 700;
+
+    host_partition_add( "app0", ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, 0x10000 );
+    const esp_partition_t* target = host_partition_add( "app1", ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, ( kb + 4 ) * 1024 & ~0xfff );
+    host_flash_timing( erase_us, page_us );
+
+    std::vector<uint8_t> image( kb * 1024 );
+    uint32_t x = 1;
+    for( auto& b : image ) { x = x * 1103515245 + 12345; b = x >> 24; }
+    image[0] = 0xE9; // app image magic
+
+    printf("%zu KB image, budget %u us, erase %u us/sector, program %u us/page\n\n", kb, budget, erase_us, page_us);
+    bool ok = run( "burst", target, image, UINT32_MAX / 2, false );
+    ok = run( "sliced", target, image, budget, false ) && ok;
+    ok = run( "pre-erase", target, image, budget, true ) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,22 @@
+/*
+   esp32 firmware OTA
+   Host shim of FreeRTOS: ticks are milliseconds, tasks are threads.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t TickType_t;
+typedef int      BaseType_t;
+typedef void*    TaskHandle_t;
+typedef void   (*TaskFunction_t)( void* );
+
+#define pdPASS              1
+#define pdFAIL              0
+#define portMAX_DELAY       0xffffffffUL
+#define portTICK_PERIOD_MS  1
+#define pdMS_TO_TICKS( ms ) ( (TickType_t)( ms ) )
+
+void vTaskDelay( TickType_t ticks );
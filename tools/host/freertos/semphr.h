@@ -0,0 +1,15 @@
+/*
+   esp32 firmware OTA
+   Host shim of FreeRTOS mutexes (taken and given by the same task).
+*/
+
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct HostSemaphore* SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+void       vSemaphoreDelete( SemaphoreHandle_t semaphore );
+BaseType_t xSemaphoreTake( SemaphoreHandle_t semaphore, TickType_t wait );
+BaseType_t xSemaphoreGive( SemaphoreHandle_t semaphore );
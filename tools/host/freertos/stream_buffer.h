@@ -0,0 +1,17 @@
+/*
+   esp32 firmware OTA
+   Host shim of FreeRTOS stream buffers (one writer, one reader).
+*/
+
+#pragma once
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+typedef struct HostStreamBuffer* StreamBufferHandle_t;
+
+StreamBufferHandle_t xStreamBufferCreate( size_t size, size_t trigger );
+void   vStreamBufferDelete( StreamBufferHandle_t buffer );
+size_t xStreamBufferSend( StreamBufferHandle_t buffer, const void* data, size_t len, TickType_t wait );
+size_t xStreamBufferReceive( StreamBufferHandle_t buffer, void* data, size_t len, TickType_t wait );
+size_t xStreamBufferBytesAvailable( StreamBufferHandle_t buffer );
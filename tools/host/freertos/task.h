@@ -0,0 +1,12 @@
+/*
+   esp32 firmware OTA
+   Host shim of FreeRTOS tasks: a detached thread per task, vTaskDelete()
+   only works on the calling task (the thread ends when its function returns).
+*/
+
+#pragma once
+
+#include "FreeRTOS.h"
+
+BaseType_t xTaskCreate( TaskFunction_t fn, const char* name, uint32_t stack, void* arg, int priority, TaskHandle_t* handle );
+void vTaskDelete( TaskHandle_t task );
@@ -0,0 +1,617 @@
+/*
+   esp32 firmware OTA
+   Implementations of the tools/host shims: time, logging, Stream, FS,
+   FreeRTOS tasks, mutexes and stream buffers, multicast UDP, partitions,
+   SHA-256.
+
+   Linked with every host program, e.g.
+
+     g++ -std=gnu++17 -O2 -Itools/host -Isrc -o /tmp/agent_bench \
+       tools/host/agent_bench.cpp src/update/FOTAUpdateAgent.cpp tools/host/host.cpp -lpthread
+*/
+
+#include <Arduino.h>
+#include <FS.h>
+#include <Update.h>
+#include <WiFi.h>
+#include <esp_partition.h>
+#include <esp_ota_ops.h>
+#include <freertos/stream_buffer.h>
+#include <mbedtls/md.h>
+#include <mbedtls/sha256.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+UpdateClass Update;
+
+
+// time and logging
+
+static const auto host_start = std::chrono::steady_clock::now();
+
+unsigned long millis()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - host_start ).count();
+}
+
+unsigned long micros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - host_start ).count();
+}
+
+void delay( uint32_t ms )
+{
+    std::this_thread::sleep_for( std::chrono::milliseconds( ms ) );
+}
+
+void yield()
+{
+    std::this_thread::yield();
+}
+
+uint32_t esp_random()
+{
+    static std::mt19937 rng( std::random_device{}() );
+    static std::mutex lock;
+    std::lock_guard<std::mutex> guard( lock );
+    return rng();
+}
+
+void host_log( char level, const char* format, ... )
+{
+    static const char* levels = "ewidv";
+    static int max = -1;
+    if( max < 0 ) {
+        const char* env = getenv( "FOTA_LOG" );
+        const char* pos = env && *env ? strchr( levels, env[0] ) : nullptr;
+        max = pos ? pos - levels : 1;
+    }
+    const char* pos = strchr( levels, level );
+    if( !pos || pos - levels > max ) return;
+
+    va_list args;
+    va_start( args, format );
+    fprintf( stderr, "[%6lu][%c] ", millis(), level - 'a' + 'A' );
+    vfprintf( stderr, format, args );
+    fputc( '\n', stderr );
+    va_end( args );
+}
+
+
+// Stream
+
+int Stream::timedRead()
+{
+    unsigned long start = millis();
+    do {
+        int c = read();
+        if( c >= 0 ) return c;
+        yield();
+    } while( millis() - start < _timeout );
+    return -1;
+}
+
+size_t Stream::readBytes( char* buffer, size_t length )
+{
+    size_t count = 0;
+    while( count < length ) {
+        int c = timedRead();
+        if( c < 0 ) break;
+        buffer[count++] = (char)c;
+    }
+    return count;
+}
+
+
+// FS
+
+namespace fs
+{
+
+int File::peek()
+{
+    if( !_file ) return -1;
+    int c = fgetc( _file.get() );
+    if( c != EOF ) ungetc( c, _file.get() );
+    return c;
+}
+
+size_t File::size()
+{
+    if( !_file ) return 0;
+    fflush( _file.get() );
+    struct stat st;
+    return fstat( fileno( _file.get() ), &st ) == 0 ? st.st_size : 0;
+}
+
+File FS::open( const char* path, const char* mode, bool create )
+{
+    String real_path = real( path );
+    if( create ) {
+        // like LittleFS: missing parent directories are created
+        for( size_t i = _root.size() + 1; ( i = real_path.find( '/', i ) ) != String::npos; i++ ) {
+            ::mkdir( real_path.substr( 0, i ).c_str(), 0755 );
+        }
+    }
+    FILE* file = fopen( real_path.c_str(), strcmp( mode, FILE_READ ) == 0 ? "rb" : strcmp( mode, FILE_APPEND ) == 0 ? "ab" : "wb" );
+    return file ? File( file, path ) : File();
+}
+
+bool FS::exists( const char* path )
+{
+    struct stat st;
+    return stat( real( path ).c_str(), &st ) == 0;
+}
+
+bool FS::remove( const char* path )
+{
+    return ::remove( real( path ).c_str() ) == 0;
+}
+
+bool FS::rename( const char* from, const char* to )
+{
+    return ::rename( real( from ).c_str(), real( to ).c_str() ) == 0;
+}
+
+bool FS::mkdir( const char* path )
+{
+    return ::mkdir( real( path ).c_str(), 0755 ) == 0 || errno == EEXIST;
+}
+
+} // namespace fs
+
+
+// FreeRTOS
+
+void vTaskDelay( TickType_t ticks )
+{
+    delay( ticks * portTICK_PERIOD_MS );
+}
+
+BaseType_t xTaskCreate( TaskFunction_t fn, const char* /*name*/, uint32_t /*stack*/, void* arg, int /*priority*/, TaskHandle_t* handle )
+{
+    std::thread( fn, arg ).detach();
+    if( handle ) *handle = (TaskHandle_t)fn;
+    return pdPASS;
+}
+
+void vTaskDelete( TaskHandle_t /*task*/ )
+{
+    // tasks end by returning from their function
+}
+
+struct HostSemaphore
+{
+    std::timed_mutex lock;
+};
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    return new HostSemaphore;
+}
+
+void vSemaphoreDelete( SemaphoreHandle_t semaphore )
+{
+    delete semaphore;
+}
+
+BaseType_t xSemaphoreTake( SemaphoreHandle_t semaphore, TickType_t wait )
+{
+    return semaphore->lock.try_lock_for( std::chrono::milliseconds( wait ) ) ? pdPASS : pdFAIL;
+}
+
+BaseType_t xSemaphoreGive( SemaphoreHandle_t semaphore )
+{
+    semaphore->lock.unlock();
+    return pdPASS;
+}
+
+struct HostStreamBuffer
+{
+    std::mutex              lock;
+    std::condition_variable changed;
+    std::deque<uint8_t>     data;
+    size_t                  size;
+};
+
+StreamBufferHandle_t xStreamBufferCreate( size_t size, size_t /*trigger*/ )
+{
+    StreamBufferHandle_t buffer = new HostStreamBuffer;
+    buffer->size = size;
+    return buffer;
+}
+
+void vStreamBufferDelete( StreamBufferHandle_t buffer )
+{
+    delete buffer;
+}
+
+size_t xStreamBufferSend( StreamBufferHandle_t buffer, const void* data, size_t len, TickType_t wait )
+{
+    std::unique_lock<std::mutex> guard( buffer->lock );
+    buffer->changed.wait_for( guard, std::chrono::milliseconds( wait ), [buffer]{ return buffer->data.size() < buffer->size; } );
+    size_t n = std::min( len, buffer->size - buffer->data.size() );
+    buffer->data.insert( buffer->data.end(), (const uint8_t*)data, (const uint8_t*)data + n );
+    buffer->changed.notify_all();
+    return n;
+}
+
+size_t xStreamBufferReceive( StreamBufferHandle_t buffer, void* data, size_t len, TickType_t wait )
+{
+    std::unique_lock<std::mutex> guard( buffer->lock );
+    buffer->changed.wait_for( guard, std::chrono::milliseconds( wait ), [buffer]{ return !buffer->data.empty(); } );
+    size_t n = std::min( len, buffer->data.size() );
+    std::copy( buffer->data.begin(), buffer->data.begin() + n, (uint8_t*)data );
+    buffer->data.erase( buffer->data.begin(), buffer->data.begin() + n );
+    buffer->changed.notify_all();
+    return n;
+}
+
+size_t xStreamBufferBytesAvailable( StreamBufferHandle_t buffer )
+{
+    std::lock_guard<std::mutex> guard( buffer->lock );
+    return buffer->data.size();
+}
+
+
+// WiFiUDP
+
+bool IPAddress::fromString( const char* address )
+{
+    struct in_addr addr;
+    if( inet_pton( AF_INET, address, &addr ) != 1 ) return false;
+    memcpy( _bytes, &addr.s_addr, 4 );
+    return true;
+}
+
+String IPAddress::toString() const
+{
+    char text[16];
+    snprintf( text, sizeof(text), "%u.%u.%u.%u", _bytes[0], _bytes[1], _bytes[2], _bytes[3] );
+    return text;
+}
+
+uint8_t WiFiUDP::beginMulticast( IPAddress address, uint16_t port )
+{
+    stop();
+    _fd = socket( AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP );
+    if( _fd < 0 ) return 0;
+    int one = 1, rcvbuf = 1 << 20; // lwIP drops what isn't read in time, a host has room
+    setsockopt( _fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+    setsockopt( _fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf) );
+
+    struct sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_port = htons( port );
+    local.sin_addr.s_addr = htonl( INADDR_ANY );
+    struct ip_mreq join = {};
+    IPAddress interface;
+    const char* env = getenv( "FOTA_MULTICAST_IF" );
+    if( env && !interface.fromString( env ) ) log_w("Invalid FOTA_MULTICAST_IF '%s'", env);
+    for( int i = 0; i < 4; i++ ) {
+        ((uint8_t*)&join.imr_multiaddr.s_addr)[i] = address[i];
+        ((uint8_t*)&join.imr_interface.s_addr)[i] = interface[i];
+    }
+    if( bind( _fd, (struct sockaddr*)&local, sizeof(local) ) != 0
+     || setsockopt( _fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &join, sizeof(join) ) != 0 ) {
+        log_e("Unable to join %s:%d: %s", address.toString().c_str(), port, strerror( errno ));
+        stop();
+        return 0;
+    }
+    return 1;
+}
+
+void WiFiUDP::stop()
+{
+    if( _fd >= 0 ) close( _fd );
+    _fd = -1;
+    _rx.clear();
+    _pos = 0;
+}
+
+int WiFiUDP::parsePacket()
+{
+    _rx.resize( 65536 );
+    _pos = 0;
+    ssize_t n = _fd < 0 ? -1 : recv( _fd, _rx.data(), _rx.size(), 0 );
+    _rx.resize( n > 0 ? n : 0 );
+    return _rx.size();
+}
+
+int WiFiUDP::read( uint8_t* buffer, size_t len )
+{
+    len = std::min( len, _rx.size() - _pos );
+    memcpy( buffer, _rx.data() + _pos, len );
+    _pos += len;
+    return len;
+}
+
+
+// partitions
+
+struct HostPartition
+{
+    esp_partition_t      info;
+    std::vector<uint8_t> ram;
+    FILE*                file;
+};
+
+static std::deque<HostPartition> host_partitions; // stable addresses
+static const esp_partition_t*    host_boot = nullptr;
+static uint32_t host_erase_us = 0, host_program_us = 0;
+
+static void busy_wait( uint32_t us )
+{
+    // the flash blocks the CPU, sleeping would hide that from latency measures
+    unsigned long start = micros();
+    while( micros() - start < us ) { }
+}
+
+static HostPartition* host_partition( const esp_partition_t* partition )
+{
+    for( auto& p : host_partitions ) {
+        if( &p.info == partition ) return &p;
+    }
+    return nullptr;
+}
+
+static bool host_access( HostPartition& p, size_t offset, uint8_t* data, size_t len, bool write )
+{
+    if( !p.file ) {
+        if( write ) memcpy( p.ram.data() + offset, data, len );
+        else memcpy( data, p.ram.data() + offset, len );
+        return true;
+    }
+    if( fseek( p.file, offset, SEEK_SET ) != 0 ) return false;
+    return ( write ? fwrite( data, 1, len, p.file ) : fread( data, 1, len, p.file ) ) == len && fflush( p.file ) == 0;
+}
+
+const esp_partition_t* host_partition_add( const char* label, esp_partition_type_t type, esp_partition_subtype_t subtype, uint32_t size, const char* path )
+{
+    if( size == 0 || size % SPI_FLASH_SEC_SIZE ) return nullptr;
+    host_partitions.emplace_back();
+    HostPartition& p = host_partitions.back();
+    uint32_t address = 0x10000;
+    for( auto& other : host_partitions ) address = std::max( address, other.info.address + other.info.size );
+    p.info = { nullptr, type, subtype, address, size, SPI_FLASH_SEC_SIZE, {}, false, false };
+    snprintf( p.info.label, sizeof(p.info.label), "%s", label );
+    p.file = nullptr;
+    if( path ) {
+        // an existing file keeps its content: tests can check what survived
+        p.file = fopen( path, "r+b" );
+        if( !p.file ) p.file = fopen( path, "w+b" );
+        if( !p.file ) { host_partitions.pop_back(); return nullptr; }
+        fseek( p.file, 0, SEEK_END );
+        std::vector<uint8_t> blank( SPI_FLASH_SEC_SIZE, 0xff );
+        for( long have = ftell( p.file ); have < (long)size; have += blank.size() ) fwrite( blank.data(), 1, blank.size(), p.file );
+        fflush( p.file );
+    } else {
+        p.ram.assign( size, 0xff );
+    }
+    return &p.info;
+}
+
+void host_flash_timing( uint32_t erase_sector_us, uint32_t program_page_us )
+{
+    host_erase_us   = erase_sector_us;
+    host_program_us = program_page_us;
+}
+
+const esp_partition_t* esp_partition_find_first( esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label )
+{
+    for( auto& p : host_partitions ) {
+        if( type != ESP_PARTITION_TYPE_ANY && p.info.type != type ) continue;
+        if( subtype != ESP_PARTITION_SUBTYPE_ANY && p.info.subtype != subtype ) continue;
+        if( label && strcmp( label, p.info.label ) != 0 ) continue;
+        return &p.info;
+    }
+    return nullptr;
+}
+
+esp_err_t esp_partition_read( const esp_partition_t* partition, size_t offset, void* dst, size_t size )
+{
+    HostPartition* p = host_partition( partition );
+    if( !p || !dst ) return ESP_ERR_INVALID_ARG;
+    if( offset > partition->size || size > partition->size - offset ) return ESP_ERR_INVALID_SIZE;
+    return host_access( *p, offset, (uint8_t*)dst, size, false ) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_write( const esp_partition_t* partition, size_t offset, const void* src, size_t size )
+{
+    HostPartition* p = host_partition( partition );
+    if( !p || !src ) return ESP_ERR_INVALID_ARG;
+    if( offset > partition->size || size > partition->size - offset ) return ESP_ERR_INVALID_SIZE;
+    // NOR flash: programming only clears bits
+    std::vector<uint8_t> cells( size );
+    if( !host_access( *p, offset, cells.data(), size, false ) ) return ESP_FAIL;
+    for( size_t i = 0; i < size; i++ ) cells[i] &= ( (const uint8_t*)src )[i];
+    busy_wait( host_program_us * ( ( size + 255 ) / 256 ) );
+    return host_access( *p, offset, cells.data(), size, true ) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_erase_range( const esp_partition_t* partition, size_t offset, size_t size )
+{
+    HostPartition* p = host_partition( partition );
+    if( !p ) return ESP_ERR_INVALID_ARG;
+    if( offset % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE ) return ESP_ERR_INVALID_SIZE;
+    if( offset > partition->size || size > partition->size - offset ) return ESP_ERR_INVALID_SIZE;
+    std::vector<uint8_t> blank( SPI_FLASH_SEC_SIZE, 0xff );
+    for( size_t done = 0; done < size; done += SPI_FLASH_SEC_SIZE ) {
+        busy_wait( host_erase_us );
+        if( !host_access( *p, offset + done, blank.data(), blank.size(), true ) ) return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+const esp_partition_t* esp_ota_get_running_partition()
+{
+    return esp_partition_find_first( ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, nullptr );
+}
+
+const esp_partition_t* esp_ota_get_next_update_partition( const esp_partition_t* /*start*/ )
+{
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    for( auto& p : host_partitions ) {
+        if( p.info.type != ESP_PARTITION_TYPE_APP || &p.info == running ) continue;
+        if( p.info.subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_0 ) return &p.info;
+    }
+    return nullptr;
+}
+
+esp_err_t esp_ota_set_boot_partition( const esp_partition_t* partition )
+{
+    if( !host_partition( partition ) || partition->type != ESP_PARTITION_TYPE_APP ) return ESP_ERR_INVALID_ARG;
+    host_boot = partition;
+    return ESP_OK;
+}
+
+const esp_partition_t* esp_ota_get_boot_partition()
+{
+    return host_boot ? host_boot : esp_ota_get_running_partition();
+}
+
+
+// SHA-256 (FIPS 180-4)
+
+struct mbedtls_md_info_t { mbedtls_md_type_t type; };
+static const mbedtls_md_info_t host_sha256_info = { MBEDTLS_MD_SHA256 };
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror( uint32_t x, int n ) { return ( x >> n ) | ( x << ( 32 - n ) ); }
+
+static void sha256_block( uint32_t* state, const uint8_t* block )
+{
+    uint32_t w[64];
+    for( int i = 0; i < 16; i++ ) {
+        w[i] = (uint32_t)block[i*4] << 24 | (uint32_t)block[i*4+1] << 16 | (uint32_t)block[i*4+2] << 8 | block[i*4+3];
+    }
+    for( int i = 16; i < 64; i++ ) {
+        uint32_t s0 = ror( w[i-15], 7 ) ^ ror( w[i-15], 18 ) ^ ( w[i-15] >> 3 );
+        uint32_t s1 = ror( w[i-2], 17 ) ^ ror( w[i-2], 19 ) ^ ( w[i-2] >> 10 );
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+    for( int i = 0; i < 64; i++ ) {
+        uint32_t t1 = h + ( ror( e, 6 ) ^ ror( e, 11 ) ^ ror( e, 25 ) ) + ( ( e & f ) ^ ( ~e & g ) ) + sha256_k[i] + w[i];
+        uint32_t t2 = ( ror( a, 2 ) ^ ror( a, 13 ) ^ ror( a, 22 ) ) + ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+        h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+const mbedtls_md_info_t* mbedtls_md_info_from_type( mbedtls_md_type_t type )
+{
+    return type == MBEDTLS_MD_SHA256 ? &host_sha256_info : nullptr;
+}
+
+void mbedtls_md_init( mbedtls_md_context_t* ctx )
+{
+    memset( ctx, 0, sizeof(*ctx) );
+}
+
+void mbedtls_md_free( mbedtls_md_context_t* ctx )
+{
+    memset( ctx, 0, sizeof(*ctx) );
+}
+
+int mbedtls_md_setup( mbedtls_md_context_t* ctx, const mbedtls_md_info_t* info, int hmac )
+{
+    if( !ctx || !info || hmac ) return -1;
+    ctx->md_info = info;
+    return 0;
+}
+
+int mbedtls_md_starts( mbedtls_md_context_t* ctx )
+{
+    static const uint32_t init[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    if( !ctx || !ctx->md_info ) return -1;
+    memcpy( ctx->state, init, sizeof(init) );
+    ctx->length = 0;
+    ctx->used   = 0;
+    return 0;
+}
+
+int mbedtls_md_update( mbedtls_md_context_t* ctx, const unsigned char* input, size_t len )
+{
+    if( !ctx || !ctx->md_info ) return -1;
+    ctx->length += len;
+    if( ctx->used ) {
+        size_t n = std::min( len, sizeof(ctx->block) - ctx->used );
+        memcpy( ctx->block + ctx->used, input, n );
+        ctx->used += n; input += n; len -= n;
+        if( ctx->used < sizeof(ctx->block) ) return 0;
+        sha256_block( ctx->state, ctx->block );
+        ctx->used = 0;
+    }
+    for( ; len >= 64; input += 64, len -= 64 ) sha256_block( ctx->state, input );
+    memcpy( ctx->block, input, len );
+    ctx->used = len;
+    return 0;
+}
+
+int mbedtls_md_finish( mbedtls_md_context_t* ctx, unsigned char* output )
+{
+    if( !ctx || !ctx->md_info ) return -1;
+    uint64_t bits = ctx->length * 8;
+    ctx->block[ctx->used++] = 0x80;
+    if( ctx->used > 56 ) {
+        memset( ctx->block + ctx->used, 0, 64 - ctx->used );
+        sha256_block( ctx->state, ctx->block );
+        ctx->used = 0;
+    }
+    memset( ctx->block + ctx->used, 0, 56 - ctx->used );
+    for( int i = 0; i < 8; i++ ) ctx->block[56+i] = bits >> ( 56 - i * 8 );
+    sha256_block( ctx->state, ctx->block );
+    for( int i = 0; i < 32; i++ ) output[i] = ctx->state[i/4] >> ( 24 - ( i % 4 ) * 8 );
+    return 0;
+}
+
+void mbedtls_sha256_init( mbedtls_sha256_context* ctx )
+{
+    mbedtls_md_init( ctx );
+}
+
+void mbedtls_sha256_free( mbedtls_sha256_context* ctx )
+{
+    mbedtls_md_free( ctx );
+}
+
+int mbedtls_sha256_starts( mbedtls_sha256_context* ctx, int is224 )
+{
+    if( is224 || mbedtls_md_setup( ctx, &host_sha256_info, 0 ) != 0 ) return -1;
+    return mbedtls_md_starts( ctx );
+}
+
+int mbedtls_sha256_update( mbedtls_sha256_context* ctx, const unsigned char* input, size_t len )
+{
+    return mbedtls_md_update( ctx, input, len );
+}
+
+int mbedtls_sha256_finish( mbedtls_sha256_context* ctx, unsigned char* output )
+{
+    return mbedtls_md_finish( ctx, output );
+}
@@ -0,0 +1,33 @@
+/*
+   esp32 firmware OTA
+   Host shim of the mbedtls message digest API, SHA-256 only.
+
+   The host has no mbedtls headers to rely on: tools/host/host.cpp carries a
+   plain FIPS 180-4 implementation, checked against known answers by
+   tools/host/agent_bench.cpp.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum { MBEDTLS_MD_NONE = 0, MBEDTLS_MD_SHA256 = 6 } mbedtls_md_type_t;
+
+typedef struct mbedtls_md_info_t mbedtls_md_info_t;
+
+typedef struct {
+  const mbedtls_md_info_t* md_info;
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t  block[64];
+  size_t   used;
+} mbedtls_md_context_t;
+
+const mbedtls_md_info_t* mbedtls_md_info_from_type( mbedtls_md_type_t type );
+void mbedtls_md_init( mbedtls_md_context_t* ctx );
+void mbedtls_md_free( mbedtls_md_context_t* ctx );
+int  mbedtls_md_setup( mbedtls_md_context_t* ctx, const mbedtls_md_info_t* info, int hmac );
+int  mbedtls_md_starts( mbedtls_md_context_t* ctx );
+int  mbedtls_md_update( mbedtls_md_context_t* ctx, const unsigned char* input, size_t len );
+int  mbedtls_md_finish( mbedtls_md_context_t* ctx, unsigned char* output );
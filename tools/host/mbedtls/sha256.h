@@ -0,0 +1,16 @@
+/*
+   esp32 firmware OTA
+   Host shim of the mbedtls SHA-256 API (3.x names), over the digest of md.h.
+*/
+
+#pragma once
+
+#include "md.h"
+
+typedef mbedtls_md_context_t mbedtls_sha256_context;
+
+void mbedtls_sha256_init( mbedtls_sha256_context* ctx );
+void mbedtls_sha256_free( mbedtls_sha256_context* ctx );
+int  mbedtls_sha256_starts( mbedtls_sha256_context* ctx, int is224 );
+int  mbedtls_sha256_update( mbedtls_sha256_context* ctx, const unsigned char* input, size_t len );
+int  mbedtls_sha256_finish( mbedtls_sha256_context* ctx, unsigned char* output );
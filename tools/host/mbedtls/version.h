@@ -0,0 +1,8 @@
+/*
+   esp32 firmware OTA
+   Host shim of mbedtls/version.h, the API of tools/host/mbedtls is the 3.x one.
+*/
+
+#pragma once
+
+#define MBEDTLS_VERSION_MAJOR 3
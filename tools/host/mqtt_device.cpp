@@ -0,0 +1,173 @@
+/*
+   esp32 firmware OTA
+   Device side of MQTT updates on the host: MQTTChunkStream over a broker.
+
+   A minimal MQTT 3.1.1 client (QoS 0) publishes for the stream and feeds
+   it the "<prefix>/down" messages from its own thread, like the task of
+   esp-mqtt or AsyncMqttClient. The image is read with the same calls as
+   esp32FOTA::execOTA with setMQTT() and saved, so tools/mqtt_fota.py can
+   run its sender against the C++ device instead of its own emulator:
+
+     g++ -std=gnu++17 -O2 -Itools/host -Isrc -o /tmp/mqtt_device \
+       tools/host/mqtt_device.cpp src/streams/MQTTChunkStream.cpp tools/host/host.cpp -lpthread
+     python3 tools/mqtt_fota.py loopback firmware.bin --device /tmp/mqtt_device --drop 0.05
+
+   or against any broker and a running "mqtt_fota.py send":
+
+     /tmp/mqtt_device <host:port> <prefix> <output> [window] [chunk]
+
+   Exits with 1 when the image isn't received whole.
+*/
+
+#include <Arduino.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+#include "streams/MQTTChunkStream.hpp"
+
+#define MQTT_CONNECT   0x10
+#define MQTT_PUBLISH   0x30
+#define MQTT_SUBSCRIBE 0x82
+
+class MqttClient
+{
+public:
+  bool connect( const char* host, const char* port, const char* client_id )
+  {
+    struct addrinfo hints = {}, *found = nullptr;
+    hints.ai_socktype = SOCK_STREAM;
+    if( getaddrinfo( host, port, &hints, &found ) != 0 ) return false;
+    for( struct addrinfo* a = found; a && _fd < 0; a = a->ai_next ) {
+      _fd = socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+      if( _fd >= 0 && ::connect( _fd, a->ai_addr, a->ai_addrlen ) != 0 ) { close( _fd ); _fd = -1; }
+    }
+    freeaddrinfo( found );
+    if( _fd < 0 ) return false;
+    int one = 1;
+    setsockopt( _fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+
+    std::string body = string( "MQTT" ) + std::string( "\x04\x02\x00\x3c", 4 ) + string( client_id ); // clean session, 60s keepalive
+    send( MQTT_CONNECT, body );
+    uint8_t connack[4];
+    return recvAll( connack, sizeof(connack) ) && connack[0] == 0x20 && connack[3] == 0;
+  }
+
+  void subscribe( const char* topic )
+  {
+    send( MQTT_SUBSCRIBE, std::string( "\x00\x01", 2 ) + string( topic ) + std::string( 1, '\0' ) );
+  }
+
+  bool publish( const char* topic, const uint8_t* payload, size_t len )
+  {
+    return send( MQTT_PUBLISH, string( topic ) + std::string( (const char*)payload, len ) );
+  }
+
+  // delivers PUBLISH packets until stop()
+  void run( std::function<void(const char*, const uint8_t*, size_t)> deliver )
+  {
+    uint8_t header;
+    while( recvAll( &header, 1 ) ) {
+      size_t length = 0;
+      uint8_t byte;
+      for( int shift = 0; recvAll( &byte, 1 ); shift += 7 ) {
+        length |= ( byte & 0x7f ) << shift;
+        if( !( byte & 0x80 ) ) break;
+      }
+      std::vector<uint8_t> body( length );
+      if( !recvAll( body.data(), length ) ) break;
+      if( ( header & 0xf0 ) != MQTT_PUBLISH || length < 2 ) continue; // SUBACK, PINGRESP
+      size_t n = body[0] << 8 | body[1];
+      size_t pos = 2 + n + ( header & 0x06 ? 2 : 0 ); // packet id of QoS 1/2
+      if( pos > length ) continue;
+      std::string topic( (const char*)&body[2], n );
+      deliver( topic.c_str(), body.data() + pos, length - pos );
+    }
+  }
+
+  void stop() { if( _fd >= 0 ) shutdown( _fd, SHUT_RDWR ); }
+  ~MqttClient() { if( _fd >= 0 ) close( _fd ); }
+
+private:
+  int _fd = -1;
+
+  static std::string string( const char* s )
+  {
+    size_t n = strlen( s );
+    return std::string( 1, (char)( n >> 8 ) ) + std::string( 1, (char)( n & 0xff ) ) + s;
+  }
+
+  bool send( uint8_t header, const std::string& body )
+  {
+    std::string packet( 1, (char)header );
+    size_t n = body.size();
+    do {
+      uint8_t byte = n % 128;
+      n /= 128;
+      packet += (char)( byte | ( n ? 0x80 : 0 ) );
+    } while( n );
+    packet += body;
+    return ::send( _fd, packet.data(), packet.size(), MSG_NOSIGNAL ) == (ssize_t)packet.size();
+  }
+
+  bool recvAll( uint8_t* data, size_t len )
+  {
+    for( size_t done = 0; done < len; ) {
+      ssize_t n = recv( _fd, data + done, len - done, 0 );
+      if( n <= 0 ) return false;
+      done += n;
+    }
+    return true;
+  }
+};
+
+
+int main( int argc, char** argv )
+{
+    if( argc < 4 ) {
+        printf("usage: %s <host:port> <prefix> <output> [window] [chunk]\n", argv[0]);
+        return 1;
+    }
+    std::string broker = argv[1];
+    size_t colon = broker.rfind( ':' );
+    std::string host = colon == std::string::npos ? broker : broker.substr( 0, colon );
+    std::string port = colon == std::string::npos ? "1883" : broker.substr( colon + 1 );
+    uint8_t  window = argc > 4 ? atoi( argv[4] ) : FOTA_MQTT_WINDOW;
+    uint16_t chunk  = argc > 5 ? atoi( argv[5] ) : FOTA_MQTT_CHUNK;
+
+    MqttClient mqtt;
+    char client_id[32];
+    snprintf( client_id, sizeof(client_id), "fota-device-%u", esp_random() & 0xffff );
+    if( !mqtt.connect( host.c_str(), port.c_str(), client_id ) ) {
+        printf("unable to connect to %s\n", argv[1]);
+        return 1;
+    }
+
+    MQTTChunkStream link;
+    link.setPublisher( [&mqtt]( const char* topic, const uint8_t* payload, size_t len ) { return mqtt.publish( topic, payload, len ); }, argv[2], window, chunk );
+    mqtt.subscribe( link.downTopic().c_str() );
+    std::thread client( &MqttClient::run, &mqtt, [&link]( const char* topic, const uint8_t* payload, size_t len ) { link.feed( topic, payload, len ); } );
+
+    link.setTimeout( 5000 );
+    int64_t size = link.begin( FOTA_MQTT_TARGET_FIRMWARE, 10000 );
+    std::vector<uint8_t> image;
+    std::vector<uint8_t> buffer( chunk );
+    while( size > 0 && (int64_t)image.size() < size ) {
+        size_t n = link.readBytes( buffer.data(), buffer.size() );
+        if( n == 0 ) break;
+        image.insert( image.end(), buffer.begin(), buffer.begin() + n );
+    }
+    bool ok = size >= 0 && (int64_t)image.size() == size;
+    link.end( ok );
+    mqtt.stop();
+    client.join();
+
+    FILE* out = fopen( argv[3], "wb" );
+    ok = out && fwrite( image.data(), 1, image.size(), out ) == image.size() && ok;
+    if( out ) fclose( out );
+    printf("%s: %zu/%lld bytes received, %u chunks received twice\n", ok ? "ok  " : "FAIL", image.size(), (long long)size, link.duplicates());
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,59 @@
+/*
+   esp32 firmware OTA
+   Device side of multicast updates on the host: MulticastFECStream over UDP.
+
+   Joins the group of a "udp://" url like esp32FOTA::execOTA with a
+   multicast manifest, reads the image with the same calls and saves it,
+   so tools/multicast_fota.py can run its sender against the C++ device
+   instead of its own Decoder:
+
+     g++ -std=gnu++17 -O2 -Itools/host -Isrc -o /tmp/multicast_device \
+       tools/host/multicast_device.cpp src/streams/MulticastFECStream.cpp \
+       src/streams/SerialFrameStream.cpp tools/host/host.cpp -lpthread
+     python3 tools/multicast_fota.py loopback firmware.bin --device /tmp/multicast_device --drop 0.05,0.1
+
+   or against a running "multicast_fota.py send" (see tools/host/WiFi.h for
+   FOTA_MULTICAST_IF):
+
+     /tmp/multicast_device <udp://group:port> <output> [window] [timeout_ms]
+
+   Exits with 1 when the image isn't received whole.
+*/
+
+#include <Arduino.h>
+#include <vector>
+#include "streams/MulticastFECStream.hpp"
+
+
+int main( int argc, char** argv )
+{
+    if( argc < 3 ) {
+        printf("usage: %s <udp://group:port> <output> [window] [timeout_ms]\n", argv[0]);
+        return 1;
+    }
+    uint8_t  window  = argc > 3 ? atoi( argv[3] ) : FOTA_MULTICAST_WINDOW;
+    uint32_t timeout = argc > 4 ? atoi( argv[4] ) : 10000;
+
+    MulticastFECStream link;
+    link.setWindow( window );
+    int64_t size = link.begin( argv[1], timeout );
+    link.setTimeout( timeout ); // counted from the last packet heard
+
+    std::vector<uint8_t> image;
+    std::vector<uint8_t> chunk( 4096 );
+    while( size > 0 && (int64_t)image.size() < size ) {
+        size_t n = link.readBytes( chunk.data(), chunk.size() );
+        if( n == 0 ) break;
+        image.insert( image.end(), chunk.begin(), chunk.begin() + n );
+    }
+    bool ok = size >= 0 && (int64_t)image.size() == size;
+    uint32_t packets = link.packets(), recovered = link.recovered(), waits = link.waits();
+    link.end();
+
+    FILE* out = fopen( argv[2], "wb" );
+    ok = out && fwrite( image.data(), 1, image.size(), out ) == image.size() && ok;
+    if( out ) fclose( out );
+    printf("%s: %zu/%lld bytes received, %u packets, %u rebuilt from parity, %u groups waited for another round\n",
+      ok ? "ok  " : "FAIL", image.size(), (long long)size, packets, recovered, waits);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,123 @@
+/*
+   esp32 firmware OTA
+   Host test of the named data partition writer, over file-backed partitions.
+
+   FOTAPartitionAgent writes a partition held in a temporary file with the
+   NOR flash rules of the esp_partition shim (a sector that wasn't erased
+   corrupts the data written over it). Checks the written image, sectors
+   past the image left untouched, writeStream() taking its buffer from the
+   arena, size and codec errors, and abort() after end() erasing the
+   partition like a failed sha256 check does:
+
+     g++ -std=gnu++17 -O2 -Itools/host -Isrc -o /tmp/partition_test tools/host/partition_test.cpp \
+       src/update/FOTAPartitionAgent.cpp src/memory/FOTAArena.cpp tools/host/host.cpp -lpthread
+     /tmp/partition_test
+
+   Exits with 1 when a check fails.
+*/
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <vector>
+#include "update/FOTAPartitionAgent.hpp"
+
+#define PARTITION_SIZE 0x10000
+
+static int failures = 0;
+
+static void check( bool ok, const char* what )
+{
+    printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+    if( !ok ) failures++;
+}
+
+static std::vector<uint8_t> readPartition( const esp_partition_t* partition, size_t offset, size_t len )
+{
+    std::vector<uint8_t> data( len );
+    esp_partition_read( partition, offset, data.data(), len );
+    return data;
+}
+
+static bool filled( const std::vector<uint8_t>& data, uint8_t value )
+{
+    for( uint8_t b : data ) if( b != value ) return false;
+    return true;
+}
+
+
+class MemoryStream : public Stream
+{
+public:
+  MemoryStream( const std::vector<uint8_t>& data ) : _data(data) { }
+  int available() { return _data.size() - _pos; }
+  int read() { return _pos < _data.size() ? _data[_pos++] : -1; }
+  int peek() { return _pos < _data.size() ? _data[_pos] : -1; }
+  size_t write( uint8_t ) { return 0; }
+private:
+  const std::vector<uint8_t>& _data;
+  size_t _pos = 0;
+};
+
+
+int main()
+{
+    char path[] = "/tmp/fota_partition_XXXXXX";
+    int fd = mkstemp( path );
+    if( fd < 0 ) return 1;
+    close( fd );
+
+    const esp_partition_t* model = host_partition_add( "model", ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_UNDEFINED, PARTITION_SIZE, path );
+    const esp_partition_t* nvs   = host_partition_add( "nvs", ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, 0x4000 );
+    check( model && FOTAPartitionAgent::find( "model" ) == model, "partition found by label" );
+    check( FOTAPartitionAgent::writable( model ) && !FOTAPartitionAgent::writable( nvs ), "system partitions refused" );
+
+    // previous content: 0x5a everywhere
+    std::vector<uint8_t> old( PARTITION_SIZE, 0x5a );
+    esp_partition_erase_range( model, 0, PARTITION_SIZE );
+    esp_partition_write( model, 0, old.data(), old.size() );
+
+    std::vector<uint8_t> image( 10000 );
+    for( size_t i = 0; i < image.size(); i++ ) image[i] = i * 7 + 3;
+
+    FOTAPartitionAgent agent( model );
+    check( agent.begin( image.size(), U_FOTA_PARTITION, nullptr ), "begin()" );
+    for( size_t done = 0, n = 1; done < image.size(); done += n, n = n * 3 % 1500 + 1 ) {
+        n = std::min( n, image.size() - done );
+        agent.write( image.data() + done, n );
+    }
+    check( agent.end( false ) && agent.isFinished(), "end()" );
+    check( readPartition( model, 0, image.size() ) == image, "image written over the previous content" );
+    check( filled( readPartition( model, 3 * SPI_FLASH_SEC_SIZE, PARTITION_SIZE - 3 * SPI_FLASH_SEC_SIZE ), 0x5a ), "sectors past the image untouched" );
+
+    // writeStream() from the arena
+    static uint8_t buffer[2048];
+    FOTAArena arena;
+    arena.begin( buffer, sizeof(buffer) );
+    {
+        FOTAArena::Scope scope( arena );
+        FOTAPartitionAgent streamed( model, &arena );
+        MemoryStream stream( image );
+        check( streamed.begin( image.size(), U_FOTA_PARTITION, nullptr ), "begin() for writeStream()" );
+        check( streamed.writeStream( stream, image.size() ) == image.size() && streamed.end( false ), "writeStream()" );
+        check( arena.peak() >= 512, "writeStream() buffer taken from the arena" );
+    }
+    check( arena.used() == 0, "arena released by its scope" );
+    check( readPartition( model, 0, image.size() ) == image, "streamed image" );
+
+    // sha256 mismatch: execPartitionOTA aborts after end()
+    agent.abort();
+    check( filled( readPartition( model, 0, PARTITION_SIZE ), 0xff ), "abort() after end() erases the partition" );
+
+    check( !agent.begin( PARTITION_SIZE + 1, U_FOTA_PARTITION, nullptr ) && agent.getError() == UPDATE_ERROR_SIZE, "image larger than the partition refused" );
+    check( !agent.begin( 100, U_FOTA_PARTITION, "zlib" ) && agent.getError() == UPDATE_ERROR_BAD_ARGUMENT, "zlib codec refused" );
+    check( agent.begin( 100, U_FOTA_PARTITION, nullptr ) && agent.write( image.data(), 101 ) == 0 && agent.getError() == UPDATE_ERROR_SPACE, "write past the announced size refused" );
+    check( agent.begin( 200, U_FOTA_PARTITION, nullptr ) && agent.write( image.data(), 100 ) == 100 && !agent.end( false ) && agent.getError() == UPDATE_ERROR_SIZE, "premature end refused" );
+    check( agent.begin( UPDATE_SIZE_UNKNOWN, U_FOTA_PARTITION, nullptr ) && agent.write( image.data(), 100 ) == 100 && agent.end( true ), "unknown size image" );
+
+    FOTAPartitionAgent system( nvs );
+    check( !system.begin( 100, U_FOTA_PARTITION, nullptr ) && system.getError() == UPDATE_ERROR_BAD_ARGUMENT, "nvs partition not written" );
+
+    remove( path );
+    printf(failures ? "%d check(s) failed\n" : "all checks passed\n", failures);
+    return failures ? 1 : 0;
+}
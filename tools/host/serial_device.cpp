@@ -0,0 +1,123 @@
+/*
+   esp32 firmware OTA
+   Device side of serial updates on the host: SerialFrameStream over a tty.
+
+   Requests a firmware image like esp32FOTA::execOTA with setSerialPort(),
+   reads it with the same calls and saves it, so tools/serial_fota.py can
+   run its host side against the C++ device instead of its own emulator:
+
+     g++ -std=gnu++17 -O2 -Itools/host -Isrc -o /tmp/serial_device \
+       tools/host/serial_device.cpp src/streams/SerialFrameStream.cpp tools/host/host.cpp -lpthread
+     python3 tools/serial_fota.py loopback firmware.bin --device /tmp/serial_device --drop 0.05
+
+   or by hand, on one end of a pty pair (see tools/serial_fota.py):
+
+     /tmp/serial_device <tty> <output> [window] [payload] [flash_delay_ms]
+
+   flash_delay_ms is spent after each payload read, like flash writes.
+   Exits with 1 when the image isn't received whole.
+*/
+
+#include <Arduino.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
+#include "streams/SerialFrameStream.hpp"
+
+// non blocking tty, a UART with a large rx buffer
+class TtyStream : public Stream
+{
+public:
+  bool begin( const char* path )
+  {
+    _fd = open( path, O_RDWR | O_NOCTTY | O_NONBLOCK );
+    if( _fd < 0 ) return false;
+    struct termios attrs;
+    if( tcgetattr( _fd, &attrs ) == 0 ) {
+      cfmakeraw( &attrs );
+      tcsetattr( _fd, TCSANOW, &attrs );
+    }
+    return true;
+  }
+
+  int available()
+  {
+    fill();
+    return _rx.size() - _pos;
+  }
+  int read()
+  {
+    if( !available() ) return -1;
+    return _rx[_pos++];
+  }
+  int peek() { return available() ? _rx[_pos] : -1; }
+  size_t write( uint8_t c ) { return write( &c, 1 ); }
+  size_t write( const uint8_t* data, size_t len )
+  {
+    size_t done = 0;
+    while( done < len ) {
+      ssize_t n = ::write( _fd, data + done, len - done );
+      if( n > 0 ) {
+        done += n;
+      } else {
+        struct pollfd out = { _fd, POLLOUT, 0 };
+        if( poll( &out, 1, 100 ) < 0 ) break;
+      }
+    }
+    return done;
+  }
+
+private:
+  int                  _fd = -1;
+  std::vector<uint8_t> _rx;
+  size_t               _pos = 0;
+
+  void fill()
+  {
+    if( _pos == _rx.size() ) { _rx.clear(); _pos = 0; }
+    uint8_t buffer[4096];
+    ssize_t n;
+    while( ( n = ::read( _fd, buffer, sizeof(buffer) ) ) > 0 ) _rx.insert( _rx.end(), buffer, buffer + n );
+  }
+};
+
+
+int main( int argc, char** argv )
+{
+    if( argc < 3 ) {
+        printf("usage: %s <tty> <output> [window] [payload] [flash_delay_ms]\n", argv[0]);
+        return 1;
+    }
+    uint8_t  window   = argc > 3 ? atoi( argv[3] ) : FOTA_SERIAL_WINDOW;
+    uint16_t payload  = argc > 4 ? atoi( argv[4] ) : FOTA_SERIAL_MAX_PAYLOAD;
+    uint32_t delay_ms = argc > 5 ? atoi( argv[5] ) : 0;
+
+    TtyStream port;
+    if( !port.begin( argv[1] ) ) {
+        printf("unable to open %s\n", argv[1]);
+        return 1;
+    }
+    SerialFrameStream link;
+    link.setPort( &port, window, payload );
+    link.setTimeout( 5000 );
+    int64_t size = link.begin( FOTA_SERIAL_TARGET_FIRMWARE, 10000 );
+
+    std::vector<uint8_t> image;
+    std::vector<uint8_t> chunk( payload );
+    while( size > 0 && (int64_t)image.size() < size ) {
+        size_t n = link.readBytes( chunk.data(), chunk.size() );
+        if( n == 0 ) break;
+        image.insert( image.end(), chunk.begin(), chunk.begin() + n );
+        if( delay_ms ) delay( delay_ms );
+    }
+    bool ok = size >= 0 && (int64_t)image.size() == size;
+    link.end( ok );
+
+    FILE* out = fopen( argv[2], "wb" );
+    ok = out && fwrite( image.data(), 1, image.size(), out ) == image.size() && ok;
+    if( out ) fclose( out );
+    printf("%s: %zu/%lld bytes received, %u frames received twice\n", ok ? "ok  " : "FAIL", image.size(), (long long)size, link.retransmits());
+    return ok ? 0 : 1;
+}
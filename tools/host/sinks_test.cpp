@@ -0,0 +1,134 @@
+/*
+   esp32 firmware OTA
+   Host test of the update sinks, on a temporary directory.
+
+   Runs FOTAFileSink and FOTAMemorySink through the calls execOTA makes:
+   begin(), write(), end(), then commit() when the image passed its checks
+   or abort() when it didn't (e.g. signature mismatch). The file sink must
+   keep the previous file until commit(), and never leave "<path>.part"
+   behind:
+
+     g++ -std=gnu++17 -O2 -Itools/host -Isrc -o /tmp/sinks_test \
+       tools/host/sinks_test.cpp src/update/FOTAUpdateAgent.cpp src/update/FOTASinks.cpp tools/host/host.cpp -lpthread
+     /tmp/sinks_test
+
+   Exits with 1 when a check fails.
+*/
+
+#include <Arduino.h>
+#include <FS.h>
+#include <vector>
+#include "update/FOTASinks.hpp"
+
+static int failures = 0;
+
+static void check( bool ok, const char* what )
+{
+    printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+    if( !ok ) failures++;
+}
+
+static std::vector<uint8_t> image( size_t len, uint8_t seed )
+{
+    std::vector<uint8_t> data( len );
+    for( size_t i = 0; i < len; i++ ) data[i] = (uint8_t)( i * 31 + seed );
+    return data;
+}
+
+static std::vector<uint8_t> content( fs::FS& fs, const char* path )
+{
+    fs::File file = fs.open( path );
+    std::vector<uint8_t> data( file ? file.size() : 0 );
+    if( file ) file.read( data.data(), data.size() );
+    return data;
+}
+
+// begin + write + end, like execOTA until the checks
+static bool download( FOTAAgent& agent, const std::vector<uint8_t>& data, size_t size, int partition = U_FLASH )
+{
+    if( !agent.begin( size, partition, nullptr ) ) return false;
+    for( size_t done = 0; done < data.size(); done += 1000 ) {
+        size_t n = std::min( (size_t)1000, data.size() - done );
+        if( agent.write( data.data() + done, n ) != n ) return false;
+    }
+    return agent.end( false );
+}
+
+
+static void fileSink( fs::FS& fs )
+{
+    auto v1 = image( 10000, 1 ), v2 = image( 12345, 2 ), v3 = image( 8000, 3 );
+    FOTAFileSink sink;
+    sink.writer().setFile( fs, "/mcu/firmware.bin", "/mcu/data.bin" );
+
+    check( download( sink, v1, v1.size() ) && sink.commit(), "first image committed" );
+    check( content( fs, "/mcu/firmware.bin" ) == v1, "file holds the first image" );
+    check( sink.isFinished(), "finished after commit()" );
+
+    // signature mismatch: end() succeeded, then execOTA aborts
+    check( download( sink, v2, v2.size() ), "second image ended" );
+    check( !sink.isFinished(), "not finished before commit()" );
+    check( content( fs, "/mcu/firmware.bin" ) == v1, "previous file untouched before commit()" );
+    uint8_t sha256[32];
+    check( sink.digest( sha256 ), "digest available after end()" );
+    sink.abort();
+    check( content( fs, "/mcu/firmware.bin" ) == v1, "previous file kept after abort()" );
+    check( !fs.exists( "/mcu/firmware.bin.part" ), "no .part left after abort()" );
+    check( !sink.commit(), "commit() refused after abort()" );
+
+    // checks passed
+    check( download( sink, v2, v2.size() ) && sink.commit(), "second image committed" );
+    check( content( fs, "/mcu/firmware.bin" ) == v2, "file replaced by commit()" );
+    check( !fs.exists( "/mcu/firmware.bin.part" ), "no .part left after commit()" );
+    sink.abort(); // late abort, e.g. an error after commit(): the committed file stays
+    check( content( fs, "/mcu/firmware.bin" ) == v2, "committed file kept by a later abort()" );
+
+    // short download
+    check( !download( sink, v3, v3.size() + 1 ), "premature end refused" );
+    check( sink.getError() == UPDATE_ERROR_SIZE, "premature end reports UPDATE_ERROR_SIZE" );
+    check( !sink.digest( sha256 ), "no digest of a refused image" );
+    check( content( fs, "/mcu/firmware.bin" ) == v2 && !fs.exists( "/mcu/firmware.bin.part" ), "premature end keeps the previous file" );
+
+    // oversized image
+    check( !download( sink, v3, v3.size() - 1 ), "oversized image refused" );
+    check( sink.getError() == UPDATE_ERROR_SPACE, "oversized image reports UPDATE_ERROR_SPACE" );
+    sink.abort();
+    check( content( fs, "/mcu/firmware.bin" ) == v2 && !fs.exists( "/mcu/firmware.bin.part" ), "oversized image keeps the previous file" );
+
+    // unknown size, filesystem image
+    check( download( sink, v3, UPDATE_SIZE_UNKNOWN, U_SPIFFS ) && sink.commit(), "unknown size image committed" );
+    check( content( fs, "/mcu/data.bin" ) == v3 && content( fs, "/mcu/firmware.bin" ) == v2, "U_SPIFFS image went to fs_path" );
+
+    FOTAFileSink unset;
+    check( !unset.begin( 100, U_FLASH, nullptr ) && unset.getError() == UPDATE_ERROR_NO_PARTITION, "no file set: UPDATE_ERROR_NO_PARTITION" );
+}
+
+
+static void memorySink()
+{
+    auto v1 = image( 5000, 4 );
+    FOTAMemorySink sink;
+    check( download( sink, v1, v1.size() ) && sink.commit(), "memory image committed" );
+    check( sink.writer().size() == v1.size() && memcmp( sink.writer().data(), v1.data(), v1.size() ) == 0, "memory image content" );
+
+    uint8_t buffer[4096];
+    sink.writer().setBuffer( buffer, sizeof(buffer) );
+    check( !download( sink, v1, v1.size() ) && sink.getError() == UPDATE_ERROR_SPACE, "fixed buffer overflow: UPDATE_ERROR_SPACE" );
+}
+
+
+int main()
+{
+    char root[] = "/tmp/fota_sinks_XXXXXX";
+    if( !mkdtemp( root ) ) return 1;
+    fs::FS fs( root );
+    fs.mkdir( "/mcu" );
+
+    fileSink( fs );
+    memorySink();
+
+    String cleanup = String( "rm -rf " ) + root;
+    if( system( cleanup.c_str() ) != 0 ) printf("unable to remove %s\n", root);
+    printf(failures ? "%d check(s) failed\n" : "all checks passed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,149 @@
+/*
+   esp32 firmware OTA
+   Host test of the tee agent and the serial sink.
+
+   A FOTATeeAgent writes to a RAM primary, a file sink and a FOTASerialSink
+   linked to a SerialFrameStream device running in another thread (the C++
+   device side of serial updates, over HostPipe). Checks that end() keeps
+   the image out of every sink until commit(), and that abort() after end()
+   discards the file and makes the device give up:
+
+     g++ -std=gnu++17 -O2 -Itools/host -Isrc -o /tmp/tee_test tools/host/tee_test.cpp \
+       src/update/FOTATeeAgent.cpp src/update/FOTASerialWriter.cpp src/update/FOTASinks.cpp \
+       src/update/FOTAUpdateAgent.cpp src/streams/SerialFrameStream.cpp tools/host/host.cpp -lpthread
+     /tmp/tee_test
+
+   Exits with 1 when a check fails.
+*/
+
+#include <Arduino.h>
+#include <FS.h>
+#include <thread>
+#include <vector>
+#include "update/FOTASinks.hpp"
+#include "update/FOTASerialWriter.hpp"
+#include "update/FOTATeeAgent.hpp"
+#include "HostPipe.h"
+
+static int failures = 0;
+
+static void check( bool ok, const char* what )
+{
+    printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+    if( !ok ) failures++;
+}
+
+static std::vector<uint8_t> content( fs::FS& fs, const char* path )
+{
+    fs::File file = fs.open( path );
+    std::vector<uint8_t> data( file ? file.size() : 0 );
+    if( file ) file.read( data.data(), data.size() );
+    return data;
+}
+
+
+// device side, like esp32FOTA::execOTA with setSerialPort()
+struct Device
+{
+    HostPipeEnd*         port;
+    std::vector<uint8_t> image;
+    int64_t              size = -1;
+    volatile bool        done = false;
+
+    void run()
+    {
+        SerialFrameStream link;
+        link.setPort( port, 8, 256 );
+        link.setTimeout( 3000 ); // stream timeout: the gateway checks the image meanwhile
+        size = link.begin( FOTA_SERIAL_TARGET_FIRMWARE, 5000 );
+        uint8_t chunk[700];
+        while( size > 0 && (int64_t)image.size() < size ) {
+            size_t n = link.readBytes( chunk, sizeof(chunk) );
+            if( n == 0 ) break;
+            image.insert( image.end(), chunk, chunk + n );
+        }
+        link.end( size > 0 && (int64_t)image.size() == size );
+        done = true;
+    }
+};
+
+
+static bool download( FOTAAgent& agent, const std::vector<uint8_t>& data )
+{
+    if( !agent.begin( data.size(), U_FLASH, nullptr ) ) return false;
+    for( size_t done = 0; done < data.size(); done += 1460 ) {
+        size_t n = std::min( (size_t)1460, data.size() - done );
+        if( agent.write( data.data() + done, n ) != n ) return false;
+    }
+    return agent.end( false );
+}
+
+
+static void update( fs::FS& fs, const std::vector<uint8_t>& data, bool verified, double loss )
+{
+    HostPipe link;
+    link.a.setLoss( loss, 7 );
+    link.b.setLoss( loss, 8 );
+    Device device;
+    device.port = &link.b;
+    std::thread thread( &Device::run, &device );
+
+    FOTAMemorySink primary;
+    FOTAFileSink archive;
+    FOTASerialSink mcu;
+    archive.writer().setFile( fs, "/fw/gateway.bin" );
+    mcu.writer().setPort( &link.a, 5000 );
+    FOTATeeAgent tee( &primary );
+    tee.add( &archive );
+    tee.add( &mcu, 4096 );
+
+    std::vector<uint8_t> before = content( fs, "/fw/gateway.bin" );
+    check( download( tee, data ), "tee end()" );
+    check( tee.sinkError( 0 ) == 0 && tee.sinkError( 1 ) == 0, "sinks took the whole image" );
+    check( content( fs, "/fw/gateway.bin" ) == before && fs.exists( "/fw/gateway.bin.part" ), "archive kept apart before commit()" );
+    delay( 500 ); // signature check on the gateway
+    check( !device.done && device.image.size() < data.size(), "device waits for the last frame" );
+
+    if( verified ) {
+        check( tee.commit(), "tee commit()" );
+        thread.join();
+        check( content( fs, "/fw/gateway.bin" ) == data && !fs.exists( "/fw/gateway.bin.part" ), "archive replaced by commit()" );
+        check( device.image == data, "device got the whole image" );
+        check( tee.sinkError( 0 ) == 0 && tee.sinkError( 1 ) == 0, "sinks committed" );
+        check( mcu.isFinished(), "serial sink finished" );
+        printf("      %u frames retransmitted\n", mcu.writer().retransmits());
+    } else {
+        uint32_t start = millis();
+        tee.abort();
+        thread.join();
+        check( millis() - start < 1000, "device told at once (ABORT frame, not its stream timeout)" );
+        check( content( fs, "/fw/gateway.bin" ) == before && !fs.exists( "/fw/gateway.bin.part" ), "archive discarded by abort()" );
+        check( device.size == (int64_t)data.size() && device.image.size() < data.size(), "device gave up before the last frame" );
+        check( !mcu.isFinished() && mcu.getError() == UPDATE_ERROR_ABORT, "serial sink aborted" );
+    }
+}
+
+
+int main()
+{
+    char root[] = "/tmp/fota_tee_XXXXXX";
+    if( !mkdtemp( root ) ) return 1;
+    fs::FS fs( root );
+    fs.mkdir( "/fw" );
+
+    std::vector<uint8_t> v1( 50000 ), v2( 70001 );
+    for( size_t i = 0; i < v1.size(); i++ ) v1[i] = i * 7;
+    for( size_t i = 0; i < v2.size(); i++ ) v2[i] = i * 13 + 1;
+
+    printf("-- verified image\n");
+    update( fs, v1, true, 0 );
+    printf("-- signature mismatch\n");
+    update( fs, v2, false, 0 );
+    printf("-- verified image, lossy link\n");
+    update( fs, v2, true, 0.0005 );
+
+    String cleanup = String( "rm -rf " ) + root;
+    if( system( cleanup.c_str() ) != 0 ) printf("unable to remove %s\n", root);
+    printf(failures ? "%d check(s) failed\n" : "all checks passed\n", failures);
+    return failures ? 1 : 0;
+}
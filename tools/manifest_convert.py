@@ -0,0 +1,221 @@
+#!/usr/bin/env python3
+"""
+Convert esp32FOTA manifests between JSON and MessagePack.
+
+MessagePack manifests have exactly the same structure as JSON ones, they're
+smaller and faster to parse on the device. Serve them with
+"Content-Type: application/msgpack" (or with a .msgpack extension).
+
+  $ python3 manifest_convert.py firmware.json firmware.msgpack
+  $ python3 manifest_convert.py firmware.msgpack -         # back to JSON, on stdout
+  $ python3 manifest_convert.py --check firmware.json      # round trip and size report
+
+The direction is guessed from the input: anything starting with '{' or '['
+is JSON. Only the standard library is needed.
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+
+def pack(obj, out=None):
+    """Encode obj using the smallest MessagePack representation of each value."""
+    if out is None:
+        out = bytearray()
+    if obj is None:
+        out += b"\xc0"
+    elif obj is True:
+        out += b"\xc3"
+    elif obj is False:
+        out += b"\xc2"
+    elif isinstance(obj, int):
+        if 0 <= obj < 0x80:
+            out += struct.pack("B", obj)
+        elif -32 <= obj < 0:
+            out += struct.pack("b", obj)
+        elif 0 <= obj <= 0xFF:
+            out += b"\xcc" + struct.pack("B", obj)
+        elif 0 <= obj <= 0xFFFF:
+            out += b"\xcd" + struct.pack(">H", obj)
+        elif 0 <= obj <= 0xFFFFFFFF:
+            out += b"\xce" + struct.pack(">I", obj)
+        elif 0 <= obj <= 0xFFFFFFFFFFFFFFFF:
+            out += b"\xcf" + struct.pack(">Q", obj)
+        elif -0x80 <= obj:
+            out += b"\xd0" + struct.pack(">b", obj)
+        elif -0x8000 <= obj:
+            out += b"\xd1" + struct.pack(">h", obj)
+        elif -0x80000000 <= obj:
+            out += b"\xd2" + struct.pack(">i", obj)
+        elif -0x8000000000000000 <= obj:
+            out += b"\xd3" + struct.pack(">q", obj)
+        else:
+            raise ValueError("integer out of range: %d" % obj)
+    elif isinstance(obj, float):
+        # float32 when lossless, ArduinoJson handles both
+        f32 = struct.pack(">f", obj)
+        if struct.unpack(">f", f32)[0] == obj:
+            out += b"\xca" + f32
+        else:
+            out += b"\xcb" + struct.pack(">d", obj)
+    elif isinstance(obj, str):
+        raw = obj.encode("utf-8")
+        n = len(raw)
+        if n < 32:
+            out += struct.pack("B", 0xA0 | n)
+        elif n <= 0xFF:
+            out += b"\xd9" + struct.pack("B", n)
+        elif n <= 0xFFFF:
+            out += b"\xda" + struct.pack(">H", n)
+        else:
+            out += b"\xdb" + struct.pack(">I", n)
+        out += raw
+    elif isinstance(obj, (list, tuple)):
+        n = len(obj)
+        if n < 16:
+            out += struct.pack("B", 0x90 | n)
+        elif n <= 0xFFFF:
+            out += b"\xdc" + struct.pack(">H", n)
+        else:
+            out += b"\xdd" + struct.pack(">I", n)
+        for item in obj:
+            pack(item, out)
+    elif isinstance(obj, dict):
+        n = len(obj)
+        if n < 16:
+            out += struct.pack("B", 0x80 | n)
+        elif n <= 0xFFFF:
+            out += b"\xde" + struct.pack(">H", n)
+        else:
+            out += b"\xdf" + struct.pack(">I", n)
+        for key, value in obj.items():
+            pack(str(key), out)
+            pack(value, out)
+    else:
+        raise TypeError("can't encode %s" % type(obj).__name__)
+    return out
+
+
+class Unpacker:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def take(self, n):
+        if self.pos + n > len(self.data):
+            raise ValueError("truncated input at offset %d" % self.pos)
+        chunk = self.data[self.pos:self.pos + n]
+        self.pos += n
+        return chunk
+
+    def unpack(self, fmt):
+        return struct.unpack(fmt, self.take(struct.calcsize(fmt)))[0]
+
+    def value(self):
+        b = self.unpack("B")
+        if b < 0x80:
+            return b
+        if b >= 0xE0:
+            return b - 0x100
+        if 0x80 <= b <= 0x8F:
+            return self.map(b & 0x0F)
+        if 0x90 <= b <= 0x9F:
+            return self.array(b & 0x0F)
+        if 0xA0 <= b <= 0xBF:
+            return self.str(b & 0x1F)
+        simple = {
+            0xC0: lambda: None,
+            0xC2: lambda: False,
+            0xC3: lambda: True,
+            0xC4: lambda: self.bin(self.unpack("B")),
+            0xC5: lambda: self.bin(self.unpack(">H")),
+            0xC6: lambda: self.bin(self.unpack(">I")),
+            0xCA: lambda: self.unpack(">f"),
+            0xCB: lambda: self.unpack(">d"),
+            0xCC: lambda: self.unpack("B"),
+            0xCD: lambda: self.unpack(">H"),
+            0xCE: lambda: self.unpack(">I"),
+            0xCF: lambda: self.unpack(">Q"),
+            0xD0: lambda: self.unpack(">b"),
+            0xD1: lambda: self.unpack(">h"),
+            0xD2: lambda: self.unpack(">i"),
+            0xD3: lambda: self.unpack(">q"),
+            0xD9: lambda: self.str(self.unpack("B")),
+            0xDA: lambda: self.str(self.unpack(">H")),
+            0xDB: lambda: self.str(self.unpack(">I")),
+            0xDC: lambda: self.array(self.unpack(">H")),
+            0xDD: lambda: self.array(self.unpack(">I")),
+            0xDE: lambda: self.map(self.unpack(">H")),
+            0xDF: lambda: self.map(self.unpack(">I")),
+        }
+        if b not in simple:
+            raise ValueError("unsupported MessagePack type 0x%02x at offset %d" % (b, self.pos - 1))
+        return simple[b]()
+
+    def str(self, n):
+        return self.take(n).decode("utf-8")
+
+    def bin(self, n):
+        # no JSON equivalent, the device ignores it anyway
+        return self.take(n).hex()
+
+    def array(self, n):
+        return [self.value() for _ in range(n)]
+
+    def map(self, n):
+        out = {}
+        for _ in range(n):
+            key = self.value()
+            out[str(key)] = self.value()
+        return out
+
+
+def unpack(data):
+    u = Unpacker(data)
+    obj = u.value()
+    if u.pos != len(data):
+        raise ValueError("%d trailing bytes after the manifest" % (len(data) - u.pos))
+    return obj
+
+
+def is_json(data):
+    return data.lstrip()[:1] in (b"{", b"[")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="manifest file, '-' for stdin")
+    parser.add_argument("output", nargs="?", help="output file, '-' for stdout")
+    parser.add_argument("--check", action="store_true", help="convert back and forth, compare and report sizes")
+    parser.add_argument("--indent", type=int, default=2, help="JSON output indentation")
+    args = parser.parse_args()
+
+    data = sys.stdin.buffer.read() if args.input == "-" else open(args.input, "rb").read()
+
+    if is_json(data):
+        obj = json.loads(data)
+        converted = bytes(pack(obj))
+        if args.check and unpack(converted) != obj:
+            sys.exit("round trip mismatch")
+    else:
+        obj = unpack(data)
+        converted = (json.dumps(obj, indent=args.indent) + "\n").encode("utf-8")
+        if args.check and bytes(pack(obj)) != data:
+            print("note: re-encoding differs from the input (non minimal encoding)", file=sys.stderr)
+
+    if args.check:
+        print("%s: %d bytes -> %d bytes (%s)" % (args.input, len(data), len(converted),
+              "MessagePack" if is_json(data) else "JSON"), file=sys.stderr)
+    if args.output == "-":
+        sys.stdout.buffer.write(converted)
+    elif args.output:
+        with open(args.output, "wb") as f:
+            f.write(converted)
+    elif not args.check:
+        parser.error("an output file is required")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,552 @@
+#!/usr/bin/env python3
+"""
+Sender side of the esp32FOTA MQTT transport (FOTA_MQTT_STREAM),
+see src/streams/MQTTChunkStream.hpp for the message format.
+
+  send      serve firmware/filesystem images to a device, and optionally
+            publish a retained manifest on <prefix>/manifest
+  receive   emulate a device and save the image (testing)
+  broker    minimal local MQTT broker (QoS 0, retained messages)
+  loopback  run a broker, a sender and a device, and compare the result
+
+  $ python3 mqtt_fota.py send -H 192.168.1.10 --prefix fota/gw-01 --firmware firmware.bin \\
+        --type esp32-fota-mqtt --version 2.0.0
+  $ python3 mqtt_fota.py loopback firmware.bin --drop 0.05
+
+loopback tests this script against its own device emulator (receive_image),
+add --device to run the C++ MQTTChunkStream instead, built on the host
+from tools/host/mqtt_device.cpp:
+
+  $ python3 mqtt_fota.py loopback firmware.bin --device /tmp/mqtt_device --drop 0.05
+
+Any MQTT 3.1.1 broker works (e.g. mosquitto), the built-in one is enough
+for tests on Linux: --drop loses DATA messages on their way to the device,
+like QoS 0 messages published while it reconnects.
+
+Only the standard library is needed.
+"""
+
+import argparse
+import json
+import os
+import random
+import select
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+MSG_REQ = 0x01
+MSG_OPEN = 0x02
+MSG_DATA = 0x03
+MSG_ACK = 0x04
+MSG_FIN = 0x05
+MSG_ABORT = 0x06
+
+TARGET_FIRMWARE = 0
+TARGET_FILESYSTEM = 1
+
+DEFAULT_WINDOW = 4
+DEFAULT_CHUNK = 2048
+
+CONNECT, CONNACK, PUBLISH, SUBSCRIBE, SUBACK, PINGREQ, PINGRESP, DISCONNECT = 1, 2, 3, 8, 9, 12, 13, 14
+
+
+def encode_length(n):
+    out = bytearray()
+    while True:
+        byte, n = n % 128, n // 128
+        out.append(byte | (0x80 if n else 0))
+        if not n:
+            return bytes(out)
+
+
+def encode_string(s):
+    data = s.encode() if isinstance(s, str) else s
+    return struct.pack(">H", len(data)) + data
+
+
+def read_packet(sock, buf):
+    """Returns (type, flags, body) from buf, reading sock as needed, None when closed."""
+    while True:
+        if len(buf) >= 2:
+            length, mult, pos = 0, 1, 1
+            while pos < len(buf) and pos <= 4:
+                length += (buf[pos] & 0x7f) * mult
+                mult *= 128
+                pos += 1
+                if not buf[pos - 1] & 0x80:
+                    if len(buf) >= pos + length:
+                        header = buf[0]
+                        body = bytes(buf[pos:pos + length])
+                        del buf[:pos + length]
+                        return header >> 4, header & 0x0f, body
+                    break
+        chunk = sock.recv(65536)
+        if not chunk:
+            return None
+        buf += chunk
+
+
+class Client:
+    """MQTT 3.1.1 client, QoS 0 only."""
+
+    def __init__(self, host, port, client_id, keepalive=30):
+        self.sock = socket.create_connection((host, port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.buf = bytearray()
+        self.keepalive = keepalive
+        self.last_tx = time.monotonic()
+        body = encode_string("MQTT") + bytes([4, 0x02]) + struct.pack(">H", keepalive) + encode_string(client_id)
+        self._send(CONNECT << 4, body)
+        packet = read_packet(self.sock, self.buf)
+        if not packet or packet[0] != CONNACK or packet[2][1] != 0:
+            raise RuntimeError("broker refused the connection")
+
+    def _send(self, header, body):
+        self.sock.sendall(bytes([header]) + encode_length(len(body)) + body)
+        self.last_tx = time.monotonic()
+
+    def subscribe(self, topic):
+        self._send(SUBSCRIBE << 4 | 0x02, struct.pack(">H", 1) + encode_string(topic) + b"\x00")
+
+    def publish(self, topic, payload, retain=False):
+        self._send(PUBLISH << 4 | (1 if retain else 0), encode_string(topic) + payload)
+
+    def recv(self, timeout):
+        """Returns (topic, payload) or None on timeout."""
+        deadline = time.monotonic() + timeout
+        while True:
+            if not self.buf:
+                left = deadline - time.monotonic()
+                if time.monotonic() - self.last_tx > self.keepalive / 2:
+                    self._send(PINGREQ << 4, b"")
+                if left <= 0:
+                    return None
+                r, _, _ = select.select([self.sock], [], [], left)
+                if not r:
+                    return None
+            packet = read_packet(self.sock, self.buf)
+            if packet is None:
+                raise RuntimeError("broker closed the connection")
+            ptype, flags, body = packet
+            if ptype == PUBLISH:
+                (n,) = struct.unpack_from(">H", body)
+                pos = 2 + n + (2 if flags & 0x06 else 0)  # packet id of QoS 1/2
+                return body[2:2 + n].decode(), body[pos:]
+
+    def close(self):
+        try:
+            self._send(DISCONNECT << 4, b"")
+        except OSError:
+            pass
+        self.sock.close()
+
+
+def message(mtype, session, seq, payload=b""):
+    return struct.pack("<BII", mtype, session, seq) + payload
+
+
+def parse(payload):
+    if len(payload) < 9:
+        return None
+    mtype, session, seq = struct.unpack_from("<BII", payload)
+    return mtype, session, seq, payload[9:]
+
+
+def send_image(client, prefix, session, image, window, chunk, log, rto=0.5, timeout=10.0):
+    """Selective-repeat sender. Returns the number of chunks sent again, raises on failure."""
+    down = prefix + "/down"
+    frames = (len(image) + chunk - 1) // chunk
+
+    def recv(wait):
+        while True:
+            got = client.recv(wait)
+            if got is None:
+                return None
+            msg = parse(got[1])
+            if got[0] == prefix + "/up" and msg and msg[1] == session:
+                return msg
+            wait = 0.001
+
+    deadline = time.monotonic() + timeout
+    while True:
+        client.publish(down, message(MSG_OPEN, session, 0, struct.pack("<I", len(image))))
+        msg = recv(rto)
+        if msg and msg[0] == MSG_ACK:
+            break
+        if msg and msg[0] == MSG_ABORT:
+            raise RuntimeError("device aborted")
+        if time.monotonic() > deadline:
+            raise RuntimeError("device did not acknowledge OPEN")
+
+    base = 0
+    sacked = set()
+    sent_at = {}
+    next_new = 0
+    resent = 0
+    started = last_rx = last_progress = time.monotonic()
+
+    def transmit(seq):
+        client.publish(down, message(MSG_DATA, session, seq, image[seq * chunk:(seq + 1) * chunk]))
+        sent_at[seq] = time.monotonic()
+
+    while base < frames:
+        while next_new < frames and next_new < base + window:
+            transmit(next_new)
+            next_new += 1
+
+        msg = recv(0.05)
+        now = time.monotonic()
+        if msg:
+            last_rx = now
+            mtype, _, seq, data = msg
+            if mtype == MSG_ABORT:
+                raise RuntimeError("device aborted at chunk %d" % seq)
+            if mtype == MSG_ACK and len(data) >= 5:
+                bitmap, window = struct.unpack_from("<IB", data)
+                if seq > base or bin(bitmap).count("1") > len(sacked):
+                    last_progress = now
+                base = max(base, seq)
+                sacked = {base + i for i in range(window) if bitmap >> i & 1}
+                highest = max(sacked) if sacked else base - 1
+                # a chunk missing below a buffered one was lost
+                for s in range(base, min(highest, next_new)):
+                    if s not in sacked and now - sent_at.get(s, 0) > rto / 4:
+                        transmit(s)
+                        resent += 1
+                if log and base % 16 == 0:
+                    log("\r%d/%d chunks" % (base, frames))
+
+        if now - last_progress > rto:
+            # nothing moved: send everything outstanding again
+            for s in range(base, next_new):
+                if s not in sacked:
+                    transmit(s)
+                    resent += 1
+            last_progress = now
+        if now - last_rx > timeout:
+            raise RuntimeError("device stopped answering")
+
+    msg = recv(2.0)
+    while msg and msg[0] == MSG_ACK:
+        msg = recv(2.0)
+    if not msg or msg[0] != MSG_FIN:
+        log("\nNo FIN from the device\n")
+
+    elapsed = time.monotonic() - started
+    if log:
+        log("\r%d bytes in %.2fs (%.1f KB/s), %d chunks sent again\n"
+            % (len(image), elapsed, len(image) / elapsed / 1024, resent))
+    return resent
+
+
+def serve(client, prefix, images, log, once):
+    """Answer REQ messages with the matching image."""
+    client.subscribe(prefix + "/up")
+    while True:
+        got = client.recv(60)
+        if got is None:
+            continue
+        msg = parse(got[1])
+        if got[0] != prefix + "/up" or not msg or msg[0] != MSG_REQ or len(msg[3]) < 4:
+            continue
+        _, session, _, data = msg
+        target, window, chunk = struct.unpack_from("<BBH", data)
+        image = images.get(target)
+        name = "filesystem" if target == TARGET_FILESYSTEM else "firmware"
+        if image is None:
+            log("Device requested a %s image, none given: aborting\n" % name)
+            client.publish(prefix + "/down", message(MSG_ABORT, session, 0))
+            continue
+        log("Sending %s image (%d bytes, window=%d, chunk=%d)\n" % (name, len(image), window, chunk))
+        try:
+            send_image(client, prefix, session, image, window, chunk, log)
+        except RuntimeError as e:
+            log("\n%s\n" % e)
+            if once:
+                raise
+            continue
+        if once or target == TARGET_FIRMWARE:
+            return
+
+
+def receive_image(client, prefix, target, window, chunk, timeout=30.0):
+    """Device emulator, same logic as MQTTChunkStream."""
+    up, down = prefix + "/up", prefix + "/down"
+    client.subscribe(down)
+    session = random.getrandbits(32)
+    req = struct.pack("<BBH", target, window, chunk)
+
+    def recv(wait):
+        got = client.recv(wait)
+        if got is None or got[0] != down:
+            return None
+        msg = parse(got[1])
+        return msg if msg and msg[1] == session else None
+
+    client.publish(up, message(MSG_REQ, session, 0, req))
+    total = None
+    deadline = last_req = time.monotonic()
+    deadline += timeout
+    while total is None:
+        msg = recv(0.1)
+        if msg and msg[0] == MSG_OPEN:
+            (total,) = struct.unpack_from("<I", msg[3])
+        elif msg and msg[0] == MSG_ABORT:
+            raise RuntimeError("sender aborted")
+        elif time.monotonic() > deadline:
+            raise RuntimeError("no answer from the sender")
+        elif time.monotonic() - last_req > 2:
+            client.publish(up, message(MSG_REQ, session, 0, req))
+            last_req = time.monotonic()
+
+    frames = (total + chunk - 1) // chunk
+    slots = {}
+    out = bytearray()
+    nxt = 0
+
+    def ack():
+        bitmap = sum(1 << i for i in range(window) if nxt + i in slots)
+        client.publish(up, message(MSG_ACK, session, nxt, struct.pack("<IB", bitmap, window)))
+
+    ack()
+    last_rx = time.monotonic()
+    while nxt < frames:
+        msg = recv(0.1)
+        if msg is None:
+            if time.monotonic() - last_rx > 1:
+                ack()
+                last_rx = time.monotonic()
+            continue
+        last_rx = time.monotonic()
+        mtype, _, seq, data = msg
+        if mtype == MSG_OPEN:
+            ack()
+        elif mtype == MSG_ABORT:
+            raise RuntimeError("sender aborted")
+        elif mtype == MSG_DATA and seq < frames:
+            if seq < nxt or seq in slots:
+                ack()
+            elif seq < nxt + window and len(data) == min(chunk, total - seq * chunk):
+                slots[seq] = data
+                if seq != nxt:
+                    ack()  # tells the sender about the hole
+            while nxt in slots:
+                out += slots.pop(nxt)
+                nxt += 1
+                ack()
+    client.publish(up, message(MSG_FIN, session, nxt, b"\x00"))
+    return bytes(out)
+
+
+def topic_matches(pattern, topic):
+    p, t = pattern.split("/"), topic.split("/")
+    for i, level in enumerate(p):
+        if level == "#":
+            return True
+        if i >= len(t) or (level != "+" and level != t[i]):
+            return False
+    return len(p) == len(t)
+
+
+class Broker:
+    """Just enough of a broker for local tests: QoS 0, retained messages, no auth."""
+
+    def __init__(self, port, drop=0.0, verbose=False):
+        self.server = socket.socket()
+        self.server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.server.bind(("", port))
+        self.server.listen(16)
+        self.port = self.server.getsockname()[1]
+        self.drop = drop
+        self.verbose = verbose
+        self.lock = threading.Lock()
+        self.subscriptions = {}  # socket -> [patterns]
+        self.retained = {}
+        self.dropped = 0
+
+    def serve_forever(self):
+        while True:
+            sock, _ = self.server.accept()
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            threading.Thread(target=self.handle, args=(sock,), daemon=True).start()
+
+    def send(self, sock, header, body):
+        try:
+            sock.sendall(bytes([header]) + encode_length(len(body)) + body)
+        except OSError:
+            pass
+
+    def handle(self, sock):
+        buf = bytearray()
+        with self.lock:
+            self.subscriptions[sock] = []
+        try:
+            while True:
+                packet = read_packet(sock, buf)
+                if packet is None:
+                    break
+                ptype, flags, body = packet
+                if ptype == CONNECT:
+                    self.send(sock, CONNACK << 4, b"\x00\x00")
+                elif ptype == SUBSCRIBE:
+                    pos, granted = 2, bytearray()
+                    while pos < len(body):
+                        (n,) = struct.unpack_from(">H", body, pos)
+                        pattern = body[pos + 2:pos + 2 + n].decode()
+                        pos += 3 + n
+                        granted.append(0)
+                        with self.lock:
+                            self.subscriptions[sock].append(pattern)
+                            retained = [(t, p) for t, p in self.retained.items() if topic_matches(pattern, t)]
+                        for topic, payload in retained:
+                            self.send(sock, PUBLISH << 4 | 1, encode_string(topic) + payload)
+                    self.send(sock, SUBACK << 4, body[:2] + bytes(granted))
+                elif ptype == PUBLISH:
+                    (n,) = struct.unpack_from(">H", body)
+                    topic = body[2:2 + n].decode()
+                    payload = body[2 + n + (2 if flags & 0x06 else 0):]
+                    self.publish(topic, payload, flags & 1)
+                elif ptype == PINGREQ:
+                    self.send(sock, PINGRESP << 4, b"")
+                elif ptype == DISCONNECT:
+                    break
+        except OSError:
+            pass
+        with self.lock:
+            del self.subscriptions[sock]
+        sock.close()
+
+    def publish(self, topic, payload, retain):
+        if self.verbose:
+            sys.stderr.write("%s %d bytes\n" % (topic, len(payload)))
+        if retain:
+            with self.lock:
+                if payload:
+                    self.retained[topic] = payload
+                else:
+                    self.retained.pop(topic, None)
+        if self.drop and topic.endswith("/down") and payload[:1] == bytes([MSG_DATA]) and random.random() < self.drop:
+            self.dropped += 1
+            return
+        with self.lock:
+            targets = [s for s, patterns in self.subscriptions.items() if any(topic_matches(p, topic) for p in patterns)]
+        for sock in targets:
+            self.send(sock, PUBLISH << 4, encode_string(topic) + payload)
+
+
+def parse_broker(value):
+    host, _, port = value.partition(":")
+    return host or "127.0.0.1", int(port or 1883)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    p = sub.add_parser("send", help="serve images to a device")
+    p.add_argument("-H", "--broker", default="127.0.0.1:1883", help="host[:port]")
+    p.add_argument("--prefix", required=True, help="topic prefix set with setMQTT() on the device")
+    p.add_argument("--firmware", help="app image (U_FLASH)")
+    p.add_argument("--filesystem", help="filesystem image (U_SPIFFS)")
+    p.add_argument("--type", help="firmware type, publishes a retained manifest with --version")
+    p.add_argument("--version", help="firmware version of the manifest")
+    p.add_argument("--once", action="store_true", help="exit after the first image")
+
+    p = sub.add_parser("receive", help="emulate a device")
+    p.add_argument("-H", "--broker", default="127.0.0.1:1883", help="host[:port]")
+    p.add_argument("--prefix", required=True)
+    p.add_argument("-o", "--output", required=True)
+    p.add_argument("--target", type=int, default=TARGET_FIRMWARE)
+    p.add_argument("--window", type=int, default=DEFAULT_WINDOW)
+    p.add_argument("--chunk", type=int, default=DEFAULT_CHUNK)
+
+    p = sub.add_parser("broker", help="run a minimal local broker")
+    p.add_argument("--port", type=int, default=1883)
+    p.add_argument("--drop", type=float, default=0.0, help="DATA message loss probability (testing)")
+    p.add_argument("-v", "--verbose", action="store_true", help="log published messages")
+
+    p = sub.add_parser("loopback", help="send an image through a local broker")
+    p.add_argument("image")
+    p.add_argument("--window", type=int, default=DEFAULT_WINDOW)
+    p.add_argument("--chunk", type=int, default=DEFAULT_CHUNK)
+    p.add_argument("--drop", type=float, default=0.0, help="DATA message loss probability")
+    p.add_argument("--device", help="device program connected to the broker instead of the emulator, "
+                                    "e.g. tools/host/mqtt_device.cpp built on the host")
+
+    args = parser.parse_args()
+    log = sys.stderr.write
+
+    if args.cmd == "send":
+        images = {}
+        if args.firmware:
+            images[TARGET_FIRMWARE] = open(args.firmware, "rb").read()
+        if args.filesystem:
+            images[TARGET_FILESYSTEM] = open(args.filesystem, "rb").read()
+        if not images:
+            raise SystemExit("Nothing to send")
+        client = Client(*parse_broker(args.broker), client_id="fota-sender-%d" % random.getrandbits(16))
+        if args.type and args.version:
+            # any non empty url, the image comes from this sender
+            manifest = {"type": args.type, "version": args.version, "url": "mqtt"}
+            if TARGET_FILESYSTEM in images:
+                manifest["spiffs"] = "mqtt"
+            client.publish(args.prefix + "/manifest", json.dumps(manifest).encode(), retain=True)
+            log("Published %s on %s/manifest\n" % (json.dumps(manifest), args.prefix))
+        serve(client, args.prefix, images, log, args.once)
+        client.close()
+
+    elif args.cmd == "receive":
+        client = Client(*parse_broker(args.broker), client_id="fota-device-%d" % random.getrandbits(16))
+        data = receive_image(client, args.prefix, args.target, args.window, args.chunk)
+        open(args.output, "wb").write(data)
+        log("Received %d bytes\n" % len(data))
+        client.close()
+
+    elif args.cmd == "broker":
+        broker = Broker(args.port, args.drop, args.verbose)
+        log("Listening on port %d\n" % broker.port)
+        try:
+            broker.serve_forever()
+        except KeyboardInterrupt:
+            pass
+
+    elif args.cmd == "loopback":
+        image = open(args.image, "rb").read()
+        broker = Broker(0, args.drop)
+        threading.Thread(target=broker.serve_forever, daemon=True).start()
+        prefix = "fota/loopback"
+        sender = Client("127.0.0.1", broker.port, "sender")
+        sender.subscribe(prefix + "/up")
+        result = {}
+
+        if args.device:
+            output = tempfile.NamedTemporaryFile(suffix=".bin", delete=False).name
+            proc = subprocess.Popen([args.device, "127.0.0.1:%d" % broker.port, prefix, output,
+                                     str(args.window), str(args.chunk)])
+
+            def device_side():
+                if proc.wait(60) == 0:
+                    result["data"] = open(output, "rb").read()
+                os.unlink(output)
+        else:
+            device = Client("127.0.0.1", broker.port, "device")
+
+            def device_side():
+                result["data"] = receive_image(device, prefix, TARGET_FIRMWARE, args.window, args.chunk)
+
+        t = threading.Thread(target=device_side, daemon=True)
+        t.start()
+        serve(sender, prefix, {TARGET_FIRMWARE: image}, log, True)
+        t.join(30)
+        if result.get("data") != image:
+            raise SystemExit("FAIL: received image differs")
+        log("OK, %d DATA messages dropped by the broker\n" % broker.dropped)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,498 @@
+#!/usr/bin/env python3
+"""
+UDP multicast image broadcast with forward error correction, the sender side
+of FOTA_MULTICAST_STREAM (see src/streams/MulticastFECStream.hpp).
+
+The image is cut in groups of k packets, each followed by m Reed-Solomon
+parity packets (Cauchy matrix over GF(256)): a device rebuilds a group from
+any k of its k+m packets, without acknowledgements. The sender loops over the
+image, a device that missed too many packets of a group completes it on the
+next round.
+
+  send      broadcast an image until interrupted, optionally writing the manifest
+  receive   emulate a device: join the group, rebuild the image
+  loopback  send to a local receiver with simulated packet loss, for each loss rate
+
+  $ python3 multicast_fota.py send firmware.bin --group 239.255.70.1 --port 5007 \\
+      --manifest firmware.json --type esp32-fota-multicast --version 2.0.0
+  $ python3 multicast_fota.py loopback firmware.bin --drop 0,0.05,0.1,0.2 --burst 0.3
+
+loopback tests this script against its own Decoder, add --device to run the
+C++ MulticastFECStream instead, built on the host from
+tools/host/multicast_device.cpp, the carousel then goes through the
+multicast group on the loopback interface:
+
+  $ python3 multicast_fota.py loopback firmware.bin --device /tmp/multicast_device --drop 0.05,0.1
+
+Only the standard library is needed.
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import random
+import re
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import zlib
+
+MAGIC = b"FM"
+VERSION = 1
+HEADER = struct.Struct("<2sBBBBHIII")  # crc32 follows
+HEADER_SIZE = HEADER.size + 4
+
+DEFAULT_GROUP = "239.255.70.1"
+DEFAULT_PORT = 5007
+DEFAULT_K = 16
+DEFAULT_M = 4
+DEFAULT_PAYLOAD = 1024
+DEFAULT_WINDOW = 2  # FOTA_MULTICAST_WINDOW
+MAX_K = 32
+MAX_M = 32
+MAX_GROUP = 32768
+MAX_PAYLOAD = 1472
+
+
+# GF(256), polynomial 0x11d, same tables as the device
+EXP = [0] * 512
+LOG = [0] * 256
+_x = 1
+for _i in range(255):
+    EXP[_i] = EXP[_i + 255] = _x
+    LOG[_x] = _i
+    _x <<= 1
+    if _x & 0x100:
+        _x ^= 0x11d
+EXP[510] = EXP[511] = EXP[0]
+
+
+def gf_mul(a, b):
+    return EXP[LOG[a] + LOG[b]] if a and b else 0
+
+
+def gf_inv(a):
+    return EXP[255 - LOG[a]]
+
+
+# MUL[c] translates a packet into c * packet
+MUL = [bytes(gf_mul(c, x) for x in range(256)) for c in range(256)]
+
+
+def cauchy(k, i, j):
+    """Coefficient of data packet j in parity packet i."""
+    return gf_inv((k + i) ^ j)
+
+
+def combine(coefficients, packets, size):
+    """sum(c * packet) as bytes, XOR done on big integers."""
+    acc = 0
+    for c, packet in zip(coefficients, packets):
+        if c:
+            acc ^= int.from_bytes(packet.translate(MUL[c]), "little")
+    return acc.to_bytes(size, "little")
+
+
+def invert(matrix):
+    n = len(matrix)
+    a = [row[:] for row in matrix]
+    inv = [[int(i == j) for j in range(n)] for i in range(n)]
+    for col in range(n):
+        pivot = next((r for r in range(col, n) if a[r][col]), None)
+        if pivot is None:
+            raise ValueError("singular matrix")
+        a[col], a[pivot] = a[pivot], a[col]
+        inv[col], inv[pivot] = inv[pivot], inv[col]
+        c = gf_inv(a[col][col])
+        a[col] = [gf_mul(v, c) for v in a[col]]
+        inv[col] = [gf_mul(v, c) for v in inv[col]]
+        for row in range(n):
+            f = a[row][col]
+            if row != col and f:
+                a[row] = [v ^ gf_mul(f, w) for v, w in zip(a[row], a[col])]
+                inv[row] = [v ^ gf_mul(f, w) for v, w in zip(inv[row], inv[col])]
+    return inv
+
+
+class Encoder:
+    def __init__(self, image, k, m, size):
+        if not 0 < k <= MAX_K or not 0 <= m <= MAX_M or not 0 < size <= MAX_PAYLOAD or k * size > MAX_GROUP:
+            raise ValueError("unsupported k=%d m=%d payload=%d" % (k, m, size))
+        self.image = image
+        self.k, self.m, self.size = k, m, size
+        self.session = zlib.crc32(image)
+        self.group_bytes = k * size
+        self.groups = (len(image) + self.group_bytes - 1) // self.group_bytes
+        self.rounds = [self.encode(g) for g in range(self.groups)]
+        self.round_packets = sum(len(packets) for packets in self.rounds)
+
+    def data(self, group):
+        start = group * self.group_bytes
+        block = self.image[start:start + self.group_bytes]
+        block += bytes(self.group_bytes - len(block))
+        return [block[j * self.size:(j + 1) * self.size] for j in range(self.k)]
+
+    def packet(self, group, index, payload):
+        header = HEADER.pack(MAGIC, VERSION, self.k, self.m, index, self.size,
+                             self.session, len(self.image), group)
+        return header + struct.pack("<I", zlib.crc32(payload, zlib.crc32(header))) + payload
+
+    def encode(self, group):
+        data = self.data(group)
+        packets = []
+        for j in range(self.k):
+            # data packets past the end of the image are zeroes, the device knows
+            if (group * self.k + j) * self.size < len(self.image):
+                packets.append(self.packet(group, j, data[j]))
+        for i in range(self.m):
+            parity = combine([cauchy(self.k, i, j) for j in range(self.k)], data, self.size)
+            packets.append(self.packet(group, self.k + i, parity))
+        return packets
+
+    def carousel(self):
+        while True:
+            for packets in self.rounds:
+                yield from packets
+
+
+class Decoder:
+    """Same acceptance rules as the device: groups are read in order, only
+    'window' groups from the first one not read yet are buffered."""
+
+    def __init__(self, window=DEFAULT_WINDOW):
+        self.window = window
+        self.session = None
+        self.next = 0
+        self.slots = {}  # group: {index: payload}
+        self.output = bytearray()
+        self.packets = self.recovered = self.waits = self.bad = 0
+        self.passed = False
+        self.failed = False
+
+    def parse(self, packet):
+        if len(packet) < HEADER_SIZE:
+            return False
+        magic, version, k, m, index, size, session, total, group = HEADER.unpack_from(packet)
+        payload = packet[HEADER_SIZE:]
+        crc = zlib.crc32(payload, zlib.crc32(packet[:HEADER.size]))
+        if magic != MAGIC or version != VERSION or len(payload) != size or crc != struct.unpack_from("<I", packet, HEADER.size)[0]:
+            self.bad += 1
+            return False
+        if self.session is None:
+            self.session, self.k, self.m, self.size, self.total = session, k, m, size, total
+            self.group_bytes = k * size
+            self.groups = (total + self.group_bytes - 1) // self.group_bytes
+        elif (session, k, m, size, total) != (self.session, self.k, self.m, self.size, self.total):
+            return False
+        if index >= k + m or group >= self.groups:
+            return False
+        self.packets += 1
+        self.store(group, index, payload)
+        return True
+
+    def slot(self, group):
+        if group not in self.slots:
+            known = {}
+            if group == self.groups - 1:
+                for j in range(self.k):
+                    if (group * self.k + j) * self.size >= self.total:
+                        known[j] = bytes(self.size)
+            self.slots[group] = known
+        return self.slots[group]
+
+    def store(self, group, index, payload):
+        if group < self.next:
+            return
+        if group - self.next >= self.window:
+            if not self.passed and len(self.slot(self.next)) < self.k:
+                self.passed = True
+                self.waits += 1
+            return
+        packets = self.slot(group)
+        if len(packets) < self.k:
+            packets.setdefault(index, payload)
+        while self.next < self.groups and len(self.slot(self.next)) >= self.k:
+            self.output += self.decode(self.slot(self.next))[:self.total - len(self.output)]
+            del self.slots[self.next]
+            self.next += 1
+            self.passed = False
+        if self.done() and zlib.crc32(self.output) != self.session:
+            self.failed = True
+
+    def decode(self, packets):
+        k = self.k
+        lost = [j for j in range(k) if j not in packets]
+        if lost:
+            parities = [i for i in sorted(packets) if i >= k][:len(lost)]
+            known = [j for j in range(k) if j in packets]
+            rest = []
+            for i in parities:
+                coefficients = [cauchy(k, i - k, j) for j in known]
+                acc = int.from_bytes(packets[i], "little") ^ int.from_bytes(
+                    combine(coefficients, [packets[j] for j in known], self.size), "little")
+                rest.append(acc.to_bytes(self.size, "little"))
+            inverse = invert([[cauchy(k, i - k, j) for j in lost] for i in parities])
+            for b, j in enumerate(lost):
+                packets[j] = combine(inverse[b], rest, self.size)
+            self.recovered += len(lost)
+        return b"".join(packets[j] for j in range(k))
+
+    def done(self):
+        return self.session is not None and self.next == self.groups
+
+
+class Loss:
+    """Gilbert model: after a loss, the next packet is lost with probability 'burst'."""
+
+    def __init__(self, drop, burst, rng):
+        self.drop, self.burst, self.rng = drop, burst, rng
+        self.lost = False
+
+    def __call__(self):
+        p = self.burst if self.lost and self.burst else self.drop
+        self.lost = self.rng.random() < p
+        return self.lost
+
+
+def pace(started, sent, rate):
+    if rate:
+        delay = started + sent / rate - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+
+
+def write_manifest(args, image):
+    entry = {
+        "type": args.type,
+        "version": args.version,
+        "url": "udp://%s:%d" % (args.group, args.port),
+        "size": len(image),
+        "sha256": hashlib.sha256(image).hexdigest(),
+    }
+    with open(args.manifest, "w") as f:
+        json.dump(entry, f, indent=2)
+        f.write("\n")
+    print("Manifest written to %s" % args.manifest, file=sys.stderr)
+
+
+def send(args):
+    image = open(args.image, "rb").read()
+    encoder = Encoder(image, args.k, args.m, args.payload)
+    if args.manifest:
+        if not args.type or not args.version:
+            print("--manifest needs --type and --version", file=sys.stderr)
+            return 2
+        write_manifest(args, image)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, args.ttl)
+    if args.interface:
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(args.interface))
+    loss = Loss(args.drop, 0, random.Random(args.seed))
+
+    print("Broadcasting %s (%d bytes, session %08x) on %s:%d: %d groups of %d+%d packets of %d bytes, %.1fs per round" % (
+        args.image, len(image), encoder.session, args.group, args.port, encoder.groups, args.k, args.m, args.payload,
+        encoder.round_packets * (args.payload + HEADER_SIZE) / args.rate if args.rate else 0), file=sys.stderr)
+    started = time.monotonic()
+    sent = 0
+    rounds = 0
+    try:
+        while not args.rounds or rounds < args.rounds:
+            for packets in encoder.rounds:
+                for packet in packets:
+                    if not loss():
+                        sock.sendto(packet, (args.group, args.port))
+                    sent += len(packet)
+                    pace(started, sent, args.rate)
+            rounds += 1
+            if args.verbose:
+                print("round %d" % rounds, file=sys.stderr)
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+def receive(args):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", args.port))
+    interface = socket.inet_aton(args.interface or "0.0.0.0")
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, socket.inet_aton(args.group) + interface)
+    sock.settimeout(args.timeout)
+
+    decoder = Decoder(args.window)
+    started = time.monotonic()
+    try:
+        while not decoder.done():
+            decoder.parse(sock.recv(65536))
+    except socket.timeout:
+        print("No packet for %ds, %d/%d groups" % (args.timeout, decoder.next, getattr(decoder, "groups", 0)), file=sys.stderr)
+        return 1
+    if decoder.failed:
+        print("Rebuilt image doesn't match its crc32", file=sys.stderr)
+        return 1
+    with open(args.output, "wb") as f:
+        f.write(decoder.output)
+    print("%s: %d bytes in %.1fs, %d packets, %d rebuilt from parity, %d groups waited for another round" % (
+        args.output, len(decoder.output), time.monotonic() - started, decoder.packets, decoder.recovered,
+        decoder.waits), file=sys.stderr)
+    return 0
+
+
+class DeviceResult:
+    """Counters printed by tools/host/multicast_device.cpp, in place of a Decoder."""
+
+    def __init__(self, line):
+        found = re.search(r"(\d+) rebuilt from parity, (\d+) groups waited", line)
+        self.recovered, self.waits = (int(n) for n in found.groups()) if found else (0, 0)
+
+
+def loopback_device(args):
+    """Runs the device program on the group, returns its result and image."""
+    output = tempfile.NamedTemporaryFile(suffix=".bin", delete=False).name
+    env = dict(os.environ, FOTA_MULTICAST_IF="127.0.0.1")
+    try:
+        proc = subprocess.run([args.device, "udp://%s:%d" % (args.group, args.port), output, str(args.window)],
+                              env=env, stdout=subprocess.PIPE, universal_newlines=True, timeout=120)
+        image = open(output, "rb").read() if proc.returncode == 0 else None
+    finally:
+        os.unlink(output)
+    return DeviceResult(proc.stdout), image
+
+
+def loopback_run(encoder, drop, args, seed):
+    """Carousel sent to a local socket, or to the group for --device, dropped
+    packets aren't sent at all."""
+    tx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    if args.device:
+        tx.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton("127.0.0.1"))
+        tx.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+        destination = (args.group, args.port)
+    else:
+        rx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        rx.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+        rx.bind(("127.0.0.1", 0))
+        rx.settimeout(5)
+        destination = rx.getsockname()
+    stop = threading.Event()
+    counters = {"sent": 0, "lost": 0}
+
+    def sender():
+        loss = Loss(drop, args.burst, random.Random(seed))
+        rng = random.Random(seed + 1)
+        carousel = encoder.carousel()
+        # the receiver joins at a random point of the carousel
+        for _ in range(rng.randrange(encoder.round_packets)):
+            next(carousel)
+        started = time.monotonic()
+        size = 0
+        while not stop.is_set() and counters["sent"] < args.max_rounds * encoder.round_packets:
+            packet = next(carousel)
+            counters["sent"] += 1
+            size += len(packet)
+            if loss():
+                counters["lost"] += 1
+            else:
+                tx.sendto(packet, destination)
+            pace(started, size, args.rate)
+
+    thread = threading.Thread(target=sender, daemon=True)
+    started = time.monotonic()
+    thread.start()
+    if args.device:
+        decoder, image = loopback_device(args)
+        ok = image == encoder.image
+    else:
+        decoder = Decoder(args.window)
+        try:
+            while not decoder.done():
+                decoder.parse(rx.recv(65536))
+        except socket.timeout:
+            pass
+        rx.close()
+        ok = decoder.done() and not decoder.failed and bytes(decoder.output) == encoder.image
+    stop.set()
+    thread.join()
+    tx.close()
+    return ok, decoder, counters, time.monotonic() - started
+
+
+def loopback(args):
+    image = open(args.image, "rb").read()
+    encoder = Encoder(image, args.k, args.m, args.payload)
+    print("%d bytes, %d groups of %d+%d packets of %d bytes, %d packets per round, receiver window %d groups" % (
+        len(image), encoder.groups, args.k, args.m, args.payload, encoder.round_packets, args.window))
+    print("%6s %6s %7s %8s %10s %6s %8s  %s" % ("drop", "lost", "rounds", "time (s)", "recovered", "waits", "result", ""))
+    failures = 0
+    for n, drop in enumerate(float(d) for d in args.drop.split(",")):
+        ok, decoder, counters, elapsed = loopback_run(encoder, drop, args, args.seed + n)
+        lost = counters["lost"] * 100 / max(counters["sent"], 1)
+        print("%5.1f%% %5.1f%% %7.2f %8.1f %10d %6d %8s  %s" % (
+            drop * 100, lost, counters["sent"] / encoder.round_packets, elapsed, decoder.recovered,
+            decoder.waits, "ok" if ok else "failed", "PASS" if ok else "FAIL"))
+        sys.stdout.flush()
+        failures += not ok
+    return 1 if failures else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    def coding(p):
+        p.add_argument("-k", type=int, default=DEFAULT_K, help="data packets per group")
+        p.add_argument("-m", type=int, default=DEFAULT_M, help="parity packets per group")
+        p.add_argument("--payload", type=int, default=DEFAULT_PAYLOAD, help="bytes per packet")
+
+    p = sub.add_parser("send", help="broadcast an image")
+    p.add_argument("image")
+    p.add_argument("--group", default=DEFAULT_GROUP, help="multicast address")
+    p.add_argument("--port", type=int, default=DEFAULT_PORT)
+    p.add_argument("--interface", help="address of the interface to send from")
+    p.add_argument("--ttl", type=int, default=1)
+    p.add_argument("--rate", type=int, default=150000, help="bytes/s, 0 = unlimited")
+    p.add_argument("--rounds", type=int, default=0, help="stop after this many rounds, 0 = never")
+    p.add_argument("--manifest", help="write a manifest entry pointing at the group")
+    p.add_argument("--type", help="firmware type of the manifest")
+    p.add_argument("--version", help="firmware version of the manifest")
+    p.add_argument("--drop", type=float, default=0.0, help="packet loss probability (testing)")
+    p.add_argument("--seed", type=int, default=1)
+    p.add_argument("-v", "--verbose", action="store_true")
+    coding(p)
+    p.set_defaults(func=send)
+
+    p = sub.add_parser("receive", help="emulate a device")
+    p.add_argument("-o", "--output", required=True)
+    p.add_argument("--group", default=DEFAULT_GROUP)
+    p.add_argument("--port", type=int, default=DEFAULT_PORT)
+    p.add_argument("--interface", help="address of the interface to join the group on")
+    p.add_argument("--window", type=int, default=DEFAULT_WINDOW, help="groups buffered")
+    p.add_argument("--timeout", type=int, default=30, help="seconds without packets")
+    p.set_defaults(func=receive)
+
+    p = sub.add_parser("loopback", help="local transfers with simulated loss")
+    p.add_argument("image")
+    p.add_argument("--drop", default="0,0.05,0.1,0.2", help="comma separated loss probabilities")
+    p.add_argument("--burst", type=float, default=0.0, help="loss probability right after a loss")
+    p.add_argument("--window", type=int, default=DEFAULT_WINDOW, help="groups buffered by the receiver")
+    p.add_argument("--rate", type=int, default=4000000, help="bytes/s")
+    p.add_argument("--max-rounds", type=int, default=20)
+    p.add_argument("--seed", type=int, default=1)
+    p.add_argument("--device", help="device program joining the group instead of the Decoder, "
+                                    "e.g. tools/host/multicast_device.cpp built on the host")
+    p.add_argument("--group", default=DEFAULT_GROUP, help="multicast address of --device")
+    p.add_argument("--port", type=int, default=DEFAULT_PORT)
+    coding(p)
+    p.set_defaults(func=loopback)
+
+    args = parser.parse_args()
+    return args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
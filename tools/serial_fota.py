@@ -0,0 +1,403 @@
+#!/usr/bin/env python3
+"""
+Host side of the esp32FOTA serial protocol (FOTA_SERIAL_STREAM),
+see src/streams/SerialFrameStream.hpp for the frame format.
+
+  send      serve firmware/filesystem images to a device
+  receive   emulate a device and save the image (testing)
+  loopback  run both ends over a pty pair and compare the result
+
+  $ python3 serial_fota.py send -p /dev/ttyUSB0 -b 2000000 --firmware firmware.bin
+  $ python3 serial_fota.py loopback firmware.bin --drop 0.05 --corrupt 0.01
+
+loopback tests this script against its own device emulator (receive_image),
+add --device to run the C++ SerialFrameStream instead, built on the host
+from tools/host/serial_device.cpp:
+
+  $ python3 serial_fota.py loopback firmware.bin --device /tmp/serial_device --drop 0.05
+
+Two real ptys can also be used, e.g. with socat:
+
+  $ socat -d -d pty,raw,echo=0 pty,raw,echo=0
+  $ python3 serial_fota.py receive -p /dev/pts/3 -o out.bin &
+  $ python3 serial_fota.py send -p /dev/pts/4 --firmware firmware.bin
+
+Only the standard library is needed.
+"""
+
+import argparse
+import os
+import random
+import select
+import struct
+import subprocess
+import sys
+import tempfile
+import termios
+import threading
+import time
+import tty
+import zlib
+
+SOF = b"\xa5\x5a"
+
+FRAME_REQ = 0x01
+FRAME_OPEN = 0x02
+FRAME_DATA = 0x03
+FRAME_ACK = 0x04
+FRAME_FIN = 0x05
+FRAME_ABORT = 0x06
+
+TARGET_FIRMWARE = 0
+TARGET_FILESYSTEM = 1
+
+DEFAULT_WINDOW = 8
+DEFAULT_PAYLOAD = 1024
+
+
+class Link:
+    """Frame codec over a raw file descriptor, with optional fault injection on tx,
+    and on rx too when the other end can't inject faults itself (faulty_rx)."""
+
+    def __init__(self, fd, drop=0.0, corrupt=0.0, faulty_rx=False):
+        self.fd = fd
+        self.drop = drop
+        self.corrupt = corrupt
+        self.faulty_rx = faulty_rx
+        self.rx = bytearray()
+        self.bad_crc = 0
+
+    def send(self, ftype, seq, payload=b""):
+        body = struct.pack("<BIH", ftype, seq, len(payload)) + payload
+        frame = bytearray(SOF + body + struct.pack("<I", zlib.crc32(body)))
+        if self.drop and random.random() < self.drop:
+            return
+        if self.corrupt and random.random() < self.corrupt:
+            frame[random.randrange(len(frame))] ^= 1 << random.randrange(8)
+        view = memoryview(frame)
+        while view:
+            try:
+                n = os.write(self.fd, view)
+            except BlockingIOError:
+                select.select([], [self.fd], [], 0.1)
+                continue
+            view = view[n:]
+
+    def recv(self, timeout):
+        """Returns (type, seq, payload) or None on timeout."""
+        deadline = time.monotonic() + timeout
+        while True:
+            frame = self._parse()
+            if frame and self.faulty_rx:
+                if self.drop and random.random() < self.drop:
+                    continue  # lost on the wire
+                if self.corrupt and random.random() < self.corrupt:
+                    self.bad_crc += 1  # a flipped bit fails the CRC
+                    continue
+            if frame:
+                return frame
+            left = deadline - time.monotonic()
+            if left <= 0:
+                return None
+            r, _, _ = select.select([self.fd], [], [], left)
+            if r:
+                try:
+                    chunk = os.read(self.fd, 65536)
+                except (BlockingIOError, OSError):
+                    chunk = b""
+                if not chunk:
+                    time.sleep(0.001)
+                self.rx += chunk
+
+    def _parse(self):
+        while True:
+            start = self.rx.find(SOF)
+            if start < 0:
+                del self.rx[:-1]
+                return None
+            del self.rx[:start]
+            if len(self.rx) < 9:
+                return None
+            ftype, seq, length = struct.unpack_from("<BIH", self.rx, 2)
+            if length > 65535 - 13:
+                del self.rx[:1]
+                continue
+            if len(self.rx) < 13 + length:
+                return None
+            body = bytes(self.rx[2:9 + length])
+            (crc,) = struct.unpack_from("<I", self.rx, 9 + length)
+            if crc != zlib.crc32(body):
+                self.bad_crc += 1
+                del self.rx[:1]  # resync on the next SOF
+                continue
+            del self.rx[:13 + length]
+            return ftype, seq, body[7:]
+
+
+def open_port(path, baud):
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
+    configure(fd, baud)
+    return fd
+
+
+def configure(fd, baud=None):
+    tty.setraw(fd)
+    if baud:
+        attrs = termios.tcgetattr(fd)
+        speed = getattr(termios, "B%d" % baud, None)
+        if speed is None:
+            raise SystemExit("Unsupported baud rate %d" % baud)
+        attrs[4] = attrs[5] = speed
+        termios.tcsetattr(fd, termios.TCSANOW, attrs)
+
+
+def send_image(link, image, window, payload, log, rto=0.3, timeout=5.0):
+    """Selective-repeat sender. Returns the number of retransmitted frames, raises on failure."""
+    frames = (len(image) + payload - 1) // payload
+
+    # OPEN until acknowledged
+    deadline = time.monotonic() + timeout
+    while True:
+        link.send(FRAME_OPEN, 0, struct.pack("<I", len(image)))
+        frame = link.recv(rto)
+        if frame and frame[0] == FRAME_ACK:
+            break
+        if frame and frame[0] == FRAME_ABORT:
+            raise RuntimeError("device aborted")
+        if time.monotonic() > deadline:
+            raise RuntimeError("device did not acknowledge OPEN")
+
+    base = 0             # first frame not consumed by the device
+    sacked = set()       # buffered by the device, beyond base
+    sent_at = {}         # frame -> last transmission time
+    next_new = 0
+    retransmits = 0
+    started = last_rx = last_progress = time.monotonic()
+    # a hole is reported when a later frame arrives, a frame missing from an ACK
+    # sent long after it was transmitted is lost too (tail loss)
+    hole_gap = 0.02
+    tail_gap = 0.1
+
+    def transmit(seq):
+        link.send(FRAME_DATA, seq, image[seq * payload:(seq + 1) * payload])
+        sent_at[seq] = time.monotonic()
+
+    while base < frames:
+        while next_new < frames and next_new < base + window:
+            transmit(next_new)
+            next_new += 1
+
+        frame = link.recv(0.01)
+        now = time.monotonic()
+
+        if frame:
+            last_rx = now
+            ftype, seq, data = frame
+            if ftype == FRAME_ABORT:
+                raise RuntimeError("device aborted at frame %d" % seq)
+            if ftype == FRAME_ACK and len(data) >= 5:
+                bitmap, window = struct.unpack_from("<IB", data)
+                if seq > base or bin(bitmap).count("1") > len(sacked):
+                    last_progress = now
+                base = max(base, seq)
+                sacked = {base + i for i in range(window) if bitmap >> i & 1}
+                highest = max(sacked) if sacked else base - 1
+                for s in range(base, next_new):
+                    if s in sacked:
+                        continue
+                    age = now - sent_at.get(s, 0)
+                    if (s < highest and age > hole_gap) or age > tail_gap:
+                        transmit(s)
+                        retransmits += 1
+                if log and base % 64 == 0:
+                    log("\r%d/%d frames" % (base, frames))
+
+        if now - last_progress > rto:
+            # nothing moved: resend everything outstanding
+            for s in range(base, next_new):
+                if s not in sacked:
+                    transmit(s)
+                    retransmits += 1
+            last_progress = now
+        if now - last_rx > timeout:
+            raise RuntimeError("device stopped answering")
+
+    # the device consumed everything, FIN tells the transfer is over
+    frame = link.recv(1.0)
+    while frame and frame[0] == FRAME_ACK:
+        frame = link.recv(1.0)
+    if not frame or frame[0] != FRAME_FIN:
+        log("\nNo FIN from the device\n")
+
+    elapsed = time.monotonic() - started
+    if log:
+        log("\r%d bytes in %.2fs (%.1f KB/s), %d retransmitted frames, %d bad CRC\n"
+            % (len(image), elapsed, len(image) / elapsed / 1024, retransmits, link.bad_crc))
+    return retransmits
+
+
+def serve(link, images, log, once):
+    """Answer REQ frames with the matching image."""
+    while True:
+        frame = link.recv(60)
+        if frame is None:
+            raise RuntimeError("no request from the device")
+        ftype, _, data = frame
+        if ftype != FRAME_REQ or len(data) < 4:
+            continue
+        target, window, payload = struct.unpack_from("<BBH", data)
+        image = images.get(target)
+        name = "filesystem" if target == TARGET_FILESYSTEM else "firmware"
+        if image is None:
+            log("Device requested a %s image, none given: aborting\n" % name)
+            link.send(FRAME_ABORT, 0)
+            continue
+        log("Sending %s image (%d bytes, window=%d, payload=%d)\n" % (name, len(image), window, payload))
+        send_image(link, image, window, payload, log)
+        if once or target == TARGET_FIRMWARE:
+            return
+
+
+def receive_image(link, target, window, payload, flash_delay=0.0, timeout=30.0):
+    """Device emulator, same logic as SerialFrameStream."""
+    link.send(FRAME_REQ, 0, struct.pack("<BBH", target, window, payload))
+    total = None
+    deadline = time.monotonic() + timeout
+    while total is None:
+        frame = link.recv(0.5)
+        if frame and frame[0] == FRAME_OPEN:
+            (total,) = struct.unpack_from("<I", frame[2])
+        elif frame and frame[0] == FRAME_ABORT:
+            raise RuntimeError("host aborted")
+        elif time.monotonic() > deadline:
+            raise RuntimeError("no answer from the host")
+        else:
+            link.send(FRAME_REQ, 0, struct.pack("<BBH", target, window, payload))
+
+    frames = (total + payload - 1) // payload
+    slots = {}
+    out = bytearray()
+    nxt = 0
+
+    def ack():
+        bitmap = sum(1 << i for i in range(window) if nxt + i in slots)
+        link.send(FRAME_ACK, nxt, struct.pack("<IB", bitmap, window))
+
+    ack()
+    while nxt < frames:
+        frame = link.recv(0.05)
+        if frame is None:
+            ack()
+            continue
+        ftype, seq, data = frame
+        if ftype == FRAME_OPEN:
+            ack()
+        elif ftype == FRAME_ABORT:
+            raise RuntimeError("host aborted")
+        elif ftype == FRAME_DATA and seq < frames:
+            if nxt <= seq < nxt + window and seq not in slots \
+                    and len(data) == min(payload, total - seq * payload):
+                slots[seq] = data
+            ack()
+            # the Update agent consumes in order, slowly
+            while nxt in slots:
+                out += slots.pop(nxt)
+                nxt += 1
+                if flash_delay:
+                    time.sleep(flash_delay)
+                ack()
+    link.send(FRAME_FIN, nxt, b"\x00")
+    # keep answering retransmissions in case the last ACK was lost
+    while link.recv(0.3):
+        ack()
+        link.send(FRAME_FIN, nxt, b"\x00")
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    p = sub.add_parser("send", help="serve images to a device")
+    p.add_argument("-p", "--port", required=True)
+    p.add_argument("-b", "--baud", type=int, default=2000000)
+    p.add_argument("--firmware", help="app image (U_FLASH)")
+    p.add_argument("--filesystem", help="filesystem image (U_SPIFFS)")
+    p.add_argument("--once", action="store_true", help="exit after the first image")
+    p.add_argument("--drop", type=float, default=0.0, help="simulate frame loss (testing)")
+    p.add_argument("--corrupt", type=float, default=0.0, help="simulate bit flips (testing)")
+
+    p = sub.add_parser("receive", help="emulate a device")
+    p.add_argument("-p", "--port", required=True)
+    p.add_argument("-b", "--baud", type=int, default=0)
+    p.add_argument("-o", "--output", required=True)
+    p.add_argument("--target", type=int, default=TARGET_FIRMWARE)
+    p.add_argument("--window", type=int, default=DEFAULT_WINDOW)
+    p.add_argument("--payload", type=int, default=DEFAULT_PAYLOAD)
+
+    p = sub.add_parser("loopback", help="send an image through a pty pair")
+    p.add_argument("image")
+    p.add_argument("--window", type=int, default=DEFAULT_WINDOW)
+    p.add_argument("--payload", type=int, default=DEFAULT_PAYLOAD)
+    p.add_argument("--drop", type=float, default=0.0, help="frame loss probability, both ways")
+    p.add_argument("--corrupt", type=float, default=0.0, help="bit flip probability per frame, both ways")
+    p.add_argument("--flash-delay", type=float, default=0.0, help="seconds spent writing each frame")
+    p.add_argument("--device", help="device program run on the pty instead of the emulator, "
+                                    "e.g. tools/host/serial_device.cpp built on the host")
+
+    args = parser.parse_args()
+    log = sys.stderr.write
+
+    if args.cmd == "send":
+        images = {}
+        if args.firmware:
+            images[TARGET_FIRMWARE] = open(args.firmware, "rb").read()
+        if args.filesystem:
+            images[TARGET_FILESYSTEM] = open(args.filesystem, "rb").read()
+        if not images:
+            raise SystemExit("Nothing to send")
+        serve(Link(open_port(args.port, args.baud), args.drop, args.corrupt), images, log, args.once)
+
+    elif args.cmd == "receive":
+        link = Link(open_port(args.port, args.baud))
+        data = receive_image(link, args.target, args.window, args.payload)
+        open(args.output, "wb").write(data)
+        log("Received %d bytes\n" % len(data))
+
+    elif args.cmd == "loopback":
+        image = open(args.image, "rb").read()
+        host_fd, dev_fd = os.openpty()
+        for fd in (host_fd, dev_fd):
+            configure(fd)
+            os.set_blocking(fd, False)
+        result = {}
+
+        if args.device:
+            # the device program can't inject faults: both directions are faulted here
+            host = Link(host_fd, args.drop, args.corrupt, faulty_rx=True)
+            output = tempfile.NamedTemporaryFile(suffix=".bin", delete=False).name
+            proc = subprocess.Popen([args.device, os.ttyname(dev_fd), output, str(args.window),
+                                     str(args.payload), str(int(args.flash_delay * 1000))])
+
+            def device_side():
+                if proc.wait(60) == 0:
+                    result["data"] = open(output, "rb").read()
+                os.unlink(output)
+        else:
+            host = Link(host_fd, args.drop, args.corrupt)
+            device = Link(dev_fd, args.drop, args.corrupt)
+
+            def device_side():
+                result["data"] = receive_image(device, TARGET_FIRMWARE, args.window, args.payload, args.flash_delay)
+
+        t = threading.Thread(target=device_side, daemon=True)
+        t.start()
+        serve(host, {TARGET_FIRMWARE: image}, log, True)
+        t.join(30)
+        if result.get("data") != image:
+            raise SystemExit("FAIL: received image differs")
+        log("OK\n")
+
+
+if __name__ == "__main__":
+    main()